@@ -0,0 +1,449 @@
+/**
+ * @file ahrs.cpp
+ * @author amagai
+ * @brief 加速度・角速度・磁気からの姿勢推定(Madgwickフィルタ)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 更新式は S. Madgwick, "An efficient orientation filter for inertial and
+ * inertial/magnetic sensor arrays" (2010) による．
+ */
+
+#include <math.h>
+
+#include "ahrs.h"
+
+#define AHRS_DEG_TO_RAD 0.017453292f
+#define AHRS_RAD_TO_DEG 57.29577951f
+
+
+/**
+ * @brief コンストラクタ
+ *
+ * @param rate_hz 更新のレート(Hz)．update()を呼ぶ間隔の逆数
+ * @param beta 補正の強さ
+ */
+Ahrs::Ahrs(float rate_hz, float beta) : beta(beta)
+{
+    set_rate(rate_hz);
+    mag_offset[0] = mag_offset[1] = mag_offset[2] = 0.0f;
+    reset();
+}
+
+
+void Ahrs::set_rate(float rate_hz)
+{
+    dt = (rate_hz > 0.0f) ? 1.0f / rate_hz : 0.0f;
+}
+
+
+/**
+ * @brief 磁気のオフセット(ハードアイアン)を設定する．update()に渡した値から引く
+ */
+void Ahrs::set_mag_offset(float x, float y, float z)
+{
+    mag_offset[0] = x;
+    mag_offset[1] = y;
+    mag_offset[2] = z;
+}
+
+
+/**
+ * @brief 姿勢を破棄する．次の更新で加速度と磁気から初期化し直す
+ */
+void Ahrs::reset()
+{
+    q0 = 1.0f;
+    q1 = q2 = q3 = 0.0f;
+    initialized = false;
+}
+
+
+/**
+ * @brief 加速度と磁気から直接姿勢を求める
+ *
+ * センサ座標での上(加速度)，北(磁気の水平成分)，西の向きを並べた行列が
+ * センサ座標から地面座標への回転行列になるので，それをクォータニオンに変換する．
+ */
+void Ahrs::init_pose(float ax, float ay, float az, float mx, float my, float mz, bool use_mag)
+{
+    float u[3], n[3], w[3];
+    float norm, d;
+
+    norm = sqrtf(ax * ax + ay * ay + az * az);
+    u[0] = ax / norm;
+    u[1] = ay / norm;
+    u[2] = az / norm;
+
+    if( !use_mag )
+    {
+        // 方位が分からないので，センサのX軸を北とする
+        mx = 1.0f;
+        my = mz = 0.0f;
+        if( fabsf(u[0]) > 0.9f )
+        {
+            mx = 0.0f;
+            my = 1.0f;
+        }
+    }
+    d = mx * u[0] + my * u[1] + mz * u[2];
+    n[0] = mx - d * u[0];
+    n[1] = my - d * u[1];
+    n[2] = mz - d * u[2];
+    norm = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if( norm < 1e-6f )
+    {
+        // 磁気が鉛直．方位は決められないので加速度だけで初期化する
+        init_pose(ax, ay, az, 0.0f, 0.0f, 0.0f, false);
+        return;
+    }
+    n[0] /= norm;
+    n[1] /= norm;
+    n[2] /= norm;
+    // 西 = 上 x 北
+    w[0] = u[1] * n[2] - u[2] * n[1];
+    w[1] = u[2] * n[0] - u[0] * n[2];
+    w[2] = u[0] * n[1] - u[1] * n[0];
+
+    // 回転行列の行が北，西，上
+    float r00 = n[0], r01 = n[1], r02 = n[2];
+    float r10 = w[0], r11 = w[1], r12 = w[2];
+    float r20 = u[0], r21 = u[1], r22 = u[2];
+    float tr = r00 + r11 + r22;
+    float s;
+
+    if( tr > 0.0f )
+    {
+        s = sqrtf(tr + 1.0f) * 2.0f;
+        q0 = 0.25f * s;
+        q1 = (r21 - r12) / s;
+        q2 = (r02 - r20) / s;
+        q3 = (r10 - r01) / s;
+    }
+    else if( r00 > r11 && r00 > r22 )
+    {
+        s = sqrtf(1.0f + r00 - r11 - r22) * 2.0f;
+        q0 = (r21 - r12) / s;
+        q1 = 0.25f * s;
+        q2 = (r01 + r10) / s;
+        q3 = (r02 + r20) / s;
+    }
+    else if( r11 > r22 )
+    {
+        s = sqrtf(1.0f + r11 - r00 - r22) * 2.0f;
+        q0 = (r02 - r20) / s;
+        q1 = (r01 + r10) / s;
+        q2 = 0.25f * s;
+        q3 = (r12 + r21) / s;
+    }
+    else
+    {
+        s = sqrtf(1.0f + r22 - r00 - r11) * 2.0f;
+        q0 = (r10 - r01) / s;
+        q1 = (r02 + r20) / s;
+        q2 = (r12 + r21) / s;
+        q3 = 0.25f * s;
+    }
+    norm = 1.0f / sqrtf(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q0 *= norm;
+    q1 *= norm;
+    q2 *= norm;
+    q3 *= norm;
+    initialized = true;
+}
+
+
+/**
+ * @brief 加速度と角速度で姿勢を更新する
+ *
+ * @param gx 角速度(deg/s)
+ * @param ax 加速度(単位は任意．向きだけを使う)
+ */
+void Ahrs::update_imu(float gx, float gy, float gz, float ax, float ay, float az)
+{
+    float recip_norm;
+    float s0, s1, s2, s3;
+    float qdot0, qdot1, qdot2, qdot3;
+
+    if( !initialized )
+    {
+        if( ax == 0.0f && ay == 0.0f && az == 0.0f )
+        {
+            return;
+        }
+        init_pose(ax, ay, az, 0.0f, 0.0f, 0.0f, false);
+        return;
+    }
+
+    gx *= AHRS_DEG_TO_RAD;
+    gy *= AHRS_DEG_TO_RAD;
+    gz *= AHRS_DEG_TO_RAD;
+
+    // 角速度によるクォータニオンの変化率
+    qdot0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+    qdot1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+    qdot2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+    qdot3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+    if( !(ax == 0.0f && ay == 0.0f && az == 0.0f) )
+    {
+        recip_norm = 1.0f / sqrtf(ax * ax + ay * ay + az * az);
+        ax *= recip_norm;
+        ay *= recip_norm;
+        az *= recip_norm;
+
+        float _2q0 = 2.0f * q0;
+        float _2q1 = 2.0f * q1;
+        float _2q2 = 2.0f * q2;
+        float _2q3 = 2.0f * q3;
+        float _4q0 = 4.0f * q0;
+        float _4q1 = 4.0f * q1;
+        float _4q2 = 4.0f * q2;
+        float _8q1 = 8.0f * q1;
+        float _8q2 = 8.0f * q2;
+        float q0q0 = q0 * q0;
+        float q1q1 = q1 * q1;
+        float q2q2 = q2 * q2;
+        float q3q3 = q3 * q3;
+
+        // 重力の向きの誤差の勾配
+        s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+        s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+        s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+        s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+        recip_norm = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+        if( recip_norm > 0.0f )
+        {
+            recip_norm = 1.0f / sqrtf(recip_norm);
+            qdot0 -= beta * s0 * recip_norm;
+            qdot1 -= beta * s1 * recip_norm;
+            qdot2 -= beta * s2 * recip_norm;
+            qdot3 -= beta * s3 * recip_norm;
+        }
+    }
+
+    q0 += qdot0 * dt;
+    q1 += qdot1 * dt;
+    q2 += qdot2 * dt;
+    q3 += qdot3 * dt;
+    recip_norm = 1.0f / sqrtf(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q0 *= recip_norm;
+    q1 *= recip_norm;
+    q2 *= recip_norm;
+    q3 *= recip_norm;
+}
+
+
+/**
+ * @brief 加速度，角速度，磁気で姿勢を更新する
+ *
+ * @param gx 角速度(deg/s)
+ * @param ax 加速度(単位は任意．向きだけを使う)
+ * @param mx 磁気(単位は任意．オフセットを引いた後の向きだけを使う)
+ *
+ * 磁気が全て0なら，update_imu()と同じ．
+ */
+void Ahrs::update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz)
+{
+    float recip_norm;
+    float s0, s1, s2, s3;
+    float qdot0, qdot1, qdot2, qdot3;
+    float hx, hy;
+
+    if( mx == 0.0f && my == 0.0f && mz == 0.0f )
+    {
+        update_imu(gx, gy, gz, ax, ay, az);
+        return;
+    }
+    mx -= mag_offset[0];
+    my -= mag_offset[1];
+    mz -= mag_offset[2];
+
+    if( !initialized )
+    {
+        if( ax == 0.0f && ay == 0.0f && az == 0.0f )
+        {
+            return;
+        }
+        init_pose(ax, ay, az, mx, my, mz, true);
+        return;
+    }
+    if( ax == 0.0f && ay == 0.0f && az == 0.0f )
+    {
+        // 重力の向きが分からないと磁気の水平成分も分からない
+        update_imu(gx, gy, gz, ax, ay, az);
+        return;
+    }
+
+    gx *= AHRS_DEG_TO_RAD;
+    gy *= AHRS_DEG_TO_RAD;
+    gz *= AHRS_DEG_TO_RAD;
+
+    qdot0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+    qdot1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+    qdot2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+    qdot3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+    recip_norm = 1.0f / sqrtf(ax * ax + ay * ay + az * az);
+    ax *= recip_norm;
+    ay *= recip_norm;
+    az *= recip_norm;
+    recip_norm = 1.0f / sqrtf(mx * mx + my * my + mz * mz);
+    mx *= recip_norm;
+    my *= recip_norm;
+    mz *= recip_norm;
+
+    float _2q0mx = 2.0f * q0 * mx;
+    float _2q0my = 2.0f * q0 * my;
+    float _2q0mz = 2.0f * q0 * mz;
+    float _2q1mx = 2.0f * q1 * mx;
+    float _2q0 = 2.0f * q0;
+    float _2q1 = 2.0f * q1;
+    float _2q2 = 2.0f * q2;
+    float _2q3 = 2.0f * q3;
+    float _2q0q2 = 2.0f * q0 * q2;
+    float _2q2q3 = 2.0f * q2 * q3;
+    float q0q0 = q0 * q0;
+    float q0q1 = q0 * q1;
+    float q0q2 = q0 * q2;
+    float q0q3 = q0 * q3;
+    float q1q1 = q1 * q1;
+    float q1q2 = q1 * q2;
+    float q1q3 = q1 * q3;
+    float q2q2 = q2 * q2;
+    float q2q3 = q2 * q3;
+    float q3q3 = q3 * q3;
+
+    // 地面座標での磁気の向き．水平成分を北に揃えたものを基準にする
+    hx = mx * q0q0 - _2q0my * q3 + _2q0mz * q2 + mx * q1q1 + _2q1 * my * q2 + _2q1 * mz * q3 - mx * q2q2 - mx * q3q3;
+    hy = _2q0mx * q3 + my * q0q0 - _2q0mz * q1 + _2q1mx * q2 - my * q1q1 + my * q2q2 + _2q2 * mz * q3 - my * q3q3;
+    float _2bx = sqrtf(hx * hx + hy * hy);
+    float _2bz = -_2q0mx * q2 + _2q0my * q1 + mz * q0q0 + _2q1mx * q3 - mz * q1q1 + _2q2 * my * q3 - mz * q2q2 + mz * q3q3;
+    float _4bx = 2.0f * _2bx;
+    float _4bz = 2.0f * _2bz;
+
+    // 重力と磁気の向きの誤差
+    float ex = 2.0f * q1q3 - _2q0q2 - ax;
+    float ey = 2.0f * q0q1 + _2q2q3 - ay;
+    float ez = 1.0f - 2.0f * q1q1 - 2.0f * q2q2 - az;
+    float fx = _2bx * (0.5f - q2q2 - q3q3) + _2bz * (q1q3 - q0q2) - mx;
+    float fy = _2bx * (q1q2 - q0q3) + _2bz * (q0q1 + q2q3) - my;
+    float fz = _2bx * (q0q2 + q1q3) + _2bz * (0.5f - q1q1 - q2q2) - mz;
+
+    s0 = -_2q2 * ex + _2q1 * ey - _2bz * q2 * fx + (-_2bx * q3 + _2bz * q1) * fy + _2bx * q2 * fz;
+    s1 = _2q3 * ex + _2q0 * ey - 4.0f * q1 * ez + _2bz * q3 * fx + (_2bx * q2 + _2bz * q0) * fy + (_2bx * q3 - _4bz * q1) * fz;
+    s2 = -_2q0 * ex + _2q3 * ey - 4.0f * q2 * ez + (-_4bx * q2 - _2bz * q0) * fx + (_2bx * q1 + _2bz * q3) * fy + (_2bx * q0 - _4bz * q2) * fz;
+    s3 = _2q1 * ex + _2q2 * ey + (-_4bx * q3 + _2bz * q1) * fx + (-_2bx * q0 + _2bz * q2) * fy + _2bx * q1 * fz;
+    recip_norm = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+    if( recip_norm > 0.0f )
+    {
+        recip_norm = 1.0f / sqrtf(recip_norm);
+        qdot0 -= beta * s0 * recip_norm;
+        qdot1 -= beta * s1 * recip_norm;
+        qdot2 -= beta * s2 * recip_norm;
+        qdot3 -= beta * s3 * recip_norm;
+    }
+
+    q0 += qdot0 * dt;
+    q1 += qdot1 * dt;
+    q2 += qdot2 * dt;
+    q3 += qdot3 * dt;
+    recip_norm = 1.0f / sqrtf(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q0 *= recip_norm;
+    q1 *= recip_norm;
+    q2 *= recip_norm;
+    q3 *= recip_norm;
+}
+
+
+void Ahrs::get_quaternion(float q[4]) const
+{
+    q[0] = q0;
+    q[1] = q1;
+    q[2] = q2;
+    q[3] = q3;
+}
+
+
+/**
+ * @brief オイラー角(deg)を求める
+ *
+ * @param roll X軸周りの回転
+ * @param pitch Y軸周りの回転
+ * @param yaw Z軸周りの回転．NWU座標なので反時計回りが正
+ */
+void Ahrs::get_euler(float *roll, float *pitch, float *yaw) const
+{
+    float sp = -2.0f * (q1 * q3 - q0 * q2);
+
+    if( sp > 1.0f )
+    {
+        sp = 1.0f;
+    }
+    if( sp < -1.0f )
+    {
+        sp = -1.0f;
+    }
+    *roll = atan2f(q0 * q1 + q2 * q3, 0.5f - q1 * q1 - q2 * q2) * AHRS_RAD_TO_DEG;
+    *pitch = asinf(sp) * AHRS_RAD_TO_DEG;
+    *yaw = atan2f(q1 * q2 + q0 * q3, 0.5f - q2 * q2 - q3 * q3) * AHRS_RAD_TO_DEG;
+}
+
+
+/**
+ * @brief 方位(deg)を求める．磁北から時計回りで0〜360
+ */
+float Ahrs::get_heading() const
+{
+    float h = -atan2f(q1 * q2 + q0 * q3, 0.5f - q2 * q2 - q3 * q3) * AHRS_RAD_TO_DEG;
+
+    if( h < 0.0f )
+    {
+        h += 360.0f;
+    }
+    if( h >= 360.0f )
+    {
+        h -= 360.0f;
+    }
+    return h;
+}
+
+
+/**
+ * @brief センサ座標のベクトルの鉛直(上向き)成分を求める
+ *
+ * @param x センサ座標のベクトル
+ * @return float 地面座標での上向き成分．静止時の加速度なら重力の1G
+ */
+float Ahrs::get_vertical(float x, float y, float z) const
+{
+    return 2.0f * (q1 * q3 - q0 * q2) * x + 2.0f * (q2 * q3 + q0 * q1) * y
+           + (1.0f - 2.0f * (q1 * q1 + q2 * q2)) * z;
+}
+
+
+/**
+ * @brief 現在の姿勢を記録形式に変換する
+ *
+ * @param time_us サンプルの時刻(unixtime, us)
+ * @param flags AHRS_FLAG_*
+ * @param rec 格納先
+ *
+ * qと-qは同じ姿勢なので，wが負にならないように符号を揃える．
+ */
+void Ahrs::to_record(int64_t time_us, uint8_t flags, ahrs_record_t *rec) const
+{
+    float sign = (q0 < 0.0f) ? -(float)AHRS_Q_ONE : (float)AHRS_Q_ONE;
+    int h = (int)lroundf(get_heading() * 100.0f);
+
+    rec->time_us = time_us;
+    rec->q[0] = (int16_t)lroundf(q0 * sign);
+    rec->q[1] = (int16_t)lroundf(q1 * sign);
+    rec->q[2] = (int16_t)lroundf(q2 * sign);
+    rec->q[3] = (int16_t)lroundf(q3 * sign);
+    rec->heading = (uint16_t)(h >= 36000 ? h - 36000 : h);
+    rec->flags = flags;
+    rec->reserved = 0;
+}
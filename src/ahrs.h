@@ -0,0 +1,81 @@
+/**
+ * @file ahrs.h
+ * @author amagai
+ * @brief 加速度・角速度・磁気からの姿勢推定(Madgwickフィルタ)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * IMUのサンプル毎に，固定の時間刻みで姿勢のクォータニオンを更新する．
+ * 角速度を積分した姿勢を，加速度(重力の向き)と磁気(磁北の向き)から求めた誤差の勾配で補正する．
+ * 磁気が無い(全て0の)場合は加速度だけで補正するので，方位は角速度の積分になる．
+ *
+ * 座標系はセンサの軸をそのまま使い，地面側の座標系は北・西・上(NWU)．
+ * クォータニオンはセンサ座標のベクトルを地面座標に回転する．
+ * 方位(heading)は磁北から時計回りに測ったセンサのX軸の向き．偏角は補正しない．
+ *
+ * 最初の更新では，加速度と磁気から直接姿勢を求めて初期値にする．
+ * PC用の評価ツールtools/ahrs_benchからも使うので，Arduinoに依存しないこと．
+ */
+#ifndef AHRS_H
+#define AHRS_H
+
+#include <stdint.h>
+
+// 補正の強さ(rad/s)の既定値．大きいほど加速度と磁気に早く追従するが，振動の影響を受ける
+#define AHRS_DEFAULT_BETA 0.1f
+// 固定小数点のクォータニオンの1.0
+#define AHRS_Q_ONE 16384
+
+// ahrs_record_tのフラグ
+#define AHRS_FLAG_MAG 0x01          // 磁気で方位を補正している
+#define AHRS_FLAG_CALIBRATED 0x02   // タイムスタンプがPPSで校正済み
+
+#pragma pack(push, 1)
+/**
+ * @brief 姿勢の記録形式(20バイト)
+ *
+ * クォータニオンは各成分をAHRS_Q_ONE倍した整数(Q14)．
+ * 成分の絶対値は1以下なので，int16_tに収まる．
+ */
+typedef struct {
+    int64_t time_us;            // サンプルの時刻(unixtime, us)
+    int16_t q[4];               // クォータニオン w, x, y, z
+    uint16_t heading;           // 方位(0.01度単位，0〜35999)
+    uint8_t flags;              // AHRS_FLAG_*
+    uint8_t reserved;
+} ahrs_record_t;
+#pragma pack(pop)
+
+
+class Ahrs
+{
+protected:
+    float dt;                   // 時間刻み(s)
+    float beta;
+    float q0, q1, q2, q3;
+    float mag_offset[3];
+    bool initialized;
+
+    void init_pose(float ax, float ay, float az, float mx, float my, float mz, bool use_mag);
+
+public:
+    Ahrs(float rate_hz, float beta = AHRS_DEFAULT_BETA);
+
+    void set_rate(float rate_hz);
+    void set_beta(float b) { beta = b; }
+    void set_mag_offset(float x, float y, float z);
+    void reset();
+    void update_imu(float gx, float gy, float gz, float ax, float ay, float az);
+    void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz);
+
+    bool is_initialized() const { return initialized; }
+    void get_quaternion(float q[4]) const;
+    void get_euler(float *roll, float *pitch, float *yaw) const;
+    float get_heading() const;
+    float get_vertical(float x, float y, float z) const;
+    void to_record(int64_t time_us, uint8_t flags, ahrs_record_t *rec) const;
+};
+
+#endif // AHRS_H
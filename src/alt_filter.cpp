@@ -0,0 +1,291 @@
+/**
+ * @file alt_filter.cpp
+ * @author amagai
+ * @brief 気圧・GNSS・IMUを組み合わせた高度と昇降速度の推定(カルマンフィルタ)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "alt_filter.h"
+#include "nmea_parser.h"
+
+// RTKのGNSSの高度の誤差(m)
+#define ALT_RTK_FIXED_SIGMA 0.1f
+#define ALT_RTK_FLOAT_SIGMA 0.5f
+
+// 状態の並び
+#define IDX_H 0
+#define IDX_V 1
+#define IDX_OFS 2
+
+
+AltFilter::AltFilter()
+{
+    reset();
+}
+
+
+/**
+ * @brief 推定を破棄する．次の気圧から始め直す
+ */
+void AltFilter::reset()
+{
+    initialized = false;
+    gnss_ref = false;
+    accel_used = false;
+    memset(x, 0, sizeof(x));
+    memset(P, 0, sizeof(P));
+    time_us = 0;
+    rejected_in_row = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+
+/**
+ * @brief 圧力から標準大気での高度(m)を求める
+ */
+float AltFilter::pressure_altitude(float pressure_pa)
+{
+    return 44330.77f * (1.0f - powf(pressure_pa / 101325.0f, 0.190263f));
+}
+
+
+/**
+ * @brief 時間を進める
+ *
+ * @param dt 経過時間(s)
+ * @param accel 鉛直加速度(m/s^2，重力を除く)
+ */
+void AltFilter::predict(float dt, float accel)
+{
+    float qa = accel_used ? ALT_ACCEL_NOISE * ALT_ACCEL_NOISE : ALT_MOTION_NOISE * ALT_MOTION_NOISE;
+    float dt2 = dt * dt;
+
+    x[IDX_H] += x[IDX_V] * dt + 0.5f * accel * dt2;
+    x[IDX_V] += accel * dt;
+
+    // P = F P F^T + Q，F = [1 dt 0; 0 1 0; 0 0 1]
+    P[0][0] += dt * (P[1][0] + P[0][1]) + dt2 * P[1][1];
+    P[0][1] += dt * P[1][1];
+    P[0][2] += dt * P[1][2];
+    P[1][0] = P[0][1];
+    P[2][0] = P[0][2];
+
+    P[0][0] += 0.25f * dt2 * dt2 * qa;
+    P[0][1] += 0.5f * dt2 * dt * qa;
+    P[1][0] += 0.5f * dt2 * dt * qa;
+    P[1][1] += dt2 * qa;
+    // GNSSで補正するまではオフセットを0に固定する
+    if( gnss_ref )
+    {
+        P[2][2] += ALT_OFFSET_NOISE * ALT_OFFSET_NOISE * dt;
+    }
+}
+
+
+/**
+ * @brief 1つの観測で補正する
+ *
+ * @param h 観測行列(1行)
+ * @param z 観測値
+ * @param r 観測の分散
+ * @param gate 残差がこの標準偏差の倍数を超えたら補正しない．0なら常に補正する
+ * @return bool 補正すればtrue
+ */
+bool AltFilter::update(const float h[3], float z, float r, float gate)
+{
+    float ph[3];
+    float s = r;
+    float y = z;
+
+    for( int i = 0; i < 3; i++ )
+    {
+        ph[i] = P[i][0] * h[0] + P[i][1] * h[1] + P[i][2] * h[2];
+        y -= h[i] * x[i];
+    }
+    for( int i = 0; i < 3; i++ )
+    {
+        s += h[i] * ph[i];
+    }
+    if( gate > 0.0f && y * y > gate * gate * s )
+    {
+        return false;
+    }
+    for( int i = 0; i < 3; i++ )
+    {
+        x[i] += ph[i] / s * y;
+    }
+    for( int i = 0; i < 3; i++ )
+    {
+        for( int j = 0; j < 3; j++ )
+        {
+            P[i][j] -= ph[i] * ph[j] / s;
+        }
+    }
+    // 丸め誤差で非対称にならないようにする
+    for( int i = 0; i < 3; i++ )
+    {
+        for( int j = i + 1; j < 3; j++ )
+        {
+            float m = 0.5f * (P[i][j] + P[j][i]);
+            P[i][j] = P[j][i] = m;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief GNSSの高度に合わせて高度とオフセットを置き直す
+ *
+ * 高度は気圧高度とオフセットの差なので，両者の誤差は逆向きに相関する．
+ */
+void AltFilter::set_gnss_reference(float altitude, float sigma)
+{
+    float var = sigma * sigma;
+
+    x[IDX_OFS] = x[IDX_H] + x[IDX_OFS] - altitude;
+    x[IDX_H] = altitude;
+    P[0][0] = var;
+    P[2][2] = var + ALT_BARO_SIGMA * ALT_BARO_SIGMA;
+    P[0][2] = P[2][0] = -var;
+    P[0][1] = P[1][0] = 0.0f;
+    P[1][2] = P[2][1] = 0.0f;
+    gnss_ref = true;
+    rejected_in_row = 0;
+}
+
+
+/**
+ * @brief 気圧で更新する．気圧の読み出し毎に呼ぶ
+ *
+ * @param t_us 読み出した時刻(unixtime, us)
+ * @param pressure_pa 圧力(Pa)
+ * @param accel_up 前回からの平均の鉛直加速度(m/s^2，重力を除く)．NULLならIMUを使わない
+ */
+void AltFilter::update_baro(int64_t t_us, float pressure_pa, const float *accel_up)
+{
+    static const float h_baro[3] = { 1.0f, 0.0f, 1.0f };
+    float hp = pressure_altitude(pressure_pa);
+
+    if( !initialized )
+    {
+        x[IDX_H] = hp;
+        x[IDX_V] = 0.0f;
+        x[IDX_OFS] = 0.0f;
+        memset(P, 0, sizeof(P));
+        P[0][0] = ALT_BARO_SIGMA * ALT_BARO_SIGMA;
+        P[1][1] = 1.0f;
+        time_us = t_us;
+        initialized = true;
+        return;
+    }
+    if( t_us <= time_us || t_us - time_us > ALT_MAX_GAP_US )
+    {
+        // 間が空いたら速度を捨て，高度は気圧高度に合わせる
+        x[IDX_H] = hp - x[IDX_OFS];
+        x[IDX_V] = 0.0f;
+        P[1][1] = 1.0f;
+        P[0][1] = P[1][0] = 0.0f;
+        P[1][2] = P[2][1] = 0.0f;
+        time_us = t_us;
+        return;
+    }
+
+    accel_used = (accel_up != NULL);
+    predict((t_us - time_us) / 1e6f, accel_used ? *accel_up : 0.0f);
+    time_us = t_us;
+    update(h_baro, hp, ALT_BARO_SIGMA * ALT_BARO_SIGMA, 0.0f);
+    stats.baro++;
+}
+
+
+/**
+ * @brief GNSSの高度で補正する．GGAを受信する度に呼ぶ
+ *
+ * @param altitude 平均海面からの高度(m)
+ * @param hdop 水平精度低下率
+ * @param fix_type NMEA_FIX_TYPE_*
+ * @return int 補正すれば0，測位が無効か残差が大きくて使わなければ-1
+ *
+ * 誤差はHDOPに比例するとし，RTKの場合は固定の値にする．
+ */
+int AltFilter::update_gnss(float altitude, float hdop, int fix_type)
+{
+    static const float h_gnss[3] = { 1.0f, 0.0f, 0.0f };
+    float sigma;
+
+    if( !initialized )
+    {
+        return -1;
+    }
+    switch( fix_type )
+    {
+        case NMEA_FIX_TYPE_AUTONOMOUS:
+        case NMEA_FIX_TYPE_DIFFERENTIAL:
+        case NMEA_FIX_TYPE_PPP:
+            sigma = ((hdop > 0.5f) ? hdop : 0.5f) * ALT_GNSS_UERE;
+            if( fix_type != NMEA_FIX_TYPE_AUTONOMOUS )
+            {
+                sigma *= 0.5f;
+            }
+            break;
+        case NMEA_FIX_TYPE_RTK_FIXED:
+            sigma = ALT_RTK_FIXED_SIGMA;
+            break;
+        case NMEA_FIX_TYPE_RTK_FLOAT:
+            sigma = ALT_RTK_FLOAT_SIGMA;
+            break;
+        default:
+            return -1;
+    }
+
+    if( !gnss_ref )
+    {
+        set_gnss_reference(altitude, sigma);
+        stats.gnss++;
+        return 0;
+    }
+    if( !update(h_gnss, altitude, sigma * sigma, ALT_GATE_SIGMA) )
+    {
+        stats.rejected++;
+        if( ++rejected_in_row >= ALT_MAX_REJECTS )
+        {
+            // 気圧の急変などで合わなくなったので，GNSSに合わせ直す
+            set_gnss_reference(altitude, sigma);
+            stats.resets++;
+        }
+        return -1;
+    }
+    rejected_in_row = 0;
+    stats.gnss++;
+    return 0;
+}
+
+
+/**
+ * @brief 推定した高度を取得する
+ *
+ * @param out 格納先
+ * @return bool 推定していればtrue
+ */
+bool AltFilter::get_output(alt_output_t *out) const
+{
+    if( !initialized )
+    {
+        return false;
+    }
+    out->time_us = time_us;
+    out->altitude = x[IDX_H];
+    out->vspeed = x[IDX_V];
+    out->baro_offset = x[IDX_OFS];
+    out->sigma = sqrtf(P[0][0] > 0.0f ? P[0][0] : 0.0f);
+    out->flags = (gnss_ref ? ALT_FLAG_GNSS : 0) | (accel_used ? ALT_FLAG_IMU : 0);
+    return true;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file alt_filter.h
+ * @author amagai
+ * @brief 気圧・GNSS・IMUを組み合わせた高度と昇降速度の推定(カルマンフィルタ)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 状態は高度，昇降速度，気圧高度のオフセットの3次元．
+ * 気圧高度(標準大気で圧力から求めた高度)は滑らかだが，天候や温度で数十mずれる．
+ * GNSSの高度は絶対値は正しいが，1Hzで数mのばらつきがある．
+ * 気圧の読み出し毎に予測と気圧高度での補正を行い，GNSSの測位毎に高度とオフセットを補正する．
+ * IMUの鉛直加速度があれば予測に使い，昇降速度の遅れを小さくする．
+ *
+ * GNSSで補正するまでは，高度は気圧高度そのもの(オフセット0)になる．
+ * 高度はGGAと同じ平均海面からの高さ．
+ *
+ * Arduinoに依存しないこと．
+ */
+#ifndef ALT_FILTER_H
+#define ALT_FILTER_H
+
+#include <stdint.h>
+
+// IMUの加速度を使う場合の加速度の雑音(m/s^2)
+#define ALT_ACCEL_NOISE 0.5f
+// IMUの加速度が無い場合の加速度の雑音(m/s^2)．昇降速度のランダムウォークとして扱う
+#define ALT_MOTION_NOISE 2.0f
+// 気圧高度のオフセットの変動(m/√s)．天候による変化
+#define ALT_OFFSET_NOISE 0.02f
+// 気圧高度の雑音(m)
+#define ALT_BARO_SIGMA 0.5f
+// HDOP 1あたりのGNSSの高度の誤差(m)．鉛直は水平の1.5〜2倍程度
+#define ALT_GNSS_UERE 4.0f
+// 残差がこの標準偏差の倍数を超えるGNSSの高度は使わない
+#define ALT_GATE_SIGMA 5.0f
+// 連続してこの回数GNSSの高度を捨てたら，オフセットを置き直す
+#define ALT_MAX_REJECTS 5
+// 気圧の間隔がこれより空いたら予測をやり直す(us)
+#define ALT_MAX_GAP_US 2000000
+
+// alt_output_tのフラグ
+#define ALT_FLAG_GNSS 0x01          // GNSSで補正している(高度が平均海面基準)
+#define ALT_FLAG_IMU 0x02           // IMUの加速度を使っている
+
+
+/**
+ * @brief 推定した高度
+ */
+typedef struct {
+    int64_t time_us;            // 時刻(unixtime, us)
+    float altitude;             // 高度(m)
+    float vspeed;               // 昇降速度(m/s，上が正)
+    float baro_offset;          // 気圧高度 - 高度(m)
+    float sigma;                // 高度の誤差の標準偏差(m)
+    uint8_t flags;              // ALT_FLAG_*
+} alt_output_t;
+
+
+/**
+ * @brief 統計
+ */
+typedef struct {
+    uint32_t baro;              // 補正に使った気圧の数
+    uint32_t gnss;              // 補正に使ったGNSSの高度の数
+    uint32_t rejected;          // 残差が大きくて捨てたGNSSの高度の数
+    uint32_t resets;            // オフセットを置き直した回数
+} alt_filter_stats_t;
+
+
+class AltFilter
+{
+protected:
+    bool initialized;
+    bool gnss_ref;              // GNSSで補正済み
+    bool accel_used;
+    float x[3];                 // 高度，昇降速度，オフセット
+    float P[3][3];
+    int64_t time_us;
+    int rejected_in_row;
+    alt_filter_stats_t stats;
+
+    void predict(float dt, float accel);
+    bool update(const float h[3], float z, float r, float gate);
+    void set_gnss_reference(float altitude, float sigma);
+
+public:
+    AltFilter();
+
+    void reset();
+    void update_baro(int64_t t_us, float pressure_pa, const float *accel_up);
+    int update_gnss(float altitude, float hdop, int fix_type);
+    bool get_output(alt_output_t *out) const;
+    alt_filter_stats_t get_stats() const { return stats; }
+
+    static float pressure_altitude(float pressure_pa);
+};
+
+#endif // ALT_FILTER_H
@@ -0,0 +1,296 @@
+/**
+ * @file bmi270_fifo.cpp
+ * @author amagai
+ * @brief BMI270の内蔵FIFOの読み出し
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * I2Cバスの排他は呼び出し側で行うこと．
+ */
+
+#include <Arduino.h>
+#include <M5Unified.h>
+
+#include "bmi270_fifo.h"
+
+#define BMI270_I2C_FREQ 400000
+
+// レジスタ
+#define BMI270_REG_FIFO_LENGTH_0 0x24
+#define BMI270_REG_FIFO_DATA 0x26
+#define BMI270_REG_ACC_CONF 0x40
+#define BMI270_REG_ACC_RANGE 0x41
+#define BMI270_REG_GYR_CONF 0x42
+#define BMI270_REG_GYR_RANGE 0x43
+#define BMI270_REG_FIFO_DOWNS 0x45
+#define BMI270_REG_FIFO_CONFIG_0 0x48
+#define BMI270_REG_FIFO_CONFIG_1 0x49
+#define BMI270_REG_PWR_CTRL 0x7d
+#define BMI270_REG_CMD 0x7e
+
+#define BMI270_CMD_FIFO_FLUSH 0xb0
+
+// FIFOのフレームヘッダ．下位2bitは割り込みタグなので比較の前にマスクする
+#define BMI270_FH_MASK 0xfc
+#define BMI270_FH_REGULAR_MASK 0xc0
+#define BMI270_FH_REGULAR 0x80
+#define BMI270_FH_EMPTY 0x80
+#define BMI270_FH_AUX 0x10
+#define BMI270_FH_GYR 0x08
+#define BMI270_FH_ACC 0x04
+#define BMI270_FH_SKIP 0x40
+#define BMI270_FH_SENSORTIME 0x44
+#define BMI270_FH_INPUT_CONFIG 0x48
+
+
+Bmi270Fifo::Bmi270Fifo(uint8_t addr) : addr(addr)
+{
+    odr_hz = 0;
+    period_ticks = 0;
+    time_valid = false;
+    last_raw_time = 0;
+    base_time = 0;
+    time_fresh = false;
+    last_sample_time = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+
+int Bmi270Fifo::write_reg(uint8_t reg, uint8_t value)
+{
+    stats.transactions++;
+    if( !M5.In_I2C.writeRegister8(addr, reg, value, BMI270_I2C_FREQ) )
+    {
+        return -1;
+    }
+    // 低消費電力モードでは書き込みの間隔を450us以上空ける必要がある
+    delayMicroseconds(500);
+    return 0;
+}
+
+
+int Bmi270Fifo::read_regs(uint8_t reg, uint8_t *buf, size_t len)
+{
+    stats.transactions++;
+    return M5.In_I2C.readRegister(addr, reg, buf, len, BMI270_I2C_FREQ) ? 0 : -1;
+}
+
+
+/**
+ * @brief FIFOを設定して記録を開始する
+ *
+ * @param odr 出力データレート(Hz)．100, 200, 400, 800, 1600のいずれか
+ * @return int 成功すれば0，失敗すれば-1
+ *
+ * BMI270ライブラリでの初期化の後に呼ぶこと．
+ * 加速度は±4G，角速度は±2000deg/sに設定する(ライブラリと同じ)．
+ */
+int Bmi270Fifo::begin(int odr)
+{
+    uint8_t code;
+    uint8_t pwr;
+
+    switch( odr )
+    {
+        case 100: code = 0x08; break;
+        case 200: code = 0x09; break;
+        case 400: code = 0x0a; break;
+        case 800: code = 0x0b; break;
+        case 1600: code = 0x0c; break;
+        default:
+            return -1;
+    }
+    odr_hz = odr;
+    // センサ時刻は1秒で25600カウント
+    period_ticks = 25600 / odr;
+
+    if( write_reg(BMI270_REG_ACC_RANGE, 0x01) != 0             // ±4G
+        || write_reg(BMI270_REG_GYR_RANGE, 0x00) != 0          // ±2000deg/s
+        || write_reg(BMI270_REG_ACC_CONF, 0xa0 | code) != 0    // filter_perf, 通常フィルタ
+        || write_reg(BMI270_REG_GYR_CONF, 0xa0 | code) != 0
+        || write_reg(BMI270_REG_FIFO_DOWNS, 0x88) != 0         // フィルタ後のデータ，間引き無し
+        || write_reg(BMI270_REG_FIFO_CONFIG_0, 0x02) != 0      // センサ時刻フレーム有効，一杯なら古いものを捨てる
+        || write_reg(BMI270_REG_FIFO_CONFIG_1, 0xd0) != 0      // 角速度，加速度，ヘッダモード
+        || read_regs(BMI270_REG_PWR_CTRL, &pwr, 1) != 0
+        || write_reg(BMI270_REG_PWR_CTRL, pwr | 0x06) != 0     // 加速度と角速度を有効にする
+        || write_reg(BMI270_REG_CMD, BMI270_CMD_FIFO_FLUSH) != 0 )
+    {
+        return -1;
+    }
+
+    time_valid = false;
+    last_sample_time = 0;
+    return 0;
+}
+
+
+/**
+ * @brief FIFOに溜まっているサンプルを全て読み出す
+ *
+ * @param samples サンプルの格納先
+ * @param max_samples 格納先の数．BMI270_FIFO_MAX_FRAMESあれば全て格納できる
+ * @return int 読み出したサンプル数．I2Cの通信に失敗した場合は-1
+ *
+ * FIFOの長さとデータの2回のトランザクションで読み出す．
+ * サンプルの時刻は，最後に付くセンサ時刻フレームから逆算する．
+ */
+int Bmi270Fifo::read(bmi270_sample_t *samples, int max_samples)
+{
+    uint8_t len_buf[2];
+    size_t len;
+    size_t pos = 0;
+    size_t frame_len;
+    int n = 0;
+    uint32_t skipped = 0;
+    bool got_time = false;
+    uint32_t raw_time = 0;
+    uint8_t header;
+    const uint8_t *p;
+
+    time_fresh = false;
+    if( read_regs(BMI270_REG_FIFO_LENGTH_0, len_buf, 2) != 0 )
+    {
+        return -1;
+    }
+    len = len_buf[0] | ((len_buf[1] & 0x3f) << 8);
+    if( len == 0 )
+    {
+        return 0;
+    }
+    // センサ時刻フレーム(4バイト)はFIFOの長さに含まれないので，その分多く読む
+    len += 4;
+    if( len > sizeof(buffer) )
+    {
+        len = sizeof(buffer);
+    }
+    if( read_regs(BMI270_REG_FIFO_DATA, buffer, len) != 0 )
+    {
+        return -1;
+    }
+    stats.bursts++;
+    if( len > stats.max_bytes )
+    {
+        stats.max_bytes = len;
+    }
+
+    while( pos < len )
+    {
+        header = buffer[pos] & BMI270_FH_MASK;
+        if( (header & BMI270_FH_REGULAR_MASK) == BMI270_FH_REGULAR )
+        {
+            if( header == BMI270_FH_EMPTY )
+            {
+                break;      // FIFOが空
+            }
+            frame_len = 1 + ((header & BMI270_FH_AUX) ? 8 : 0) + ((header & BMI270_FH_GYR) ? 6 : 0)
+                          + ((header & BMI270_FH_ACC) ? 6 : 0);
+            if( pos + frame_len > len )
+            {
+                break;      // 途中で切れたフレームは次回の読み出しで先頭から読み直される
+            }
+            stats.frames++;
+            // データの並びは補助センサ，角速度，加速度の順
+            p = &buffer[pos + 1];
+            if( header & BMI270_FH_AUX )
+            {
+                p += 8;
+            }
+            if( (header & BMI270_FH_GYR) && (header & BMI270_FH_ACC) && n < max_samples )
+            {
+                for( int i = 0; i < 3; i++ )
+                {
+                    samples[n].gyr[i] = (int16_t)(p[i * 2] | (p[i * 2 + 1] << 8));
+                    samples[n].acc[i] = (int16_t)(p[6 + i * 2] | (p[6 + i * 2 + 1] << 8));
+                }
+                n++;
+            }
+        }
+        else if( header == BMI270_FH_SKIP )
+        {
+            frame_len = 2;
+            if( pos + frame_len <= len )
+            {
+                skipped += buffer[pos + 1];
+            }
+        }
+        else if( header == BMI270_FH_SENSORTIME )
+        {
+            frame_len = 4;
+            if( pos + frame_len <= len )
+            {
+                raw_time = buffer[pos + 1] | (buffer[pos + 2] << 8) | ((uint32_t)buffer[pos + 3] << 16);
+                got_time = true;
+            }
+        }
+        else if( header == BMI270_FH_INPUT_CONFIG )
+        {
+            frame_len = 5;
+        }
+        else
+        {
+            break;          // 不明なフレーム．残りは捨てる
+        }
+        pos += frame_len;
+    }
+    stats.skipped += skipped;
+
+    // サンプルの時刻を求める
+    if( got_time )
+    {
+        if( time_valid )
+        {
+            base_time += (raw_time - last_raw_time) & 0xffffff;
+        }
+        else
+        {
+            base_time = raw_time;
+            time_valid = true;
+        }
+        last_raw_time = raw_time;
+        time_fresh = true;
+        // サンプルはセンサ時刻がサンプル間隔の倍数になる時点で取られるので，
+        // 読み出し時刻から切り捨てたものが最後のサンプルの時刻になる．
+        // 24bitの折り返しはサンプル間隔の倍数なので，展開後の値で計算してよい．
+        int64_t end_time = base_time - base_time % period_ticks;
+        for( int i = 0; i < n; i++ )
+        {
+            samples[i].sensortime = end_time - (int64_t)(n - 1 - i) * period_ticks;
+        }
+    }
+    else
+    {
+        // センサ時刻フレームが無い場合は前回の続きとする
+        for( int i = 0; i < n; i++ )
+        {
+            samples[i].sensortime = last_sample_time + (int64_t)(skipped + i + 1) * period_ticks;
+        }
+    }
+    if( n > 0 )
+    {
+        last_sample_time = samples[n - 1].sensortime;
+    }
+    return n;
+}
+
+
+/**
+ * @brief 直前の読み出し時点のセンサ時刻を取得する
+ *
+ * @param ticks センサ時刻の格納先(折り返しを展開済み)
+ * @return true 取得できた
+ * @return false 直前の読み出しでセンサ時刻フレームが得られなかった
+ *
+ * センサ時刻フレームはFIFOのデータを読み切った時点の時刻なので，
+ * 読み出し直後のシステムの時刻と組にすれば，センサ時刻とシステムの時刻の対応が分かる．
+ */
+bool Bmi270Fifo::get_read_time(int64_t *ticks) const
+{
+    if( !time_fresh )
+    {
+        return false;
+    }
+    *ticks = base_time;
+    return true;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file bmi270_fifo.h
+ * @author amagai
+ * @brief BMI270の内蔵FIFOの読み出し
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * BMI270の初期化(コンフィグファイルの転送など)はBMI270ライブラリで行い，
+ * その後でこのクラスがレジスタを直接設定してFIFOを使う．
+ * FIFOはヘッダモードで，加速度と角速度のフレームとセンサ時刻フレームを格納する．
+ * 読み出しは1回のバーストで行う．
+ */
+#ifndef BMI270_FIFO_H
+#define BMI270_FIFO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// FIFOのサイズ(バイト)
+#define BMI270_FIFO_SIZE 2048
+// 1回に読み出せるフレーム数の上限．加速度+角速度のフレームは13バイト
+#define BMI270_FIFO_MAX_FRAMES (BMI270_FIFO_SIZE / 13 + 1)
+// センサ時刻の1LSBの長さ(ns)
+#define BMI270_SENSORTIME_NS 39062.5
+
+
+/**
+ * @brief FIFOから取り出した1サンプル
+ */
+typedef struct {
+    int64_t sensortime;         // センサ時刻(39.0625us単位，折り返しを展開済み)
+    int16_t acc[3];             // 加速度X,Y,Zの生の値
+    int16_t gyr[3];             // 角速度X,Y,Zの生の値
+} bmi270_sample_t;
+
+
+/**
+ * @brief FIFOの読み出し統計
+ */
+typedef struct {
+    uint32_t bursts;            // FIFOを読み出した回数
+    uint32_t transactions;      // I2Cトランザクション数
+    uint32_t frames;            // 読み出したデータフレーム数
+    uint32_t skipped;           // FIFOのオーバーフローで失われたフレーム数
+    uint32_t max_bytes;         // 1回に読み出した最大バイト数
+} bmi270_fifo_stats_t;
+
+
+class Bmi270Fifo
+{
+protected:
+    uint8_t addr;
+    int odr_hz;
+    uint32_t period_ticks;      // サンプル間隔(センサ時刻の単位)
+    uint8_t buffer[BMI270_FIFO_SIZE + 4];
+    bool time_valid;
+    uint32_t last_raw_time;     // 最後に受け取ったセンサ時刻フレームの値(24bit)
+    int64_t base_time;          // last_raw_timeを展開した値
+    bool time_fresh;            // 直前の読み出しでセンサ時刻フレームを受け取った
+    int64_t last_sample_time;   // 最後のサンプルのセンサ時刻
+    bmi270_fifo_stats_t stats;
+
+    int write_reg(uint8_t reg, uint8_t value);
+    int read_regs(uint8_t reg, uint8_t *buf, size_t len);
+
+public:
+    Bmi270Fifo(uint8_t addr);
+    int begin(int odr_hz);
+    int read(bmi270_sample_t *samples, int max_samples);
+    int get_odr_hz() const { return odr_hz; }
+    uint32_t get_period_ticks() const { return period_ticks; }
+    bool get_read_time(int64_t *ticks) const;
+    bmi270_fifo_stats_t get_stats() const { return stats; }
+
+    // センサ時刻をus単位に変換する
+    static int64_t ticks_to_us(int64_t ticks) { return ticks * 625 / 16; }
+};
+
+#endif // BMI270_FIFO_H
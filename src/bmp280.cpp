@@ -0,0 +1,188 @@
+/**
+ * @file bmp280.cpp
+ * @author amagai
+ * @brief BMP280気圧センサのドライバ(整数演算の補正)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * I2Cバスの排他は呼び出し側で行うこと．
+ */
+
+#include <Arduino.h>
+#include <M5Unified.h>
+
+#include "bmp280.h"
+
+#define BMP280_I2C_FREQ 400000
+
+// レジスタ
+#define BMP280_REG_CALIB 0x88
+#define BMP280_REG_ID 0xd0
+#define BMP280_REG_RESET 0xe0
+#define BMP280_REG_CTRL_MEAS 0xf4
+#define BMP280_REG_CONFIG 0xf5
+#define BMP280_REG_PRESS_MSB 0xf7
+
+#define BMP280_CHIP_ID 0x58
+#define BMP280_CMD_RESET 0xb6
+// 温度x2，圧力x16，ノーマルモード
+#define BMP280_CTRL_MEAS 0x57
+// 待機時間0.5ms，IIRフィルタ係数4
+#define BMP280_CONFIG 0x08
+// 測定がスキップされた場合の値
+#define BMP280_ADC_SKIPPED 0x80000
+
+
+Bmp280::Bmp280(uint8_t addr) : addr(addr)
+{
+    calibrated = false;
+    dig_t1 = 0;
+    dig_t2 = dig_t3 = 0;
+    dig_p1 = 0;
+    dig_p2 = dig_p3 = dig_p4 = dig_p5 = dig_p6 = dig_p7 = dig_p8 = dig_p9 = 0;
+}
+
+
+int Bmp280::write_reg(uint8_t reg, uint8_t value)
+{
+    return M5.In_I2C.writeRegister8(addr, reg, value, BMP280_I2C_FREQ) ? 0 : -1;
+}
+
+
+int Bmp280::read_regs(uint8_t reg, uint8_t *buf, size_t len)
+{
+    return M5.In_I2C.readRegister(addr, reg, buf, len, BMP280_I2C_FREQ) ? 0 : -1;
+}
+
+
+/**
+ * @brief センサを初期化し，連続測定を開始する
+ *
+ * @return int 成功すれば0，センサが見つからないか設定に失敗すれば-1
+ */
+int Bmp280::begin()
+{
+    uint8_t id;
+    uint8_t c[24];
+
+    if( read_regs(BMP280_REG_ID, &id, 1) != 0 || id != BMP280_CHIP_ID )
+    {
+        return -1;
+    }
+    if( write_reg(BMP280_REG_RESET, BMP280_CMD_RESET) != 0 )
+    {
+        return -1;
+    }
+    // リセット後の起動時間は2ms
+    delay(5);
+    if( read_regs(BMP280_REG_CALIB, c, sizeof(c)) != 0 )
+    {
+        return -1;
+    }
+    dig_t1 = (uint16_t)(c[0] | (c[1] << 8));
+    dig_t2 = (int16_t)(c[2] | (c[3] << 8));
+    dig_t3 = (int16_t)(c[4] | (c[5] << 8));
+    dig_p1 = (uint16_t)(c[6] | (c[7] << 8));
+    dig_p2 = (int16_t)(c[8] | (c[9] << 8));
+    dig_p3 = (int16_t)(c[10] | (c[11] << 8));
+    dig_p4 = (int16_t)(c[12] | (c[13] << 8));
+    dig_p5 = (int16_t)(c[14] | (c[15] << 8));
+    dig_p6 = (int16_t)(c[16] | (c[17] << 8));
+    dig_p7 = (int16_t)(c[18] | (c[19] << 8));
+    dig_p8 = (int16_t)(c[20] | (c[21] << 8));
+    dig_p9 = (int16_t)(c[22] | (c[23] << 8));
+    calibrated = true;
+
+    // ノーマルモードではconfigへの書き込みが無視されることがあるので，スリープ中に先に書く
+    if( write_reg(BMP280_REG_CONFIG, BMP280_CONFIG) != 0
+        || write_reg(BMP280_REG_CTRL_MEAS, BMP280_CTRL_MEAS) != 0 )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 最新の測定結果の生の値を読み出す
+ *
+ * @param raw 生の値の格納先
+ * @return int 成功すれば0，読み出しに失敗したか，まだ測定結果が無ければ-1
+ *
+ * 圧力と温度を1回のバーストで読むので，両者は同じ測定のものになる．
+ */
+int Bmp280::read_raw(bmp280_raw_t *raw)
+{
+    uint8_t d[6];
+
+    if( !calibrated || read_regs(BMP280_REG_PRESS_MSB, d, sizeof(d)) != 0 )
+    {
+        return -1;
+    }
+    raw->adc_p = ((int32_t)d[0] << 12) | ((int32_t)d[1] << 4) | (d[2] >> 4);
+    raw->adc_t = ((int32_t)d[3] << 12) | ((int32_t)d[4] << 4) | (d[5] >> 4);
+    if( raw->adc_p == BMP280_ADC_SKIPPED || raw->adc_t == BMP280_ADC_SKIPPED )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 生の値を補正する(データシート8.2節の整数演算版)
+ *
+ * @param raw 生の値
+ * @param data 補正済みの値の格納先
+ */
+void Bmp280::compensate(const bmp280_raw_t &raw, bmp280_data_t *data) const
+{
+    int32_t var1, var2, t_fine;
+    int64_t v1, v2, p;
+
+    var1 = ((((raw.adc_t >> 3) - ((int32_t)dig_t1 << 1))) * ((int32_t)dig_t2)) >> 11;
+    var2 = (((((raw.adc_t >> 4) - ((int32_t)dig_t1)) * ((raw.adc_t >> 4) - ((int32_t)dig_t1))) >> 12)
+            * ((int32_t)dig_t3)) >> 14;
+    t_fine = var1 + var2;
+    data->temp_centi = (t_fine * 5 + 128) >> 8;
+
+    v1 = (int64_t)t_fine - 128000;
+    v2 = v1 * v1 * (int64_t)dig_p6;
+    v2 = v2 + ((v1 * (int64_t)dig_p5) << 17);
+    v2 = v2 + (((int64_t)dig_p4) << 35);
+    v1 = ((v1 * v1 * (int64_t)dig_p3) >> 8) + ((v1 * (int64_t)dig_p2) << 12);
+    v1 = ((((int64_t)1) << 47) + v1) * ((int64_t)dig_p1) >> 33;
+    if( v1 == 0 )
+    {
+        // 0除算を避ける
+        data->pressure_q8 = 0;
+        return;
+    }
+    p = 1048576 - raw.adc_p;
+    p = (((p << 31) - v2) * 3125) / v1;
+    v1 = (((int64_t)dig_p9) * (p >> 13) * (p >> 13)) >> 25;
+    v2 = (((int64_t)dig_p8) * p) >> 19;
+    p = ((p + v1 + v2) >> 8) + (((int64_t)dig_p7) << 4);
+    data->pressure_q8 = (uint32_t)p;
+}
+
+
+/**
+ * @brief 最新の測定結果を読み出して補正する
+ *
+ * @param data 補正済みの値の格納先
+ * @return int 成功すれば0，失敗すれば-1
+ */
+int Bmp280::read(bmp280_data_t *data)
+{
+    bmp280_raw_t raw;
+
+    if( read_raw(&raw) != 0 )
+    {
+        return -1;
+    }
+    compensate(raw, data);
+    return 0;
+}
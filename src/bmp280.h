@@ -0,0 +1,66 @@
+/**
+ * @file bmp280.h
+ * @author amagai
+ * @brief BMP280気圧センサのドライバ(整数演算の補正)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * ノーマルモードで連続して測定させ，圧力と温度の生の値(6バイト)を1回のバーストで読み出す．
+ * 補正はデータシートの整数演算版(温度は32bit，圧力は64bit)で行い，浮動小数点を使わない．
+ *
+ * 測定の設定は圧力x16，温度x2のオーバーサンプリング，IIRフィルタ係数4，待機時間0.5msで，
+ * 出力データレートは約26Hz．データシートの屋内ナビゲーション向けの設定に近い．
+ */
+#ifndef BMP280_H
+#define BMP280_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 出力データレート(Hz)．これより速く読んでも同じ値が返る
+#define BMP280_ODR_HZ 26
+
+
+/**
+ * @brief 圧力と温度の生の値(20bit)
+ */
+typedef struct {
+    int32_t adc_p;
+    int32_t adc_t;
+} bmp280_raw_t;
+
+
+/**
+ * @brief 補正済みの値
+ */
+typedef struct {
+    uint32_t pressure_q8;       // 圧力(Pa，下位8bitが小数部)
+    int32_t temp_centi;         // 温度(0.01度)
+} bmp280_data_t;
+
+
+class Bmp280
+{
+protected:
+    uint8_t addr;
+    bool calibrated;
+    // 補正係数(データシートのdig_T1〜dig_P9)
+    uint16_t dig_t1;
+    int16_t dig_t2, dig_t3;
+    uint16_t dig_p1;
+    int16_t dig_p2, dig_p3, dig_p4, dig_p5, dig_p6, dig_p7, dig_p8, dig_p9;
+
+    int write_reg(uint8_t reg, uint8_t value);
+    int read_regs(uint8_t reg, uint8_t *buf, size_t len);
+
+public:
+    Bmp280(uint8_t addr);
+    int begin();
+    int read_raw(bmp280_raw_t *raw);
+    void compensate(const bmp280_raw_t &raw, bmp280_data_t *data) const;
+    int read(bmp280_data_t *data);
+};
+
+#endif // BMP280_H
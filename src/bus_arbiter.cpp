@@ -0,0 +1,314 @@
+/**
+ * @file bus_arbiter.cpp
+ * @author amagai
+ * @brief 優先度付きのバスの排他とクライアント毎の待ち時間の統計
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#include <string.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+#include "bus_arbiter.h"
+
+
+BusArbiter::BusArbiter()
+{
+    mux = portMUX_INITIALIZER_UNLOCKED;
+    memset(clients, 0, sizeof(clients));
+    for( int i = 0; i < BUS_ARBITER_MAX_CLIENTS; i++ )
+    {
+        clients[i].name = "-";
+        clients[i].wake = xSemaphoreCreateBinary();
+    }
+    busy = false;
+    owner = -1;
+    hold_start_us = 0;
+    ceiling = 0;
+}
+
+
+BusArbiter::~BusArbiter()
+{
+    for( int i = 0; i < BUS_ARBITER_MAX_CLIENTS; i++ )
+    {
+        vSemaphoreDelete(clients[i].wake);
+    }
+}
+
+
+int BusArbiter::hist_bin(uint32_t us)
+{
+    int bin = 0;
+
+    while( bin < BUS_ARBITER_HIST_BINS - 1 && us >= (16u << bin) )
+    {
+        bin++;
+    }
+    return bin;
+}
+
+
+/**
+ * @brief クライアントを設定する．使い始める前に呼ぶこと
+ *
+ * @param id クライアント番号(0〜BUS_ARBITER_MAX_CLIENTS-1)
+ * @param name 名前(統計の表示用)
+ * @param priority 優先度．大きいほど先に渡す
+ * @param deadline_us 要求からこの時間以内に取得できなければ期限切れとして数える．0なら期限無し
+ * @param max_hold_us 1回に保持する最大時間の目安．予約を避ける判断に使う
+ */
+void BusArbiter::set_client(int id, const char *name, uint8_t priority, uint32_t deadline_us, uint32_t max_hold_us)
+{
+    if( id < 0 || id >= BUS_ARBITER_MAX_CLIENTS )
+    {
+        return;
+    }
+    portENTER_CRITICAL(&mux);
+    clients[id].name = name;
+    clients[id].priority = priority;
+    clients[id].deadline_us = deadline_us;
+    clients[id].max_hold_us = max_hold_us;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+/**
+ * @brief 優先度の高いクライアントの予約に掛かるので取得を遅らせるか．muxを取って呼ぶ
+ *
+ * @param id クライアント番号
+ * @param now 現在時刻(esp_timer, us)
+ */
+bool BusArbiter::must_defer(int id, int64_t now) const
+{
+    const client_t &c = clients[id];
+
+    for( int i = 0; i < BUS_ARBITER_MAX_CLIENTS; i++ )
+    {
+        const client_t &r = clients[i];
+        if( r.reserved && r.priority > c.priority
+            && now + c.max_hold_us > r.reserve_at_us
+            && now < r.reserve_at_us + BUS_ARBITER_RESERVE_GRACE_US )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief バスを取得する．使用中なら順番が来るまで待つ
+ *
+ * @param id クライアント番号
+ */
+void BusArbiter::lock(int id)
+{
+    client_t &c = clients[id];
+    UBaseType_t prio = uxTaskPriorityGet(NULL);
+    UBaseType_t ceil;
+    int64_t t0 = esp_timer_get_time();
+    int64_t now = t0;
+    bool deferred = false;
+    bool contended;
+    uint32_t wait;
+
+    for( ;; )
+    {
+        portENTER_CRITICAL(&mux);
+        c.reserved = false;
+        if( prio > ceiling )
+        {
+            ceiling = prio;
+        }
+        // 予約より優先度が低く，保持が予約時刻に掛かるなら，予約したクライアントが使い終わるまで遅らせる
+        if( !must_defer(id, now) )
+        {
+            break;
+        }
+        portEXIT_CRITICAL(&mux);
+        deferred = true;
+        vTaskDelay(1);
+        now = esp_timer_get_time();
+    }
+
+    contended = busy;
+    if( !busy )
+    {
+        busy = true;
+        owner = id;
+    }
+    else
+    {
+        c.waiting = true;
+        c.deadline_at = now + (c.deadline_us > 0 ? c.deadline_us : 1000000000);
+        c.stats.contended++;
+    }
+    portEXIT_CRITICAL(&mux);
+    if( contended )
+    {
+        // unlock()で所有者がこのクライアントに替わってから起こされる
+        xSemaphoreTake(c.wake, portMAX_DELAY);
+    }
+
+    now = esp_timer_get_time();
+    wait = (uint32_t)(now - t0);
+    portENTER_CRITICAL(&mux);
+    hold_start_us = now;
+    c.saved_prio = prio;
+    ceil = ceiling;
+    c.stats.count++;
+    if( deferred )
+    {
+        c.stats.deferred++;
+    }
+    if( c.deadline_us > 0 && wait > c.deadline_us )
+    {
+        c.stats.deadline_miss++;
+    }
+    if( wait > c.stats.max_wait_us )
+    {
+        c.stats.max_wait_us = wait;
+    }
+    c.stats.wait_hist[hist_bin(wait)]++;
+    portEXIT_CRITICAL(&mux);
+
+    // 優先度の上限まで上げる．自分の優先度だけを変えるので，他のタスクと競合しない
+    if( ceil > prio )
+    {
+        vTaskPrioritySet(NULL, ceil);
+    }
+}
+
+
+/**
+ * @brief バスを解放する．待っているクライアントがあれば，優先度の最も高いものに渡す
+ *
+ * @param id クライアント番号
+ */
+void BusArbiter::unlock(int id)
+{
+    client_t &c = clients[id];
+    int64_t now = esp_timer_get_time();
+    UBaseType_t prio;
+    uint32_t hold;
+    int next = -1;
+
+    portENTER_CRITICAL(&mux);
+    hold = (uint32_t)(now - hold_start_us);
+    if( hold > c.stats.max_hold_us )
+    {
+        c.stats.max_hold_us = hold;
+    }
+    c.stats.hold_hist[hist_bin(hold)]++;
+    prio = c.saved_prio;
+    for( int i = 0; i < BUS_ARBITER_MAX_CLIENTS; i++ )
+    {
+        if( !clients[i].waiting )
+        {
+            continue;
+        }
+        if( next < 0 || clients[i].priority > clients[next].priority
+            || (clients[i].priority == clients[next].priority && clients[i].deadline_at < clients[next].deadline_at) )
+        {
+            next = i;
+        }
+    }
+    if( next >= 0 )
+    {
+        clients[next].waiting = false;
+        owner = next;
+    }
+    else
+    {
+        busy = false;
+        owner = -1;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    if( next >= 0 )
+    {
+        xSemaphoreGive(clients[next].wake);
+    }
+    // 次の所有者に渡してから元の優先度に戻す
+    if( uxTaskPriorityGet(NULL) != prio )
+    {
+        vTaskPrioritySet(NULL, prio);
+    }
+}
+
+
+/**
+ * @brief 次にバスを使う時刻を予約する
+ *
+ * @param id クライアント番号
+ * @param at_us 使う時刻(esp_timer, us)
+ *
+ * 予約はクライアント毎に1つで，同じクライアントが予約し直すと置き換わる．
+ * 予約はそのクライアントが次にlock()した時に消える．
+ */
+void BusArbiter::reserve(int id, int64_t at_us)
+{
+    if( id < 0 || id >= BUS_ARBITER_MAX_CLIENTS )
+    {
+        return;
+    }
+    portENTER_CRITICAL(&mux);
+    clients[id].reserved = true;
+    clients[id].reserve_at_us = at_us;
+    portEXIT_CRITICAL(&mux);
+}
+
+
+const char *BusArbiter::get_name(int id) const
+{
+    if( id < 0 || id >= BUS_ARBITER_MAX_CLIENTS )
+    {
+        return "-";
+    }
+    return clients[id].name;
+}
+
+
+/**
+ * @brief クライアントの統計を取得する
+ *
+ * @param id クライアント番号
+ * @param stats 統計の格納先
+ * @return int 成功すれば0，番号が不正か一度も使っていなければ-1
+ */
+int BusArbiter::get_stats(int id, bus_client_stats_t *stats) const
+{
+    int rtn = -1;
+
+    if( id < 0 || id >= BUS_ARBITER_MAX_CLIENTS )
+    {
+        return -1;
+    }
+    portENTER_CRITICAL(&mux);
+    if( clients[id].stats.count != 0 )
+    {
+        *stats = clients[id].stats;
+        rtn = 0;
+    }
+    portEXIT_CRITICAL(&mux);
+    return rtn;
+}
+
+
+/**
+ * @brief 全てのクライアントの統計を消去する
+ */
+void BusArbiter::reset_stats()
+{
+    portENTER_CRITICAL(&mux);
+    for( int i = 0; i < BUS_ARBITER_MAX_CLIENTS; i++ )
+    {
+        memset(&clients[i].stats, 0, sizeof(clients[i].stats));
+    }
+    portEXIT_CRITICAL(&mux);
+}
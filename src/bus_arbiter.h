@@ -0,0 +1,95 @@
+/**
+ * @file bus_arbiter.h
+ * @author amagai
+ * @brief 優先度付きのバスの排他とクライアント毎の待ち時間の統計
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * SimpleMutexの代わりに使う．バスを使う処理(クライアント)毎に番号を決め，lock(client)で取得する．
+ * バスが使用中なら待ち行列に入り，解放された時に優先度の高いクライアントから順に渡す．
+ * 同じ優先度では期限(要求した時刻+クライアントの期限)の早い方を先にする．
+ *
+ * 周期的に使うクライアントは，reserve()で次に使う時刻を予約できる．予約はクライアント毎に1つ．
+ * 予約より優先度の低いクライアントは，自分の最大保持時間が予約時刻に掛かる場合は取得を遅らせる．
+ * これで優先度の高いクライアントが長い読み出しの終わりを待たされないようにする．
+ *
+ * 待ち行列はバイナリセマフォで作るので，FreeRTOSのミューテックスの優先度継承は効かない．
+ * 代わりに保持している間は，これまでにlock()したタスクの最高の優先度まで保持者の優先度を上げる．
+ * 低い優先度の保持者が中間の優先度のタスクに割り込まれ，待っているタスクが止まり続けるのを防ぐ．
+ *
+ * 1つのクライアント番号を同時に複数のタスクから使わないこと．lock()とunlock()は同じタスクから呼ぶこと．
+ * 一連の読み書きは1回のlock()からunlock()の間にまとめること．
+ */
+#ifndef BUS_ARBITER_H
+#define BUS_ARBITER_H
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// クライアントの最大数
+#define BUS_ARBITER_MAX_CLIENTS 8
+// 待ち時間と保持時間の分布のビン数．ビン0は16us未満，ビンiは8*2^i以上16*2^i未満(us)，最後のビンはそれ以上全て
+#define BUS_ARBITER_HIST_BINS 12
+// 予約時刻をこれ以上過ぎても予約したクライアントが来なければ，予約を無視する(us)
+#define BUS_ARBITER_RESERVE_GRACE_US 5000
+
+
+/**
+ * @brief クライアント毎の統計
+ */
+typedef struct {
+    uint32_t count;             // 取得した回数
+    uint32_t contended;         // 使用中で待たされた回数
+    uint32_t deferred;          // 予約を避けるために遅らせた回数
+    uint32_t deadline_miss;     // 期限までに取得できなかった回数
+    uint32_t max_wait_us;       // 最大の待ち時間
+    uint32_t max_hold_us;       // 最大の保持時間
+    uint32_t wait_hist[BUS_ARBITER_HIST_BINS];  // 待ち時間の分布
+    uint32_t hold_hist[BUS_ARBITER_HIST_BINS];  // 保持時間の分布
+} bus_client_stats_t;
+
+
+class BusArbiter
+{
+protected:
+    typedef struct {
+        const char *name;
+        uint8_t priority;
+        uint32_t deadline_us;
+        uint32_t max_hold_us;
+        SemaphoreHandle_t wake;     // 順番が来たことを知らせる
+        bool waiting;
+        int64_t deadline_at;        // 待ち行列での順序に使う期限(us)
+        bool reserved;
+        int64_t reserve_at_us;      // 予約した時刻(esp_timer, us)
+        UBaseType_t saved_prio;     // 取得前のタスクの優先度．unlock()で戻す
+        bus_client_stats_t stats;
+    } client_t;
+
+    mutable portMUX_TYPE mux;   // 以下の全てとクライアントの状態，統計を保護する
+    client_t clients[BUS_ARBITER_MAX_CLIENTS];
+    bool busy;
+    int owner;
+    int64_t hold_start_us;
+    UBaseType_t ceiling;        // lock()したタスクの最高の優先度．保持者をここまで上げる
+
+    static int hist_bin(uint32_t us);
+    bool must_defer(int id, int64_t now) const;
+
+public:
+    BusArbiter();
+    ~BusArbiter();
+
+    void set_client(int id, const char *name, uint8_t priority, uint32_t deadline_us, uint32_t max_hold_us);
+    void lock(int id);
+    void unlock(int id);
+    void reserve(int id, int64_t at_us);
+    const char *get_name(int id) const;
+    int get_stats(int id, bus_client_stats_t *stats) const;
+    void reset_stats();
+};
+
+#endif // BUS_ARBITER_H
@@ -2,7 +2,22 @@
 #define BUS_MUTEX_H
 
 #include "simple_mutex.h"
+#include "bus_arbiter.h"
 
-extern SimpleMutex i2c_mutex;
-extern SimpleMutex spi_mutex;
+// I2Cバス(M5.In_I2C)のクライアント．優先度などはsetup()で設定する
+#define I2C_CLIENT_IMU 0        // IMUと気圧のサンプリングタスク
+#define I2C_CLIENT_UI 1         // M5.update() (タッチパネル，ボタン，電源)
+#define I2C_CLIENT_STATUS 2     // 1秒毎のバッテリー残量
+#define I2C_CLIENT_RTC 3        // RTCの読み書き
+#define I2C_CLIENT_INIT 4       // 起動時の初期化
+#define I2C_NUM_CLIENTS 5
+
+// SPIバス(LCDとSDカード)のクライアント
+#define SPI_CLIENT_LCD 0        // LVGLの描画の転送
+#define SPI_CLIENT_SD 1         // SDカードのI/Oスケジューラ
+#define SPI_CLIENT_SD_INFO 2    // SDカードの空き容量の取得
+#define SPI_NUM_CLIENTS 3
+
+extern BusArbiter i2c_mutex;
+extern BusArbiter spi_mutex;
 #endif // BUS_MUTEX_H
@@ -0,0 +1,49 @@
+/**
+ * @file crc32.h
+ * @author amagai
+ * @brief CRC-32 (IEEE 802.3) の計算
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 4bit単位のテーブルを使うので，テーブルは64バイトで済む．
+ * ファームウエアとPC側のツールの両方から使う．
+ */
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief CRC-32を計算する
+ *
+ * @param crc 前回までの計算結果．最初は0
+ * @param data データ
+ * @param len データの長さ
+ * @return uint32_t CRC-32
+ *
+ * 続けて呼び出すことで，分割されたデータのCRCを計算できる．
+ */
+static inline uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+    while( len-- > 0 )
+    {
+        crc = table[(crc ^ *p) & 0x0f] ^ (crc >> 4);
+        crc = table[(crc ^ (*p >> 4)) & 0x0f] ^ (crc >> 4);
+        p++;
+    }
+    return ~crc;
+}
+
+#endif // CRC32_H
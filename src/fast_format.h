@@ -0,0 +1,425 @@
+/**
+ * @file fast_format.h
+ * @author amagai
+ * @brief ログやUI用の軽量な数値フォーマッタ
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * snprintf()の%fはdoubleのソフトウエア演算で遅いので，固定小数点の整数に
+ * 変換してから整数として出力する．書式は引数の型で決まるので，
+ * コンパイル時に書式が確定し，出力の最大長も求まる．
+ *
+ * 使い方:
+ *   char buf[64];
+ *   int n = fmt_format(buf, fmt_fixed<7>(lat), ',', fmt_zero<2>(hour), ",abc\n");
+ *
+ *   - fmt_fixed<D>(v)    小数点以下D桁の固定小数点(%.Dfと同じ丸め．2進数の値そのものを丸め，ちょうど半分は偶数へ)
+ *   - fmt_zero<W>(v)     W桁のゼロ埋め(%0Wuと同じ)．W桁を超える上位桁は出力しない
+ *   - 整数               10進数(%d, %u)
+ *   - 文字, 文字列リテラル  そのまま
+ *   - fmt_str(s)         長さが不定の文字列．最大長が決まらないのでfmt_cat()でのみ使える
+ *
+ * fmt_format()はバッファが最大長より小さいとコンパイルエラーになる．
+ * fmt_cat()は長さの確認をしないので，呼び出し側でバッファの大きさを保証すること．
+ * snprintf()と異なり，0に丸められた負の値には符号を付けない．
+ */
+#ifndef FAST_FORMAT_H
+#define FAST_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+
+// 10のD乗
+template<int D> struct FmtPow10 { static const uint32_t value = 10 * FmtPow10<D - 1>::value; };
+template<> struct FmtPow10<0> { static const uint32_t value = 1; };
+
+
+/**
+ * @brief 符号なし整数を10進数で書き込む
+ *
+ * @param p 書き込み先
+ * @param v 値
+ * @return char* 書き込み後の位置
+ */
+static inline char *fmt_put_uint(char *p, uint32_t v)
+{
+    char tmp[10];
+    int n = 0;
+
+    do
+    {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while( v != 0 );
+    while( n > 0 )
+    {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+
+/**
+ * @brief 整数をゼロ埋めで書き込む
+ *
+ * @param p 書き込み先
+ * @param v 値
+ * @param width 桁数．この桁数ちょうどを書き込む
+ * @return char* 書き込み後の位置
+ */
+static inline char *fmt_put_zero(char *p, uint32_t v, int width)
+{
+    for( int i = width - 1; i >= 0; i-- )
+    {
+        p[i] = '0' + v % 10;
+        v /= 10;
+    }
+    return p + width;
+}
+
+
+static inline char *fmt_put_uint64(char *p, uint64_t v)
+{
+    if( v <= 0xffffffffu )
+    {
+        return fmt_put_uint(p, (uint32_t)v);
+    }
+    // 64bitの除算は遅いので，上位と下位9桁に分けて1回だけ行う
+    p = fmt_put_uint64(p, v / 1000000000u);
+    return fmt_put_zero(p, (uint32_t)(v % 1000000000u), 9);
+}
+
+
+static inline char *fmt_put_int64(char *p, int64_t v)
+{
+    if( v < 0 )
+    {
+        *p++ = '-';
+        return fmt_put_uint64(p, 0 - (uint64_t)v);
+    }
+    return fmt_put_uint64(p, (uint64_t)v);
+}
+
+
+/**
+ * @brief 整数部と小数部に分けた値を書き込む
+ *
+ * @param p 書き込み先
+ * @param neg 負の値ならtrue
+ * @param ip 整数部
+ * @param fp 小数部を10^dec倍して整数にしたもの
+ * @param dec 小数点以下の桁数
+ * @return char* 書き込み後の位置
+ */
+static inline char *fmt_put_split(char *p, bool neg, uint64_t ip, uint32_t fp, int dec)
+{
+    if( neg && (ip != 0 || fp != 0) )
+    {
+        *p++ = '-';
+    }
+    p = fmt_put_uint64(p, ip);
+    if( dec > 0 )
+    {
+        *p++ = '.';
+        p = fmt_put_zero(p, fp, dec);
+    }
+    return p;
+}
+
+
+/**
+ * @brief 非数や範囲外の値を書き込む
+ */
+static inline char *fmt_put_special(char *p, bool nan, bool neg)
+{
+    const char *s = nan ? "nan" : (neg ? "-inf" : "inf");
+    while( *s != '\0' )
+    {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+
+/**
+ * @brief 10^D倍した小数部を切り上げるかを決める
+ *
+ * @param d 10^D倍した値(丸め後)の端数から0.5を引いたもの．0の近くでは誤差なく求まる
+ * @param err 10^D倍の丸め誤差(真の値 - 丸め後)．絶対値は端数の最小単位の半分以下
+ * @param fp 切り捨てた値．ちょうど半分の時は偶数に丸める
+ *
+ * dが0でなければ誤差より大きいので，dの符号で決まる．dが0なら誤差の符号で決まる．
+ */
+template<typename T>
+static inline bool fmt_round_up(T d, T err, uint32_t fp)
+{
+    if( d != 0 )
+    {
+        return d > 0;
+    }
+    if( err != 0 )
+    {
+        return err > 0;
+    }
+    return (fp & 1) != 0;
+}
+
+
+/**
+ * @brief doubleを小数点以下D桁で書き込む
+ */
+template<int D>
+static inline char *fmt_put_fixed(char *p, double v)
+{
+    static_assert(D >= 0 && D <= 9, "fmt_fixed: 0 to 9 decimals");
+    bool neg = v < 0;
+
+    if( neg )
+    {
+        v = -v;
+    }
+    if( !(v < 1e18 / FmtPow10<D>::value) )
+    {
+        return fmt_put_special(p, v != v, neg);
+    }
+    // 整数部を除いた小数部は誤差なく求まる．10^D倍の丸め誤差はfma()で正確に求め，
+    // 丸めの判断は乗算前の2進数の値そのもので行う(snprintf()と同じ)
+    uint64_t ip = (uint64_t)v;
+    double f = v - (double)ip;
+    double x = f * FmtPow10<D>::value;
+    double err = fma(f, (double)FmtPow10<D>::value, -x);
+    uint32_t fp = (uint32_t)x;
+    if( fmt_round_up(x - fp - 0.5, err, fp) )
+    {
+        fp++;
+    }
+    if( fp >= FmtPow10<D>::value )
+    {
+        ip++;
+        fp -= FmtPow10<D>::value;
+    }
+    return fmt_put_split(p, neg, ip, fp, D);
+}
+
+
+/**
+ * @brief floatを小数点以下D桁で書き込む
+ *
+ * 整数部が32bitに収まる範囲ならfloatのまま(ハードウエアFPUで)計算する．
+ */
+template<int D>
+static inline char *fmt_put_fixed(char *p, float v)
+{
+    static_assert(D >= 0 && D <= 9, "fmt_fixed: 0 to 9 decimals");
+    bool neg = v < 0;
+
+    if( neg )
+    {
+        v = -v;
+    }
+    if( !(v < 4.0e9f) )
+    {
+        return fmt_put_fixed<D>(p, neg ? -(double)v : (double)v);
+    }
+    if( D >= 8 )
+    {
+        // 10^D倍がfloatの仮数部(24bit)に収まらない
+        return fmt_put_fixed<D>(p, neg ? -(double)v : (double)v);
+    }
+    // doubleと同じく，10^D倍の丸め誤差をfmaf()で求めて元の値で丸める
+    uint32_t ip = (uint32_t)v;
+    float f = v - (float)ip;
+    float x = f * FmtPow10<D>::value;
+    float err = fmaf(f, (float)FmtPow10<D>::value, -x);
+    uint32_t fp = (uint32_t)x;
+    if( fmt_round_up(x - fp - 0.5f, err, fp) )
+    {
+        fp++;
+    }
+    if( fp >= FmtPow10<D>::value )
+    {
+        ip++;
+        fp -= FmtPow10<D>::value;
+    }
+    return fmt_put_split(p, neg, ip, fp, D);
+}
+
+
+// 書式を表す型
+template<int D, typename T> struct FmtFixed { T v; };
+template<int W> struct FmtZero { uint32_t v; };
+struct FmtStr { const char *s; };
+
+template<int D> static inline FmtFixed<D, double> fmt_fixed(double v) { FmtFixed<D, double> f = { v }; return f; }
+template<int D> static inline FmtFixed<D, float> fmt_fixed(float v) { FmtFixed<D, float> f = { v }; return f; }
+template<int W> static inline FmtZero<W> fmt_zero(uint32_t v) { FmtZero<W> f = { v }; return f; }
+static inline FmtStr fmt_str(const char *s) { FmtStr f = { s }; return f; }
+
+
+/**
+ * @brief 日付と時刻を書き込む．日付部分はキャッシュする．
+ *
+ * 出力は "YYYY-MM-DDTHH:MM:SS.mmm" の形式．区切り文字はコンストラクタで指定する．
+ * 日付が変わらない限り，日付部分はコピーするだけで済む．
+ * インスタンスは1つのタスクからだけ使うこと．
+ */
+class FmtDateTime
+{
+protected:
+    char date_sep;
+    char time_sep;
+    int32_t cached_key;         // キャッシュしている日付(YYYYMMDD)．-1なら無し
+    char cached[11];            // 日付と区切り文字
+
+public:
+    struct Value
+    {
+        FmtDateTime *writer;
+        int year, month, day, hour, minute, second, msec;
+    };
+
+    FmtDateTime(char date_sep = '-', char time_sep = 'T') : date_sep(date_sep), time_sep(time_sep), cached_key(-1) {}
+
+    char *put(char *p, int year, int month, int day, int hour, int minute, int second, int msec)
+    {
+        int32_t key = year * 10000 + month * 100 + day;
+
+        if( key != cached_key )
+        {
+            char *q = fmt_put_zero(cached, year, 4);
+            *q++ = date_sep;
+            q = fmt_put_zero(q, month, 2);
+            *q++ = date_sep;
+            q = fmt_put_zero(q, day, 2);
+            *q = time_sep;
+            cached_key = key;
+        }
+        for( int i = 0; i < (int)sizeof(cached); i++ )
+        {
+            *p++ = cached[i];
+        }
+        p = fmt_put_zero(p, hour, 2);
+        *p++ = ':';
+        p = fmt_put_zero(p, minute, 2);
+        *p++ = ':';
+        p = fmt_put_zero(p, second, 2);
+        *p++ = '.';
+        return fmt_put_zero(p, msec, 3);
+    }
+
+    // fmt_format()の引数として使う
+    Value operator()(int year, int month, int day, int hour, int minute, int second, int msec)
+    {
+        Value v = { this, year, month, day, hour, minute, second, msec };
+        return v;
+    }
+};
+
+
+// 各書式の出力
+static inline char *fmt_put(char *p, char c) { *p++ = c; return p; }
+static inline char *fmt_put(char *p, signed char v) { return fmt_put_int64(p, v); }
+static inline char *fmt_put(char *p, unsigned char v) { return fmt_put_uint(p, v); }
+static inline char *fmt_put(char *p, short v) { return fmt_put_int64(p, v); }
+static inline char *fmt_put(char *p, unsigned short v) { return fmt_put_uint(p, v); }
+static inline char *fmt_put(char *p, int v) { return fmt_put_int64(p, v); }
+static inline char *fmt_put(char *p, unsigned int v) { return fmt_put_uint64(p, v); }
+static inline char *fmt_put(char *p, long v) { return fmt_put_int64(p, v); }
+static inline char *fmt_put(char *p, unsigned long v) { return fmt_put_uint64(p, v); }
+static inline char *fmt_put(char *p, long long v) { return fmt_put_int64(p, v); }
+static inline char *fmt_put(char *p, unsigned long long v) { return fmt_put_uint64(p, v); }
+template<size_t N>
+static inline char *fmt_put(char *p, const char (&s)[N])
+{
+    for( size_t i = 0; i < N - 1 && s[i] != '\0'; i++ )
+    {
+        *p++ = s[i];
+    }
+    return p;
+}
+static inline char *fmt_put(char *p, FmtStr s)
+{
+    for( const char *q = s.s; *q != '\0'; q++ )
+    {
+        *p++ = *q;
+    }
+    return p;
+}
+template<int D, typename T>
+static inline char *fmt_put(char *p, FmtFixed<D, T> f) { return fmt_put_fixed<D>(p, f.v); }
+template<int W>
+static inline char *fmt_put(char *p, FmtZero<W> z) { return fmt_put_zero(p, z.v, W); }
+static inline char *fmt_put(char *p, const FmtDateTime::Value &t)
+{
+    return t.writer->put(p, t.year, t.month, t.day, t.hour, t.minute, t.second, t.msec);
+}
+
+
+// 各書式の最大長
+template<typename T> struct FmtMaxLen;      // 最大長が決まらない型(FmtStrなど)は未定義
+template<> struct FmtMaxLen<char> { static const int value = 1; };
+template<> struct FmtMaxLen<signed char> { static const int value = 4; };
+template<> struct FmtMaxLen<unsigned char> { static const int value = 3; };
+template<> struct FmtMaxLen<short> { static const int value = 6; };
+template<> struct FmtMaxLen<unsigned short> { static const int value = 5; };
+template<> struct FmtMaxLen<int> { static const int value = (sizeof(int) == 4) ? 11 : 20; };
+template<> struct FmtMaxLen<unsigned int> { static const int value = (sizeof(int) == 4) ? 10 : 20; };
+template<> struct FmtMaxLen<long> { static const int value = (sizeof(long) == 4) ? 11 : 20; };
+template<> struct FmtMaxLen<unsigned long> { static const int value = (sizeof(long) == 4) ? 10 : 20; };
+template<> struct FmtMaxLen<long long> { static const int value = 20; };
+template<> struct FmtMaxLen<unsigned long long> { static const int value = 20; };
+template<size_t N> struct FmtMaxLen<char[N]> { static const int value = N - 1; };
+// 符号 + 整数部(1e18未満なので18桁) + 小数点 + 小数部
+template<int D, typename T> struct FmtMaxLen<FmtFixed<D, T> > { static const int value = 1 + 18 + 1 + D; };
+template<int W> struct FmtMaxLen<FmtZero<W> > { static const int value = W; };
+template<> struct FmtMaxLen<FmtDateTime::Value> { static const int value = 23; };
+
+template<typename... Args> struct FmtSumLen;
+template<> struct FmtSumLen<> { static const int value = 0; };
+template<typename T, typename... Rest> struct FmtSumLen<T, Rest...>
+{
+    static const int value = FmtMaxLen<T>::value + FmtSumLen<Rest...>::value;
+};
+
+
+/**
+ * @brief 引数を順に書き込み，終端に'\0'を付ける
+ *
+ * @param p 書き込み先
+ * @return char* 終端の'\0'の位置
+ *
+ * バッファの大きさは確認しない．
+ */
+static inline char *fmt_cat(char *p)
+{
+    *p = '\0';
+    return p;
+}
+
+template<typename T, typename... Rest>
+static inline char *fmt_cat(char *p, const T &a, const Rest &... rest)
+{
+    return fmt_cat(fmt_put(p, a), rest...);
+}
+
+
+/**
+ * @brief 引数を順に書き込み，終端に'\0'を付ける
+ *
+ * @param buf 書き込み先の配列
+ * @return int 書き込んだ文字数('\0'を除く)
+ *
+ * 出力の最大長がバッファに収まらない場合はコンパイルエラーになる．
+ */
+template<size_t N, typename... Args>
+static inline int fmt_format(char (&buf)[N], const Args &... args)
+{
+    static_assert(FmtSumLen<Args...>::value + 1 <= (int)N, "fmt_format: buffer too small");
+    return fmt_cat(buf, args...) - buf;
+}
+
+#endif // FAST_FORMAT_H
@@ -0,0 +1,553 @@
+/**
+ * @file gnss_ins.cpp
+ * @author amagai
+ * @brief GNSSとIMUを組み合わせた位置推定(疎結合のエラーステート・カルマンフィルタ)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "gnss_ins.h"
+
+#define GNSS_INS_G 9.80665f
+#define GNSS_INS_DEG_TO_RAD 0.017453292519943295
+// 測位時刻に最も近い履歴がこれ以上離れていれば，履歴は使わない
+#define GNSS_INS_HISTORY_TOLERANCE_US 50000
+// 続けてこの回数の測位を捨てたら，測位点からやり直す
+#define GNSS_INS_MAX_REJECTS 3
+
+// 状態の並び
+#define IDX_P 0
+#define IDX_V 3
+#define IDX_BA 6
+
+
+GnssIns::GnssIns()
+{
+    decl_cos = 1.0f;
+    decl_sin = 0.0f;
+    max_coast_us = (int64_t)GNSS_INS_MAX_COAST_SEC * 1000000;
+    reset();
+}
+
+
+/**
+ * @brief 推定を破棄する．次の測位から始め直す
+ */
+void GnssIns::reset()
+{
+    initialized = false;
+    lat0 = lon0 = 0.0;
+    alt0 = 0.0f;
+    m_per_deg_lat = m_per_deg_lon = 0.0;
+    memset(p, 0, sizeof(p));
+    memset(v, 0, sizeof(v));
+    memset(ba, 0, sizeof(ba));
+    memset(P, 0, sizeof(P));
+    time_us = 0;
+    last_fix_us = 0;
+    rejected_in_row = 0;
+    hist_head = 0;
+    hist_count = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+
+/**
+ * @brief 磁気偏角を設定する
+ *
+ * @param deg 偏角(度)．磁北が真北より東にある場合を正とする(日本では負)
+ *
+ * Ahrsの方位は磁北が基準なので，加速度を地面座標に回転する際に真北基準に直す．
+ */
+void GnssIns::set_declination(float deg)
+{
+    decl_cos = cosf(deg * (float)GNSS_INS_DEG_TO_RAD);
+    decl_sin = sinf(deg * (float)GNSS_INS_DEG_TO_RAD);
+}
+
+
+/**
+ * @brief 測位が途切れてから位置を出し続ける最大時間を設定する
+ */
+void GnssIns::set_max_coast(float sec)
+{
+    max_coast_us = (int64_t)(sec * 1e6f);
+}
+
+
+/**
+ * @brief 平面近似の原点を設定する
+ */
+void GnssIns::set_origin(double lat, double lon, float alt)
+{
+    double phi = lat * GNSS_INS_DEG_TO_RAD;
+
+    lat0 = lat;
+    lon0 = lon;
+    alt0 = alt;
+    // WGS84での緯度1度，経度1度あたりの距離
+    m_per_deg_lat = 111132.92 - 559.82 * cos(2.0 * phi) + 1.175 * cos(4.0 * phi);
+    m_per_deg_lon = 111412.84 * cos(phi) - 93.5 * cos(3.0 * phi);
+}
+
+
+/**
+ * @brief 測位結果を地面座標(NWU)に変換する
+ */
+void GnssIns::to_local(const gnss_fix_t &fix, float pos[3], float vel[3]) const
+{
+    double c = fix.course * GNSS_INS_DEG_TO_RAD;
+
+    pos[0] = (float)((fix.latitude - lat0) * m_per_deg_lat);
+    pos[1] = (float)(-(fix.longitude - lon0) * m_per_deg_lon);
+    pos[2] = fix.altitude - alt0;
+    vel[0] = (float)(fix.speed * cos(c));
+    vel[1] = (float)(-fix.speed * sin(c));
+    vel[2] = 0.0f;
+}
+
+
+/**
+ * @brief 測位点から推定を始める
+ */
+void GnssIns::start_at(const gnss_fix_t &fix)
+{
+    float sigma_h = ((fix.hdop > 0.5f) ? fix.hdop : 0.5f) * GNSS_INS_UERE;
+    float pos[3], vel[3];
+
+    set_origin(fix.latitude, fix.longitude, fix.altitude);
+    to_local(fix, pos, vel);
+    memset(p, 0, sizeof(p));
+    if( fix.vel_valid )
+    {
+        memcpy(v, vel, sizeof(v));
+    }
+    else
+    {
+        memset(v, 0, sizeof(v));
+    }
+    if( !initialized )
+    {
+        memset(ba, 0, sizeof(ba));
+    }
+
+    memset(P, 0, sizeof(P));
+    P[0][0] = P[1][1] = sigma_h * sigma_h;
+    P[2][2] = 4.0f * sigma_h * sigma_h;
+    P[3][3] = P[4][4] = fix.vel_valid ? GNSS_INS_VEL_SIGMA * GNSS_INS_VEL_SIGMA : 4.0f;
+    P[5][5] = 1.0f;
+    P[6][6] = P[7][7] = P[8][8] = 0.2f * 0.2f;
+
+    hist_head = 0;
+    hist_count = 0;
+    rejected_in_row = 0;
+    last_fix_us = fix.time_us;
+    if( time_us < fix.time_us )
+    {
+        time_us = fix.time_us;
+    }
+    initialized = true;
+}
+
+
+/**
+ * @brief 加速度で位置と速度を進める
+ *
+ * @param t_us この更新の時刻(unixtime, us)
+ * @param q Ahrsの姿勢(w, x, y, z)
+ * @param accel 時間刻みの間の平均の加速度(G，センサ座標)
+ * @param dt 時間刻み(s)
+ */
+void GnssIns::propagate(int64_t t_us, const float q[4], const float accel[3], float dt)
+{
+    float r[3][3], rm[3][3];
+    float f[3], a[3];
+    float fp[GNSS_INS_STATES][GNSS_INS_STATES];
+
+    if( !initialized )
+    {
+        time_us = t_us;
+        return;
+    }
+
+    // センサ座標から地面座標(磁北基準)への回転
+    rm[0][0] = 1.0f - 2.0f * (q[2] * q[2] + q[3] * q[3]);
+    rm[0][1] = 2.0f * (q[1] * q[2] - q[0] * q[3]);
+    rm[0][2] = 2.0f * (q[1] * q[3] + q[0] * q[2]);
+    rm[1][0] = 2.0f * (q[1] * q[2] + q[0] * q[3]);
+    rm[1][1] = 1.0f - 2.0f * (q[1] * q[1] + q[3] * q[3]);
+    rm[1][2] = 2.0f * (q[2] * q[3] - q[0] * q[1]);
+    rm[2][0] = 2.0f * (q[1] * q[3] - q[0] * q[2]);
+    rm[2][1] = 2.0f * (q[2] * q[3] + q[0] * q[1]);
+    rm[2][2] = 1.0f - 2.0f * (q[1] * q[1] + q[2] * q[2]);
+    // 真北基準に直す(上向きの軸周りに-偏角回す)
+    for( int j = 0; j < 3; j++ )
+    {
+        r[0][j] = decl_cos * rm[0][j] + decl_sin * rm[1][j];
+        r[1][j] = -decl_sin * rm[0][j] + decl_cos * rm[1][j];
+        r[2][j] = rm[2][j];
+    }
+
+    for( int i = 0; i < 3; i++ )
+    {
+        f[i] = accel[i] * GNSS_INS_G - ba[i];
+    }
+    for( int i = 0; i < 3; i++ )
+    {
+        a[i] = r[i][0] * f[0] + r[i][1] * f[1] + r[i][2] * f[2];
+    }
+    a[2] -= GNSS_INS_G;
+
+    for( int i = 0; i < 3; i++ )
+    {
+        p[i] += v[i] * dt + 0.5f * a[i] * dt * dt;
+        v[i] += a[i] * dt;
+    }
+
+    // 誤差の共分散を進める．F = I + [0 I*dt 0; 0 0 -R*dt; 0 0 0]
+    // まずF*Pを求める
+    for( int j = 0; j < GNSS_INS_STATES; j++ )
+    {
+        for( int i = 0; i < 3; i++ )
+        {
+            fp[IDX_P + i][j] = P[IDX_P + i][j] + P[IDX_V + i][j] * dt;
+            fp[IDX_V + i][j] = P[IDX_V + i][j]
+                               - (r[i][0] * P[IDX_BA][j] + r[i][1] * P[IDX_BA + 1][j] + r[i][2] * P[IDX_BA + 2][j]) * dt;
+            fp[IDX_BA + i][j] = P[IDX_BA + i][j];
+        }
+    }
+    // 次に(F*P)*F^T
+    for( int i = 0; i < GNSS_INS_STATES; i++ )
+    {
+        for( int k = 0; k < 3; k++ )
+        {
+            P[i][IDX_P + k] = fp[i][IDX_P + k] + fp[i][IDX_V + k] * dt;
+            P[i][IDX_V + k] = fp[i][IDX_V + k]
+                              - (fp[i][IDX_BA] * r[k][0] + fp[i][IDX_BA + 1] * r[k][1] + fp[i][IDX_BA + 2] * r[k][2]) * dt;
+            P[i][IDX_BA + k] = fp[i][IDX_BA + k];
+        }
+    }
+    for( int i = 0; i < 3; i++ )
+    {
+        P[IDX_V + i][IDX_V + i] += GNSS_INS_ACCEL_NOISE * GNSS_INS_ACCEL_NOISE * dt;
+        P[IDX_BA + i][IDX_BA + i] += GNSS_INS_BIAS_NOISE * GNSS_INS_BIAS_NOISE * dt;
+    }
+
+    time_us = t_us;
+    history[hist_head].time_us = t_us;
+    memcpy(history[hist_head].p, p, sizeof(p));
+    memcpy(history[hist_head].v, v, sizeof(v));
+    hist_head = (hist_head + 1) % GNSS_INS_HISTORY;
+    if( hist_count < GNSS_INS_HISTORY )
+    {
+        hist_count++;
+    }
+
+    stats.propagations++;
+    if( (time_us - last_fix_us) / 1e6f > stats.max_coast_sec )
+    {
+        stats.max_coast_sec = (time_us - last_fix_us) / 1e6f;
+    }
+}
+
+
+/**
+ * @brief 測位時刻に最も近い過去の状態を探す
+ *
+ * @return const history_t* 見つからなければNULL
+ */
+const GnssIns::history_t *GnssIns::find_history(int64_t t_us) const
+{
+    const history_t *best = NULL;
+    int64_t best_diff = GNSS_INS_HISTORY_TOLERANCE_US;
+
+    for( int i = 0; i < hist_count; i++ )
+    {
+        const history_t &h = history[(hist_head + GNSS_INS_HISTORY - 1 - i) % GNSS_INS_HISTORY];
+        int64_t diff = h.time_us - t_us;
+        if( diff < 0 )
+        {
+            diff = -diff;
+        }
+        if( diff <= best_diff )
+        {
+            best = &h;
+            best_diff = diff;
+        }
+        else if( h.time_us < t_us )
+        {
+            // これより古い履歴は離れていく一方
+            break;
+        }
+    }
+    return best;
+}
+
+
+/**
+ * @brief 1つの状態を直接観測した値で誤差の推定を更新する
+ *
+ * @param dx 誤差の推定値．更新される
+ * @param idx 観測した状態の番号
+ * @param y 観測と推定の差
+ * @param r 観測の分散
+ * @param gate trueなら，差が大きすぎる場合は更新せずにfalseを返す
+ * @return true 更新した
+ */
+bool GnssIns::scalar_update(float dx[GNSS_INS_STATES], int idx, float y, float r, bool gate)
+{
+    float s = P[idx][idx] + r;
+    float innov = y - dx[idx];
+    float k[GNSS_INS_STATES];
+    float row[GNSS_INS_STATES];
+
+    if( gate && innov * innov > GNSS_INS_GATE_SIGMA * GNSS_INS_GATE_SIGMA * s )
+    {
+        return false;
+    }
+    for( int i = 0; i < GNSS_INS_STATES; i++ )
+    {
+        k[i] = P[i][idx] / s;
+        row[i] = P[idx][i];
+    }
+    for( int i = 0; i < GNSS_INS_STATES; i++ )
+    {
+        dx[i] += k[i] * innov;
+        for( int j = 0; j < GNSS_INS_STATES; j++ )
+        {
+            P[i][j] -= k[i] * row[j];
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief GNSSの測位で補正する
+ *
+ * @param fix 測位結果
+ * @return int 補正に使えば0，使わなければ-1
+ *
+ * 測位が途切れた時間が長い場合や，続けて測位を捨てた場合は，測位点からやり直す．
+ */
+int GnssIns::update_gnss(const gnss_fix_t &fix)
+{
+    float sigma_h, sigma_v;
+    float zp[3], zv[3];
+    float hp[3], hv[3];
+    float dx[GNSS_INS_STATES];
+    const history_t *h;
+
+    if( fix.fix_type == NMEA_FIX_TYPE_NOFIX || fix.fix_type >= NMEA_FIX_TYPE_INVALID )
+    {
+        return -1;
+    }
+    if( !initialized || fix.time_us - last_fix_us > max_coast_us || rejected_in_row >= GNSS_INS_MAX_REJECTS )
+    {
+        if( initialized )
+        {
+            stats.resets++;
+        }
+        start_at(fix);
+        stats.fixes++;
+        return 0;
+    }
+    if( fix.time_us <= last_fix_us )
+    {
+        return -1;      // 同じ測位が重複した
+    }
+
+    to_local(fix, zp, zv);
+    if( fabsf(zp[0]) > GNSS_INS_REBASE_M || fabsf(zp[1]) > GNSS_INS_REBASE_M )
+    {
+        // 原点を測位点に移す．平面近似の誤差を抑えるため
+        for( int i = 0; i < hist_count; i++ )
+        {
+            for( int c = 0; c < 3; c++ )
+            {
+                history[i].p[c] -= zp[c];
+            }
+        }
+        for( int c = 0; c < 3; c++ )
+        {
+            p[c] -= zp[c];
+        }
+        set_origin(fix.latitude, fix.longitude, fix.altitude);
+        to_local(fix, zp, zv);
+    }
+
+    h = find_history(fix.time_us);
+    if( h != NULL )
+    {
+        memcpy(hp, h->p, sizeof(hp));
+        memcpy(hv, h->v, sizeof(hv));
+    }
+    else
+    {
+        memcpy(hp, p, sizeof(hp));
+        memcpy(hv, v, sizeof(hv));
+    }
+
+    sigma_h = ((fix.hdop > 0.5f) ? fix.hdop : 0.5f) * GNSS_INS_UERE;
+    sigma_v = 2.0f * sigma_h;
+    memset(dx, 0, sizeof(dx));
+    // 水平位置が大きく外れていれば，その測位は使わない
+    for( int i = 0; i < 2; i++ )
+    {
+        float y = zp[i] - hp[i];
+        if( y * y > GNSS_INS_GATE_SIGMA * GNSS_INS_GATE_SIGMA * (P[i][i] + sigma_h * sigma_h) )
+        {
+            stats.rejected++;
+            rejected_in_row++;
+            return -1;
+        }
+    }
+    scalar_update(dx, IDX_P + 0, zp[0] - hp[0], sigma_h * sigma_h, false);
+    scalar_update(dx, IDX_P + 1, zp[1] - hp[1], sigma_h * sigma_h, false);
+    scalar_update(dx, IDX_P + 2, zp[2] - hp[2], sigma_v * sigma_v, true);
+    if( fix.vel_valid )
+    {
+        scalar_update(dx, IDX_V + 0, zv[0] - hv[0], GNSS_INS_VEL_SIGMA * GNSS_INS_VEL_SIGMA, true);
+        scalar_update(dx, IDX_V + 1, zv[1] - hv[1], GNSS_INS_VEL_SIGMA * GNSS_INS_VEL_SIGMA, true);
+    }
+
+    // 誤差を状態に反映する．測位時刻以降の履歴にも同じ補正を掛ける
+    for( int c = 0; c < 3; c++ )
+    {
+        p[c] += dx[IDX_P + c];
+        v[c] += dx[IDX_V + c];
+        ba[c] += dx[IDX_BA + c];
+    }
+    for( int i = 0; i < hist_count; i++ )
+    {
+        for( int c = 0; c < 3; c++ )
+        {
+            history[i].p[c] += dx[IDX_P + c];
+            history[i].v[c] += dx[IDX_V + c];
+        }
+    }
+    // 数値誤差で対称性が崩れないようにする
+    for( int i = 0; i < GNSS_INS_STATES; i++ )
+    {
+        for( int j = i + 1; j < GNSS_INS_STATES; j++ )
+        {
+            float m = 0.5f * (P[i][j] + P[j][i]);
+            P[i][j] = P[j][i] = m;
+        }
+    }
+
+    last_fix_us = fix.time_us;
+    rejected_in_row = 0;
+    stats.fixes++;
+    return 0;
+}
+
+
+int GnssIns::get_status() const
+{
+    if( !initialized )
+    {
+        return GNSS_INS_STATUS_INIT;
+    }
+    if( time_us - last_fix_us <= GNSS_INS_FIX_TIMEOUT_US )
+    {
+        return GNSS_INS_STATUS_GNSS;
+    }
+    if( time_us - last_fix_us <= max_coast_us )
+    {
+        return GNSS_INS_STATUS_COAST;
+    }
+    return GNSS_INS_STATUS_LOST;
+}
+
+
+/**
+ * @brief 現在の推定値を取得する
+ *
+ * @param out 格納先
+ * @return true 推定値がある
+ * @return false まだ測位が無い
+ */
+bool GnssIns::get_output(gnss_ins_output_t *out) const
+{
+    if( !initialized )
+    {
+        return false;
+    }
+    out->time_us = time_us;
+    out->latitude = lat0 + p[0] / m_per_deg_lat;
+    out->longitude = lon0 - p[1] / m_per_deg_lon;
+    out->altitude = alt0 + p[2];
+    out->vn = v[0];
+    out->ve = -v[1];
+    out->vu = v[2];
+    out->pos_sigma = sqrtf(P[0][0] + P[1][1]);
+    out->status = (uint8_t)get_status();
+    return true;
+}
+
+
+/**
+ * @brief 日時をunixtime(us)に変換する
+ *
+ * タイムゾーンに依存しないように，日付から日数を直接求める．
+ */
+int64_t gnss_ins_utc_us(int year, int month, int day, int hour, int minute, int second, int millisecond)
+{
+    int y = year - (month <= 2 ? 1 : 0);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = (int64_t)era * 146097 + doe - 719468;
+
+    return ((days * 86400 + hour * 3600 + minute * 60 + second) * 1000 + millisecond) * 1000LL;
+}
+
+
+/**
+ * @brief GGAとRMCから測位結果を作る
+ *
+ * @param rmc 直前に受信したRMC．日付と対地速度を使う
+ * @param gga GGA
+ * @param fix 格納先
+ * @return int 成功すれば0，測位できていないか日付が分からなければ-1
+ *
+ * 受信機はRMC, GGAの順に出力するので，GGAを受信した時点のRMCは同じ測位のもの．
+ * 時刻が異なる場合は対地速度を使わない．
+ */
+int gnss_ins_fix_from_nmea(const nmea_rmc_data_t *rmc, const nmea_gga_data_t *gga, gnss_fix_t *fix)
+{
+    bool same_epoch;
+
+    if( gga->fix_type == NMEA_FIX_TYPE_NOFIX || gga->fix_type >= NMEA_FIX_TYPE_INVALID || rmc->date_year < 2000 )
+    {
+        return -1;
+    }
+    same_epoch = rmc->data_valid && rmc->time_hour == gga->time_hour && rmc->time_minute == gga->time_minute
+                 && rmc->time_second == gga->time_second && rmc->time_millisecond == gga->time_millisecond;
+
+    fix->time_us = gnss_ins_utc_us(rmc->date_year, rmc->date_month, rmc->date_day,
+                                   gga->time_hour, gga->time_minute, gga->time_second, gga->time_millisecond);
+    if( !same_epoch && rmc->time_hour == 0 && gga->time_hour == 23 )
+    {
+        // RMCが日付を跨いだ後に，前日のGGAを受信した
+        fix->time_us -= 86400LL * 1000000;
+    }
+    fix->latitude = gga->latitude;
+    fix->longitude = gga->longitude;
+    fix->altitude = (float)gga->altitude;
+    fix->hdop = (float)gga->hdop;
+    fix->fix_type = gga->fix_type;
+    fix->num_sats = gga->num_sats;
+    fix->vel_valid = same_epoch && rmc->course_valid;
+    fix->speed = (float)(rmc->speed_knots * 0.514444);
+    fix->course = (float)rmc->course_deg;
+    return 0;
+}
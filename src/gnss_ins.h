@@ -0,0 +1,152 @@
+/**
+ * @file gnss_ins.h
+ * @author amagai
+ * @brief GNSSとIMUを組み合わせた位置推定(疎結合のエラーステート・カルマンフィルタ)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * IMUの加速度を姿勢(Ahrs)で地面座標に回転して積分し，位置と速度を高いレートで更新する．
+ * GNSSの測位(位置と対地速度)が来る度に，その誤差をカルマンフィルタで推定して補正する．
+ * 測位が途切れても，GNSS_INS_MAX_COAST_SEC秒までは加速度の積分だけで位置を出し続ける．
+ *
+ * フィルタの状態は位置，速度，加速度センサのバイアスの誤差(各3次元)の9次元．
+ * 姿勢はAhrsの推定値をそのまま使い，フィルタでは推定しない．
+ * 地面座標はAhrsと同じ北・西・上(NWU)で，最初の測位点を原点とする平面で近似する．
+ * 原点から離れたら測位点に原点を移す．
+ *
+ * 測位の時刻は受信機が測位した時点であり，NMEAを受信するのはその後になる．
+ * 過去の状態を保持しておき，測位時刻の状態との差を現在の状態の補正に使う．
+ *
+ * PC用の再生ツールtools/ins_replayからも使うので，Arduinoに依存しないこと．
+ */
+#ifndef GNSS_INS_H
+#define GNSS_INS_H
+
+#include <stdint.h>
+
+#include "nmea_parser.h"
+
+// 状態の次元(位置，速度，加速度バイアス)
+#define GNSS_INS_STATES 9
+// 測位時刻の状態を探すために保持する履歴の数
+#define GNSS_INS_HISTORY 128
+// 測位が途切れてから位置を出し続ける最大時間(秒)の既定値
+#define GNSS_INS_MAX_COAST_SEC 10
+// この時間(us)以内に測位があればGNSSで補正している状態とみなす
+#define GNSS_INS_FIX_TIMEOUT_US 1500000
+// 加速度の雑音(m/s^2/√Hz)．姿勢の誤差による重力の漏れ込みも含めて大きめにする
+#define GNSS_INS_ACCEL_NOISE 0.5f
+// 加速度バイアスの変動(m/s^2/√s)
+#define GNSS_INS_BIAS_NOISE 0.01f
+// HDOP 1あたりの水平位置の誤差(m)
+#define GNSS_INS_UERE 2.5f
+// 対地速度の誤差(m/s)
+#define GNSS_INS_VEL_SIGMA 0.3f
+// 残差がこの標準偏差の倍数を超える測位は使わない
+#define GNSS_INS_GATE_SIGMA 5.0f
+// 原点を移す距離(m)
+#define GNSS_INS_REBASE_M 10000.0f
+
+// 状態
+#define GNSS_INS_STATUS_INIT 0      // まだ測位が無い
+#define GNSS_INS_STATUS_GNSS 1      // GNSSで補正している
+#define GNSS_INS_STATUS_COAST 2     // 測位が途切れ，IMUだけで推定している
+#define GNSS_INS_STATUS_LOST 3      // 途切れた時間が長すぎて，位置は使えない
+
+
+/**
+ * @brief GNSSの測位結果
+ */
+typedef struct {
+    int64_t time_us;            // 測位時刻(unixtime, us)
+    double latitude;            // 緯度(度)
+    double longitude;           // 経度(度)
+    float altitude;             // 高度(m)
+    float hdop;
+    int fix_type;               // NMEA_FIX_TYPE_*
+    int num_sats;
+    bool vel_valid;             // 対地速度が有効
+    float speed;                // 対地速度(m/s)
+    float course;               // 対地進路(度，真北から時計回り)
+} gnss_fix_t;
+
+
+/**
+ * @brief 推定した位置と速度
+ */
+typedef struct {
+    int64_t time_us;            // 時刻(unixtime, us)
+    double latitude;            // 緯度(度)
+    double longitude;           // 経度(度)
+    float altitude;             // 高度(m)
+    float vn, ve, vu;           // 速度(m/s，北，東，上)
+    float pos_sigma;            // 水平位置の誤差の標準偏差(m)
+    uint8_t status;             // GNSS_INS_STATUS_*
+} gnss_ins_output_t;
+
+
+/**
+ * @brief 統計
+ */
+typedef struct {
+    uint32_t propagations;      // 加速度での更新の回数
+    uint32_t fixes;             // 補正に使った測位の数
+    uint32_t rejected;          // 残差が大きくて捨てた測位の数
+    uint32_t resets;            // 測位点からやり直した回数
+    float max_coast_sec;        // 測位が途切れた最長の時間(秒)
+} gnss_ins_stats_t;
+
+
+class GnssIns
+{
+protected:
+    typedef struct {
+        int64_t time_us;
+        float p[3];
+        float v[3];
+    } history_t;
+
+    bool initialized;
+    double lat0, lon0;          // 原点
+    float alt0;
+    double m_per_deg_lat;
+    double m_per_deg_lon;
+    float p[3];                 // 位置(m, NWU)
+    float v[3];                 // 速度(m/s, NWU)
+    float ba[3];                // 加速度バイアス(m/s^2, センサ座標)
+    float P[GNSS_INS_STATES][GNSS_INS_STATES];
+    float decl_cos, decl_sin;   // 偏角の補正
+    int64_t time_us;
+    int64_t last_fix_us;
+    int64_t max_coast_us;
+    int rejected_in_row;
+    history_t history[GNSS_INS_HISTORY];
+    int hist_head;
+    int hist_count;
+    gnss_ins_stats_t stats;
+
+    void set_origin(double lat, double lon, float alt);
+    void to_local(const gnss_fix_t &fix, float pos[3], float vel[3]) const;
+    void start_at(const gnss_fix_t &fix);
+    const history_t *find_history(int64_t t_us) const;
+    bool scalar_update(float dx[GNSS_INS_STATES], int idx, float y, float r, bool gate);
+
+public:
+    GnssIns();
+
+    void reset();
+    void set_declination(float deg);
+    void set_max_coast(float sec);
+    void propagate(int64_t t_us, const float q[4], const float accel[3], float dt);
+    int update_gnss(const gnss_fix_t &fix);
+    bool get_output(gnss_ins_output_t *out) const;
+    int get_status() const;
+    gnss_ins_stats_t get_stats() const { return stats; }
+};
+
+int64_t gnss_ins_utc_us(int year, int month, int day, int hour, int minute, int second, int millisecond);
+int gnss_ins_fix_from_nmea(const nmea_rmc_data_t *rmc, const nmea_gga_data_t *gga, gnss_fix_t *fix);
+
+#endif // GNSS_INS_H
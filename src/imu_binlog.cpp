@@ -0,0 +1,118 @@
+/**
+ * @file imu_binlog.cpp
+ * @author amagai
+ * @brief IMUデータのバイナリ記録形式のエンコーダ
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 形式はimu_binlog.hを参照．
+ */
+
+#include <string.h>
+
+#include "imu_binlog.h"
+
+
+/**
+ * @brief Construct a new ImuBinEncoder object
+ *
+ * @param accel_scale 加速度の1LSBあたりの値(G)
+ * @param gyro_scale 角速度の1LSBあたりの値(deg/s)
+ * @param mag_scale 磁気の1LSBあたりの値
+ */
+ImuBinEncoder::ImuBinEncoder(float accel_scale, float gyro_scale, float mag_scale)
+{
+    memset(&header, 0, sizeof(header));
+    header.magic = IMU_BINLOG_MAGIC;
+    header.version = IMU_BINLOG_VERSION;
+    header.header_size = sizeof(imu_binlog_header_t);
+    header.accel_scale = accel_scale;
+    header.gyro_scale = gyro_scale;
+    header.mag_scale = mag_scale;
+    reset();
+}
+
+
+/**
+ * @brief ブロックを空にする
+ */
+void ImuBinEncoder::reset()
+{
+    header.num_records = 0;
+    header.payload_size = 0;
+    header.base_time_us = 0;
+    header.base_count = 0;
+    payload_size = 0;
+    last_time_us = 0;
+    last_count = 0;
+}
+
+
+/**
+ * @brief レコードを追加する
+ *
+ * @param time_us タイムスタンプ(unixtime, us)
+ * @param count サンプル番号
+ * @param raw 加速度X,Y,Z，角速度X,Y,Z，磁気X,Y,Zの生の値
+ * @return true 追加できた
+ * @return false ブロックが一杯．finish()でブロックを取り出してから再度追加すること
+ */
+bool ImuBinEncoder::add(int64_t time_us, uint32_t count, const int16_t raw[IMU_BINLOG_NUM_AXES])
+{
+    uint8_t *p;
+    int n;
+
+    if( payload_size + IMU_BINLOG_MAX_RECORD_SIZE > IMU_BINLOG_MAX_PAYLOAD || header.num_records == 0xffff )
+    {
+        return false;
+    }
+    if( header.num_records == 0 )
+    {
+        header.base_time_us = time_us;
+        header.base_count = count;
+        last_time_us = time_us;
+        last_count = count;
+    }
+
+    p = buffer + sizeof(imu_binlog_header_t) + payload_size;
+    n = imu_binlog_put_varint(p, imu_binlog_zigzag(time_us - last_time_us));
+    n += imu_binlog_put_varint(p + n, (uint32_t)(count - last_count));
+    for( int i = 0; i < IMU_BINLOG_NUM_AXES; i++ )
+    {
+        p[n++] = (uint8_t)(raw[i] & 0xff);
+        p[n++] = (uint8_t)((raw[i] >> 8) & 0xff);
+    }
+    payload_size += n;
+    header.num_records++;
+    last_time_us = time_us;
+    last_count = count;
+    return true;
+}
+
+
+/**
+ * @brief ブロックを完成させて取り出す
+ *
+ * @param block ブロックの先頭アドレスの格納先
+ * @return size_t ブロックのバイト数．レコードが無い場合は0
+ *
+ * 取り出したブロックは次のadd()までに書き出すこと．
+ */
+size_t ImuBinEncoder::finish(const uint8_t **block)
+{
+    size_t len;
+
+    if( header.num_records == 0 )
+    {
+        return 0;
+    }
+    header.payload_size = payload_size;
+    header.crc = imu_binlog_block_crc(&header, buffer + sizeof(imu_binlog_header_t));
+    memcpy(buffer, &header, sizeof(header));
+    len = sizeof(imu_binlog_header_t) + payload_size;
+    *block = buffer;
+    reset();
+    return len;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file imu_binlog.h
+ * @author amagai
+ * @brief IMUデータのバイナリ記録形式
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * ファイルはブロックの並びで，各ブロックはヘッダとレコード列からなる．
+ * 数値は全てリトルエンディアン．
+ *
+ * レコードは次の並び．
+ *   - タイムスタンプの差分(us)．直前のレコードからの差をzigzag符号化したLEB128可変長整数
+ *   - カウントの差分．直前のレコードからの差をLEB128可変長整数
+ *   - 加速度X,Y,Z，角速度X,Y,Z，磁気X,Y,Zの生の値(int16_t x 9)
+ * ブロックの最初のレコードの差分は，ヘッダのbase_time_us, base_countからの差．
+ * 物理量はヘッダのスケール係数を掛けて求める．
+ *
+ * ブロック単位でCRCを持つので，途中で切れたファイルや壊れたブロックがあっても
+ * 次のマジックナンバーから読み直せる．
+ * PC側のデコーダはtools/imu_decodeにある．
+ */
+#ifndef IMU_BINLOG_H
+#define IMU_BINLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "crc32.h"
+
+#define IMU_BINLOG_MAGIC 0x42554d49     // "IMUB"
+#define IMU_BINLOG_VERSION 1
+#define IMU_BINLOG_NUM_AXES 9
+// 1レコードの最大長．可変長整数は最大10バイト
+#define IMU_BINLOG_MAX_RECORD_SIZE (10 + 5 + IMU_BINLOG_NUM_AXES * 2)
+// 1ブロックのペイロードの最大長
+#define IMU_BINLOG_MAX_PAYLOAD 1024
+
+#pragma pack(push, 1)
+/**
+ * @brief ブロックヘッダ
+ */
+typedef struct {
+    uint32_t magic;             // IMU_BINLOG_MAGIC
+    uint8_t version;            // IMU_BINLOG_VERSION
+    uint8_t header_size;        // ヘッダのサイズ．将来の拡張用
+    uint16_t num_records;       // ブロック内のレコード数
+    uint32_t payload_size;      // ヘッダに続くレコード列のバイト数
+    int64_t base_time_us;       // タイムスタンプの基準値(unixtime, us)
+    uint32_t base_count;        // カウントの基準値
+    float accel_scale;          // 加速度の1LSBあたりの値(G)
+    float gyro_scale;           // 角速度の1LSBあたりの値(deg/s)
+    float mag_scale;            // 磁気の1LSBあたりの値
+    uint32_t crc;               // crcを除くヘッダとペイロードのCRC-32
+} imu_binlog_header_t;
+#pragma pack(pop)
+
+
+/**
+ * @brief 可変長整数(LEB128)を書き込む
+ *
+ * @param p 書き込み先
+ * @param v 値
+ * @return int 書き込んだバイト数
+ */
+static inline int imu_binlog_put_varint(uint8_t *p, uint64_t v)
+{
+    int n = 0;
+    while( v >= 0x80 )
+    {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+
+/**
+ * @brief 可変長整数(LEB128)を読み出す
+ *
+ * @param p 読み出し元
+ * @param end 読み出し可能な範囲の終端
+ * @param v 値の格納先
+ * @return int 読み出したバイト数．範囲を超えた場合は0
+ */
+static inline int imu_binlog_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t r = 0;
+    int n = 0;
+    int shift = 0;
+    while( p + n < end && shift < 64 )
+    {
+        uint8_t b = p[n++];
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if( (b & 0x80) == 0 )
+        {
+            *v = r;
+            return n;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+
+static inline uint64_t imu_binlog_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+
+static inline int64_t imu_binlog_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+
+/**
+ * @brief ブロックのCRCを計算する
+ *
+ * @param header ヘッダ
+ * @param payload ペイロード
+ * @return uint32_t CRC-32
+ */
+static inline uint32_t imu_binlog_block_crc(const imu_binlog_header_t *header, const uint8_t *payload)
+{
+    uint32_t crc = crc32_update(0, header, offsetof(imu_binlog_header_t, crc));
+    return crc32_update(crc, payload, header->payload_size);
+}
+
+
+#ifdef __cplusplus
+/**
+ * @brief IMUデータをバイナリ形式のブロックにまとめるエンコーダ
+ */
+class ImuBinEncoder
+{
+protected:
+    uint8_t buffer[sizeof(imu_binlog_header_t) + IMU_BINLOG_MAX_PAYLOAD];
+    imu_binlog_header_t header;
+    size_t payload_size;
+    int64_t last_time_us;
+    uint32_t last_count;
+
+public:
+    ImuBinEncoder(float accel_scale, float gyro_scale, float mag_scale);
+    void reset();
+    bool add(int64_t time_us, uint32_t count, const int16_t raw[IMU_BINLOG_NUM_AXES]);
+    size_t finish(const uint8_t **block);
+    int get_num_records() const { return header.num_records; }
+    int64_t get_base_time_us() const { return header.base_time_us; }
+};
+#endif
+
+#endif // IMU_BINLOG_H
@@ -0,0 +1,242 @@
+/**
+ * @file imu_clock.cpp
+ * @author amagai
+ * @brief IMUのサンプル時刻をPPSで校正する
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#include <string.h>
+
+#include "imu_clock.h"
+
+
+ImuClock::ImuClock(double tick_us) : tick_us(tick_us)
+{
+    memset(&stats, 0, sizeof(stats));
+    reset();
+}
+
+
+/**
+ * @brief 校正を破棄して最初からやり直す
+ */
+void ImuClock::reset()
+{
+    num_sync = 0;
+    num_pending = 0;
+    num_cal = 0;
+    cal_head = 0;
+    valid = false;
+    ref_ticks = 0;
+    ref_utc = 0;
+    a = 0.0;
+    b = tick_us;
+    stats.points = 0;
+    stats.rate_ppm = 0.0f;
+    stats.residual_us = 0.0f;
+}
+
+
+/**
+ * @brief センサ時刻とモノトニック時刻の組を追加する
+ *
+ * @param ticks FIFOを読み出した時点のセンサ時刻
+ * @param mono_us 読み出し直後のモノトニック時刻(esp_timer, us)
+ */
+void ImuClock::add_sync(int64_t ticks, int64_t mono_us)
+{
+    if( num_sync > 0 && (ticks <= sync[num_sync - 1].ticks || mono_us <= sync[num_sync - 1].mono_us) )
+    {
+        // センサが初期化し直されたか，時刻が戻った
+        reset();
+    }
+    if( num_sync == IMU_CLOCK_SYNC_HISTORY )
+    {
+        memmove(&sync[0], &sync[1], sizeof(sync_t) * (IMU_CLOCK_SYNC_HISTORY - 1));
+        num_sync--;
+    }
+    sync[num_sync].ticks = ticks;
+    sync[num_sync].mono_us = mono_us;
+    num_sync++;
+    resolve_pending();
+}
+
+
+/**
+ * @brief PPSのエッジを追加する
+ *
+ * @param edge エッジのモノトニック時刻とUTCの秒
+ *
+ * エッジの後のFIFOの読み出しがまだなら，次のadd_sync()まで保留する．
+ */
+void ImuClock::add_pps(const imu_pps_edge_t &edge)
+{
+    if( num_pending == IMU_CLOCK_PPS_PENDING )
+    {
+        memmove(&pending[0], &pending[1], sizeof(imu_pps_edge_t) * (IMU_CLOCK_PPS_PENDING - 1));
+        num_pending--;
+    }
+    pending[num_pending++] = edge;
+    resolve_pending();
+}
+
+
+/**
+ * @brief 前後の読み出し時刻が揃ったエッジについて，エッジでのセンサ時刻を求める
+ *
+ * 2回の読み出しの間はセンサ時刻とモノトニック時刻が比例するものとして補間する．
+ * 読み出しの間隔は高々100ms程度なので，両者の周波数の違いは問題にならない．
+ */
+void ImuClock::resolve_pending()
+{
+    int n = 0;
+
+    for( int i = 0; i < num_pending; i++ )
+    {
+        const imu_pps_edge_t &e = pending[i];
+        bool keep = false;
+
+        if( num_sync >= 2 && e.mono_us >= sync[0].mono_us )
+        {
+            if( e.mono_us > sync[num_sync - 1].mono_us )
+            {
+                keep = true;    // 次の読み出しを待つ
+            }
+            else
+            {
+                for( int j = 1; j < num_sync; j++ )
+                {
+                    if( e.mono_us <= sync[j].mono_us )
+                    {
+                        const sync_t &s0 = sync[j - 1];
+                        const sync_t &s1 = sync[j];
+                        double frac = (double)(e.mono_us - s0.mono_us) / (double)(s1.mono_us - s0.mono_us);
+                        int64_t ticks = s0.ticks + (int64_t)(frac * (double)(s1.ticks - s0.ticks) + 0.5);
+                        add_cal(ticks, e.utc_sec * 1000000LL);
+                        break;
+                    }
+                }
+            }
+        }
+        else if( num_sync < 2 )
+        {
+            keep = true;
+        }
+        // 履歴より古いエッジは捨てる
+        if( keep )
+        {
+            pending[n++] = e;
+        }
+    }
+    num_pending = n;
+}
+
+
+/**
+ * @brief センサ時刻とUTCの組を追加して回帰直線を更新する
+ */
+void ImuClock::add_cal(int64_t ticks, int64_t utc_us)
+{
+    if( valid && num_cal >= 2 )
+    {
+        int64_t predicted;
+        to_utc_us(ticks, &predicted);
+        stats.residual_us = (float)(utc_us - predicted);
+        if( utc_us - predicted > IMU_CLOCK_RESET_US || predicted - utc_us > IMU_CLOCK_RESET_US )
+        {
+            // GNSSの時刻が飛んだか，センサの時刻がおかしい
+            stats.resets++;
+            num_cal = 0;
+            cal_head = 0;
+            valid = false;
+        }
+    }
+    if( num_cal > 0 )
+    {
+        const cal_t &last = cal[(cal_head + IMU_CLOCK_CAL_POINTS - 1) % IMU_CLOCK_CAL_POINTS];
+        if( utc_us <= last.utc_us || ticks <= last.ticks )
+        {
+            return;     // 同じ秒のエッジが重複した
+        }
+    }
+
+    cal[cal_head].ticks = ticks;
+    cal[cal_head].utc_us = utc_us;
+    cal_head = (cal_head + 1) % IMU_CLOCK_CAL_POINTS;
+    if( num_cal < IMU_CLOCK_CAL_POINTS )
+    {
+        num_cal++;
+    }
+    fit();
+}
+
+
+/**
+ * @brief 保持している組から回帰直線を求める
+ *
+ * 桁落ちを避けるため，最新の組を原点にして計算する．
+ * 組が1つしかない場合は，読み出し時刻の履歴からセンサ時刻とモノトニック時刻の比を
+ * 傾きとする．センサの内蔵発振器は公称値から%単位でずれることがあるが，
+ * ESP32の水晶はppm単位なので，こちらの方がずっと良い．
+ */
+void ImuClock::fit()
+{
+    const cal_t &last = cal[(cal_head + IMU_CLOCK_CAL_POINTS - 1) % IMU_CLOCK_CAL_POINTS];
+    double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+    double n = num_cal;
+
+    ref_ticks = last.ticks;
+    ref_utc = last.utc_us;
+    for( int i = 0; i < num_cal; i++ )
+    {
+        double x = (double)(cal[i].ticks - ref_ticks);
+        double y = (double)(cal[i].utc_us - ref_utc);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    if( num_cal >= 2 && n * sxx - sx * sx > 0.0 )
+    {
+        b = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+        a = (sy - b * sx) / n;
+    }
+    else if( num_sync >= 2 && sync[num_sync - 1].ticks > sync[0].ticks )
+    {
+        b = (double)(sync[num_sync - 1].mono_us - sync[0].mono_us) / (double)(sync[num_sync - 1].ticks - sync[0].ticks);
+        a = 0.0;
+    }
+    else
+    {
+        b = tick_us;
+        a = 0.0;
+    }
+    valid = true;
+    stats.points = num_cal;
+    // センサの1カウントが長いほど，センサの発振器は遅い
+    stats.rate_ppm = (float)((tick_us / b - 1.0) * 1e6);
+}
+
+
+/**
+ * @brief センサ時刻をUTCに変換する
+ *
+ * @param ticks センサ時刻
+ * @param utc_us UTC(1970年からのus)の格納先
+ * @return true 変換できた
+ * @return false まだ校正されていない
+ */
+bool ImuClock::to_utc_us(int64_t ticks, int64_t *utc_us) const
+{
+    if( !valid )
+    {
+        return false;
+    }
+    *utc_us = ref_utc + (int64_t)(a + b * (double)(ticks - ref_ticks) + 0.5);
+    return true;
+}
+
@@ -0,0 +1,98 @@
+/**
+ * @file imu_clock.h
+ * @author amagai
+ * @brief IMUのサンプル時刻をPPSで校正する
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * IMUのセンサ時刻(BMI270のsensortime)とUTCの関係を，PPSのエッジを使って求める．
+ *
+ * FIFOを読み出す毎に，センサ時刻とその時のモノトニック時刻(esp_timer)の組を
+ * add_sync()で与える．PPSのエッジのモノトニック時刻とそのUTCの秒をadd_pps()で与えると，
+ * 前後の読み出し時刻からエッジでのセンサ時刻を補間し，センサ時刻とUTCの組を作る．
+ * 直近の組から最小二乗法で直線を求め，センサ時刻をUTCに変換する．
+ * 傾きがセンサの発振器のGNSS時刻に対する周波数になる．
+ */
+#ifndef IMU_CLOCK_H
+#define IMU_CLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// センサ時刻とモノトニック時刻の組を保持する数．
+// PPSのエッジが届くまでの遅れ(メインループの周期)より長い期間を保持する
+#define IMU_CLOCK_SYNC_HISTORY 32
+// 回帰に使うセンサ時刻とUTCの組の数(PPSの秒数)
+#define IMU_CLOCK_CAL_POINTS 32
+// 処理待ちのPPSエッジの数
+#define IMU_CLOCK_PPS_PENDING 4
+// 予測からこれ以上ずれた組が来たら，校正をやり直す(us)
+#define IMU_CLOCK_RESET_US 5000
+
+
+/**
+ * @brief PPSのエッジ
+ */
+typedef struct {
+    int64_t mono_us;            // エッジのモノトニック時刻(esp_timer, us)
+    int64_t utc_sec;            // エッジが示すUTCの秒
+} imu_pps_edge_t;
+
+
+/**
+ * @brief 校正の状態
+ */
+typedef struct {
+    int points;                 // 回帰に使っている組の数
+    float rate_ppm;             // センサの発振器の公称値からのずれ(ppm)
+    float residual_us;          // 最新の組の回帰直線からのずれ(us)
+    uint32_t resets;            // 校正をやり直した回数
+} imu_clock_stats_t;
+
+
+class ImuClock
+{
+protected:
+    typedef struct {
+        int64_t ticks;
+        int64_t mono_us;
+    } sync_t;
+    typedef struct {
+        int64_t ticks;
+        int64_t utc_us;
+    } cal_t;
+
+    double tick_us;             // センサ時刻の1カウントの公称値(us)
+    sync_t sync[IMU_CLOCK_SYNC_HISTORY];
+    int num_sync;
+    imu_pps_edge_t pending[IMU_CLOCK_PPS_PENDING];
+    int num_pending;
+    cal_t cal[IMU_CLOCK_CAL_POINTS];
+    int num_cal;
+    int cal_head;               // 次に書き込む位置
+
+    // 回帰直線 utc_us = ref_utc + a + b * (ticks - ref_ticks)
+    bool valid;
+    int64_t ref_ticks;
+    int64_t ref_utc;
+    double a, b;
+    imu_clock_stats_t stats;
+
+    void resolve_pending();
+    void add_cal(int64_t ticks, int64_t utc_us);
+    void fit();
+
+public:
+    ImuClock(double tick_us);
+    void reset();
+    void add_sync(int64_t ticks, int64_t mono_us);
+    void add_pps(const imu_pps_edge_t &edge);
+    bool to_utc_us(int64_t ticks, int64_t *utc_us) const;
+    bool is_valid() const { return valid; }
+    imu_clock_stats_t get_stats() const { return stats; }
+};
+
+
+#endif // IMU_CLOCK_H
@@ -0,0 +1,424 @@
+/**
+ * @file imu_filter.cpp
+ * @author amagai
+ * @brief IMUデータの間引きとフィルタ
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "imu_filter.h"
+
+#if IMU_FILTER_USE_DSP
+#include <esp_dsp.h>
+#endif
+
+
+/**
+ * @brief 双二次フィルタ(直接形II)．係数と状態の並びはesp-dspのdsps_biquad_f32()と同じ
+ *
+ * @param in 入力
+ * @param out 出力．inと同じでもよい
+ * @param n サンプル数
+ * @param coef 係数 b0, b1, b2, a1, a2
+ * @param w 状態(2個)
+ */
+void imu_filter_biquad_scalar(const float *in, float *out, int n, const float *coef, float *w)
+{
+    for( int i = 0; i < n; i++ )
+    {
+        float d0 = in[i] - coef[3] * w[0] - coef[4] * w[1];
+        out[i] = coef[0] * d0 + coef[1] * w[0] + coef[2] * w[1];
+        w[1] = w[0];
+        w[0] = d0;
+    }
+}
+
+
+float imu_filter_dot_scalar(const float *a, const float *b, int n)
+{
+    float acc = 0.0f;
+
+    for( int i = 0; i < n; i++ )
+    {
+        acc += a[i] * b[i];
+    }
+    return acc;
+}
+
+
+void imu_filter_biquad(const float *in, float *out, int n, const float *coef, float *w)
+{
+#if IMU_FILTER_USE_DSP
+    dsps_biquad_f32(in, out, n, (float *)coef, w);
+#else
+    imu_filter_biquad_scalar(in, out, n, coef, w);
+#endif
+}
+
+
+float imu_filter_dot(const float *a, const float *b, int n)
+{
+#if IMU_FILTER_USE_DSP
+    float acc;
+    dsps_dotprod_f32(a, b, &acc, n);
+    return acc;
+#else
+    return imu_filter_dot_scalar(a, b, n);
+#endif
+}
+
+
+ImuFilter::ImuFilter(float in_rate_hz)
+{
+    in_rate = in_rate_hz;
+    out_rate = in_rate_hz;
+    decim = 1;
+    phase = 0;
+    delay = 0.0f;
+    num_stages = 0;
+    memset(stages, 0, sizeof(stages));
+}
+
+
+ImuFilter::~ImuFilter()
+{
+    for( int i = 0; i < num_stages; i++ )
+    {
+        delete[] stages[i].fir_coef;
+        delete[] stages[i].fir_delay;
+    }
+}
+
+
+/**
+ * @brief 段を1つ追加する
+ *
+ * @param type 段の種類
+ * @param stage_decim 段の間引き率
+ * @return stage_t* 追加した段．段の数が上限に達していればNULL
+ */
+ImuFilter::stage_t *ImuFilter::new_stage(stage_type_t type, int stage_decim)
+{
+    stage_t *st;
+
+    if( num_stages >= IMU_FILTER_MAX_STAGES || stage_decim < 1 )
+    {
+        return NULL;
+    }
+    st = &stages[num_stages];
+    memset(st, 0, sizeof(stage_t));
+    st->type = type;
+    st->decim = stage_decim;
+    return st;
+}
+
+
+/**
+ * @brief 双二次のローパスフィルタの段を追加する
+ *
+ * @param fc_hz カットオフ周波数(Hz)．その時点の出力レートの半分未満
+ * @param q Q値．0.7071でバターワース
+ * @return int 成功すれば0，失敗すれば-1
+ *
+ * 間引きの段の後に追加した場合は，間引いた後のレートで動作する．
+ */
+int ImuFilter::add_lowpass(float fc_hz, float q)
+{
+    stage_t *st;
+    float w0, alpha, cs, a0;
+
+    if( fc_hz <= 0.0f || fc_hz >= out_rate / 2 || q <= 0.0f )
+    {
+        return -1;
+    }
+    st = new_stage(STAGE_BIQUAD, 1);
+    if( st == NULL )
+    {
+        return -1;
+    }
+    // RBJのAudio EQ Cookbookのローパス
+    w0 = 2.0f * (float)M_PI * fc_hz / out_rate;
+    cs = cosf(w0);
+    alpha = sinf(w0) / (2.0f * q);
+    a0 = 1.0f + alpha;
+    st->coef[0] = (1.0f - cs) / 2.0f / a0;
+    st->coef[1] = (1.0f - cs) / a0;
+    st->coef[2] = st->coef[0];
+    st->coef[3] = -2.0f * cs / a0;
+    st->coef[4] = (1.0f - alpha) / a0;
+    // 直線位相ではないので，低域での群遅延 1/(Q*w0) で近似する
+    delay += in_rate / (q * 2.0f * (float)M_PI * fc_hz);
+    num_stages++;
+    return 0;
+}
+
+
+/**
+ * @brief FIRの間引きフィルタの段を追加する
+ *
+ * @param stage_decim 間引き率
+ * @param taps タップ数．0なら間引き率から決める
+ * @return int 成功すれば0，失敗すれば-1
+ *
+ * カットオフを出力レートの0.4倍にしたローパスを，ハミング窓の窓関数法で設計する．
+ * 係数は直線位相なので，群遅延は(taps-1)/2サンプル．
+ */
+int ImuFilter::add_fir_decimator(int stage_decim, int taps)
+{
+    stage_t *st;
+    float fc;
+    float sum = 0.0f;
+    float *h;
+
+    if( taps <= 0 )
+    {
+        taps = 8 * stage_decim + 1;
+    }
+    if( taps > IMU_FILTER_FIR_MAX_TAPS )
+    {
+        taps = IMU_FILTER_FIR_MAX_TAPS - 1;
+    }
+    st = new_stage(STAGE_FIR, stage_decim);
+    if( st == NULL )
+    {
+        return -1;
+    }
+    st->fir_coef = new float[taps];
+    st->fir_delay = new float[taps * 2 * IMU_FILTER_CHANNELS];
+    if( st->fir_coef == NULL || st->fir_delay == NULL )
+    {
+        delete[] st->fir_coef;
+        delete[] st->fir_delay;
+        return -1;
+    }
+    st->taps = taps;
+    memset(st->fir_delay, 0, sizeof(float) * taps * 2 * IMU_FILTER_CHANNELS);
+
+    // 入力レートに対する正規化したカットオフ周波数
+    fc = 0.4f / stage_decim;
+    h = st->fir_coef;
+    for( int k = 0; k < taps; k++ )
+    {
+        float x = k - (taps - 1) / 2.0f;
+        float sinc = (x == 0.0f) ? 2.0f * fc : sinf(2.0f * (float)M_PI * fc * x) / ((float)M_PI * x);
+        float win = (taps > 1) ? 0.54f - 0.46f * cosf(2.0f * (float)M_PI * k / (taps - 1)) : 1.0f;
+        // 古い順に並んだ遅延線との積和にするため逆順に格納する．対称なので値は同じ
+        h[taps - 1 - k] = sinc * win;
+        sum += sinc * win;
+    }
+    for( int k = 0; k < taps; k++ )
+    {
+        h[k] /= sum;
+    }
+
+    delay += (taps - 1) / 2.0f * decim;
+    decim *= stage_decim;
+    out_rate /= stage_decim;
+    num_stages++;
+    return 0;
+}
+
+
+/**
+ * @brief CICの間引きフィルタの段を追加する
+ *
+ * @param stage_decim 間引き率
+ * @param order 次数(積分器と櫛形フィルタの段数)
+ * @param lsb チャネル毎の1LSBあたりの値．入力をこの値で割って整数にする
+ * @return int 成功すれば0，失敗すれば-1
+ *
+ * 積分器の値は2の補数の32bitで折り返すが，櫛形フィルタで差を取るので結果は正しい．
+ * 出力の振幅は入力の(間引き率)^(次数)倍になるので，これが16bitに収まる範囲に制限する．
+ * 群遅延は次数*(間引き率-1)/2サンプル．通過域が垂れるので，後段にFIRを置くとよい．
+ */
+int ImuFilter::add_cic_decimator(int stage_decim, int order, const float *lsb)
+{
+    stage_t *st;
+    uint32_t growth = 1;
+
+    if( order < 1 || order > IMU_FILTER_CIC_MAX_ORDER || stage_decim < 2 )
+    {
+        return -1;
+    }
+    for( int i = 0; i < order; i++ )
+    {
+        growth *= stage_decim;
+        if( growth > 65536 )
+        {
+            return -1;
+        }
+    }
+    st = new_stage(STAGE_CIC, stage_decim);
+    if( st == NULL )
+    {
+        return -1;
+    }
+    st->order = order;
+    st->gain = 1.0f / growth;
+    for( int c = 0; c < IMU_FILTER_CHANNELS; c++ )
+    {
+        st->lsb[c] = lsb[c];
+    }
+
+    delay += order * (stage_decim - 1) / 2.0f * decim;
+    decim *= stage_decim;
+    out_rate /= stage_decim;
+    num_stages++;
+    return 0;
+}
+
+
+/**
+ * @brief フィルタの状態と間引きの位相を初期化する
+ */
+void ImuFilter::reset()
+{
+    for( int i = 0; i < num_stages; i++ )
+    {
+        stage_t *st = &stages[i];
+        st->count = 0;
+        st->pos = 0;
+        memset(st->w, 0, sizeof(st->w));
+        memset(st->integ, 0, sizeof(st->integ));
+        memset(st->comb, 0, sizeof(st->comb));
+        if( st->fir_delay != NULL )
+        {
+            memset(st->fir_delay, 0, sizeof(float) * st->taps * 2 * IMU_FILTER_CHANNELS);
+        }
+    }
+    phase = 0;
+}
+
+
+int ImuFilter::run_biquad(stage_t *st, float **ch, int n)
+{
+    for( int c = 0; c < IMU_FILTER_CHANNELS; c++ )
+    {
+        imu_filter_biquad(ch[c], ch[c], n, st->coef, st->w[c]);
+    }
+    return n;
+}
+
+
+/**
+ * @brief FIRの間引き
+ *
+ * 遅延線は2倍の長さを持ち，同じ値を2か所に書くことで，
+ * 常に連続したtaps個の領域で積和を取れるようにする．
+ * 出力を書く位置は入力を読む位置より後ろにならないので，その場で上書きできる．
+ */
+int ImuFilter::run_fir(stage_t *st, float **ch, int n)
+{
+    int taps = st->taps;
+    int m = 0;
+    int count = st->count;
+    int pos = st->pos;
+
+    for( int i = 0; i < n; i++ )
+    {
+        pos = (pos + 1 == taps) ? 0 : pos + 1;
+        for( int c = 0; c < IMU_FILTER_CHANNELS; c++ )
+        {
+            float *d = st->fir_delay + c * taps * 2;
+            d[pos] = ch[c][i];
+            d[pos + taps] = ch[c][i];
+        }
+        if( ++count < st->decim )
+        {
+            continue;
+        }
+        count = 0;
+        for( int c = 0; c < IMU_FILTER_CHANNELS; c++ )
+        {
+            // pos+1からtaps個が古い順の入力
+            ch[c][m] = imu_filter_dot(st->fir_delay + c * taps * 2 + pos + 1, st->fir_coef, taps);
+        }
+        m++;
+    }
+    st->count = count;
+    st->pos = pos;
+    return m;
+}
+
+
+int ImuFilter::run_cic(stage_t *st, float **ch, int n)
+{
+    int m = 0;
+    int order = st->order;
+
+    for( int i = 0; i < n; i++ )
+    {
+        bool output = (++st->count >= st->decim);
+        if( output )
+        {
+            st->count = 0;
+        }
+        for( int c = 0; c < IMU_FILTER_CHANNELS; c++ )
+        {
+            uint32_t *integ = st->integ[c];
+            uint32_t x = (uint32_t)(int32_t)lrintf(ch[c][i] / st->lsb[c]);
+
+            integ[0] += x;
+            for( int k = 1; k < order; k++ )
+            {
+                integ[k] += integ[k - 1];
+            }
+            if( output )
+            {
+                uint32_t *comb = st->comb[c];
+                uint32_t y = integ[order - 1];
+                for( int k = 0; k < order; k++ )
+                {
+                    uint32_t t = y;
+                    y -= comb[k];
+                    comb[k] = t;
+                }
+                ch[c][m] = (float)(int32_t)y * st->gain * st->lsb[c];
+            }
+        }
+        if( output )
+        {
+            m++;
+        }
+    }
+    return m;
+}
+
+
+/**
+ * @brief データをまとめて処理する
+ *
+ * @param ch チャネル毎のデータ．出力で上書きされる
+ * @param n 入力のサンプル数
+ * @return int 出力のサンプル数
+ *
+ * 出力の最初のサンプルは，呼ぶ前のget_first_output_index()番目の入力の時点のもの．
+ * 以降はget_decimation()毎．
+ */
+int ImuFilter::process(float *ch[IMU_FILTER_CHANNELS], int n)
+{
+    phase = (phase + n) % decim;
+    for( int i = 0; i < num_stages && n > 0; i++ )
+    {
+        stage_t *st = &stages[i];
+        switch( st->type )
+        {
+            case STAGE_BIQUAD:
+                n = run_biquad(st, ch, n);
+                break;
+            case STAGE_FIR:
+                n = run_fir(st, ch, n);
+                break;
+            case STAGE_CIC:
+                n = run_cic(st, ch, n);
+                break;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file imu_filter.h
+ * @author amagai
+ * @brief IMUデータの間引きとフィルタ
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 高いレートでサンプリングしたIMUデータを，エイリアシングを抑えながら低いレートに間引く．
+ * 段(ステージ)を直列につないで使う．使える段は次の3種類．
+ *   - 双二次(biquad)のローパスフィルタ．レートは変わらない
+ *   - FIRの間引きフィルタ．窓関数法で設計したローパスを通してから間引く
+ *   - CICの間引きフィルタ．整数演算のみで，乗算が無い
+ *
+ * 各チャネル(加速度と角速度のX,Y,Z)は独立に処理する．
+ * データはチャネル毎の配列でまとめて渡し，出力は同じ配列に上書きする．
+ *
+ * esp-dspが使える場合は，biquadとFIRの積和をesp-dspの最適化された関数で行う．
+ * 使えない場合(ホストでのテストなど)は同じ計算をCで行う．
+ *
+ * 間引きの段が出力するのは，段への入力がdecim個揃った時点．
+ * 全体の間引き率をDとすると，reset()からの入力の番号をiとして(i+1)がDの倍数の時に出力する．
+ */
+#ifndef IMU_FILTER_H
+#define IMU_FILTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef IMU_FILTER_USE_DSP
+#if defined(__has_include)
+#if __has_include(<esp_dsp.h>)
+#define IMU_FILTER_USE_DSP 1
+#endif
+#endif
+#endif
+#ifndef IMU_FILTER_USE_DSP
+#define IMU_FILTER_USE_DSP 0
+#endif
+
+// チャネル数(加速度X,Y,Z，角速度X,Y,Z)
+#define IMU_FILTER_CHANNELS 6
+// つなげる段の最大数
+#define IMU_FILTER_MAX_STAGES 4
+// FIRのタップ数の上限
+#define IMU_FILTER_FIR_MAX_TAPS 64
+// CICの次数の上限
+#define IMU_FILTER_CIC_MAX_ORDER 5
+
+// 間引きの方法
+#define IMU_DECIM_FIR 0
+#define IMU_DECIM_CIC 1
+
+
+// 各段の処理関数．esp-dspがあればそれを使う
+void imu_filter_biquad(const float *in, float *out, int n, const float *coef, float *w);
+float imu_filter_dot(const float *a, const float *b, int n);
+// 比較用のCでの実装
+void imu_filter_biquad_scalar(const float *in, float *out, int n, const float *coef, float *w);
+float imu_filter_dot_scalar(const float *a, const float *b, int n);
+
+
+class ImuFilter
+{
+protected:
+    typedef enum {
+        STAGE_BIQUAD,
+        STAGE_FIR,
+        STAGE_CIC,
+    } stage_type_t;
+
+    typedef struct {
+        stage_type_t type;
+        int decim;                  // 間引き率(biquadは1)
+        int count;                  // 間引きの位相
+        // biquad
+        float coef[5];              // b0, b1, b2, a1, a2
+        float w[IMU_FILTER_CHANNELS][2];
+        // FIR
+        int taps;
+        int pos;
+        float *fir_coef;            // 逆順に並べた係数
+        float *fir_delay;           // チャネル毎に2*taps．後半は前半の複製
+        // CIC
+        int order;
+        float lsb[IMU_FILTER_CHANNELS];
+        float gain;                 // 1 / decim^order
+        uint32_t integ[IMU_FILTER_CHANNELS][IMU_FILTER_CIC_MAX_ORDER];
+        uint32_t comb[IMU_FILTER_CHANNELS][IMU_FILTER_CIC_MAX_ORDER];
+    } stage_t;
+
+    float in_rate;
+    float out_rate;
+    int decim;                      // 全体の間引き率
+    uint32_t phase;                 // reset()からの入力数をdecimで割った余り
+    float delay;                    // 群遅延(入力のサンプル数)
+    stage_t stages[IMU_FILTER_MAX_STAGES];
+    int num_stages;
+
+    stage_t *new_stage(stage_type_t type, int stage_decim);
+    int run_biquad(stage_t *st, float **ch, int n);
+    int run_fir(stage_t *st, float **ch, int n);
+    int run_cic(stage_t *st, float **ch, int n);
+
+public:
+    ImuFilter(float in_rate_hz);
+    ~ImuFilter();
+
+    int add_lowpass(float fc_hz, float q);
+    int add_fir_decimator(int decim, int taps);
+    int add_cic_decimator(int decim, int order, const float *lsb);
+    void reset();
+    int process(float *ch[IMU_FILTER_CHANNELS], int n);
+
+    float get_input_rate() const { return in_rate; }
+    float get_output_rate() const { return out_rate; }
+    int get_decimation() const { return decim; }
+    float get_delay_samples() const { return delay; }
+    int get_first_output_index() const { return decim - 1 - (int)phase; }
+};
+
+#endif // IMU_FILTER_H
@@ -0,0 +1,62 @@
+/**
+ * @file imu_resampler.cpp
+ * @author amagai
+ * @brief IMUのサンプルをUTCに揃った等間隔の時刻に補間する
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#include "imu_resampler.h"
+
+
+/**
+ * @brief サンプルを1つ入力し，前のサンプルとの間にある格子点のサンプルを出力する
+ *
+ * @param in 入力のサンプル
+ * @param t_us 入力のサンプルのUTC(us)
+ * @param out 出力の格納先
+ * @param max_out 出力の格納先の数
+ * @return int 出力したサンプル数
+ *
+ * 入力の間隔が格子の間隔より長いと，1つの入力で複数の出力が出る．
+ * 時刻が戻ったり，入力が1秒以上途切れたりした場合は補間しないでやり直す．
+ */
+int ImuResampler::push(const imu_record_t &in, int64_t t_us, imu_record_t *out, int max_out)
+{
+    int n = 0;
+
+    if( !has_prev || t_us <= prev_us || t_us - prev_us > 1000000 )
+    {
+        prev = in;
+        prev_us = t_us;
+        has_prev = true;
+        return 0;
+    }
+
+    // prev_usより後の最初の格子点
+    int64_t k = prev_us / period_us + 1;
+    for( int64_t tg = k * period_us; tg <= t_us && n < max_out; tg += period_us, k++ )
+    {
+        float w = (float)(tg - prev_us) / (float)(t_us - prev_us);
+        imu_record_t &r = out[n++];
+        r.timestamp.tv_sec = tg / 1000000;
+        r.timestamp.tv_usec = tg % 1000000;
+        // 1日の格子点の数は32bitに収まる
+        r.count = (uint32_t)(k % (86400000000LL / period_us));
+        r.ax = prev.ax + (in.ax - prev.ax) * w;
+        r.ay = prev.ay + (in.ay - prev.ay) * w;
+        r.az = prev.az + (in.az - prev.az) * w;
+        r.gx = prev.gx + (in.gx - prev.gx) * w;
+        r.gy = prev.gy + (in.gy - prev.gy) * w;
+        r.gz = prev.gz + (in.gz - prev.gz) * w;
+        r.mx = prev.mx;
+        r.my = prev.my;
+        r.mz = prev.mz;
+    }
+    prev = in;
+    prev_us = t_us;
+    return n;
+}
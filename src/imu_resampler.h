@@ -0,0 +1,40 @@
+/**
+ * @file imu_resampler.h
+ * @author amagai
+ * @brief IMUのサンプルをUTCに揃った等間隔の時刻に補間する
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+#ifndef IMU_RESAMPLER_H
+#define IMU_RESAMPLER_H
+
+#include <stdint.h>
+
+#include "sensor_logger.h"
+
+/**
+ * @brief IMUのサンプルをUTCに揃った等間隔の時刻に補間する
+ *
+ * 入力のサンプルの間にある格子点の値を線形補間で求める．磁気は直前のサンプルの値を使う．
+ * 出力のカウントは格子点の番号(UTCの0時からの格子点の数)．
+ */
+class ImuResampler
+{
+protected:
+    int64_t period_us;
+    bool has_prev;
+    imu_record_t prev;
+    int64_t prev_us;
+
+public:
+    ImuResampler(int64_t period_us) : period_us(period_us), has_prev(false), prev_us(0) {}
+    void set_period(int64_t period) { period_us = period; has_prev = false; }
+    int64_t get_period() const { return period_us; }
+    void reset() { has_prev = false; }
+    int push(const imu_record_t &in, int64_t t_us, imu_record_t *out, int max_out);
+};
+
+#endif // IMU_RESAMPLER_H
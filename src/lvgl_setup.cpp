@@ -1,6 +1,12 @@
 #include <M5Unified.h>
 #include <lvgl.h>
 #include <esp_timer.h>
+#include <string.h>
+#include <sys/time.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 
 #include "lvgl_setup.h"
 #include "bus_mutex.h"
@@ -18,6 +24,52 @@ constexpr int32_t BYTES_PER_PIXEL = (LV_COLOR_FORMAT_GET_SIZE(LV_COLOR_FORMAT_RG
 // 描画バッファの分割数．大きいほど省メモリになるが，描画が遅くなる．
 constexpr int32_t DISPBUF_DIVIDE = 4;
 
+// trueなら描画バッファを2つ使い，一方をDMAで転送している間にもう一方に描画する．
+// 2つ目のバッファを割り当てられなければ1つで動かす．
+constexpr bool DISPBUF_DOUBLE = true;
+
+// LVGLのタスク．loop()と同じコアで動かし，描画ユニットのスレッドは両方のコアで動く
+constexpr uint32_t LVGL_TASK_STACK = 8192;
+constexpr UBaseType_t LVGL_TASK_PRIORITY = 1;
+constexpr BaseType_t LVGL_TASK_CORE = 1;
+// タイマの待ちが長くても，この間隔(ms)で画面の定期処理を呼ぶ
+constexpr uint32_t LVGL_TASK_PERIOD_MS = 10;
+// lvgl_post()で受け付ける要求の数
+constexpr int LVGL_POST_QUEUE_LEN = 16;
+// 秒の境界のこの時間(us)前からは画面の更新を始めず，境界を待つ．1回の画面の更新より長くすること
+constexpr int64_t LVGL_FLIP_GUARD_US = 30000;
+// タイマが早く起きた時に，時計が次の秒になるまで待つ最長の時間(us)
+constexpr int64_t LVGL_FLIP_SPIN_MAX_US = 2000;
+
+typedef struct {
+    void (*func)(void *arg);
+    void *arg;
+} lvgl_post_t;
+
+static QueueHandle_t post_queue = nullptr;
+static TaskHandle_t lvgl_task_handle = nullptr;
+static void (*ui_loop_func)() = nullptr;
+
+// タッチパネルの状態．loop()のM5.update()で更新し，LVGLのタスクが読む
+static portMUX_TYPE touch_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool touch_pressed = false;
+static int16_t touch_x, touch_y;
+
+// DMAで転送中．転送中はSPIを取得したままにする
+static bool flush_in_flight = false;
+static int64_t refr_start_us;
+static lvgl_frame_stats_t frame_stats;
+
+// 秒の切り替え．時計(gettimeofday)の秒の境界でesp_timerがタスクを起こす
+static void (*flip_prepare_func)(time_t next_sec) = nullptr;
+static void (*flip_func)(time_t sec) = nullptr;
+static bool (*flip_active_func)() = nullptr;
+static esp_timer_handle_t flip_timer = nullptr;
+// 境界でタイマが与える．LVGLの描画ユニットがタスク通知を使うので，通知とは別にする
+static SemaphoreHandle_t flip_sem = nullptr;
+static time_t flip_last_sec = 0;
+static lvgl_flip_stats_t flip_stats;
+
 
 static uint32_t my_tick_function() 
 {
@@ -25,35 +77,274 @@ static uint32_t my_tick_function()
 }
 
 
+/**
+ * @brief 転送中のDMAの完了を待ち，SPIを解放する．転送中でなければ何もしない
+ */
+static void flush_finish()
+{
+    if( !flush_in_flight )
+    {
+        return;
+    }
+    int64_t t0 = esp_timer_get_time();
+    M5.Display.waitDMA();
+    M5.Display.endWrite();
+    frame_stats.dma_wait_us += (uint32_t)(esp_timer_get_time() - t0);
+    spi_mutex.unlock(SPI_CLIENT_LCD);
+    flush_in_flight = false;
+}
+
+
 static void my_display_flush(lv_display_t *disp, const lv_area_t *area, uint8_t *px_map) 
 {
     uint32_t w = (area->x2 - area->x1 + 1);
     uint32_t h = (area->y2 - area->y1 + 1);
 
     lv_draw_sw_rgb565_swap(px_map, w*h);
+    frame_stats.flushes++;
     // SDカードとLCDがSPIを共有しているので排他制御が必要
-    spi_mutex.lock();
+    // SDカードの書き込みはチャンク毎にSPIを解放するので，待ちは1チャンク分で済む
+    if( lv_display_is_double_buffered(disp) )
+    {
+        // 転送を始めるだけで戻り，完了はmy_flush_wait()で待つ．
+        // その間にLVGLはもう一方のバッファに次の領域を描画する
+        flush_finish();
+        spi_mutex.lock(SPI_CLIENT_LCD);
+        M5.Display.startWrite();
+        M5.Display.pushImageDMA<uint16_t>(area->x1, area->y1, w, h, (uint16_t *)px_map);
+        flush_in_flight = true;
+        return;
+    }
+    spi_mutex.lock(SPI_CLIENT_LCD);
     M5.Display.pushImageDMA<uint16_t>(area->x1, area->y1, w, h, (uint16_t *)px_map);
-    spi_mutex.unlock();
+    M5.Display.waitDMA();
+    spi_mutex.unlock(SPI_CLIENT_LCD);
     lv_disp_flush_ready(disp);
 }
 
 
+/**
+ * @brief LVGLが描画バッファを再び使う前に呼ばれる．DMAの完了を待つ
+ */
+static void my_flush_wait(lv_display_t *disp)
+{
+    flush_finish();
+}
+
+
+/**
+ * @brief 画面の更新の開始と終了で呼ばれる．更新に要した時間を測る
+ *
+ * 最後の領域の転送はここで待ち，更新の合間にSPIを保持したままにならないようにする．
+ */
+static void my_refr_event(lv_event_t *e)
+{
+    if( lv_event_get_code(e) == LV_EVENT_REFR_START )
+    {
+        refr_start_us = esp_timer_get_time();
+        return;
+    }
+    flush_finish();
+    uint32_t dt = (uint32_t)(esp_timer_get_time() - refr_start_us);
+    frame_stats.frames++;
+    frame_stats.total_us += dt;
+    if( dt > frame_stats.max_us )
+    {
+        frame_stats.max_us = dt;
+    }
+}
+
+
 static void my_touchpad_read(lv_indev_t * drv, lv_indev_data_t * data) 
 {
-    // M5.update();
-    auto count = M5.Touch.getCount();
+    // loop()のM5.update()で読んだ状態を使う．ここではI2Cを読まない
+    portENTER_CRITICAL(&touch_mux);
+    bool pressed = touch_pressed;
+    data->point.x = touch_x;
+    data->point.y = touch_y;
+    portEXIT_CRITICAL(&touch_mux);
+
+    data->state = pressed ? LV_INDEV_STATE_PRESSED : LV_INDEV_STATE_RELEASED;
+}
+
+
+static int64_t wall_time_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void flip_timer_cb(void *arg)
+{
+    xSemaphoreGive(flip_sem);
+}
+
+
+/**
+ * @brief 切り替えた秒の遅れを統計に加える
+ *
+ * @param sec 切り替えた秒
+ * @param wake_us 境界からタスクが起きた時刻までの遅れ(us)
+ * @param late 境界を過ぎてから切り替えた
+ */
+static void flip_record(time_t sec, int64_t wake_us, bool late)
+{
+    int64_t elapsed = wall_time_us() - (int64_t)sec * 1000000;
+    uint32_t dt = (uint32_t)(elapsed > 0 ? elapsed : 0);
 
-    if ( count == 0 ) 
+    // 時計を合わせた直後などで秒が飛んだ時は数えない
+    if( flip_last_sec != 0 && sec == flip_last_sec + 1 )
     {
-        data->state = LV_INDEV_STATE_RELEASED;
-    } 
-    else 
+        if( flip_stats.flips == 0 || dt < flip_stats.min_us )
+        {
+            flip_stats.min_us = dt;
+        }
+        flip_stats.flips++;
+        flip_stats.last_us = dt;
+        flip_stats.total_us += dt;
+        if( dt > flip_stats.max_us )
+        {
+            flip_stats.max_us = dt;
+        }
+        if( wake_us > (int64_t)flip_stats.max_wake_us )
+        {
+            flip_stats.max_wake_us = (uint32_t)wake_us;
+        }
+        if( late )
+        {
+            flip_stats.late++;
+        }
+    }
+    flip_last_sec = sec;
+}
+
+
+/**
+ * @brief 次の秒の境界が近ければ，境界まで待って秒を切り替える
+ *
+ * @param wait_ms この後に待つ予定の時間(ms)
+ * @return uint32_t この後に待つ時間(ms)．切り替えた時は0
+ *
+ * 境界の前にprepareで次の秒の表示を用意し，画面の更新を止めて境界を待つ．
+ * 境界でflipを呼んで表示を替え，lv_refr_now()ですぐに描画と転送を行う．
+ * 待つ前に境界を過ぎていれば，すぐに切り替えて遅れとして数える．
+ * activeがfalseを返す間(時計が画面に無い間)は何もしない．
+ */
+static uint32_t flip_second(uint32_t wait_ms)
+{
+    int64_t now = wall_time_us();
+    time_t sec = (time_t)(now / 1000000);
+    int64_t to_boundary = (int64_t)(sec + 1) * 1000000 - now;
+    bool late = false;
+    bool active = true;
+
+    if( flip_active_func != nullptr )
+    {
+        lv_lock();
+        active = flip_active_func();
+        lv_unlock();
+    }
+    if( !active )
+    {
+        // 戻った時に秒が飛ぶので，遅れとして数えない
+        flip_last_sec = 0;
+        return wait_ms;
+    }
+
+    if( flip_last_sec != 0 && sec > flip_last_sec )
+    {
+        // 境界を待てなかった
+        late = true;
+    }
+    else if( to_boundary <= LVGL_FLIP_GUARD_US + (int64_t)wait_ms * 1000 )
+    {
+        lv_lock();
+        if( flip_prepare_func != nullptr )
+        {
+            flip_prepare_func(sec + 1);
+        }
+        lv_unlock();
+
+        to_boundary = (int64_t)(sec + 1) * 1000000 - wall_time_us();
+        if( to_boundary > 0 )
+        {
+            // 止め損ねたタイマの残りを捨てる
+            xSemaphoreTake(flip_sem, 0);
+            esp_timer_start_once(flip_timer, to_boundary);
+            if( xSemaphoreTake(flip_sem, pdMS_TO_TICKS(to_boundary / 1000 + 10)) != pdTRUE )
+            {
+                esp_timer_stop(flip_timer);
+            }
+        }
+        // esp_timerと時計の進みは僅かに違うので，早く起きた時は時計が次の秒になるまで待つ
+        int64_t spin_end = esp_timer_get_time() + LVGL_FLIP_SPIN_MAX_US;
+        while( wall_time_us() < (int64_t)(sec + 1) * 1000000 && esp_timer_get_time() < spin_end )
+        {
+        }
+        sec++;
+    }
+    else
+    {
+        return wait_ms;
+    }
+
+    int64_t wake_us = wall_time_us() - (int64_t)sec * 1000000;
+    lv_lock();
+    if( late && flip_prepare_func != nullptr )
     {
-        auto touch = M5.Touch.getDetail(0);
-        data->state = LV_INDEV_STATE_PRESSED; 
-        data->point.x = touch.x;
-        data->point.y = touch.y;
+        flip_prepare_func(sec);
+    }
+    flip_func(sec);
+    lv_refr_now(display);
+    flip_record(sec, wake_us, late);
+    lv_unlock();
+    return 0;
+}
+
+
+/**
+ * @brief LVGLのタスク
+ *
+ * @param param 未使用
+ *
+ * 他のタスクから送られた要求，画面の定期処理，LVGLのタイマを順に処理する．
+ * 描画中はlv_lock()を取得しているので，他のタスクはlvgl_lock()を取ってからLVGLを操作すること．
+ * lvgl_set_second_flip()を設定すると，秒の境界の直前は処理を止めて境界で秒を切り替える．
+ */
+static void lvgl_task(void *param)
+{
+    lvgl_post_t post;
+    uint32_t wait_ms;
+
+    for( ;; )
+    {
+        lv_lock();
+        while( xQueueReceive(post_queue, &post, 0) == pdTRUE )
+        {
+            post.func(post.arg);
+        }
+        if( ui_loop_func != nullptr )
+        {
+            ui_loop_func();
+        }
+        wait_ms = lv_timer_handler();
+        lv_unlock();
+
+        if( wait_ms > LVGL_TASK_PERIOD_MS )
+        {
+            wait_ms = LVGL_TASK_PERIOD_MS;
+        }
+        if( flip_func != nullptr )
+        {
+            wait_ms = flip_second(wait_ms);
+            if( wait_ms == 0 )
+            {
+                continue;
+            }
+        }
+        vTaskDelay(wait_ms > 0 ? pdMS_TO_TICKS(wait_ms) : 1);
     }
 }
 
@@ -68,6 +359,7 @@ void lvgl_setup()
     // DMA対応ヒープからバッファを割り当て
     size_t buffer_size = HOR_RES * VER_RES / DISPBUF_DIVIDE * BYTES_PER_PIXEL;
     uint8_t *buf1 = (uint8_t*)heap_caps_aligned_alloc(4, buffer_size, MALLOC_CAP_DMA);
+    uint8_t *buf2 = nullptr;
   
     // Serial.printf("Allocated DMA buffer at %p, size: %d bytes\r\n", buf1, buffer_size);
     // DISPBUF_DIVIDEが10のときに，15360バイト割り当てられるはず．
@@ -78,11 +370,179 @@ void lvgl_setup()
         return;
     }
 
-    lv_display_set_buffers(display, buf1, nullptr, buffer_size, LV_DISPLAY_RENDER_MODE_PARTIAL);
+    if( DISPBUF_DOUBLE )
+    {
+        buf2 = (uint8_t*)heap_caps_aligned_alloc(4, buffer_size, MALLOC_CAP_DMA);
+        if( buf2 == nullptr )
+        {
+            Serial.println("Failed to allocate 2nd DMA buffer");
+        }
+    }
+
+    lv_display_set_buffers(display, buf1, buf2, buffer_size, LV_DISPLAY_RENDER_MODE_PARTIAL);
     lv_display_set_flush_cb(display, my_display_flush);
+    lv_display_set_flush_wait_cb(display, my_flush_wait);
+    lv_display_add_event_cb(display, my_refr_event, LV_EVENT_REFR_START, nullptr);
+    lv_display_add_event_cb(display, my_refr_event, LV_EVENT_REFR_READY, nullptr);
 
     indev = lv_indev_create();
     lv_indev_set_type(indev, LV_INDEV_TYPE_POINTER);
     lv_indev_set_read_cb(indev, my_touchpad_read);
 }
 
+
+/**
+ * @brief 画面の更新に要した時間の統計を取得する
+ *
+ * @param stats 統計の格納先
+ * @param reset trueなら取得後に統計を消去する
+ */
+void lvgl_get_frame_stats(lvgl_frame_stats_t *stats, bool reset)
+{
+    *stats = frame_stats;
+    stats->double_buffered = lv_display_is_double_buffered(display);
+    if( reset )
+    {
+        memset(&frame_stats, 0, sizeof(frame_stats));
+    }
+}
+
+
+/**
+ * @brief 秒の境界で表示を切り替える関数を設定する．lvgl_start_task()の前に呼ぶ
+ *
+ * @param prepare 境界の少し前に次の秒を引数にして呼ぶ．次の表示を用意しておく．NULLなら呼ばない
+ * @param flip 境界でその秒を引数にして呼ぶ．用意した表示に替える．その直後に画面を更新する
+ * @param active 切り替える表示が画面に出ていればtrueを返す．falseの間は境界を待たない．NULLなら常に切り替える
+ *
+ * どれもLVGLのタスクから呼び，LVGLを操作してよい．
+ */
+void lvgl_set_second_flip(void (*prepare)(time_t next_sec), void (*flip)(time_t sec), bool (*active)())
+{
+    if( flip_sem == nullptr )
+    {
+        flip_sem = xSemaphoreCreateBinary();
+        if( flip_sem == nullptr )
+        {
+            ESP_LOGE("LVGL", "Failed to create flip semaphore");
+            return;
+        }
+    }
+    if( flip_timer == nullptr )
+    {
+        esp_timer_create_args_t args = {};
+        args.callback = flip_timer_cb;
+        args.name = "lvgl_flip";
+        if( esp_timer_create(&args, &flip_timer) != ESP_OK )
+        {
+            ESP_LOGE("LVGL", "Failed to create flip timer");
+            return;
+        }
+    }
+    flip_prepare_func = prepare;
+    flip_active_func = active;
+    flip_func = flip;
+}
+
+
+/**
+ * @brief 秒の切り替えの遅れの統計を取得する
+ *
+ * @param stats 統計の格納先
+ * @param reset trueなら取得後に統計を消去する
+ */
+void lvgl_get_flip_stats(lvgl_flip_stats_t *stats, bool reset)
+{
+    *stats = flip_stats;
+    if( reset )
+    {
+        memset(&flip_stats, 0, sizeof(flip_stats));
+    }
+}
+
+
+/**
+ * @brief LVGLのタスクを起動する．lvgl_setup()と画面の準備の後に呼ぶ
+ *
+ * @param ui_loop LVGLのタスクから定期的に呼ぶ関数(画面の更新など)．NULLなら呼ばない
+ * @return int 成功すれば0，失敗すれば-1
+ *
+ * 起動後はloop()でlv_timer_handler()を呼ばないこと．
+ */
+int lvgl_start_task(void (*ui_loop)())
+{
+    if( lvgl_task_handle != nullptr )
+    {
+        return 0;
+    }
+    post_queue = xQueueCreate(LVGL_POST_QUEUE_LEN, sizeof(lvgl_post_t));
+    if( post_queue == nullptr )
+    {
+        ESP_LOGE("LVGL", "Failed to create post queue");
+        return -1;
+    }
+    ui_loop_func = ui_loop;
+    xTaskCreatePinnedToCore(lvgl_task, "LVGL", LVGL_TASK_STACK, NULL, LVGL_TASK_PRIORITY, &lvgl_task_handle, LVGL_TASK_CORE);
+    if( lvgl_task_handle == nullptr )
+    {
+        ESP_LOGE("LVGL", "Failed to create LVGL task");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief LVGLのタスクで関数を呼ぶように要求する．描画を待たずにすぐ戻る
+ *
+ * @param func LVGLのタスクで呼ぶ関数．LVGLを操作してよい
+ * @param arg funcに渡す引数
+ * @return int 受け付ければ0，待ち行列が一杯かタスクが起動していなければ-1
+ */
+int lvgl_post(void (*func)(void *arg), void *arg)
+{
+    lvgl_post_t post = { func, arg };
+
+    if( post_queue == nullptr || xQueueSend(post_queue, &post, 0) != pdTRUE )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief LVGLを操作する前に取得する．描画中なら終わるまで待つ
+ *
+ * 同じタスクから重ねて取得してよい．
+ */
+void lvgl_lock()
+{
+    lv_lock();
+}
+
+
+void lvgl_unlock()
+{
+    lv_unlock();
+}
+
+
+/**
+ * @brief タッチパネルの状態を設定する．M5.update()の後に呼ぶ
+ *
+ * @param pressed 触れていればtrue
+ * @param x X座標
+ * @param y Y座標
+ */
+void lvgl_set_touch(bool pressed, int16_t x, int16_t y)
+{
+    portENTER_CRITICAL(&touch_mux);
+    touch_pressed = pressed;
+    if( pressed )
+    {
+        touch_x = x;
+        touch_y = y;
+    }
+    portEXIT_CRITICAL(&touch_mux);
+}
@@ -1,7 +1,42 @@
-
 #ifndef LVGL_SETUP_H
 #define LVGL_SETUP_H
 
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief 画面の更新に要した時間の統計
+ */
+typedef struct {
+    uint32_t frames;            // 更新の回数
+    uint32_t flushes;           // 転送した領域の数
+    uint32_t total_us;          // 更新に要した時間の合計(描画と転送，us)
+    uint32_t max_us;            // 1回の更新に要した最長時間(us)
+    uint32_t dma_wait_us;       // DMAの完了を待った時間の合計(us)
+    bool double_buffered;       // 描画バッファが2つ
+} lvgl_frame_stats_t;
+
+/**
+ * @brief 秒の切り替えの遅れの統計．遅れは秒の境界から，切り替えた画面の転送が終わるまで
+ */
+typedef struct {
+    uint32_t flips;             // 切り替えの回数
+    uint32_t late;              // 境界の前に待ち始められず，境界を過ぎてから切り替えた回数
+    uint32_t last_us;           // 最後の切り替えの遅れ(us)
+    uint32_t min_us;            // 最短の遅れ(us)
+    uint32_t max_us;            // 最長の遅れ(us)
+    uint32_t total_us;          // 遅れの合計(us)
+    uint32_t max_wake_us;       // 境界からタスクが起きるまでの最長の遅れ(us)
+} lvgl_flip_stats_t;
+
 extern void lvgl_setup();
+extern int lvgl_start_task(void (*ui_loop)());
+extern int lvgl_post(void (*func)(void *arg), void *arg);
+extern void lvgl_lock();
+extern void lvgl_unlock();
+extern void lvgl_set_touch(bool pressed, int16_t x, int16_t y);
+extern void lvgl_get_frame_stats(lvgl_frame_stats_t *stats, bool reset);
+extern void lvgl_set_second_flip(void (*prepare)(time_t next_sec), void (*flip)(time_t sec), bool (*active)());
+extern void lvgl_get_flip_stats(lvgl_flip_stats_t *stats, bool reset);
 
 #endif // LVGL_SETUP_H
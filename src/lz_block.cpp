@@ -0,0 +1,327 @@
+/**
+ * @file lz_block.cpp
+ * @author amagai
+ * @brief ログ用のブロック圧縮
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * LZ4のブロック形式で圧縮・展開する．
+ * 圧縮対象のデータの直前に辞書(直前のブロック)を置いた連続領域(window)を渡す．
+ * 作業領域はハッシュテーブル(LZB_TABLE_SIZE)だけで，ヒープは使わない．
+ * ファームウエアとPC側のツールの両方から使う．
+ */
+
+#include <string.h>
+
+#include "lz_block.h"
+
+#define LZB_MIN_MATCH 4
+#define LZB_LAST_LITERALS 5         // 最後の5バイトは必ずリテラル
+#define LZB_MF_LIMIT 12             // 最後の12バイト以内からはマッチを始めない
+#define LZB_MAX_OFFSET 65535
+#define LZB_EMPTY 0xffff
+
+
+static uint32_t lzb_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static uint32_t lzb_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZB_HASH_LOG);
+}
+
+
+/**
+ * @brief 長さを255単位の追加バイトで書き込む
+ *
+ * @param op 書き込み先
+ * @param len 長さ
+ * @return uint8_t* 書き込み後の位置
+ */
+static uint8_t *lzb_put_length(uint8_t *op, size_t len)
+{
+    while( len >= 255 )
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+
+/**
+ * @brief シーケンス(リテラルとマッチ)を1つ書き込む
+ *
+ * @param op 書き込み先
+ * @param op_end 書き込み先の終端
+ * @param lit リテラルの先頭
+ * @param lit_len リテラルの長さ
+ * @param offset マッチの距離．0ならマッチ無し(最後のシーケンス)
+ * @param match_len マッチの長さ
+ * @return uint8_t* 書き込み後の位置．書き込み先が足りない場合はNULL
+ */
+static uint8_t *lzb_put_sequence(uint8_t *op, uint8_t *op_end, const uint8_t *lit, size_t lit_len,
+                                 size_t offset, size_t match_len)
+{
+    uint8_t *token;
+    size_t ml = (offset > 0) ? match_len - LZB_MIN_MATCH : 0;
+
+    // 最悪の場合の長さで容量を確認する
+    if( op + 1 + lit_len / 255 + 1 + lit_len + 2 + ml / 255 + 1 > op_end )
+    {
+        return NULL;
+    }
+    token = op++;
+    *token = (uint8_t)(((lit_len < 15) ? lit_len : 15) << 4);
+    if( lit_len >= 15 )
+    {
+        op = lzb_put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if( offset == 0 )
+    {
+        return op;
+    }
+
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    *token |= (uint8_t)((ml < 15) ? ml : 15);
+    if( ml >= 15 )
+    {
+        op = lzb_put_length(op, ml - 15);
+    }
+    return op;
+}
+
+
+/**
+ * @brief ブロックを圧縮する
+ *
+ * @param window 辞書と圧縮対象のデータを連結した領域
+ * @param dict_len 辞書の長さ．圧縮対象はwindow + dict_lenから始まる
+ * @param src_len 圧縮対象の長さ
+ * @param dst 圧縮データの書き込み先
+ * @param dst_capacity dstのサイズ
+ * @param table 作業用のハッシュテーブル(LZB_TABLE_SIZEバイト)
+ * @return size_t 圧縮後の長さ．dstに収まらない場合は0
+ */
+size_t lzb_compress(const uint8_t *window, size_t dict_len, size_t src_len,
+                    uint8_t *dst, size_t dst_capacity, uint16_t *table)
+{
+    const uint8_t *src = window + dict_len;
+    const uint8_t *end = src + src_len;
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *mf_limit = end - LZB_MF_LIMIT;
+    const uint8_t *match_limit = end - LZB_LAST_LITERALS;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_capacity;
+    const uint8_t *p;
+
+    if( dict_len + src_len > LZB_MAX_WINDOW )
+    {
+        return 0;
+    }
+    memset(table, 0xff, LZB_TABLE_SIZE);
+
+    if( src_len >= LZB_MF_LIMIT + 1 )
+    {
+        // 辞書の内容をハッシュテーブルに登録する
+        for( p = window; p + LZB_MIN_MATCH <= src; p++ )
+        {
+            table[lzb_hash(lzb_read32(p))] = (uint16_t)(p - window);
+        }
+
+        while( ip < mf_limit )
+        {
+            uint32_t h = lzb_hash(lzb_read32(ip));
+            uint16_t ref = table[h];
+            const uint8_t *m;
+            size_t len;
+
+            table[h] = (uint16_t)(ip - window);
+            if( ref == LZB_EMPTY )
+            {
+                ip++;
+                continue;
+            }
+            m = window + ref;
+            if( (size_t)(ip - m) > LZB_MAX_OFFSET || lzb_read32(m) != lzb_read32(ip) )
+            {
+                ip++;
+                continue;
+            }
+
+            // 後方に伸ばす
+            while( ip > anchor && m > window && ip[-1] == m[-1] )
+            {
+                ip--;
+                m--;
+            }
+            // 前方に伸ばす
+            len = LZB_MIN_MATCH;
+            while( ip + len < match_limit && ip[len] == m[len] )
+            {
+                len++;
+            }
+
+            op = lzb_put_sequence(op, op_end, anchor, ip - anchor, ip - m, len);
+            if( op == NULL )
+            {
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+            if( ip < mf_limit )
+            {
+                table[lzb_hash(lzb_read32(ip - 2))] = (uint16_t)(ip - 2 - window);
+            }
+        }
+    }
+
+    // 最後のリテラル
+    op = lzb_put_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    if( op == NULL )
+    {
+        return 0;
+    }
+    return op - dst;
+}
+
+
+/**
+ * @brief ブロックを展開する
+ *
+ * @param src 圧縮データ
+ * @param src_len 圧縮データの長さ
+ * @param window 辞書の後ろに展開する領域．dict_len + raw_sizeバイト必要
+ * @param dict_len 辞書の長さ．展開データはwindow + dict_lenに書き込まれる
+ * @param raw_size 展開後の長さ
+ * @return int 成功すれば0，データが壊れていれば-1
+ */
+int lzb_decompress(const uint8_t *src, size_t src_len, uint8_t *window, size_t dict_len, size_t raw_size)
+{
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = src + src_len;
+    uint8_t *op = window + dict_len;
+    uint8_t *op_end = op + raw_size;
+    size_t len, offset;
+    uint8_t token, b;
+
+    while( ip < ip_end )
+    {
+        token = *ip++;
+
+        // リテラル
+        len = token >> 4;
+        if( len == 15 )
+        {
+            do
+            {
+                if( ip >= ip_end )
+                {
+                    return -1;
+                }
+                b = *ip++;
+                len += b;
+            } while( b == 255 );
+        }
+        if( ip + len > ip_end || op + len > op_end )
+        {
+            return -1;
+        }
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if( ip >= ip_end )
+        {
+            break;      // 最後のシーケンス
+        }
+
+        // マッチ
+        if( ip + 2 > ip_end )
+        {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        len = token & 0x0f;
+        if( len == 15 )
+        {
+            do
+            {
+                if( ip >= ip_end )
+                {
+                    return -1;
+                }
+                b = *ip++;
+                len += b;
+            } while( b == 255 );
+        }
+        len += LZB_MIN_MATCH;
+        if( offset == 0 || offset > (size_t)(op - window) || op + len > op_end )
+        {
+            return -1;
+        }
+        // 重なりがあり得るので1バイトずつコピーする
+        while( len-- > 0 )
+        {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+    return (op == op_end) ? 0 : -1;
+}
+
+
+/**
+ * @brief ヘッダ付きのフレームを作る
+ *
+ * @param window 辞書と圧縮対象のデータを連結した領域
+ * @param dict_len 辞書の長さ．0ならキーフレームになる
+ * @param src_len 圧縮対象の長さ(LZB_MAX_RAW_SIZE以下)
+ * @param frame フレームの書き込み先(LZB_MAX_FRAME_SIZEバイト)
+ * @param table 作業用のハッシュテーブル(LZB_TABLE_SIZEバイト)
+ * @return size_t フレームの長さ．src_lenが大きすぎる場合は0
+ *
+ * 圧縮で小さくならない場合は，そのまま格納する．
+ */
+size_t lzb_encode_frame(const uint8_t *window, size_t dict_len, size_t src_len,
+                        uint8_t *frame, uint16_t *table)
+{
+    lzb_frame_header_t header;
+    uint8_t *payload = frame + sizeof(header);
+    size_t n;
+
+    if( src_len > LZB_MAX_RAW_SIZE )
+    {
+        return 0;
+    }
+    header.magic = LZB_MAGIC;
+    header.version = LZB_VERSION;
+    header.flags = (dict_len == 0) ? LZB_FLAG_KEYFRAME : 0;
+    header.raw_size = (uint16_t)src_len;
+    header.reserved = 0;
+    header.crc = crc32_update(0, window + dict_len, src_len);
+
+    n = lzb_compress(window, dict_len, src_len, payload, src_len, table);
+    if( n == 0 )
+    {
+        // 圧縮できないのでそのまま格納する．辞書を使わないのでキーフレームになる．
+        memcpy(payload, window + dict_len, src_len);
+        n = src_len;
+        header.flags = LZB_FLAG_STORED | LZB_FLAG_KEYFRAME;
+    }
+    header.payload_size = (uint16_t)n;
+    memcpy(frame, &header, sizeof(header));
+    return sizeof(header) + n;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file lz_block.h
+ * @author amagai
+ * @brief ログ用のブロック圧縮
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 圧縮データの形式はLZ4のブロック形式と同じ．
+ * 直前のブロックを辞書として使うことで，小さなブロックでも圧縮率を確保する．
+ *
+ * ファイルはフレームの並びで，各フレームはヘッダと圧縮データからなる．
+ * キーフレームは直前のブロックに依存しないので，壊れたフレームがあっても
+ * 次のキーフレームから展開を再開できる．途中で切れたファイルは，
+ * 最後の完全なフレームまで展開できる．
+ * PC側の展開ツールはtools/nmea_unpackにある．
+ */
+#ifndef LZ_BLOCK_H
+#define LZ_BLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "crc32.h"
+
+#define LZB_MAGIC 0x315a4c4e        // "NLZ1"
+#define LZB_VERSION 1
+#define LZB_FLAG_STORED 0x01        // 圧縮せずにそのまま格納
+#define LZB_FLAG_KEYFRAME 0x02      // 直前のブロックを辞書として使っていない
+#define LZB_MAX_RAW_SIZE 4096       // 1フレームの最大データ長
+#define LZB_HASH_LOG 12             // ハッシュテーブルのサイズ(2^12エントリ)
+// 辞書込みで扱える最大長
+#define LZB_MAX_WINDOW (LZB_MAX_RAW_SIZE * 2)
+// 圧縮後の最大長．圧縮できないデータは格納に切り替えるので，ヘッダ分だけ増える．
+#define LZB_MAX_FRAME_SIZE (sizeof(lzb_frame_header_t) + LZB_MAX_RAW_SIZE)
+// 作業用のハッシュテーブルのバイト数
+#define LZB_TABLE_SIZE ((1 << LZB_HASH_LOG) * sizeof(uint16_t))
+
+#pragma pack(push, 1)
+/**
+ * @brief フレームヘッダ
+ */
+typedef struct {
+    uint32_t magic;             // LZB_MAGIC
+    uint8_t version;            // LZB_VERSION
+    uint8_t flags;              // LZB_FLAG_*
+    uint16_t raw_size;          // 展開後のバイト数
+    uint16_t payload_size;      // ヘッダに続く圧縮データのバイト数
+    uint16_t reserved;
+    uint32_t crc;               // 展開後のデータのCRC-32
+} lzb_frame_header_t;
+#pragma pack(pop)
+
+size_t lzb_compress(const uint8_t *window, size_t dict_len, size_t src_len,
+                    uint8_t *dst, size_t dst_capacity, uint16_t *table);
+int lzb_decompress(const uint8_t *src, size_t src_len, uint8_t *window, size_t dict_len, size_t raw_size);
+size_t lzb_encode_frame(const uint8_t *window, size_t dict_len, size_t src_len,
+                        uint8_t *frame, uint16_t *table);
+
+#endif // LZ_BLOCK_H
@@ -18,15 +18,93 @@
 #define GNSS_RX_PIN 13
 #define GNSS_TX_PIN 14
 
+// タッチパネル(FT6336)の割り込み．触れている間Lになる
+#define TOUCH_INT_PIN 39
+// 1にするとタッチパネルの割り込みが無い間はM5.update()の間隔を空ける
+#define TOUCH_IRQ_ENABLE 1
+// 触れていない間のボタン(電源ボタン)の読み出し間隔(ms)
+#define BUTTON_POLL_INTERVAL_MS 100
+// 1にすると時計の秒を時刻の秒の境界で切り替える．境界の直前は画面の更新を止めて境界を待つ
+#define CLOCK_FLIP_ON_SECOND 1
+
 // 1にするとGNSSモジュールのシリアル通信をM5StackのSerialに接続する．
 // PCからu-centerでGNSSモジュールにアクセスしたい場合には1にする．
 // 0はデバッグ用で，GNSSモジュールのデータをM5StackのSerialに流さない．
 #define GNSS_BYPASS 1
 
+// ログファイルのローテーション設定．
+// 周期はUTCの時刻境界で切り替わる．0にするとその条件ではローテーションしない．
+#define LOG_ROTATION_PERIOD_SEC 3600
+#define LOG_ROTATION_MAX_BYTES (64 * 1024 * 1024)
+
+// 1にするとIMUデータをバイナリ形式で記録する．0ならCSV形式．
+// バイナリ形式はtools/imu_decodeでCSVに変換できる．
+#define IMU_LOG_BINARY 1
+
+// IMUのサンプリングレート(Hz)．10ならポーリング．
+// 100, 200, 400, 800, 1600ならBMI270のFIFOをまとめて読み出す．
+#define IMU_SAMPLE_RATE_HZ 400
+
+// IMUのサンプルをUTCに揃った格子にリサンプルする間隔(us)．0ならリサンプルしない．
+// 1秒を割り切る値にする(例: 10000なら毎秒0msから10ms毎)．FIFOを使う場合だけ有効．
+#define IMU_RESAMPLE_PERIOD_US 0
+
+// 1にするとNMEAログを圧縮して記録する．
+// 圧縮したファイル(.nlz)はtools/nmea_unpackで展開できる．
+#define NMEA_LOG_COMPRESS 1
+
+// IMUデータを記録するレート(Hz)．0ならサンプリングレートのまま．
+// サンプリングレートを割り切る値にする．IMU_LOG_DECIMで指定した方法で間引く．
+#define IMU_LOG_RATE_HZ 0
+// 間引きの方法．IMU_DECIM_FIR または IMU_DECIM_CIC
+#define IMU_LOG_DECIM IMU_DECIM_FIR
+// 間引きの前に通すローパスのカットオフ周波数(Hz)．0なら通さない
+#define IMU_LOG_LOWPASS_HZ 0
+
+// 1にすると加速度の振動スペクトルを解析し，特徴量を/vibに記録する．FIFOを使う場合だけ有効．
+#define VIB_ANALYZER_ENABLE 1
+// 振動スペクトルの平均と記録の間隔(秒)
+#define VIB_ANALYZER_PERIOD_SEC 10
+
+// 1にするとIMUのサンプル毎に姿勢を推定する(Madgwickフィルタ)
+#define AHRS_ENABLE 1
+// 姿勢推定の補正の強さ
+#define AHRS_BETA AHRS_DEFAULT_BETA
+// 姿勢を/ahrsに記録するレート(Hz)．0なら記録しない
+#define AHRS_LOG_RATE_HZ 10
+// 磁気のオフセット(生の値)．本体の周りの磁性体による方位のずれを補正する
+#define AHRS_MAG_OFFSET_X 0
+#define AHRS_MAG_OFFSET_Y 0
+#define AHRS_MAG_OFFSET_Z 0
+
+// 気圧と温度を/baroに記録するレート(Hz)．0なら記録しない．センサの出力は約26Hz
+#define BARO_LOG_RATE_HZ 25
+
+// 1にすると気圧とGNSSの高度から高度と昇降速度を推定し，/altに記録する
+#define ALT_FILTER_ENABLE 1
+// 1にすると高度の推定にIMUの鉛直加速度も使う(AHRS_ENABLEが1の場合だけ)
+#define ALT_FILTER_USE_IMU 1
+
+// 1にするとGNSSとIMUを組み合わせて位置を推定する．AHRS_ENABLEも1にすること
+#define GNSS_INS_ENABLE 1
+// 加速度で位置を更新するレート(Hz)
+#define GNSS_INS_RATE_HZ 100
+// 推定位置を/fusedに記録するレート(Hz)．0なら記録しない
+#define GNSS_INS_LOG_RATE_HZ 10
+// 磁気偏角(度)．東偏を正とする．東京付近は約-7.5度
+#define GNSS_INS_DECLINATION_DEG -7.5f
+
+// 1にすると起動時に書式化の速度を測定し，ターミナルに結果を出力する．
+#define FMT_BENCHMARK 0
+
+// 1にすると起動時にIMUのフィルタの速度を測定し，ターミナルに結果を出力する．
+#define IMU_FILTER_BENCHMARK 0
+
 #include <Arduino.h>
 #include <M5Unified.h>
 #include <time.h>
-#include <Adafruit_BMP280.h>
+#include <stdarg.h>
+#include <esp_timer.h>
 
 // #define LV_CONF_INCLUDE_SIMPLE
 #include <lvgl.h>
@@ -36,6 +114,9 @@
 #include "scrn_main.h"
 #include "scrn_shutdown.h"
 #include "scrn_terminal.h"
+#include "scrn_vib.h"
+#include "scrn_attitude.h"
+#include "scrn_diag.h"
 #include "screen_id.h"
 
 #include "nmea_parser.h"
@@ -44,9 +125,12 @@
 #include "sd_logger.h"
 #include "bus_mutex.h"
 #include "sensor_logger.h"
+#include "bmp280.h"
+#include "vib_analyzer.h"
+#include "fast_format.h"
 
-SimpleMutex i2c_mutex;
-SimpleMutex spi_mutex;
+BusArbiter i2c_mutex;
+BusArbiter spi_mutex;
 
 static const char* time_zone  = "JST-9";
 const int time_zone_offset = 9 * 3600; // JSTはUTC+9時間
@@ -57,16 +141,17 @@ system_status_t sys_status;
 static ScreenMain scrn_main;
 static ScreenShutdown scrn_shutdown;
 static ScreenTerminal scrn_terminal;
+static ScreenVib scrn_vib;
+static ScreenAttitude scrn_attitude;
+static ScreenDiag scrn_diag;
 
 // スクリーンマネージャのインスタンスを生成
 static ScreenManager scrn_manager;
 
 // 気圧センサ
 #define BMP280_SENSOR_ADDR 0x76
-// Core2ではWire1を使用．Coreの場合とは違うので注意．
-Adafruit_BMP280 bmp280(&Wire1);
-Adafruit_Sensor *bmp280_temp = bmp280.getTemperatureSensor();
-Adafruit_Sensor *bmp280_pres = bmp280.getPressureSensor();
+// BMI270と同じ内部I2Cバス(M5.In_I2C)に接続されている
+Bmp280 bmp280(BMP280_SENSOR_ADDR);
 
 // SDカードのNMEAロガー
 SDLogger *nmea_logger;
@@ -74,15 +159,212 @@ SDLogger *position_logger;
 
 // IMUロガー
 SensorLogger sensor_logger;
+VibAnalyzer vib_analyzer;
 
 // 1PPS タイムスタンパ
 volatile uint32_t ppsTimestamp = 0;
 static const int IRQ_LATENCY_US = 5; // 割り込み遅延時間（マイクロ秒）
 static const int ADJTIME_LATENCY_US = 10; // adjtimeで補正する時間（マイクロ秒）
 
+// IMUの時刻の校正用のPPSエッジ．ppsTimestampと違って途中でクリアしない
+volatile int64_t ppsEdgeMonoUs = 0;     // esp_timer_get_time()の値
+volatile uint32_t ppsEdgeCount = 0;
+
 void IRAM_ATTR onPPSInterrupt() 
 {
     ppsTimestamp = micros();  // PPS信号受信時のタイムスタンプ（マイクロ秒）
+    ppsEdgeMonoUs = esp_timer_get_time();
+    ppsEdgeCount++;
+}
+
+// タッチパネルの割り込みの回数
+volatile uint32_t touchIrqCount = 0;
+// M5.update()を呼んだ回数と，割り込みが無いので省いた回数
+static uint32_t touch_update_count = 0;
+static uint32_t touch_skip_count = 0;
+// loop()の1回の処理に要した最長時間(us)．delay()を除く
+static uint32_t loop_max_us = 0;
+
+void IRAM_ATTR onTouchInterrupt() 
+{
+    touchIrqCount++;
+}
+
+
+/**
+ * @brief タッチパネルとボタンの状態を更新する
+ *
+ * タッチパネルの割り込みがあった時，触れている間，離した直後はループ毎に読む．
+ * それ以外は電源ボタンのためにBUTTON_POLL_INTERVAL_MS毎にだけ読み，I2Cバスを空ける．
+ *
+ * @return true M5.update()を呼んだ．ボタンのwasPressed()などはこの時だけ有効
+ * @return false 読むのを省いた
+ */
+static bool input_update()
+{
+#if TOUCH_IRQ_ENABLE
+    static uint32_t prev_irq_count = 0;
+    static uint32_t prev_update_ms = 0;
+    uint32_t irq_count = touchIrqCount;
+    uint32_t now_ms = millis();
+
+    if( irq_count == prev_irq_count && digitalRead(TOUCH_INT_PIN) == HIGH
+        && M5.Touch.getCount() == 0 && now_ms - prev_update_ms < BUTTON_POLL_INTERVAL_MS )
+    {
+        touch_skip_count++;
+        return false;
+    }
+    prev_irq_count = irq_count;
+    prev_update_ms = now_ms;
+#endif
+    i2c_mutex.lock(I2C_CLIENT_UI);
+    M5.update();
+    i2c_mutex.unlock(I2C_CLIENT_UI);
+    touch_update_count++;
+
+    // LVGLのタスクに渡す
+    if( M5.Touch.getCount() > 0 )
+    {
+        auto touch = M5.Touch.getDetail(0);
+        lvgl_set_touch(true, touch.x, touch.y);
+    }
+    else
+    {
+        lvgl_set_touch(false, 0, 0);
+    }
+    return true;
+}
+
+
+/**
+ * @brief 新しいPPSエッジがあれば，IMUロガーに通知する
+ * 
+ * PPSで同期している時だけ通知する．エッジのUTCの秒は，現在のシステム時刻から
+ * エッジの時点まで戻した時刻に最も近い秒とする．
+ */
+static void notify_pps_edge()
+{
+    static uint32_t prev_count = 0;
+    uint32_t count;
+    int64_t edge_us;
+    int64_t now_mono_us;
+    int64_t edge_utc_us;
+    struct timeval tv;
+
+    // 64bitの値は割り込みと競合しうるので，カウントが変わらない間に読めたものを使う
+    do
+    {
+        count = ppsEdgeCount;
+        edge_us = ppsEdgeMonoUs;
+    } while( count != ppsEdgeCount );
+
+    if( count == prev_count )
+    {
+        return;
+    }
+    prev_count = count;
+    if( sys_status.sync_state != SYNC_STATE_PPS )
+    {
+        return;
+    }
+
+    now_mono_us = esp_timer_get_time();
+    gettimeofday(&tv, NULL);
+    if( now_mono_us - edge_us > 500000 )
+    {
+        return;     // 古すぎて秒が曖昧
+    }
+    edge_utc_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - (now_mono_us - edge_us);
+    sensor_logger.add_pps_edge(edge_us, (edge_utc_us + 500000) / 1000000);
+}
+
+
+/**
+ * @brief LVGLのタスクで呼ぶ画面の更新．lvgl_post()で送る
+ */
+static void ui_led_trigger(void *arg)
+{
+    scrn_main.led_trigger();
+}
+
+
+static void ui_sync_state(void *arg)
+{
+    scrn_main.set_sync_state((int)(intptr_t)arg);
+}
+
+
+static void ui_sdcard_status(void *arg)
+{
+    scrn_main.set_sdcard_status((int)(intptr_t)arg);
+}
+
+
+static void ui_screen(void *arg)
+{
+    scrn_manager.change_screen((int)(intptr_t)arg, SCREEN_ANIM_NONE);
+}
+
+
+/**
+ * @brief 画面を切り替える．描画を待たない
+ */
+static void ui_change_screen(int id)
+{
+    lvgl_post(ui_screen, (void *)(intptr_t)id);
+}
+
+
+/**
+ * @brief 時計の同期状態の表示を更新する．描画を待たない
+ */
+static void ui_set_sync_state(int state)
+{
+    lvgl_post(ui_sync_state, (void *)(intptr_t)state);
+}
+
+
+/**
+ * @brief SDカードの状態の表示を更新する．描画を待たない．変わった時だけ送る
+ */
+static void ui_set_sdcard_status(int status)
+{
+    static int posted = -1;
+
+    if( status != posted && lvgl_post(ui_sdcard_status, (void *)(intptr_t)status) == 0 )
+    {
+        posted = status;
+    }
+}
+
+
+/**
+ * @brief 秒の境界の前と境界でLVGLのタスクから呼ばれる．時計の表示を用意して替える．メイン画面が出ている間だけ呼ばれる
+ */
+static void ui_prepare_second(time_t next_sec)
+{
+    scrn_main.prepare_second(next_sec);
+}
+
+
+static void ui_flip_second(time_t sec)
+{
+    scrn_main.flip_second(sec);
+}
+
+
+static bool ui_clock_active()
+{
+    return scrn_main.is_active();
+}
+
+
+/**
+ * @brief LVGLのタスクから定期的に呼ばれる
+ */
+static void ui_loop()
+{
+    scrn_manager.loop();
 }
 
 
@@ -94,22 +376,28 @@ void IRAM_ATTR onPPSInterrupt()
  */
 void term_log(const char* msg, bool timestamp = true)
 {
+    static FmtDateTime datetime('/', ' ');
     struct timeval tv;
     struct tm tm;
+    char buf[256];
+    int n;
 
+    lvgl_lock();
     if( !timestamp ) 
     {
         scrn_terminal.println(msg);
     }
     else 
     {
+        // 他のタスクの出力と混ざらないように，1行にまとめてから出力する
         gettimeofday(&tv, NULL);
         localtime_r(&tv.tv_sec, &tm);
-        scrn_terminal.printf("%04d/%02d/%02d %02d:%02d:%02d.%03ld\n%s\n",
-                tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-                tm.tm_hour, tm.tm_min, tm.tm_sec,
-                tv.tv_usec / 1000, msg);
+        n = fmt_format(buf, datetime(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                tm.tm_hour, tm.tm_min, tm.tm_sec, tv.tv_usec / 1000), '\n');
+        strlcpy(buf + n, msg, sizeof(buf) - n);
+        scrn_terminal.println(buf);
     }
+    lvgl_unlock();
 }
 
 
@@ -125,11 +413,11 @@ void rtc_read(struct tm *tm)
 
     do
     {
-        i2c_mutex.lock();
+        i2c_mutex.lock(I2C_CLIENT_RTC);
         M5.Rtc.getDate(&DateStruct);
         M5.Rtc.getTime(&TimeStruct);
         M5.Rtc.getDate(&DateStruct2);
-        i2c_mutex.unlock();
+        i2c_mutex.unlock(I2C_CLIENT_RTC);
     }while( DateStruct.date != DateStruct2.date);
 
     tm->tm_year = DateStruct.year - 1900;
@@ -176,10 +464,10 @@ void rtc_write(struct tm *tm)
     TimeStruct.minutes = tm->tm_min;
     TimeStruct.seconds = tm->tm_sec;
 
-    i2c_mutex.lock();
+    i2c_mutex.lock(I2C_CLIENT_RTC);
     M5.Rtc.setDate(&DateStruct);
     M5.Rtc.setTime(&TimeStruct);
-    i2c_mutex.unlock();
+    i2c_mutex.unlock(I2C_CLIENT_RTC);
 }
 
 
@@ -226,6 +514,7 @@ static void sys_status_init(system_status_t *status)
     nmea_init_gga(&status->gga_data);
     status->sync_state = SYNC_STATE_NONE;
     status->shutdown_request = 0;
+    status->alt_valid = 0;
 }
 
 
@@ -245,7 +534,7 @@ void rmc_to_systime(nmea_rmc_data_t *rmc)
 
     if( !rmc->data_valid ) 
     {
-        scrn_main.set_sync_state(0);
+        ui_set_sync_state(0);
         return; // データが無効な場合は何もしない
     }
 
@@ -321,18 +610,161 @@ void rmc_to_systime(nmea_rmc_data_t *rmc)
         // Serial.printf("System time set to: %s", ctime(&tv.tv_sec));
         if( ppsLatency > 0 )
         {
-            scrn_main.set_sync_state(2);        // PPS有効
+            ui_set_sync_state(2);        // PPS有効
             sys_status.sync_state = SYNC_STATE_PPS;
         }
         else
         {
-            scrn_main.set_sync_state(1);        // PPS無効
+            ui_set_sync_state(1);        // PPS無効
             sys_status.sync_state = SYNC_STATE_GNSS;
         }
     }
 }
 
 
+#if FMT_BENCHMARK
+/**
+ * @brief 書式化の速度を測定する
+ * 
+ * 位置データとIMUデータの1レコード分の書式化に要するCPUサイクル数を，
+ * snprintf()とfast_format.hで比較してターミナルに出力する．
+ */
+void fmt_benchmark()
+{
+    const int N = 1000;
+    static FmtDateTime iso_time('-', 'T');
+    char buf[256];
+    volatile int sink = 0;
+    uint32_t c0, c1, c2;
+    double lat = 35.6812362, lon = 139.7671248, alt = 40.12, hdop = 0.71;
+    float a = -0.0123f, g = 123.456f;
+
+    // 位置データ
+    c0 = ESP.getCycleCount();
+    for( int i = 0; i < N; i++ )
+    {
+        sink += snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ,%.7f,%.7f,%.2f,%d,%d,%.2f\n",
+                2025, 9, 20, 5, 51, i % 60, 0, lat + i * 1e-7, lon, alt, 1, 12, hdop);
+    }
+    c1 = ESP.getCycleCount();
+    for( int i = 0; i < N; i++ )
+    {
+        sink += fmt_format(buf, iso_time(2025, 9, 20, 5, 51, i % 60, 0), "Z,", fmt_fixed<7>(lat + i * 1e-7), ',',
+                fmt_fixed<7>(lon), ',', fmt_fixed<2>(alt), ',', 1, ',', 12, ',', fmt_fixed<2>(hdop), '\n');
+    }
+    c2 = ESP.getCycleCount();
+    scrn_terminal.printf("fmt pos: printf %u, fast %u cyc\n", (c1 - c0) / N, (c2 - c1) / N);
+
+    // IMUデータ
+    c0 = ESP.getCycleCount();
+    for( int i = 0; i < N; i++ )
+    {
+        sink += snprintf(buf, sizeof(buf), "%ld.%06ld,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d,%d\n",
+                1758347487L, (long)i * 1000, (unsigned)i, a, a, a + i * 0.001f, g, g, g, -120, 35, 410);
+    }
+    c1 = ESP.getCycleCount();
+    for( int i = 0; i < N; i++ )
+    {
+        sink += fmt_format(buf, 1758347487L, '.', fmt_zero<6>(i * 1000), ',', (unsigned)i, ',',
+                fmt_fixed<3>(a), ',', fmt_fixed<3>(a), ',', fmt_fixed<3>(a + i * 0.001f), ',',
+                fmt_fixed<3>(g), ',', fmt_fixed<3>(g), ',', fmt_fixed<3>(g), ',', -120, ',', 35, ',', 410, '\n');
+    }
+    c2 = ESP.getCycleCount();
+    scrn_terminal.printf("fmt imu: printf %u, fast %u cyc\n", (c1 - c0) / N, (c2 - c1) / N);
+}
+#endif
+
+
+#if IMU_FILTER_BENCHMARK
+/**
+ * @brief IMUのフィルタの速度を測定する
+ * 
+ * 各段の処理に要する1チャネル1サンプルあたりのCPUサイクル数をターミナルに出力する．
+ * biquadと積和は，esp-dspを使った場合とCでの実装を比較する．
+ */
+void imu_filter_benchmark()
+{
+    const int N = 256;
+    static float data[IMU_FILTER_CHANNELS][N];
+    float *ch[IMU_FILTER_CHANNELS];
+    float coef[5] = { 0.02f, 0.04f, 0.02f, -1.56f, 0.64f };
+    float w[2] = { 0.0f, 0.0f };
+    const float lsb[IMU_FILTER_CHANNELS] = {
+        IMU_ACCEL_SCALE, IMU_ACCEL_SCALE, IMU_ACCEL_SCALE,
+        IMU_GYRO_SCALE, IMU_GYRO_SCALE, IMU_GYRO_SCALE,
+    };
+    volatile float sink = 0.0f;
+    uint32_t c0, c1, c2;
+
+    for( int c = 0; c < IMU_FILTER_CHANNELS; c++ )
+    {
+        ch[c] = data[c];
+        for( int i = 0; i < N; i++ )
+        {
+            data[c][i] = (int16_t)(i * 37 + c * 1000) * lsb[c];
+        }
+    }
+
+    // biquad
+    c0 = ESP.getCycleCount();
+    imu_filter_biquad(data[0], data[0], N, coef, w);
+    c1 = ESP.getCycleCount();
+    imu_filter_biquad_scalar(data[1], data[1], N, coef, w);
+    c2 = ESP.getCycleCount();
+    scrn_terminal.printf("biquad: %s %u, c %u cyc\n", IMU_FILTER_USE_DSP ? "dsp" : "c", (c1 - c0) / N, (c2 - c1) / N);
+
+    // 33タップの積和
+    c0 = ESP.getCycleCount();
+    for( int i = 0; i < N - 33; i++ )
+    {
+        sink += imu_filter_dot(&data[2][i], data[3], 33);
+    }
+    c1 = ESP.getCycleCount();
+    for( int i = 0; i < N - 33; i++ )
+    {
+        sink += imu_filter_dot_scalar(&data[2][i], data[3], 33);
+    }
+    c2 = ESP.getCycleCount();
+    scrn_terminal.printf("dot33: %s %u, c %u cyc\n", IMU_FILTER_USE_DSP ? "dsp" : "c", (c1 - c0) / (N - 33), (c2 - c1) / (N - 33));
+
+    // 各段(6チャネル分を処理して1チャネルあたりに換算)
+    ImuFilter fir(1600);
+    ImuFilter cic(1600);
+    ImuFilter lpf(1600);
+    fir.add_fir_decimator(4, 0);
+    cic.add_cic_decimator(8, 3, lsb);
+    lpf.add_lowpass(100.0f, 0.7071f);
+    c0 = ESP.getCycleCount();
+    fir.process(ch, N);
+    c1 = ESP.getCycleCount();
+    cic.process(ch, N);
+    c2 = ESP.getCycleCount();
+    scrn_terminal.printf("fir/4: %u, cic/8: %u cyc/smp\n",
+            (c1 - c0) / (N * IMU_FILTER_CHANNELS), (c2 - c1) / (N * IMU_FILTER_CHANNELS));
+    c0 = ESP.getCycleCount();
+    lpf.process(ch, N);
+    c1 = ESP.getCycleCount();
+    scrn_terminal.printf("lpf: %u cyc/smp\n", (c1 - c0) / (N * IMU_FILTER_CHANNELS));
+
+    // 姿勢推定(1回の更新あたり)
+    Ahrs ahrs(1600);
+    ahrs.update(0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 300.0f, 0.0f, -400.0f);
+    c0 = ESP.getCycleCount();
+    for( int i = 0; i < N; i++ )
+    {
+        ahrs.update_imu(data[3][i], data[4][i], data[5][i], data[0][i], data[1][i], 1.0f);
+    }
+    c1 = ESP.getCycleCount();
+    for( int i = 0; i < N; i++ )
+    {
+        ahrs.update(data[3][i], data[4][i], data[5][i], data[0][i], data[1][i], 1.0f, 300.0f, 0.0f, -400.0f);
+    }
+    c2 = ESP.getCycleCount();
+    scrn_terminal.printf("ahrs: 6-axis %u, 9-axis %u cyc\n", (c1 - c0) / N, (c2 - c1) / N);
+}
+#endif
+
+
 /**
  * @brief RMC, GGAデータから位置情報をSDカードに記録する
  * 
@@ -345,16 +777,17 @@ void rmc_to_systime(nmea_rmc_data_t *rmc)
  */
 void log_position_data(nmea_rmc_data_t *rmc_data, nmea_gga_data_t *gga_data)
 {
+    static FmtDateTime iso_time('-', 'T');
+
     if( position_logger->get_status() == SD_STATUS_READY )
     {
-        char log_line[128];
+        char log_line[192];
         int n;
-        n = snprintf(log_line, sizeof(log_line), 
-        "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ,%.7f,%.7f,%.2f,%d,%d,%.2f\n",
-        rmc_data->date_year, rmc_data->date_month, rmc_data->date_day,
-        gga_data->time_hour, gga_data->time_minute, gga_data->time_second, gga_data->time_millisecond,
-        gga_data->latitude, gga_data->longitude, gga_data->altitude,
-        gga_data->fix_type, gga_data->num_sats, gga_data->hdop);
+        n = fmt_format(log_line,
+        iso_time(rmc_data->date_year, rmc_data->date_month, rmc_data->date_day,
+        gga_data->time_hour, gga_data->time_minute, gga_data->time_second, gga_data->time_millisecond),
+        "Z,", fmt_fixed<7>(gga_data->latitude), ',', fmt_fixed<7>(gga_data->longitude), ',', fmt_fixed<2>(gga_data->altitude),
+        ',', gga_data->fix_type, ',', gga_data->num_sats, ',', fmt_fixed<2>(gga_data->hdop), '\n');
 
         position_logger->write_data((uint8_t *)log_line, n);
 //        Serial.printf("Position: %s\r\n", log_line);
@@ -387,6 +820,12 @@ void gnss_parse_nmea_line(char *line)
             sys_status.gps_status = new_gga.fix_type; // GPSの状態を更新
             sys_status.gps_satellites = new_gga.num_sats; // 使用衛星数を更新
             log_position_data(&sys_status.rmc_data, &new_gga); // 位置情報をSDカードに記録
+            // 同じ時刻のRMCがあれば対地速度と合わせてGNSS/INSに渡す
+            gnss_fix_t fix;
+            if( gnss_ins_fix_from_nmea(&sys_status.rmc_data, &new_gga, &fix) == 0 )
+            {
+                sensor_logger.add_gnss_fix(fix);
+            }
         }
     }
     else if( line[1] == 'G' && line[3] == 'G' && line[4] == 'S' && line[5] == 'V' )
@@ -406,7 +845,7 @@ void gnss_parse_nmea_line(char *line)
         }
         else 
         {
-            scrn_main.set_sync_state(0); // 測位できていない場合は同期状態を0に
+            ui_set_sync_state(0); // 測位できていない場合は同期状態を0に
         }
         ppsTimestamp = 0;
         sys_status.update_count++; // 更新回数をインクリメント
@@ -427,11 +866,19 @@ void gnss_poll()
     static int linestate = 0;
     static int ubx_payload_length = 0;
     char c;
+    uint8_t rawbuf[128];
+    int rawpos = 0;
 
     while( Serial1.available() )
     {
         c = Serial1.read();
-        nmea_logger->write_data((uint8_t *)&c, 1);
+        // 受信データはまとめてロガーに渡す
+        rawbuf[rawpos++] = c;
+        if( rawpos >= sizeof(rawbuf) )
+        {
+            nmea_logger->write_data(rawbuf, rawpos);
+            rawpos = 0;
+        }
         #if GNSS_BYPASS
         Serial.write(c); // GNSS_BYPASSが1の場合は受信したデータをそのままSerialに流す
         #endif
@@ -553,6 +1000,10 @@ void gnss_poll()
                 break;
         }
     }
+    if( rawpos > 0 )
+    {
+        nmea_logger->write_data(rawbuf, rawpos);
+    }
 }
 
 
@@ -562,6 +1013,18 @@ void gnss_poll()
  */
 void setup() 
 {
+    // I2Cバスのクライアント．IMUのサンプリングを最優先にする
+    // (番号, 名前, 優先度, 期限(us), 最大保持時間(us))
+    i2c_mutex.set_client(I2C_CLIENT_IMU, "imu", 4, 2000, 15000);
+    i2c_mutex.set_client(I2C_CLIENT_UI, "ui", 2, 20000, 1000);
+    i2c_mutex.set_client(I2C_CLIENT_STATUS, "status", 1, 100000, 2000);
+    i2c_mutex.set_client(I2C_CLIENT_RTC, "rtc", 1, 100000, 2000);
+    i2c_mutex.set_client(I2C_CLIENT_INIT, "init", 0, 0, 0);
+    // SPIバスのクライアント．LCDの転送を期限付きで優先し，SDカードの書き込みはチャンク毎に譲る
+    spi_mutex.set_client(SPI_CLIENT_LCD, "lcd", 2, 5000, 25000);
+    spi_mutex.set_client(SPI_CLIENT_SD, "sd", 1, 100000, 5000);
+    spi_mutex.set_client(SPI_CLIENT_SD_INFO, "sdinfo", 0, 0, 0);
+
     auto cfg = M5.config();
     M5.begin(cfg);
 
@@ -583,8 +1046,11 @@ void setup()
     rtc_to_system_time();
 
     // BMP280センサの初期化
-    unsigned status = bmp280.begin(BMP280_SENSOR_ADDR);
-    if (!status) 
+    M5.Lcd.print("Initializing BMP280...\n");
+    i2c_mutex.lock(I2C_CLIENT_INIT);
+    int status = bmp280.begin();
+    i2c_mutex.unlock(I2C_CLIENT_INIT);
+    if( status != 0 ) 
     {
         M5.Lcd.setTextColor(RED, BLACK);
         M5.Lcd.println("BMP280 not found!\n");
@@ -592,13 +1058,6 @@ void setup()
             delay(10);
     }
 
-    M5.Lcd.print("Initializing BMP280...\n");
-    bmp280.setSampling(Adafruit_BMP280::MODE_NORMAL,
-                  Adafruit_BMP280::SAMPLING_X2,
-                  Adafruit_BMP280::SAMPLING_X16,
-                  Adafruit_BMP280::FILTER_X16,
-                  Adafruit_BMP280::STANDBY_MS_500);
-
 
     Serial1.setRxBufferSize(1024);
     Serial1.begin(38400, SERIAL_8N1, GNSS_RX_PIN, GNSS_TX_PIN); // RX, TX
@@ -607,10 +1066,23 @@ void setup()
     ppsTimestamp = 0;
     pinMode(GNSS_PPS_PIN, INPUT);
     attachInterrupt(GNSS_PPS_PIN, onPPSInterrupt, RISING);  // PPS信号の立ち上がりで割り込み
+#if TOUCH_IRQ_ENABLE
+    pinMode(TOUCH_INT_PIN, INPUT);
+    attachInterrupt(TOUCH_INT_PIN, onTouchInterrupt, FALLING);  // 触れた時に割り込み
+#endif
+
+    // ログファイルのローテーション設定．全ロガーが同じ境界で切り替わる．
+    sd_set_rotation(LOG_ROTATION_MAX_BYTES, LOG_ROTATION_PERIOD_SEC);
 
     // NMEAロガーの初期化
     nmea_logger = new SDLogger();
     nmea_logger->set_prefix("/nmea");
+    #if NMEA_LOG_COMPRESS
+    if( nmea_logger->set_compression(true) == 0 )
+    {
+        nmea_logger->set_suffix(".nlz");
+    }
+    #endif
 
     // 位置ロガーの初期化
     position_logger = new SDLogger();
@@ -624,12 +1096,19 @@ void setup()
     scrn_shutdown.setup();
     scrn_shutdown.set_shutdown_request_ptr(&sys_status.shutdown_request);
     scrn_terminal.setup();
+    scrn_vib.setup();
+    scrn_attitude.setup();
+    scrn_attitude.set_sensor_logger(&sensor_logger);
+    scrn_diag.setup();
 
     // スクリーンマネージャにスクリーンを追加
     // 最初に追加したスクリーンが最初に表示されるスクリーンになる
     scrn_manager.add_screen(SCREEN_ID_MAIN, &scrn_main);
     scrn_manager.add_screen(SCREEN_ID_SHUTDOWN, &scrn_shutdown);
     scrn_manager.add_screen(SCREEN_ID_TERMINAL, &scrn_terminal);
+    scrn_manager.add_screen(SCREEN_ID_VIB, &scrn_vib);
+    scrn_manager.add_screen(SCREEN_ID_ATTITUDE, &scrn_attitude);
+    scrn_manager.add_screen(SCREEN_ID_DIAG, &scrn_diag);
 
     // IMUロガーの初期化
     M5.Lcd.print("Initializing BMI270...\n");
@@ -640,6 +1119,29 @@ void setup()
         while(1)
             delay(10);
     }
+    sensor_logger.set_sample_rate(IMU_SAMPLE_RATE_HZ);
+    sensor_logger.set_output_rate(IMU_LOG_RATE_HZ, IMU_LOG_DECIM, IMU_LOG_LOWPASS_HZ);
+    sensor_logger.set_resample_period(IMU_RESAMPLE_PERIOD_US);
+    sensor_logger.set_ahrs(AHRS_ENABLE, AHRS_BETA, AHRS_LOG_RATE_HZ);
+    sensor_logger.set_mag_offset(AHRS_MAG_OFFSET_X, AHRS_MAG_OFFSET_Y, AHRS_MAG_OFFSET_Z);
+    sensor_logger.set_baro(&bmp280, BARO_LOG_RATE_HZ);
+    sensor_logger.set_altitude(ALT_FILTER_ENABLE, ALT_FILTER_USE_IMU);
+    sensor_logger.set_gnss_ins(GNSS_INS_ENABLE, GNSS_INS_RATE_HZ, GNSS_INS_LOG_RATE_HZ, GNSS_INS_DECLINATION_DEG);
+    #if VIB_ANALYZER_ENABLE
+    vib_analyzer.set_log_period(VIB_ANALYZER_PERIOD_SEC);
+    sensor_logger.set_vib_analyzer(&vib_analyzer);
+    scrn_vib.set_analyzer(&vib_analyzer);
+    #endif
+    #if IMU_LOG_BINARY
+    sensor_logger.set_format(IMU_LOG_FORMAT_BINARY);
+    #endif
+    // サンプリングと推定は起動時から動かす．SDカードへの記録だけを同期後に始める
+    if( sensor_logger.start() != 0 )
+    {
+        M5.Lcd.setTextColor(RED, BLACK);
+        M5.Lcd.print("Sensor sampling failed!\n");
+        scrn_terminal.print("Sensor sampling failed!\n");
+    }
 
     if (sd_init() != 0) 
     {
@@ -661,6 +1163,24 @@ void setup()
     #if GNSS_BYPASS
         term_log("GNSS Bypass mode", false);
     #endif
+    #if FMT_BENCHMARK
+    fmt_benchmark();
+    #endif
+    #if IMU_FILTER_BENCHMARK
+    imu_filter_benchmark();
+    #endif
+
+    #if CLOCK_FLIP_ON_SECOND
+    lvgl_set_second_flip(ui_prepare_second, ui_flip_second, ui_clock_active);
+    #endif
+    // ここから先はLVGLのタスクが描画する．他のタスクからはlvgl_post()かlvgl_lock()を使う
+    if( lvgl_start_task(ui_loop) != 0 )
+    {
+        M5.Lcd.setTextColor(RED, BLACK);
+        M5.Lcd.println("LVGL task failed!\n");
+        while (1) 
+            delay(10);
+    }
     delay(1000);
 }
 
@@ -669,15 +1189,27 @@ void every_1s_task()
 {
     // 1秒毎に実行するタスク
 
-    // 温度センサデータの更新
-    sensors_event_t temp_event, pressure_event;
-    i2c_mutex.lock();
-    bmp280_temp->getEvent(&temp_event);
-    bmp280_pres->getEvent(&pressure_event);
+    // 温度センサデータの更新．気圧センサはサンプリングタスクが読んでいるので，その最新の値を使う
+    baro_record_t baro;
+    i2c_mutex.lock(I2C_CLIENT_STATUS);
     sys_status.battery_level = M5.Power.getBatteryLevel();
-    i2c_mutex.unlock();
-    sys_status.temp = temp_event.temperature;
-    sys_status.pressure = pressure_event.pressure;
+    i2c_mutex.unlock(I2C_CLIENT_STATUS);
+    if( sensor_logger.get_baro(&baro) == 0 )
+    {
+        sys_status.temp = baro.temp_centi / 100.0f;
+        sys_status.pressure = baro.pressure_q8 / 25600.0f;     // hPa
+    }
+    alt_output_t alt;
+    if( sensor_logger.get_altitude(&alt) == 0 )
+    {
+        sys_status.altitude = alt.altitude;
+        sys_status.vspeed = alt.vspeed;
+        sys_status.alt_valid = 1;
+    }
+    else
+    {
+        sys_status.alt_valid = 0;
+    }
     #if GNSS_BYPASS == 0
         Serial.printf("Batt: %d%%, Temp: %.2f C, Pressure: %.2f hPa\r\n", sys_status.battery_level, sys_status.temp, sys_status.pressure);
     #endif
@@ -688,15 +1220,235 @@ void every_1m_task()
     // 1分毎に実行するタスク
 }
 
+// 1時間毎の統計．LVGLのロックの外で書式化し，ターミナルにはまとめて出力する
+static char stats_buf[4096];
+static int stats_len = 0;
+
+
+/**
+ * @brief 1時間毎の統計に書式化した文字列を追加する．溢れた分は捨てる
+ * 
+ * @param format フォーマット文字列
+ * @param ... 可変長引数
+ */
+static void stats_printf(const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    if( stats_len >= (int)sizeof(stats_buf) - 1 )
+    {
+        return;
+    }
+    va_start(args, format);
+    n = vsnprintf(stats_buf + stats_len, sizeof(stats_buf) - stats_len, format, args);
+    va_end(args);
+    if( n > 0 )
+    {
+        stats_len += n;
+        if( stats_len > (int)sizeof(stats_buf) - 1 )
+        {
+            stats_len = sizeof(stats_buf) - 1;
+        }
+    }
+}
+
+
+/**
+ * @brief ロガーの書き込み統計を1時間毎の統計に追加する
+ * 
+ * @param snap 対象のロガーの統計の写し
+ */
+void log_logger_stats(const sd_logger_snapshot_t &snap)
+{
+    const sd_logger_stats_t &st = snap.stats;
+    uint32_t elapsed;
+
+    elapsed = (millis() - st.start_ms) / 1000;
+    if( elapsed == 0 )
+    {
+        elapsed = 1;
+    }
+    stats_printf("%s: %uKB %uB/s x%u.%u\n wr%ums risk%ums drop%u\n",
+            snap.prefix, st.bytes_written / 1024, st.bytes_written / elapsed,
+            st.bytes_written ? st.raw_bytes / st.bytes_written : 1,
+            st.bytes_written ? (unsigned)((st.raw_bytes * 10ULL / st.bytes_written) % 10) : 0,
+            st.max_write_us / 1000, st.max_risk_ms, st.dropped_bytes);
+}
+
+
+/**
+ * @brief 時間の分布を1時間毎の統計に1行で追加する
+ *
+ * @param name 行の見出し
+ * @param bins ビン毎の回数
+ */
+static void log_bus_hist(const char *name, const uint32_t *bins)
+{
+    char hist[BUS_ARBITER_HIST_BINS * 11 + 1];
+    int len = 0;
+
+    for( int j = 0; j < BUS_ARBITER_HIST_BINS; j++ )
+    {
+        len += snprintf(hist + len, sizeof(hist) - len, " %u", bins[j]);
+    }
+    stats_printf("  %s hist:%s\n", name, hist);
+}
+
+
+/**
+ * @brief バスのクライアント毎の待ち時間と保持時間を1時間毎の統計に追加する
+ *
+ * @param bus バスの名前
+ * @param arb バス
+ * @param num_clients クライアントの数
+ *
+ * wait hist，hold histはそれぞれ待ち時間，保持時間のビン毎の回数(16us未満, 32us未満, ... の順)．
+ */
+static void log_bus_stats(const char *bus, const BusArbiter *arb, int num_clients)
+{
+    bus_client_stats_t st;
+
+    for( int i = 0; i < num_clients; i++ )
+    {
+        if( arb->get_stats(i, &st) != 0 )
+        {
+            continue;
+        }
+        stats_printf("%s %s: %u, cont %u, defer %u, miss %u, wait %uus, hold %uus\n",
+                bus, arb->get_name(i), st.count, st.contended, st.deferred, st.deadline_miss,
+                st.max_wait_us, st.max_hold_us);
+        log_bus_hist("wait", st.wait_hist);
+        log_bus_hist("hold", st.hold_hist);
+    }
+}
+
+
 void every_1h_task()
 {
     // 1時間毎に実行するタスク
+    // 統計の収集とRTCの更新はLVGLのロックの外で行い，ターミナルへの出力だけをロックする
+    bool sd_stats = !sd_is_fault();
+
     // RTCを更新
     if( sys_status.sync_state != SYNC_STATE_NONE )
     {
         rtc_from_system_time();
         term_log("RTC updated");
     }
+
+    stats_len = 0;
+    stats_buf[0] = '\0';
+
+    // SDカードの書き込み統計
+    if( sd_stats )
+    {
+        sd_io_stats_t io = sd_io_get_stats();
+        stats_printf("cycles %u, max window %ums\n", io.cycles, io.max_window_us / 1000);
+        // 他のタスクが閉じるロガーは，持ち主のロックの下で写した統計だけを使う
+        sd_logger_snapshot_t snap;
+        if( nmea_logger->get_snapshot(&snap) == 0 )
+        {
+            log_logger_stats(snap);
+        }
+        if( position_logger->get_snapshot(&snap) == 0 )
+        {
+            log_logger_stats(snap);
+        }
+        for( int i = 0; i < SENSOR_LOG_NUM; i++ )
+        {
+            if( sensor_logger.get_log_snapshot(i, &snap) == 0 )
+            {
+                log_logger_stats(snap);
+            }
+        }
+        if( vib_analyzer.get_log_snapshot(&snap) == 0 )
+        {
+            log_logger_stats(snap);
+        }
+    }
+
+    // IMUのFIFOの統計
+    spsc_ring_stats_t fifo;
+    if( sensor_logger.get_fifo_stats(&fifo) == 0 )
+    {
+        stats_printf("imu fifo: max %u/%u, overflow %u\n", fifo.max_used, fifo.capacity, fifo.overflow);
+    }
+    bmi270_fifo_stats_t bmi;
+    if( sensor_logger.get_bmi270_stats(&bmi) == 0 )
+    {
+        stats_printf("bmi270: %u frames, %u bursts, %u i2c, skip %u\n",
+                bmi.frames, bmi.bursts, bmi.transactions, bmi.skipped);
+    }
+    imu_logger_stats_t lg;
+    if( sensor_logger.get_logger_stats(&lg) == 0 )
+    {
+        stats_printf("imu log: %u wakes (%u notified), %u writes\n", lg.wakes, lg.notified, lg.writes);
+        stats_printf("  batch avg %u max %u, hist", lg.batches ? lg.records / lg.batches : 0, lg.max_batch);
+        for( int i = 0; i < IMU_LOG_BATCH_HIST; i++ )
+        {
+            stats_printf(" %u", lg.batch_hist[i]);
+        }
+        stats_printf("\n");
+    }
+    if( vib_analyzer.is_running() )
+    {
+        spsc_ring_stats_t vq = vib_analyzer.get_queue_stats();
+        stats_printf("vib queue: max %u/%u, overflow %u\n", vq.max_used, vq.capacity, vq.overflow);
+    }
+    imu_clock_stats_t clk;
+    if( sensor_logger.get_clock_stats(&clk) == 0 )
+    {
+        stats_printf("imu clock: %d pts, %dppm, resid %dus, reset %u\n",
+                clk.points, (int)clk.rate_ppm, (int)clk.residual_us, clk.resets);
+    }
+    gnss_ins_stats_t ins;
+    if( sensor_logger.get_gnss_ins_stats(&ins) == 0 )
+    {
+        stats_printf("ins: %u fixes, rej %u, reset %u, gap %ds\n",
+                ins.fixes, ins.rejected, ins.resets, (int)ins.max_coast_sec);
+    }
+    alt_filter_stats_t alt;
+    if( sensor_logger.get_alt_stats(&alt) == 0 )
+    {
+        stats_printf("alt: %u baro, %u gnss, rej %u, reset %u\n",
+                alt.baro, alt.gnss, alt.rejected, alt.resets);
+    }
+    // タッチパネルの読み出しの回数(1秒あたり)．skipは割り込みが無いので省いた回数
+    stats_printf("touch: %u/s, skip %u/s\n", touch_update_count / 3600, touch_skip_count / 3600);
+    touch_update_count = 0;
+    touch_skip_count = 0;
+    stats_printf("loop: max %uus\n", loop_max_us);
+    loop_max_us = 0;
+    // 画面の更新に要した時間．dmaは描画を終えてDMAの完了を待った時間
+    lvgl_frame_stats_t fr;
+    lvgl_flip_stats_t fl;
+    lvgl_lock();
+    lvgl_get_frame_stats(&fr, true);
+    lvgl_get_flip_stats(&fl, true);
+    lvgl_unlock();
+    if( fr.frames > 0 )
+    {
+        stats_printf("lvgl %s: %u frames, avg %uus, max %uus, dma %uus\n",
+                fr.double_buffered ? "x2" : "x1", fr.frames, fr.total_us / fr.frames,
+                fr.max_us, fr.dma_wait_us / fr.frames);
+    }
+    // 秒の境界から時計を替えた画面の転送が終わるまでの遅れ
+    if( fl.flips > 0 )
+    {
+        stats_printf("flip: avg %uus, min %uus, max %uus, wake %uus, late %u\n",
+                fl.total_us / fl.flips, fl.min_us, fl.max_us, fl.max_wake_us, fl.late);
+    }
+    log_bus_stats("i2c", &i2c_mutex, I2C_NUM_CLIENTS);
+    log_bus_stats("spi", &spi_mutex, SPI_NUM_CLIENTS);
+
+    lvgl_lock();
+    if( sd_stats )
+    {
+        term_log("SD I/O stats");
+    }
+    scrn_terminal.print(stats_buf);
+    lvgl_unlock();
 }
 
 
@@ -707,17 +1459,17 @@ void loop()
     static uint32_t prev_sec = 0;
     uint32_t sec;
     static uint32_t sec_count = 0;
+    int64_t loop_start_us = esp_timer_get_time();
 
-    i2c_mutex.lock();
-    M5.update();
-    i2c_mutex.unlock();
+    bool input_updated = input_update();
 
     // PPS信号が来たらLEDを点灯
     if (ppsTimestamp != 0 && ppsTimestamp != prev_pps_timestamp) 
     {
-        scrn_main.led_trigger();
+        lvgl_post(ui_led_trigger, NULL);
         prev_pps_timestamp = ppsTimestamp;
     }
+    notify_pps_edge();
     gnss_poll();
 
     // Serialから入ったデータをそのままSerial1に流す
@@ -729,9 +1481,7 @@ void loop()
     }
     #endif
 
-    // LVGLのタスクハンドラを呼び出す.
-    lv_task_handler();
-    scrn_manager.loop();
+    // 画面の更新とLVGLのタスクハンドラはLVGLのタスクで動く(lvgl_start_task())
 
     // 毎秒1回の動作
     sec = millis() / 1000;
@@ -767,13 +1517,13 @@ void loop()
             // Serial.printf("Sync state changed: %d\r\n", sys_status.sync_state);
             nmea_logger->start();
             position_logger->start();
-            sensor_logger.start();
-            scrn_main.set_sdcard_status(2); // SDカード記録中
+            sensor_logger.start_logging();
+            ui_set_sdcard_status(2); // SDカード記録中
         }
     }
     else 
     {
-        scrn_main.set_sdcard_status(0); // SDカード利用不可
+        ui_set_sdcard_status(0); // SDカード利用不可
     }
 
     // シャットダウン要求があればシャットダウンする
@@ -790,21 +1540,31 @@ void loop()
         }
     }
 
-    // Bボタンが押されたらメイン画面へ，それ以外はシャットダウン画面へ
-    if (M5.BtnB.wasPressed()) {
-        scrn_manager.change_screen(SCREEN_ID_MAIN, SCREEN_ANIM_NONE);
-    } else if (M5.BtnA.wasPressed()) {
-        scrn_manager.change_screen(SCREEN_ID_TERMINAL, SCREEN_ANIM_NONE);
-    } else if (M5.BtnC.wasPressed()) {
-        scrn_manager.change_screen(SCREEN_ID_SHUTDOWN, SCREEN_ANIM_NONE);
-    }
-
-    // 電源ボタンが押されたらシャットダウン画面へ
-    if( M5.BtnPWR.wasClicked() ) 
+    // ボタンの状態はM5.update()を呼んだループでだけ見る．省いたループでは前回の押下が残っている
+    if( input_updated )
     {
-        scrn_manager.change_screen(SCREEN_ID_SHUTDOWN, SCREEN_ANIM_NONE);
+        // Bボタンが押されたらメイン画面へ，それ以外はシャットダウン画面へ
+        if (M5.BtnB.wasPressed()) {
+            ui_change_screen(SCREEN_ID_MAIN);
+        } else if (M5.BtnA.wasPressed()) {
+            ui_change_screen(SCREEN_ID_TERMINAL);
+        } else if (M5.BtnC.wasPressed()) {
+            ui_change_screen(SCREEN_ID_SHUTDOWN);
+        }
+
+        // 電源ボタンが押されたらシャットダウン画面へ
+        if( M5.BtnPWR.wasClicked() ) 
+        {
+            ui_change_screen(SCREEN_ID_SHUTDOWN);
+        }
     }
 
     prev_sync_state = sys_status.sync_state;
+
+    uint32_t loop_us = (uint32_t)(esp_timer_get_time() - loop_start_us);
+    if( loop_us > loop_max_us )
+    {
+        loop_max_us = loop_us;
+    }
     delay(10);
 }
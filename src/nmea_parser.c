@@ -614,6 +614,22 @@ int nmea_parse_rmc(const char *nmea_sentence, nmea_rmc_data_t *rmc_data)
         rmc_data->longitude = -rmc_data->longitude; // 西経の場合
     }   
 
+    // 対地速度と進路の抽出．停止中は進路が空になることがある
+    rmc_data->speed_knots = 0.0;
+    rmc_data->course_deg = 0.0;
+    rmc_data->course_valid = 0;
+    if (nmea_extract_field(nmea_sentence, 7, field, sizeof(field)) == 0 && field[0] != '\0') 
+    {
+        speed = atof(field);
+        rmc_data->speed_knots = speed;
+        if (nmea_extract_field(nmea_sentence, 8, field, sizeof(field)) == 0 && field[0] != '\0') 
+        {
+            course = atof(field);
+            rmc_data->course_deg = course;
+            rmc_data->course_valid = 1;
+        }
+    }
+
     // 日付の抽出 ddmmyy
     if (nmea_extract_field(nmea_sentence, 9, field, sizeof(field)) != 0) 
     {
@@ -79,6 +79,9 @@ typedef struct {
     double latitude;          // 緯度 (度)
     double longitude;         // 経度 (度)
     int fix_type;            // 測位タイプ
+    double speed_knots;      // 対地速度 (ノット)
+    double course_deg;       // 対地進路 (度，真北から時計回り)
+    int course_valid;        // 進路が出力されているか (1: 有効, 0: 無効)
 } nmea_rmc_data_t;
 
 
@@ -9,7 +9,10 @@ enum {
     SCREEN_ID_NONE = -1,
     SCREEN_ID_MAIN = 0,
     SCREEN_ID_SHUTDOWN,
-    SCREEN_ID_TERMINAL
+    SCREEN_ID_TERMINAL,
+    SCREEN_ID_VIB,
+    SCREEN_ID_ATTITUDE,
+    SCREEN_ID_DIAG
 };
 
 #endif // SCREEN_ID_H
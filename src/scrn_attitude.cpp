@@ -0,0 +1,220 @@
+/**
+ * @file scrn_attitude.cpp
+ * @author amagai
+ * @brief 方位と姿勢の画面
+ * @version 0.1
+ * @date 2025-10-18
+ * 
+ * @copyright Copyright (c) 2025
+ * 
+ * SensorLoggerの姿勢推定の結果を表示する．
+ * 左はコンパス．上がセンサのX軸の向きで，方位に合わせて文字盤が回る．
+ * 右は水平儀．ロールで水平線が傾き，ピッチで上下に動く．
+ */
+#include <math.h>
+#include "scrn_attitude.h"
+#include "fast_format.h"
+
+// コンパスの中心と文字の半径
+#define DIAL_CX 85
+#define DIAL_CY 130
+#define DIAL_SIZE 150
+#define DIAL_LABEL_R 60
+// 水平儀の大きさと，ピッチ1度あたりの移動量
+#define HORIZON_SIZE 120
+#define HORIZON_PX_PER_DEG 2.0f
+
+static const char *dir_names[4] = { "N", "E", "S", "W" };
+
+
+ScreenAttitude::ScreenAttitude()
+{
+    dial = nullptr;
+    horizon_box = nullptr;
+    horizon = nullptr;
+    label_heading = nullptr;
+    label_angles = nullptr;
+    label_status = nullptr;
+    logger = nullptr;
+    for( int i = 0; i < 4; i++ )
+    {
+        label_dir[i] = nullptr;
+    }
+}
+
+
+/**
+ * @brief セットアップ
+ * 
+ */
+void ScreenAttitude::setup()
+{
+    ScreenBase::setup();
+
+    lv_obj_set_style_bg_color(lv_screen, lv_color_make(0, 0, 0), 0);
+
+    label_heading = lv_label_create(lv_screen);
+    lv_obj_set_style_text_font(label_heading, &lv_font_montserrat_24, 0);
+    lv_obj_set_style_text_color(label_heading, lv_color_make(255, 255, 255), 0);
+    lv_label_set_text(label_heading, "HDG ---");
+    lv_obj_align(label_heading, LV_ALIGN_TOP_LEFT, 4, 4);
+
+    label_status = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_status, lv_color_make(160, 160, 160), 0);
+    lv_label_set_text(label_status, "");
+    lv_obj_align(label_status, LV_ALIGN_TOP_RIGHT, -4, 10);
+
+    // コンパスの文字盤
+    dial = lv_obj_create(lv_screen);
+    lv_obj_set_size(dial, DIAL_SIZE, DIAL_SIZE);
+    lv_obj_set_pos(dial, DIAL_CX - DIAL_SIZE / 2, DIAL_CY - DIAL_SIZE / 2);
+    lv_obj_set_style_radius(dial, LV_RADIUS_CIRCLE, 0);
+    lv_obj_set_style_bg_color(dial, lv_color_make(16, 16, 16), 0);
+    lv_obj_set_style_border_color(dial, lv_color_make(128, 128, 128), 0);
+    lv_obj_set_style_border_width(dial, 2, 0);
+    lv_obj_remove_flag(dial, LV_OBJ_FLAG_SCROLLABLE);
+    lv_obj_remove_flag(dial, LV_OBJ_FLAG_CLICKABLE);
+    for( int i = 0; i < 4; i++ )
+    {
+        label_dir[i] = lv_label_create(lv_screen);
+        lv_obj_set_style_text_color(label_dir[i], i == 0 ? lv_color_make(255, 64, 64) : lv_color_make(255, 255, 255), 0);
+        lv_label_set_text(label_dir[i], dir_names[i]);
+    }
+    // 上端の目印(センサのX軸の向き)
+    lv_obj_t *mark = lv_obj_create(lv_screen);
+    lv_obj_set_size(mark, 4, 14);
+    lv_obj_set_pos(mark, DIAL_CX - 2, DIAL_CY - DIAL_SIZE / 2 - 6);
+    lv_obj_set_style_bg_color(mark, lv_color_make(255, 200, 0), 0);
+    lv_obj_set_style_border_width(mark, 0, 0);
+    lv_obj_set_style_radius(mark, 0, 0);
+    lv_obj_remove_flag(mark, LV_OBJ_FLAG_SCROLLABLE);
+    lv_obj_remove_flag(mark, LV_OBJ_FLAG_CLICKABLE);
+
+    // 水平儀．枠の外にはみ出した水平線は描かれない
+    horizon_box = lv_obj_create(lv_screen);
+    lv_obj_set_size(horizon_box, HORIZON_SIZE, HORIZON_SIZE);
+    lv_obj_set_pos(horizon_box, 320 - HORIZON_SIZE - 16, DIAL_CY - HORIZON_SIZE / 2);
+    lv_obj_set_style_bg_color(horizon_box, lv_color_make(0, 64, 128), 0);
+    lv_obj_set_style_border_color(horizon_box, lv_color_make(128, 128, 128), 0);
+    lv_obj_set_style_border_width(horizon_box, 2, 0);
+    lv_obj_set_style_radius(horizon_box, 0, 0);
+    lv_obj_set_style_pad_all(horizon_box, 0, 0);
+    lv_obj_remove_flag(horizon_box, LV_OBJ_FLAG_SCROLLABLE);
+    lv_obj_remove_flag(horizon_box, LV_OBJ_FLAG_CLICKABLE);
+    horizon = lv_line_create(horizon_box);
+    lv_obj_set_style_line_width(horizon, 3, 0);
+    lv_obj_set_style_line_color(horizon, lv_color_make(255, 255, 255), 0);
+    horizon_points[0].x = 0;
+    horizon_points[0].y = HORIZON_SIZE / 2;
+    horizon_points[1].x = HORIZON_SIZE;
+    horizon_points[1].y = HORIZON_SIZE / 2;
+    lv_line_set_points(horizon, horizon_points, 2);
+
+    label_angles = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_angles, lv_color_make(255, 255, 255), 0);
+    lv_label_set_text(label_angles, "");
+    lv_obj_align(label_angles, LV_ALIGN_BOTTOM_RIGHT, -8, -8);
+
+    // スワイプジェスチャーの有効化
+    lv_obj_add_event_cb(lv_screen, callback, LV_EVENT_GESTURE, this);
+
+    lv_timer_create(callback_timer, 100, this);
+}
+
+
+void ScreenAttitude::loop()
+{
+}
+
+
+/**
+ * @brief 最新の姿勢で表示を更新する
+ * 
+ */
+void ScreenAttitude::update()
+{
+    ahrs_record_t rec;
+    char buf[64];
+    float w, x, y, z;
+    float roll, pitch, heading, sp;
+
+    if( logger == nullptr || logger->get_attitude(&rec) != 0 )
+    {
+        lv_label_set_text(label_status, "no data");
+        return;
+    }
+    w = rec.q[0] / (float)AHRS_Q_ONE;
+    x = rec.q[1] / (float)AHRS_Q_ONE;
+    y = rec.q[2] / (float)AHRS_Q_ONE;
+    z = rec.q[3] / (float)AHRS_Q_ONE;
+    sp = -2.0f * (x * z - w * y);
+    sp = (sp > 1.0f) ? 1.0f : (sp < -1.0f) ? -1.0f : sp;
+    roll = atan2f(w * x + y * z, 0.5f - x * x - y * y) * 57.29578f;
+    pitch = asinf(sp) * 57.29578f;
+    heading = rec.heading / 100.0f;
+
+    fmt_format(buf, "HDG ", fmt_fixed<1>(heading));
+    lv_label_set_text(label_heading, buf);
+    fmt_format(buf, "roll ", fmt_fixed<1>(roll), "  pitch ", fmt_fixed<1>(pitch));
+    lv_label_set_text(label_angles, buf);
+    lv_label_set_text(label_status, (rec.flags & AHRS_FLAG_MAG) ? "MAG" : "no mag");
+
+    // 文字盤の方位Nは，上から-heading度の位置
+    for( int i = 0; i < 4; i++ )
+    {
+        float a = (i * 90.0f - heading) * 0.017453293f;
+        int px = DIAL_CX + (int)(DIAL_LABEL_R * sinf(a));
+        int py = DIAL_CY - (int)(DIAL_LABEL_R * cosf(a));
+        lv_obj_set_pos(label_dir[i], px - 6, py - 8);
+    }
+
+    // 水平線．右に傾けると(ロール正)水平線は反時計回りに傾く
+    float c = cosf(roll * 0.017453293f);
+    float s = sinf(roll * 0.017453293f);
+    float cy = HORIZON_SIZE / 2 + pitch * HORIZON_PX_PER_DEG;
+    horizon_points[0].x = (int)(HORIZON_SIZE / 2 - HORIZON_SIZE * c);
+    horizon_points[0].y = (int)(cy + HORIZON_SIZE * s);
+    horizon_points[1].x = (int)(HORIZON_SIZE / 2 + HORIZON_SIZE * c);
+    horizon_points[1].y = (int)(cy - HORIZON_SIZE * s);
+    lv_line_set_points(horizon, horizon_points, 2);
+}
+
+
+void ScreenAttitude::callback(lv_event_t *e)
+{
+    lv_event_code_t code = lv_event_get_code(e);
+    ScreenAttitude *scrn = static_cast<ScreenAttitude *>(lv_event_get_user_data(e));
+    if (code == LV_EVENT_GESTURE)
+    {
+        lv_dir_t dir = lv_indev_get_gesture_dir(lv_indev_get_act());
+        scrn->on_swipe(dir);
+    }
+}
+
+
+void ScreenAttitude::callback_timer(lv_timer_t *timer)
+{
+    ScreenAttitude *scrn = static_cast<ScreenAttitude *>(lv_timer_get_user_data(timer));
+    if( scrn->is_active() )
+        scrn->update();
+}
+
+
+/**
+ * @brief スワイプ操作の処理
+ * 
+ * @param dir スワイプ方向
+ */
+void ScreenAttitude::on_swipe(lv_dir_t dir)
+{
+    if (dir == LV_DIR_LEFT)
+    {
+        // 左スワイプで振動スペクトルの画面へ
+        change_screen(SCREEN_ID_VIB, SCREEN_ANIM_LEFT);
+    }
+    else if (dir == LV_DIR_RIGHT)
+    {
+        // 右スワイプで診断画面へ
+        change_screen(SCREEN_ID_DIAG, SCREEN_ANIM_RIGHT);
+    }
+}
@@ -0,0 +1,42 @@
+/**
+ * @file scrn_attitude.h
+ * @author amagai
+ * @brief 方位と姿勢の画面
+ * @version 0.1
+ * @date 2025-10-18
+ * 
+ * @copyright Copyright (c) 2025
+ * 
+ */
+#ifndef SCRN_ATTITUDE_H
+#define SCRN_ATTITUDE_H
+
+#include "screen_base.h"
+#include "screen_id.h"
+#include "sensor_logger.h"
+
+class ScreenAttitude : public ScreenBase
+{
+protected:
+    lv_obj_t *dial;
+    lv_obj_t *label_dir[4];
+    lv_obj_t *horizon_box;
+    lv_obj_t *horizon;
+    lv_point_precise_t horizon_points[2];
+    lv_obj_t *label_heading;
+    lv_obj_t *label_angles;
+    lv_obj_t *label_status;
+    SensorLogger *logger;
+
+public:
+    ScreenAttitude();
+    void setup();
+    void loop();
+    void update();
+    static void callback(lv_event_t *e);
+    static void callback_timer(lv_timer_t *timer);
+    void on_swipe(lv_dir_t dir);
+    void set_sensor_logger(SensorLogger *l) { logger = l; }
+};
+
+#endif // SCRN_ATTITUDE_H
@@ -0,0 +1,130 @@
+/**
+ * @file scrn_diag.cpp
+ * @author amagai
+ * @brief 時計の表示の遅れと画面の更新の診断画面
+ * @version 0.1
+ * @date 2025-10-18
+ * 
+ * @copyright Copyright (c) 2025
+ * 
+ * 秒の境界から時計の表示を替えた画面の転送が終わるまでの遅れと，LVGLの画面の更新に要した時間を表示する．
+ * 統計はmain.cppの1時間毎の出力で消去されるので，その後の値になる．
+ * 転送後にLCDが画面を走査するまでの遅れ(最大1フレーム)は含まない．
+ */
+#include "scrn_diag.h"
+#include "lvgl_setup.h"
+#include "fast_format.h"
+
+
+ScreenDiag::ScreenDiag()
+{
+    label_title = nullptr;
+    label_flip = nullptr;
+    label_frame = nullptr;
+}
+
+
+/**
+ * @brief セットアップ
+ * 
+ */
+void ScreenDiag::setup()
+{
+    ScreenBase::setup();
+
+    lv_obj_set_style_bg_color(lv_screen, lv_color_make(0, 0, 0), 0);
+
+    label_title = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_title, lv_color_make(255, 255, 255), 0);
+    lv_label_set_text(label_title, "Diagnostics");
+    lv_obj_align(label_title, LV_ALIGN_TOP_LEFT, 4, 2);
+
+    label_flip = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_flip, lv_color_make(0, 255, 0), 0);
+    lv_label_set_text(label_flip, "clock flip: waiting");
+    lv_obj_align(label_flip, LV_ALIGN_TOP_LEFT, 4, 30);
+
+    label_frame = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_frame, lv_color_make(255, 200, 0), 0);
+    lv_label_set_text(label_frame, "lvgl: waiting");
+    lv_obj_align(label_frame, LV_ALIGN_TOP_LEFT, 4, 150);
+
+    // スワイプジェスチャーの有効化
+    lv_obj_add_event_cb(lv_screen, callback, LV_EVENT_GESTURE, this);
+
+    lv_timer_create(callback_timer, 1000, this);
+}
+
+
+void ScreenDiag::loop()
+{
+}
+
+
+/**
+ * @brief 統計を読んで表示を更新する
+ * 
+ */
+void ScreenDiag::update()
+{
+    lvgl_flip_stats_t fl;
+    lvgl_frame_stats_t fr;
+    char buf[192];
+
+    lvgl_get_flip_stats(&fl, false);
+    if( fl.flips > 0 )
+    {
+        fmt_format(buf, "clock flip latency\n",
+                "  last ", fl.last_us, " us\n",
+                "  avg  ", fl.total_us / fl.flips, " us\n",
+                "  min  ", fl.min_us, " us\n",
+                "  max  ", fl.max_us, " us\n",
+                "  wake max ", fl.max_wake_us, " us\n",
+                "  late ", fl.late, " / ", fl.flips);
+        lv_label_set_text(label_flip, buf);
+    }
+
+    lvgl_get_frame_stats(&fr, false);
+    if( fr.frames > 0 )
+    {
+        fmt_format(buf, "lvgl ", fr.double_buffered ? "x2" : "x1", ": ", fr.frames, " frames\n",
+                "  avg ", fr.total_us / fr.frames, " us, max ", fr.max_us, " us\n",
+                "  dma wait ", fr.dma_wait_us / fr.frames, " us");
+        lv_label_set_text(label_frame, buf);
+    }
+}
+
+
+void ScreenDiag::callback(lv_event_t *e)
+{
+    lv_event_code_t code = lv_event_get_code(e);
+    ScreenDiag *scrn = static_cast<ScreenDiag *>(lv_event_get_user_data(e));
+    if (code == LV_EVENT_GESTURE)
+    {
+        lv_dir_t dir = lv_indev_get_gesture_dir(lv_indev_get_act());
+        scrn->on_swipe(dir);
+    }
+}
+
+
+void ScreenDiag::callback_timer(lv_timer_t *timer)
+{
+    ScreenDiag *scrn = static_cast<ScreenDiag *>(lv_timer_get_user_data(timer));
+    if( scrn->is_active() )
+        scrn->update();
+}
+
+
+/**
+ * @brief スワイプ操作の処理
+ * 
+ * @param dir スワイプ方向
+ */
+void ScreenDiag::on_swipe(lv_dir_t dir)
+{
+    if (dir == LV_DIR_LEFT)
+    {
+        // 左スワイプで姿勢の画面へ
+        change_screen(SCREEN_ID_ATTITUDE, SCREEN_ANIM_LEFT);
+    }
+}
@@ -0,0 +1,34 @@
+/**
+ * @file scrn_diag.h
+ * @author amagai
+ * @brief 時計の表示の遅れと画面の更新の診断画面
+ * @version 0.1
+ * @date 2025-10-18
+ * 
+ * @copyright Copyright (c) 2025
+ * 
+ */
+#ifndef SCRN_DIAG_H
+#define SCRN_DIAG_H
+
+#include "screen_base.h"
+#include "screen_id.h"
+
+class ScreenDiag : public ScreenBase
+{
+protected:
+    lv_obj_t *label_title;
+    lv_obj_t *label_flip;
+    lv_obj_t *label_frame;
+
+public:
+    ScreenDiag();
+    void setup();
+    void loop();
+    void update();
+    static void callback(lv_event_t *e);
+    static void callback_timer(lv_timer_t *timer);
+    void on_swipe(lv_dir_t dir);
+};
+
+#endif // SCRN_DIAG_H
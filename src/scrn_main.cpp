@@ -7,9 +7,19 @@
 
 #include "scrn_main.h"
 #include "screen_id.h"
+#include "fast_format.h"
 
 LV_FONT_DECLARE(font_opensans_bold_48);
 
+// 値の再描画の最短間隔(ms)．GNSSの出力レートを上げても画面の更新の負荷が増えないようにする
+#define SCRN_MAIN_VALUE_INTERVAL_MS 500
+// 衛星配置の再描画の最短間隔(ms)
+#define SCRN_MAIN_SKY_INTERVAL_MS 1000
+// この時間(ms)GSVに出てこない衛星は衛星配置から消す
+#define SCRN_MAIN_SAT_STALE_MS 10000
+// 時計に出す秒の小数部の桁数(0〜3)．48ptの時計の右に衛星配置があるので，幅が収まるのは1桁まで
+#define SCRN_MAIN_CLOCK_FRAC_DIGITS 0
+
 void BoxLabel::init(lv_obj_t *parent, int x, int y, int w, int h, const char *text)
 {
     bkgrnd = lv_obj_create(parent);
@@ -52,11 +62,56 @@ void BoxLabel::init(lv_obj_t *parent, int x, int y, int w, int h, const char *te
 }
 
 
+void BoxLabel::apply_text2(const char *text)
+{
+    strlcpy(text2_shown, text, sizeof(text2_shown));
+    lv_label_set_text(label2, text2_shown);
+    last_set_ms = lv_tick_get();
+    pending = false;
+}
+
+
 /**
- * @brief 衛星配置のキャンバスを描画
+ * @brief 値を設定する．表示中と同じなら何もしない
+ * 
+ * @param text 値
  * 
+ * 前回の再描画から最短間隔が経っていなければ，値を覚えておいてupdate()で表示する．
  */
-void SatelliteDisplay::paint_canvas()
+void BoxLabel::set_text2(const char *text)
+{
+    if( strncmp(text, text2_shown, sizeof(text2_shown) - 1) == 0 )
+    {
+        pending = false;
+        return;
+    }
+    if( min_interval_ms > 0 && lv_tick_elaps(last_set_ms) < min_interval_ms )
+    {
+        strlcpy(text2_pending, text, sizeof(text2_pending));
+        pending = true;
+        return;
+    }
+    apply_text2(text);
+}
+
+
+/**
+ * @brief 待っている値があり，最短間隔が経っていれば表示する．画面のloop()から毎回呼ぶ
+ */
+void BoxLabel::update()
+{
+    if( pending && lv_tick_elaps(last_set_ms) >= min_interval_ms )
+    {
+        apply_text2(text2_pending);
+    }
+}
+
+
+/**
+ * @brief 格子(仰角0度と45度の円，東西と南北の線)を描き，背景として保存する．init()で1回だけ呼ぶ
+ * 
+ */
+void SatelliteDisplay::paint_background()
 {
     lv_canvas_init_layer(canvas, &layer);
     lv_canvas_fill_bg(canvas, lv_color_make(0x00, 0x00, 0x40), LV_OPA_COVER); // キャンバスの背景を暗い青に設定
@@ -94,62 +149,330 @@ void SatelliteDisplay::paint_canvas()
     line_dsc.p2.x = img_w / 2;
     line_dsc.p2.y = img_h;
     lv_draw_line(&layer, &line_dsc);
+    lv_canvas_finish_layer(canvas, &layer);
 
-    // 衛星の位置を描画
-    for( int i = 0; i < MAX_SATELLITES; i++ )
+    for( int y = 0; y < img_h; y++ )
+    {
+        memcpy(&bgbuf[y * img_w], &px[y * stride], img_w * sizeof(uint16_t));
+    }
+}
+
+
+/**
+ * @brief 衛星の印の範囲を求める
+ * 
+ * @param cx 中心のX座標(キャンバス上)
+ * @param cy 中心のY座標(キャンバス上)
+ * @param area 範囲の格納先．キャンバスの外は除く
+ * @return bool 範囲がキャンバスに掛かればtrue
+ */
+bool SatelliteDisplay::mark_area(int cx, int cy, lv_area_t *area)
+{
+    area->x1 = LV_MAX(cx - SAT_MARK_HALF, 0);
+    area->y1 = LV_MAX(cy - SAT_MARK_HALF, 0);
+    area->x2 = LV_MIN(cx + SAT_MARK_HALF, img_w - 1);
+    area->y2 = LV_MIN(cy + SAT_MARK_HALF, img_h - 1);
+    return area->x1 <= area->x2 && area->y1 <= area->y2;
+}
+
+
+/**
+ * @brief 範囲を背景に戻す
+ */
+void SatelliteDisplay::restore_area(const lv_area_t *area)
+{
+    int w = area->x2 - area->x1 + 1;
+
+    for( int y = area->y1; y <= area->y2; y++ )
     {
-        if( sat_positions[i][0] > 0 ) // PRNが設定されている衛星のみ描画
+        memcpy(&px[y * stride + area->x1], &bgbuf[y * img_w + area->x1], w * sizeof(uint16_t));
+    }
+}
+
+
+/**
+ * @brief 衛星の印(円)を描く．clipの外の画素は変えない
+ * 
+ * @param cx 中心のX座標(キャンバス上)
+ * @param cy 中心のY座標(キャンバス上)
+ * @param level SNRの段階(snr_level())
+ * @param clip 描く範囲
+ */
+void SatelliteDisplay::draw_mark(int cx, int cy, int level, const lv_area_t *clip)
+{
+    static const lv_color_t colors[3] = {
+        LV_COLOR_MAKE(0xff, 0x00, 0x00),    // 赤色
+        LV_COLOR_MAKE(0xff, 0xa5, 0x00),    // オレンジ色
+        LV_COLOR_MAKE(0x00, 0xff, 0x00),    // 緑色
+    };
+    uint16_t fg = lv_color_to_u16(colors[level]);
+    int fr = fg >> 11, fgr = (fg >> 5) & 0x3f, fb = fg & 0x1f;
+
+    for( int y = LV_MAX(cy - SAT_MARK_HALF, clip->y1); y <= LV_MIN(cy + SAT_MARK_HALF, clip->y2); y++ )
+    {
+        for( int x = LV_MAX(cx - SAT_MARK_HALF, clip->x1); x <= LV_MIN(cx + SAT_MARK_HALF, clip->x2); x++ )
         {
-            int x = img_w / 2 + sat_positions[i][1];
-            int y = img_h / 2 - sat_positions[i][2]; // Y座標は上方向が小さいので反転
-            // SNRに応じて色を変える
-            if( sat_positions[i][3] < 20 )
+            int a = mark_alpha[y - cy + SAT_MARK_HALF][x - cx + SAT_MARK_HALF];
+            if( a == 0 )
             {
-                arc_dsc.color = lv_color_make(0xff, 0x00, 0x00); // 赤色
+                continue;
             }
-            else if( sat_positions[i][3] < 30 )
-            {
-                arc_dsc.color = lv_color_make(0xff, 0xa5, 0x00); // オレンジ色
-            }
-            else
+            // RGB565のまま混ぜる
+            uint16_t bg = px[y * stride + x];
+            int r = ((bg >> 11) * (255 - a) + fr * a) / 255;
+            int g = (((bg >> 5) & 0x3f) * (255 - a) + fgr * a) / 255;
+            int b = ((bg & 0x1f) * (255 - a) + fb * a) / 255;
+            px[y * stride + x] = (uint16_t)((r << 11) | (g << 5) | b);
+        }
+    }
+}
+
+
+/**
+ * @brief 衛星配置のキャンバスを全て描き直す
+ * 
+ */
+void SatelliteDisplay::paint_canvas()
+{
+    lv_area_t all = { 0, 0, img_w - 1, img_h - 1 };
+
+    if( px == NULL )
+    {
+        return;
+    }
+    restore_area(&all);
+    for( int i = 0; i < MAX_SATELLITES; i++ )
+    {
+        sat_entry_t &s = sats[i];
+        s.drawn_level = -1;
+        if( s.used ) // 衛星がある位置のみ描画
+        {
+            s.drawn_x = img_w / 2 + s.x;
+            s.drawn_y = img_h / 2 - s.y; // Y座標は上方向が小さいので反転
+            s.drawn_level = snr_level(s.snr);
+            draw_mark(s.drawn_x, s.drawn_y, s.drawn_level, &all);
+        }
+    }
+    lv_obj_invalidate(canvas);
+    dirty = false;
+    last_paint_ms = lv_tick_get();
+}
+
+
+/**
+ * @brief 衛星の位置か色が変わっていれば，変わった印の範囲だけ描き直す
+ * 
+ * @param min_interval_ms 前回の描画からこの時間(ms)が経つまでは描き直さない
+ * 
+ * 印の前の範囲と新しい範囲を背景に戻し，そこに掛かる印を描き直して，その範囲だけを無効化する．
+ */
+void SatelliteDisplay::update(uint32_t min_interval_ms)
+{
+    lv_area_t rects[SAT_DIRTY_MAX];
+    lv_area_t canvas_area;
+    int num_rects = 0;
+    int x, y, level;
+
+    if( !dirty || px == NULL || lv_tick_elaps(last_paint_ms) < min_interval_ms )
+    {
+        return;
+    }
+
+    for( int i = 0; i < MAX_SATELLITES; i++ )
+    {
+        sat_entry_t &s = sats[i];
+        level = s.used ? snr_level(s.snr) : -1;
+        x = img_w / 2 + s.x;
+        y = img_h / 2 - s.y;
+        if( level == s.drawn_level && (level < 0 || (x == s.drawn_x && y == s.drawn_y)) )
+        {
+            continue;
+        }
+        if( num_rects + 2 > SAT_DIRTY_MAX )
+        {
+            // 変化が多ければ全体を描き直す
+            paint_canvas();
+            return;
+        }
+        if( s.drawn_level >= 0 && mark_area(s.drawn_x, s.drawn_y, &rects[num_rects]) )
+        {
+            num_rects++;
+        }
+        if( level >= 0 && mark_area(x, y, &rects[num_rects]) )
+        {
+            num_rects++;
+        }
+        s.drawn_x = x;
+        s.drawn_y = y;
+        s.drawn_level = level;
+    }
+
+    // 戻した範囲に掛かる印を，元と同じ順に描き直す．範囲が重なっていても二重に描かないよう，範囲毎に戻してから描く
+    for( int j = 0; j < num_rects; j++ )
+    {
+        restore_area(&rects[j]);
+        for( int i = 0; i < MAX_SATELLITES; i++ )
+        {
+            if( sats[i].drawn_level >= 0 )
             {
-                arc_dsc.color = lv_color_make(0x00, 0xff, 0x00); // 緑色
+                draw_mark(sats[i].drawn_x, sats[i].drawn_y, sats[i].drawn_level, &rects[j]);
             }
-            arc_dsc.radius = 4;
-            arc_dsc.center.x = x;
-            arc_dsc.center.y = y;
-            lv_draw_arc(&layer, &arc_dsc);
-//            Serial.printf("Sat PRN=%d, x=%d, y=%d, SNR=%d\n", sat_positions[i][0], x, y, sat_positions[i][3]);
         }
     }
-    lv_canvas_finish_layer(canvas, &layer);
+    lv_obj_get_coords(canvas, &canvas_area);
+    for( int j = 0; j < num_rects; j++ )
+    {
+        rects[j].x1 += canvas_area.x1;
+        rects[j].x2 += canvas_area.x1;
+        rects[j].y1 += canvas_area.y1;
+        rects[j].y2 += canvas_area.y1;
+        lv_obj_invalidate_area(canvas, &rects[j]);
+    }
+    dirty = false;
+    last_paint_ms = lv_tick_get();
+}
+
+
+/**
+ * @brief SNRから描画の色の段階を求める
+ */
+int SatelliteDisplay::snr_level(int snr)
+{
+    if( snr < 20 )
+        return 0;
+    if( snr < 30 )
+        return 1;
+    return 2;
+}
+
+
+/**
+ * @brief 衛星系とPRN番号から表の位置を求める
+ * 
+ * @param constellation 衛星系(NMEA_SAT_GPSなど)
+ * @param prn PRN番号(GSVに出てくる番号)
+ * @return int 表の位置．範囲外なら-1
+ * 
+ * 衛星系毎に範囲を分けて直接引くので，探さずに位置が決まる．
+ * GPSのGSVにQZSSが193〜202で出てくる受信機があるので，それはQZSSの範囲に入れる．
+ */
+int SatelliteDisplay::slot_index(int constellation, int prn)
+{
+    switch( constellation )
+    {
+        case NMEA_SAT_GPS:
+            if( prn >= 1 && prn <= 64 )
+                return prn - 1;                 // 0〜63
+            if( prn >= 193 && prn <= 202 )
+                return 195 + (prn - 193);       // QZSSの範囲
+            break;
+        case NMEA_SAT_GLONASS:
+            if( prn >= 65 && prn <= 96 )
+                return 64 + (prn - 65);         // 64〜95
+            break;
+        case NMEA_SAT_GALILEO:
+            if( prn >= 1 && prn <= 36 )
+                return 96 + (prn - 1);          // 96〜131
+            break;
+        case NMEA_SAT_BEIDOU:
+            if( prn >= 1 && prn <= 63 )
+                return 132 + (prn - 1);         // 132〜194
+            break;
+        case NMEA_SAT_QZSS:
+            if( prn >= 1 && prn <= 10 )
+                return 195 + (prn - 1);         // 195〜204
+            if( prn >= 193 && prn <= 202 )
+                return 195 + (prn - 193);
+            break;
+        default:
+            break;
+    }
+    return -1;
+}
+
+
+// sin(0〜90度)を1度毎に16384倍した表
+static const int16_t sin_table_q14[91] = {
+        0,   286,   572,   857,  1143,  1428,  1713,  1997,  2280,  2563,
+     2845,  3126,  3406,  3686,  3964,  4240,  4516,  4790,  5063,  5334,
+     5604,  5872,  6138,  6402,  6664,  6924,  7182,  7438,  7692,  7943,
+     8192,  8438,  8682,  8923,  9162,  9397,  9630,  9860, 10087, 10311,
+    10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365,
+    12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+    14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296,
+    15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+    16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382,
+    16384
+};
+
+
+/**
+ * @brief 整数の角度(度)のsinを16384倍して返す
+ */
+int SatelliteDisplay::isin(int deg)
+{
+    deg %= 360;
+    if( deg < 0 )
+        deg += 360;
+    if( deg <= 90 )
+        return sin_table_q14[deg];
+    if( deg <= 180 )
+        return sin_table_q14[180 - deg];
+    if( deg <= 270 )
+        return -sin_table_q14[deg - 180];
+    return -sin_table_q14[360 - deg];
 }
 
 
 void SatelliteDisplay::init(lv_obj_t *parent, int x, int y)
 {
     canvas = lv_canvas_create(parent);
+    if( cbuf == NULL || bgbuf == NULL )
+    {
+        return;
+    }
     lv_canvas_set_buffer(canvas, cbuf, img_w, img_h, LV_COLOR_FORMAT_NATIVE);
-    lv_canvas_fill_bg(canvas, lv_color_hex3(0xccc), LV_OPA_COVER);
     lv_obj_align(canvas, LV_ALIGN_TOP_LEFT, x, y);
+
+    // set_buffer()で先頭が揃えられるので，画素の位置はdraw_bufから得る
+    lv_draw_buf_t *draw_buf = lv_canvas_get_draw_buf(canvas);
+    px = (uint16_t *)draw_buf->data;
+    stride = draw_buf->header.stride / sizeof(uint16_t);
+
+    paint_background();
     paint_canvas(); // キャンバスの初期描画
 }
 
 
 SatelliteDisplay::SatelliteDisplay()
 {
-    int i;
-    for( i = 0; i < MAX_SATELLITES; i++ )
+    memset(sats, 0, sizeof(sats));
+    for( int i = 0; i < MAX_SATELLITES; i++ )
     {
-        sat_positions[i][0] = 0; // PRN
-        sat_positions[i][1] = 0; // x座標
-        sat_positions[i][2] = 0; // y座標
+        sats[i].drawn_level = -1;
     }
+    pass = 0;
     r_0 = img_h / 2; // 半径0の位置
     r_45 = r_0 / 2; // 半径45度の位置
+    dirty = true;
+    last_paint_ms = 0;
+    px = NULL;
+    stride = img_w;
 
-    cbuf = new uint8_t[LV_CANVAS_BUF_SIZE(img_w, img_h, 32, LV_DRAW_BUF_STRIDE_ALIGN)];
-    if( cbuf == NULL )
+    // 半径SAT_MARK_R，太さ1の円の各画素の濃さ．円周からの距離で滑らかにする
+    for( int dy = -SAT_MARK_HALF; dy <= SAT_MARK_HALF; dy++ )
+    {
+        for( int dx = -SAT_MARK_HALF; dx <= SAT_MARK_HALF; dx++ )
+        {
+            float d = fabsf(sqrtf((float)(dx * dx + dy * dy)) - SAT_MARK_R);
+            mark_alpha[dy + SAT_MARK_HALF][dx + SAT_MARK_HALF] = (d < 1.0f) ? (uint8_t)((1.0f - d) * 255.0f) : 0;
+        }
+    }
+
+    // キャンバスはLV_COLOR_FORMAT_NATIVE(RGB565)で作るので，その大きさにする
+    cbuf = new uint8_t[LV_CANVAS_BUF_SIZE(img_w, img_h, LV_COLOR_FORMAT_GET_BPP(LV_COLOR_FORMAT_NATIVE), LV_DRAW_BUF_STRIDE_ALIGN)];
+    bgbuf = new uint16_t[img_w * img_h];
+    if( cbuf == NULL || bgbuf == NULL )
     {
         // メモリ確保失敗
         return;
@@ -163,85 +486,512 @@ SatelliteDisplay::~SatelliteDisplay()
         delete[] cbuf;
         cbuf = NULL;
     }
+    if( bgbuf != NULL )
+    {
+        delete[] bgbuf;
+        bgbuf = NULL;
+    }
+}
+
+
+/**
+ * @brief GSVからの一連のset_sat_pos()の前に呼ぶ
+ * 
+ * 同じ回の中で同じ衛星が複数の信号(L1, L5など)で出てきた時は，SNRの大きい方を使う．
+ */
+void SatelliteDisplay::begin_update()
+{
+    pass++;
 }
 
 
 /**
  * @brief 衛星の位置を設定
  * 
+ * @param constellation 衛星系(NMEA_SAT_GPSなど)
  * @param prn PRN番号
  * @param elv 仰角
  * @param azm 方位角
  * @param snr SNR
+ * @param seen_ms この衛星が出てきたGSVの更新時刻(ms)．evict()で古さを判断する
  * @return int 成功したら0，失敗したら-1
  */
-int SatelliteDisplay::set_sat_pos(int prn, int elv, int azm, int snr)
+int SatelliteDisplay::set_sat_pos(int constellation, int prn, int elv, int azm, int snr, uint64_t seen_ms)
 {
-    int i;
+    int idx;
     int x, y, r;
-    double theta;
 
-    if( prn <= 0 )
+    idx = slot_index(constellation, prn);
+    if( idx < 0 )
         return -1; // PRNが無効
     if( elv < 0 || elv > 90 )
         return -1; // Elevationが無効
+    if( snr < 0 )
+        snr = 0;
+    if( snr > 99 )
+        snr = 99;
 
     // ElevationとAzimuthからx, y座標を計算
     // Azimuthは0度が北で時計回り．90度が東、180度が南、270度が西．
     // Elevationは0度が地平線、90度が真上とする
-    r = r_0 * (1.0 - (elv / 90.0)); // 半径はr_0の範囲で計算
-    theta = (90.0 - azm) * M_PI / 180.0;
-    x = (int)(r * cos(theta));
-    y = (int)(r * sin(theta));
+    // 半径はr_0の範囲で四捨五入し，sin, cosは1度毎の表(16384倍)から引く
+    r = (r_0 * (90 - elv) + 45) / 90;
+    x = (r * isin(azm) + (1 << 13)) >> 14;
+    y = (r * isin(azm + 90) + (1 << 13)) >> 14;
+
+    sat_entry_t &s = sats[idx];
+    if( s.used && s.pass == pass && s.snr > snr )
+    {
+        snr = s.snr; // 同じ回で先に出てきた信号の方が強い
+    }
+    // 描画上の位置か色が変わった時だけ描き直す
+    if( !s.used || s.x != x || s.y != y || snr_level(s.snr) != snr_level(snr) )
+    {
+        dirty = true;
+    }
+    s.used = 1;
+    s.x = x;
+    s.y = y;
+    s.snr = snr;
+    s.pass = pass;
+    // 時刻が戻っても(時計の同期など)最後に見た時刻で上書きし，evict()で消えなくならないようにする
+    s.seen_ms = seen_ms;
+    return 0; // 成功
+}
+
+
+/**
+ * @brief 衛星の削除
+ * 
+ * @param constellation 衛星系(NMEA_SAT_GPSなど)
+ * @param prn 削除対象のPRN番号
+ * @return int 成功したら0，失敗したら-1
+ */
+int SatelliteDisplay::remove_sat(int constellation, int prn)
+{
+    int idx = slot_index(constellation, prn);
+
+    if( idx < 0 || !sats[idx].used )
+    {
+        return -1; // エラー（見つからなかった）
+    }
+    sats[idx].used = 0;
+    sats[idx].seen_ms = 0;
+    dirty = true;
+    return 0; // 成功
+}
+
+
+/**
+ * @brief 長くGSVに出てこない衛星を削除する
+ * 
+ * @param older_than_ms 最後に出てきた時刻がこれより前の衛星を削除する(ms)
+ * @return int 削除した数
+ */
+int SatelliteDisplay::evict(uint64_t older_than_ms)
+{
+    int count = 0;
+
+    for( int i = 0; i < MAX_SATELLITES; i++ )
+    {
+        if( sats[i].used && sats[i].seen_ms < older_than_ms )
+        {
+            sats[i].used = 0;
+            sats[i].seen_ms = 0;
+            count++;
+        }
+    }
+    if( count > 0 )
+    {
+        dirty = true;
+    }
+    return count;
+}
+
+
+// 時計の色(未同期，同期中，同期完了，その他)
+static const uint8_t clock_colors[4][3] = {
+    { 128, 0, 0 },
+    { 128, 128, 0 },
+    { 0, 255, 0 },
+    { 128, 128, 128 },
+};
+
+
+DigitClock::DigitClock()
+{
+    font = NULL;
+    canvas = NULL;
+    label = NULL;
+    cbuf = NULL;
+    px = NULL;
+    stride = 0;
+    tiles = NULL;
+    small_tiles = NULL;
+    digit_w = colon_w = line_h = 0;
+    small_w = small_h = small_y = 0;
+    frac_digits = 0;
+    num_cells = 0;
+    memset(cell_x, 0, sizeof(cell_x));
+    memset(shown, 0, sizeof(shown));
+    memset(next_text, 0, sizeof(next_text));
+    color = 0;
+}
+
+DigitClock::~DigitClock()
+{
+    if( cbuf != NULL )
+    {
+        heap_caps_free(cbuf);
+        cbuf = NULL;
+    }
+    if( tiles != NULL )
+    {
+        heap_caps_free(tiles);
+        tiles = NULL;
+    }
+    if( small_tiles != NULL )
+    {
+        heap_caps_free(small_tiles);
+        small_tiles = NULL;
+    }
+}
+
+
+/**
+ * @brief 文字から画像の番号を求める
+ */
+int DigitClock::glyph_index(char c)
+{
+    if( c >= '0' && c <= '9' )
+        return c - '0';
+    if( c == ':' )
+        return 10;
+    return 11; // '.'
+}
+
+
+/**
+ * @brief 時計を作る
+ * 
+ * @param parent 親オブジェクト
+ * @param x 左上のX座標
+ * @param y 左上のY座標
+ * @param font 数字のフォント
+ * @param frac_digits 秒の小数部の桁数(0〜3)
+ */
+void DigitClock::init(lv_obj_t *parent, int x, int y, const lv_font_t *font, int frac_digits)
+{
+    int w, n;
+    size_t tile_size, cbuf_size;
+
+    this->font = font;
+    this->frac_digits = LV_MAX(0, LV_MIN(frac_digits, MAX_FRAC_DIGITS));
+    digit_w = 0;
+    for( char c = '0'; c <= '9'; c++ )
+    {
+        digit_w = LV_MAX(digit_w, lv_font_get_glyph_width(font, c, 0));
+    }
+    colon_w = LV_MAX(lv_font_get_glyph_width(font, ':', 0), lv_font_get_glyph_width(font, '.', 0));
+    line_h = lv_font_get_line_height(font);
+    small_w = digit_w / 2;
+    small_h = line_h / 2;
+    // 小さい文字のベースラインを大きい文字に揃える
+    small_y = (line_h - font->base_line) - (small_h - font->base_line / 2);
+
+    // 桁の配置．HH:MM:SSの後ろに小数部を付ける
+    w = 0;
+    n = 0;
+    for( int i = 0; i < 8; i++ )
+    {
+        cell_x[n++] = w;
+        w += (i == 2 || i == 5) ? colon_w : digit_w;
+    }
+    for( int i = 0; i < this->frac_digits + (this->frac_digits > 0 ? 1 : 0); i++ )
+    {
+        cell_x[n++] = w;
+        w += (i == 0) ? colon_w / 2 : small_w;
+    }
+    num_cells = n;
+
+    // 画像はPSRAMに置く．キャンバスは描画の度にLVGLが読むので内部RAMに置く
+    tile_size = (size_t)NUM_COLORS * NUM_GLYPHS * digit_w * line_h * sizeof(uint16_t);
+    tiles = (uint16_t *)heap_caps_malloc(tile_size, MALLOC_CAP_SPIRAM);
+    if( this->frac_digits > 0 )
+    {
+        small_tiles = (uint16_t *)heap_caps_malloc((size_t)NUM_COLORS * NUM_GLYPHS * small_w * small_h * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+    }
+    cbuf_size = LV_CANVAS_BUF_SIZE(w, line_h, LV_COLOR_FORMAT_GET_BPP(LV_COLOR_FORMAT_NATIVE), LV_DRAW_BUF_STRIDE_ALIGN);
+    cbuf = (uint8_t *)heap_caps_malloc(cbuf_size, MALLOC_CAP_8BIT);
+    if( tiles == NULL || cbuf == NULL || (this->frac_digits > 0 && small_tiles == NULL) )
+    {
+        // メモリが足りなければラベルで表示する
+        ESP_LOGE("DigitClock", "Failed to allocate digit tiles, fall back to label");
+        label = lv_label_create(parent);
+        lv_label_set_text(label, "");
+        lv_obj_align(label, LV_ALIGN_TOP_LEFT, x, y);
+        lv_obj_set_style_text_font(label, font, 0);
+        lv_obj_set_style_text_color(label, lv_color_make(clock_colors[color][0], clock_colors[color][1], clock_colors[color][2]), 0);
+        return;
+    }
+
+    canvas = lv_canvas_create(parent);
+    lv_canvas_set_buffer(canvas, cbuf, w, line_h, LV_COLOR_FORMAT_NATIVE);
+    lv_obj_align(canvas, LV_ALIGN_TOP_LEFT, x, y);
+    lv_draw_buf_t *draw_buf = lv_canvas_get_draw_buf(canvas);
+    px = (uint16_t *)draw_buf->data;
+    stride = draw_buf->header.stride / sizeof(uint16_t);
+
+    render_glyphs();
+    lv_canvas_fill_bg(canvas, lv_color_make(0, 0, 0), LV_OPA_COVER);
+    memset(shown, 0, sizeof(shown));
+}
+
+
+/**
+ * @brief 全ての色の数字の画像を作る
+ * 
+ * キャンバスの左端にLVGLで1文字ずつ描き，それを画像に写す．小数部用の画像は等倍の画像を2x2で平均して作る．
+ */
+void DigitClock::render_glyphs()
+{
+    static const char glyph_chars[NUM_GLYPHS + 1] = "0123456789:.";
+    lv_layer_t layer;
+    lv_draw_label_dsc_t dsc;
+    lv_area_t area = { 0, 0, digit_w - 1, line_h - 1 };
+    char text[2];
+
+    for( int c = 0; c < NUM_COLORS; c++ )
+    {
+        for( int g = 0; g < NUM_GLYPHS; g++ )
+        {
+            text[0] = glyph_chars[g];
+            text[1] = '\0';
+            lv_canvas_fill_bg(canvas, lv_color_make(0, 0, 0), LV_OPA_COVER);
+            lv_canvas_init_layer(canvas, &layer);
+            lv_draw_label_dsc_init(&dsc);
+            dsc.font = font;
+            dsc.color = lv_color_make(clock_colors[c][0], clock_colors[c][1], clock_colors[c][2]);
+            dsc.text = text;
+            lv_draw_label(&layer, &dsc, &area);
+            lv_canvas_finish_layer(canvas, &layer);
+
+            uint16_t *t = tile(c, g);
+            for( int y = 0; y < line_h; y++ )
+            {
+                memcpy(&t[y * digit_w], &px[y * stride], digit_w * sizeof(uint16_t));
+            }
+
+            if( small_tiles == NULL )
+            {
+                continue;
+            }
+            uint16_t *s = small_tile(c, g);
+            for( int y = 0; y < small_h; y++ )
+            {
+                for( int x = 0; x < small_w; x++ )
+                {
+                    uint16_t p[4] = { t[(y * 2) * digit_w + x * 2], t[(y * 2) * digit_w + x * 2 + 1],
+                                      t[(y * 2 + 1) * digit_w + x * 2], t[(y * 2 + 1) * digit_w + x * 2 + 1] };
+                    int r = 0, gr = 0, b = 0;
+                    for( int k = 0; k < 4; k++ )
+                    {
+                        r += p[k] >> 11;
+                        gr += (p[k] >> 5) & 0x3f;
+                        b += p[k] & 0x1f;
+                    }
+                    s[y * small_w + x] = ((r / 4) << 11) | ((gr / 4) << 5) | (b / 4);
+                }
+            }
+        }
+    }
+}
 
-    // そのPRNの衛星が既に存在するか確認
-    for( i = 0; i < MAX_SATELLITES; i++ )
+
+/**
+ * @brief 1桁の画像をキャンバスに写す
+ * 
+ * @param cell 桁の位置
+ * @param ch 文字
+ * @param area 写した範囲をこれに加える(キャンバス上)
+ */
+void DigitClock::blit(int cell, char ch, lv_area_t *area)
+{
+    int g = glyph_index(ch);
+    int x0 = cell_x[cell];
+    int x1;
+
+    if( cell < 8 )
     {
-        if( sat_positions[i][0] == prn )
+        const uint16_t *t = tile(color, g);
+        int w = (ch == ':') ? colon_w : digit_w;
+        for( int y = 0; y < line_h; y++ )
         {
-            sat_positions[i][1] = x;
-            sat_positions[i][2] = y;
-            sat_positions[i][3] = snr; // SNRを保存
-            return 0; // 成功
+            memcpy(&px[y * stride + x0], &t[y * digit_w], w * sizeof(uint16_t));
         }
+        x1 = x0 + w - 1;
     }
-    // 存在しない場合は空いている位置を探す
-    for( i = 0; i < MAX_SATELLITES; i++ )
+    else
     {
-        if( sat_positions[i][0] == 0 ) // PRNが0の位置を探す
+        const uint16_t *s = small_tile(color, g);
+        int w = (ch == '.') ? colon_w / 2 : small_w;
+        for( int y = 0; y < small_h; y++ )
         {
-            sat_positions[i][0] = prn;
-            sat_positions[i][1] = x;
-            sat_positions[i][2] = y;
-            sat_positions[i][3] = snr; // SNRを保存
-            return 0; // 成功
+            memcpy(&px[(small_y + y) * stride + x0], &s[y * small_w], w * sizeof(uint16_t));
         }
+        x1 = x0 + w - 1;
+    }
+    if( area->x1 > area->x2 )
+    {
+        area->x1 = x0;
+        area->x2 = x1;
+    }
+    else
+    {
+        area->x1 = LV_MIN(area->x1, x0);
+        area->x2 = LV_MAX(area->x2, x1);
     }
-    return -1; // エラー
 }
 
 
 /**
- * @brief 衛星の削除
+ * @brief 時計の色を設定する
  * 
- * @param prn 削除対象のPRN番号
- * @return int 成功したら0，失敗したら-1
+ * @param color 色の番号(0: 未同期, 1: 同期中, 2: 同期完了, 3: その他)
+ * 
+ * 変わった時は表示中の桁を全てその色で描き直す．
  */
-int SatelliteDisplay::remove_sat(int prn)
+void DigitClock::set_color(int color)
 {
-    int i;
-    // PRNが一致する衛星を探して削除
-    for( i = 0; i < MAX_SATELLITES; i++ )
+    char text[MAX_CELLS];
+
+    if( color < 0 || color >= NUM_COLORS )
+    {
+        color = NUM_COLORS - 1;
+    }
+    if( color == this->color )
     {
-        if( sat_positions[i][0] == prn )
+        return;
+    }
+    this->color = color;
+    if( label != NULL )
+    {
+        lv_obj_set_style_text_color(label, lv_color_make(clock_colors[color][0], clock_colors[color][1], clock_colors[color][2]), 0);
+        return;
+    }
+    memcpy(text, shown, sizeof(text));
+    draw_cells(text, true);
+}
+
+
+/**
+ * @brief 文字列のうち表示中と違う桁を描き直し，その範囲を無効化する
+ * 
+ * @param text 各桁の文字(num_cells文字)
+ * @param all trueなら全ての桁を描き直す
+ */
+void DigitClock::draw_cells(const char *text, bool all)
+{
+    lv_area_t area = { 1, 0, 0, line_h - 1 }; // x1 > x2は空
+    lv_area_t canvas_area;
+
+    if( px == NULL )
+    {
+        return;
+    }
+    for( int i = 0; i < num_cells; i++ )
+    {
+        if( text[i] != 0 && (all || text[i] != shown[i]) )
         {
-            sat_positions[i][0] = 0; // PRNを0にして削除
-            sat_positions[i][1] = 0; // x座標をリセット
-            sat_positions[i][2] = 0; // y座標をリセット
-            return 0; // 成功
+            blit(i, text[i], &area);
+            shown[i] = text[i];
         }
     }
-    return -1; // エラー（見つからなかった）
+    if( area.x1 > area.x2 )
+    {
+        return;
+    }
+    lv_obj_get_coords(canvas, &canvas_area);
+    area.x1 += canvas_area.x1;
+    area.x2 += canvas_area.x1;
+    area.y1 += canvas_area.y1;
+    area.y2 += canvas_area.y1;
+    lv_obj_invalidate_area(canvas, &area);
+}
+
+
+/**
+ * @brief 時刻を表示する文字列にする
+ * 
+ * @param text 格納先
+ */
+void DigitClock::format_time(char (&text)[MAX_CELLS + 1], int hour, int min, int sec, int frac)
+{
+    char *p;
+
+    p = text + fmt_format(text, fmt_zero<2>(hour), ':', fmt_zero<2>(min), ':', fmt_zero<2>(sec));
+    if( frac_digits > 0 )
+    {
+        *p++ = '.';
+        p = fmt_put_zero(p, frac, frac_digits);
+        *p = '\0';
+    }
+}
+
+
+/**
+ * @brief 文字列を表示する．変わった桁だけを描き直す
+ */
+void DigitClock::show(const char *text)
+{
+    if( label != NULL )
+    {
+        lv_label_set_text(label, text);
+        return;
+    }
+    draw_cells(text, false);
+}
+
+
+/**
+ * @brief 次に表示する時刻を用意する．表示はflip()で替える
+ * 
+ * @param hour 時
+ * @param min 分
+ * @param sec 秒
+ * @param frac 秒の小数部(frac_digits桁の整数)．frac_digitsが0なら使わない
+ */
+void DigitClock::prepare_time(int hour, int min, int sec, int frac)
+{
+    format_time(next_text, hour, min, sec, frac);
+}
+
+
+/**
+ * @brief prepare_time()で用意した時刻に表示を替える．変わった桁だけを描き直す
+ */
+void DigitClock::flip()
+{
+    show(next_text);
+}
+
+
+/**
+ * @brief 時刻を表示する．変わった桁だけを描き直す
+ * 
+ * @param hour 時
+ * @param min 分
+ * @param sec 秒
+ * @param frac 秒の小数部(frac_digits桁の整数)．frac_digitsが0なら使わない
+ * 
+ * prepare_time()で用意した時刻は上書きしないので，用意してからflip()までの間に呼んでもよい．
+ */
+void DigitClock::set_time(int hour, int min, int sec, int frac)
+{
+    char text[MAX_CELLS + 1];
+
+    format_time(text, hour, min, sec, frac);
+    show(text);
 }
 
 
@@ -274,17 +1024,15 @@ void ScreenMain::setup()
     ScreenBase::setup();
 
     last_update = 0;
+    clock_sec = 0;
+    clock_frac = -1;
     sync_state = 0;
     sync_state_prev = 0;
     lv_obj_set_style_bg_color(lv_screen, lv_color_make(0, 0, 0), 0);
 
-    // 時刻を表示するラベルを作成
-    label_clock = lv_label_create(lv_screen);
-    lv_label_set_text(label_clock, "12:34:56");
-    lv_obj_align(label_clock, LV_ALIGN_OUT_TOP_LEFT, 0, 24);
-    lv_obj_set_style_text_font(label_clock, &font_opensans_bold_48, 0);
-    lv_obj_set_style_text_color(label_clock, lv_color_make(128, 0, 0), 0);
-    lv_obj_set_style_text_align(label_clock, LV_TEXT_ALIGN_CENTER, 0);
+    // 時刻を表示する．数字は画像にしておき，変わった桁だけを描き直す
+    digit_clock.init(lv_screen, 0, 24, &font_opensans_bold_48, SCRN_MAIN_CLOCK_FRAC_DIGITS);
+    digit_clock.set_time(12, 34, 56, 0);
 
     // 日付を表示するラベルを作成
     label_date = lv_label_create(lv_screen);
@@ -329,6 +1077,7 @@ void ScreenMain::setup()
     boxl_lat.set_text_color(lv_color_make(255, 255, 255));
     boxl_lat.set_font(&lv_font_montserrat_24);
     boxl_lat.set_align(LV_TEXT_ALIGN_LEFT);
+    boxl_lat.set_min_interval(SCRN_MAIN_VALUE_INTERVAL_MS);
 
     lbl_y += lbl_h +1;
     boxl_lon.init(lv_screen, 0, lbl_y, 200, lbl_h, "Lon:");
@@ -336,6 +1085,7 @@ void ScreenMain::setup()
     boxl_lon.set_text_color(lv_color_make(255, 255, 255));
     boxl_lon.set_font(&lv_font_montserrat_24);
     boxl_lon.set_align(LV_TEXT_ALIGN_LEFT);
+    boxl_lon.set_min_interval(SCRN_MAIN_VALUE_INTERVAL_MS);
 
     // 温度と気圧表示用のボックスラベル
     lbl_y += lbl_h +1;
@@ -344,6 +1094,7 @@ void ScreenMain::setup()
     boxl_temp.set_text_color(lv_color_make(255, 255, 255));
     boxl_temp.set_font(&lv_font_montserrat_24);
     boxl_temp.set_align(LV_TEXT_ALIGN_LEFT);
+    boxl_temp.set_min_interval(SCRN_MAIN_VALUE_INTERVAL_MS);
 
     lbl_y += lbl_h +1;
     boxl_pres.init(lv_screen, 0, lbl_y, 200, lbl_h, "hPa:");
@@ -351,6 +1102,22 @@ void ScreenMain::setup()
     boxl_pres.set_text_color(lv_color_make(255, 255, 255));
     boxl_pres.set_font(&lv_font_montserrat_24);
     boxl_pres.set_align(LV_TEXT_ALIGN_LEFT);
+    boxl_pres.set_min_interval(SCRN_MAIN_VALUE_INTERVAL_MS);
+
+    // 推定高度と昇降速度表示用のボックスラベル．SDカードの状態の下に出す
+    boxl_alt.init(lv_screen, 220, 100 + lbl_h + 1, 100, lbl_h, "m");
+    boxl_alt.set_bg_color(lv_color_make(0, 48, 64));
+    boxl_alt.set_text_color(lv_color_make(255, 255, 255));
+    boxl_alt.set_font(&lv_font_montserrat_24);
+    boxl_alt.set_align(LV_TEXT_ALIGN_LEFT);
+    boxl_alt.set_min_interval(SCRN_MAIN_VALUE_INTERVAL_MS);
+
+    boxl_vs.init(lv_screen, 220, 100 + (lbl_h + 1) * 2, 100, lbl_h, LV_SYMBOL_UP);
+    boxl_vs.set_bg_color(lv_color_make(0, 48, 64));
+    boxl_vs.set_text_color(lv_color_make(255, 255, 255));
+    boxl_vs.set_font(&lv_font_montserrat_24);
+    boxl_vs.set_align(LV_TEXT_ALIGN_LEFT);
+    boxl_vs.set_min_interval(SCRN_MAIN_VALUE_INTERVAL_MS);
 
     // SDカードの状態表示用のボックスラベル
     boxl_sdcard.init(lv_screen, 220, 100, 100, lbl_h, LV_SYMBOL_SD_CARD " --");
@@ -406,62 +1173,105 @@ void ScreenMain::led_trigger()
 }
 
 
+/**
+ * @brief 次の秒の時計の表示を用意する．秒の境界の少し前に呼ぶ
+ * 
+ * @param next_sec 次の秒(UNIX時刻)
+ */
+void ScreenMain::prepare_second(time_t next_sec)
+{
+    struct tm tm;
+
+    localtime_r(&next_sec, &tm);
+    digit_clock.prepare_time(tm.tm_hour, tm.tm_min, tm.tm_sec, 0);
+}
+
+
+/**
+ * @brief prepare_second()で用意した表示に時計を替える．秒の境界で呼ぶ
+ * 
+ * @param sec 替える秒(UNIX時刻)
+ */
+void ScreenMain::flip_second(time_t sec)
+{
+    digit_clock.flip();
+    clock_sec = sec;
+    clock_frac = 0;
+}
+
+
 void ScreenMain::loop()
 {
     struct tm tm;
     char buf[32];
     static int last_sec = -1;
+    static int last_mday = -1;
     struct timeval tv;
+    int frac = 0;
 
-    // 時計の更新
+    // 時計の更新．変わった桁の画像だけを写すので，小数部を出しても負荷は小さい
+    // 秒の境界ではflip_second()で替えるので，ここで替えるのは境界で替えられなかった時と小数部だけ
     gettimeofday(&tv, NULL);
+#if SCRN_MAIN_CLOCK_FRAC_DIGITS > 0
+    frac = tv.tv_usec / FmtPow10<6 - SCRN_MAIN_CLOCK_FRAC_DIGITS>::value;
+#endif
+    if( tv.tv_sec != clock_sec || frac != clock_frac )
+    {
+        tm = *localtime(&tv.tv_sec);
+        digit_clock.set_time(tm.tm_hour, tm.tm_min, tm.tm_sec, frac);
+        clock_sec = tv.tv_sec;
+        clock_frac = frac;
+    }
     if( tv.tv_sec != last_sec )
     {
         tm = *localtime(&tv.tv_sec);
-        snprintf(buf, sizeof(buf), "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
-        lv_label_set_text(label_clock, buf);
-        snprintf(buf, sizeof(buf), "%04d/%02d/%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
-        lv_label_set_text(label_date, buf);
+        // 日付は変わった時だけ描き直す
+        if( tm.tm_mday != last_mday )
+        {
+            fmt_format(buf, fmt_zero<4>(tm.tm_year + 1900), '/', fmt_zero<2>(tm.tm_mon + 1), '/', fmt_zero<2>(tm.tm_mday));
+            lv_label_set_text(label_date, buf);
+            last_mday = tm.tm_mday;
+        }
         last_sec = tv.tv_sec;
     }
     if( sys_status.update_count != last_update )
     {
         last_update = sys_status.update_count;
-        // 衛星データの更新
+        // 衛星データの更新．描き直すのは位置か色が変わった時だけ
         update_satellite_all();
-        sat_display.paint_canvas();
 
         // 測位モード
+        const char *mode;
         if( sys_status.rmc_data.data_valid )
         {
             switch(sys_status.rmc_data.fix_type)
             {
                 case NMEA_FIX_TYPE_NOFIX:
-                    snprintf(buf, sizeof(buf), "No Fix");
+                    mode = "No Fix";
                     break;
                 case NMEA_FIX_TYPE_AUTONOMOUS:
-                    snprintf(buf, sizeof(buf), "SPS");
+                    mode = "SPS";
                     break;
                 case NMEA_FIX_TYPE_DIFFERENTIAL:
-                    snprintf(buf, sizeof(buf), "DIFF");
+                    mode = "DIFF";
                     break;
                 default:
-                    snprintf(buf, sizeof(buf), "Unknown");
+                    mode = "Unknown";
                     break;
             }
         }
         else
-            snprintf(buf, sizeof(buf), "-");
-        boxl_mode.set_text2(buf);
+            mode = "-";
+        boxl_mode.set_text2(mode);
 
         // 測位できている場合は緯度経度を表示
         if( sys_status.rmc_data.data_valid && sys_status.rmc_data.fix_type > NMEA_FIX_TYPE_NOFIX )
         {
             // 緯度
-            snprintf(buf, sizeof(buf), "%.6f", sys_status.rmc_data.latitude);
+            fmt_format(buf, fmt_fixed<6>(sys_status.rmc_data.latitude));
             boxl_lat.set_text2(buf);
             // 経度
-            snprintf(buf, sizeof(buf), "%.6f", sys_status.rmc_data.longitude);
+            fmt_format(buf, fmt_fixed<6>(sys_status.rmc_data.longitude));
             boxl_lon.set_text2(buf);
         }
         else
@@ -471,15 +1281,39 @@ void ScreenMain::loop()
         }
 
         // 温度と気圧
-        snprintf(buf, sizeof(buf), "%.1f", sys_status.temp);
+        fmt_format(buf, fmt_fixed<1>(sys_status.temp));
         boxl_temp.set_text2(buf);
-        snprintf(buf, sizeof(buf), "%.1f", sys_status.pressure);
+        fmt_format(buf, fmt_fixed<1>(sys_status.pressure));
         boxl_pres.set_text2(buf);
 
+        // 推定高度と昇降速度
+        if( sys_status.alt_valid )
+        {
+            fmt_format(buf, fmt_fixed<0>(sys_status.altitude));
+            boxl_alt.set_text2(buf);
+            fmt_format(buf, fmt_fixed<1>(sys_status.vspeed));
+            boxl_vs.set_text2(buf);
+        }
+        else
+        {
+            boxl_alt.set_text2("-");
+            boxl_vs.set_text2("-");
+        }
+
         // バッテリー残量
         set_battery_level(sys_status.battery_level);
     }
 
+    // 間隔を空けるために待たせている値と衛星配置を表示する
+    boxl_mode.update();
+    boxl_lat.update();
+    boxl_lon.update();
+    boxl_temp.update();
+    boxl_pres.update();
+    boxl_alt.update();
+    boxl_vs.update();
+    sat_display.update(SCRN_MAIN_SKY_INTERVAL_MS);
+
     // LEDの更新
     if( led_duration > 0 ) {
         led_duration -= 10;
@@ -511,7 +1345,7 @@ void ScreenMain::on_swipe(lv_dir_t dir)
 }
 
 
-void ScreenMain::update_satellite(nmea_gsv_data_t *gsv_data)
+void ScreenMain::update_satellite(nmea_gsv_data_t *gsv_data, int constellation)
 {
     nmea_gsv_data_t *current_gsv = gsv_data;
     int sat_count;
@@ -529,7 +1363,7 @@ void ScreenMain::update_satellite(nmea_gsv_data_t *gsv_data)
             int snr = current_gsv->satellites[i].snr;
 
             // 衛星の位置を設定
-            sat_display.set_sat_pos(prn, elv, azm, snr);
+            sat_display.set_sat_pos(constellation, prn, elv, azm, snr, current_gsv->last_update_ms);
         }
         current_gsv = current_gsv->next;
     }
@@ -537,12 +1371,24 @@ void ScreenMain::update_satellite(nmea_gsv_data_t *gsv_data)
 
 void ScreenMain::update_satellite_all()
 {
+    struct timeval tv;
+    uint64_t now_ms;
+
     nmea_clear_old_gsv_data_all(&sys_status.gsv_data, 3);
-    update_satellite(&sys_status.gsv_data.gps);
-    update_satellite(&sys_status.gsv_data.glonass);
-    update_satellite(&sys_status.gsv_data.galileo);
-    update_satellite(&sys_status.gsv_data.beidou);
-    update_satellite(&sys_status.gsv_data.qzss);
+    sat_display.begin_update();
+    update_satellite(&sys_status.gsv_data.gps, NMEA_SAT_GPS);
+    update_satellite(&sys_status.gsv_data.glonass, NMEA_SAT_GLONASS);
+    update_satellite(&sys_status.gsv_data.galileo, NMEA_SAT_GALILEO);
+    update_satellite(&sys_status.gsv_data.beidou, NMEA_SAT_BEIDOU);
+    update_satellite(&sys_status.gsv_data.qzss, NMEA_SAT_QZSS);
+
+    // GSVに出てこなくなった衛星を消す
+    gettimeofday(&tv, NULL);
+    now_ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    if( now_ms > SCRN_MAIN_SAT_STALE_MS )
+    {
+        sat_display.evict(now_ms - SCRN_MAIN_SAT_STALE_MS);
+    }
 }
 
 
@@ -561,16 +1407,12 @@ void ScreenMain::set_sync_state(int state)
         switch( sync_state )
         {
             case 0:
-                lv_obj_set_style_text_color(label_clock, lv_color_make(128, 0, 0), 0);
-                break;
             case 1:
-                lv_obj_set_style_text_color(label_clock, lv_color_make(128, 128, 0), 0);
-                break;
             case 2:
-                lv_obj_set_style_text_color(label_clock, lv_color_make(0, 255, 0), 0);
+                digit_clock.set_color(sync_state);
                 break;
             default:
-                lv_obj_set_style_text_color(label_clock, lv_color_make(128, 128, 128), 0);
+                digit_clock.set_color(3);
                 break;
         }
         sync_state_prev = sync_state;
@@ -2,13 +2,21 @@
 #ifndef SCRN_MAIN_H
 #define SCRN_MAIN_H
 
+#include <string.h>
+
 #include "nmea_parser.h"
 #include "screen_base.h"
 #include "system_status.h"
 
+// BoxLabelの値の最大長
+#define BOX_LABEL_TEXT_MAX 24
+
 /**
  * 背景色指定が出来るラベル. 矩形領域の中に文字列を2つ表示できる.
  * 一方を左寄せ，もう一方を右寄せにし，ラベルと値という関係で表示する.
+ *
+ * 値(text2)は表示中の文字列と比べ，変わった時だけLVGLに渡して再描画させる．
+ * set_min_interval()を設定すると，再描画をその間隔以上に空け，間の値は最後のものだけをupdate()で表示する．
  */
 class BoxLabel
 {
@@ -16,6 +24,13 @@ protected:
     lv_obj_t *bkgrnd;
     lv_obj_t *label;
     lv_obj_t *label2;
+    char text2_shown[BOX_LABEL_TEXT_MAX];       // 表示中の値
+    char text2_pending[BOX_LABEL_TEXT_MAX];     // 間隔が空くのを待っている値
+    bool pending;
+    uint32_t min_interval_ms;
+    uint32_t last_set_ms;
+
+    void apply_text2(const char *text);
 
 public:
     BoxLabel()
@@ -23,6 +38,11 @@ public:
         bkgrnd = NULL; // 背景オブジェクト
         label = NULL; // ラベルオブジェクト
         label2 = NULL; // 2つ目のラベルオブジェクト
+        text2_shown[0] = '\0';
+        text2_pending[0] = '\0';
+        pending = false;
+        min_interval_ms = 0;
+        last_set_ms = 0;
     }
 
     void init(lv_obj_t *parent, int x, int y, int w, int h, const char *text);
@@ -32,9 +52,12 @@ public:
         lv_label_set_text(label, text);
     }
 
-    void set_text2(const char *text)
+    void set_text2(const char *text);
+    void update();
+
+    void set_min_interval(uint32_t ms)
     {
-        lv_label_set_text(label2, text);
+        min_interval_ms = ms;
     }
 
     void set_bg_color(lv_color_t color)
@@ -75,30 +98,123 @@ public:
 class SatelliteDisplay
 {
 protected:
+    /**
+     * @brief 衛星1つの情報．表は(衛星系, PRN)から位置が決まる
+     */
+    typedef struct {
+        uint64_t seen_ms;       // 最後にGSVに現れた時刻(GSVの更新時刻, ms)
+        uint8_t used;           // 1なら衛星がある
+        uint8_t snr;            // SNR(dBHz)．信号が複数あれば最大のもの
+        uint8_t pass;           // 最後に更新したbegin_update()の回
+        int8_t x, y;            // 中心からの位置(右と上が正)
+        int8_t drawn_level;     // 描いてある印のSNRの段階．-1なら描いていない
+        int16_t drawn_x, drawn_y;   // 描いてある印の位置(キャンバス上)
+    } sat_entry_t;
+
     lv_obj_t *screen;
     lv_obj_t *satellite_circle;
-    static const int MAX_SATELLITES = 32; // 最大衛星数
-    int sat_positions[MAX_SATELLITES][4]; // 衛星の位置 (PRN, x, y, SNR) 座標
+    static const int MAX_SATELLITES = 205;  // 表の大きさ．GPS 64, GLONASS 32, Galileo 36, BeiDou 63, QZSS 10
+    sat_entry_t sats[MAX_SATELLITES];
+    uint8_t pass;
     static const int img_h = 100;
     static const int img_w = 100;
+    static const int SAT_MARK_R = 4;                    // 衛星の印の半径
+    static const int SAT_MARK_HALF = SAT_MARK_R + 1;    // 印の範囲の中心からの幅
+    static const int SAT_DIRTY_MAX = 16;                // 部分的に描き直す範囲の最大数
     lv_obj_t *canvas;
     int r_0, r_45;
     uint8_t *cbuf;
+    uint16_t *bgbuf;            // 格子だけを描いた背景
+    uint16_t *px;               // キャンバスの画素の先頭
+    int stride;                 // キャンバスの1行の画素数
     lv_layer_t layer;
+    bool dirty;                 // 前回の描画から衛星の位置か色が変わった
+    uint32_t last_paint_ms;
+    uint8_t mark_alpha[SAT_MARK_HALF * 2 + 1][SAT_MARK_HALF * 2 + 1];
+
+    static int snr_level(int snr);
+    static int slot_index(int constellation, int prn);
+    static int isin(int deg);
+    void paint_background();
+    bool mark_area(int cx, int cy, lv_area_t *area);
+    void restore_area(const lv_area_t *area);
+    void draw_mark(int cx, int cy, int level, const lv_area_t *clip);
 
 public:
     void paint_canvas();
+    void update(uint32_t min_interval_ms);
     void init(lv_obj_t *parent, int x, int y);
     SatelliteDisplay();
     ~SatelliteDisplay();
-    int set_sat_pos(int prn, int elv, int azm, int snr);
-    int remove_sat(int prn);
+    void begin_update();
+    int set_sat_pos(int constellation, int prn, int elv, int azm, int snr, uint64_t seen_ms);
+    int remove_sat(int constellation, int prn);
+    int evict(uint64_t older_than_ms);
 };
 
+/**
+ * @brief 大きな時計を数字の画像を並べて描画するクラス
+ * 
+ * 0〜9と':', '.'を時計の色毎に一度だけRGB565の画像にしておき，時刻が変わった時は変わった桁の画像だけをキャンバスに写す．
+ * 小数部は半分の大きさの画像で秒の後ろに出す．
+ * 画像のメモリが確保できなければ，通常のラベルで表示する．
+ */
+class DigitClock
+{
+protected:
+    static const int NUM_COLORS = 4;        // 色の数(未同期，同期中，同期完了，その他)
+    static const int NUM_GLYPHS = 12;       // 0〜9, ':', '.'
+    static const int MAX_FRAC_DIGITS = 3;
+    static const int MAX_CELLS = 8 + 1 + MAX_FRAC_DIGITS;  // HH:MM:SS.fff
+    const lv_font_t *font;
+    lv_obj_t *canvas;
+    lv_obj_t *label;            // 画像が使えない時の代わり
+    uint8_t *cbuf;
+    uint16_t *px;               // キャンバスの画素の先頭
+    int stride;                 // キャンバスの1行の画素数
+    uint16_t *tiles;            // 等倍の画像．1つの大きさはdigit_w x line_h
+    uint16_t *small_tiles;      // 小数部用の半分の画像．1つの大きさはsmall_w x small_h
+    int digit_w, colon_w, line_h;
+    int small_w, small_h, small_y;
+    int frac_digits;
+    int num_cells;
+    int cell_x[MAX_CELLS];
+    char shown[MAX_CELLS];      // 表示中の文字．0なら未表示
+    char next_text[MAX_CELLS + 1];  // prepare_time()で用意し，flip()で表示する文字列．set_time()は使わない
+    int color;
+
+    static int glyph_index(char c);
+    uint16_t *tile(int c, int glyph)
+    {
+        return tiles + (c * NUM_GLYPHS + glyph) * digit_w * line_h;
+    }
+    uint16_t *small_tile(int c, int glyph)
+    {
+        return small_tiles + (c * NUM_GLYPHS + glyph) * small_w * small_h;
+    }
+    void render_glyphs();
+    void blit(int cell, char ch, lv_area_t *area);
+    void draw_cells(const char *text, bool all);
+    void format_time(char (&text)[MAX_CELLS + 1], int hour, int min, int sec, int frac);
+    void show(const char *text);
+
+public:
+    DigitClock();
+    ~DigitClock();
+    void init(lv_obj_t *parent, int x, int y, const lv_font_t *font, int frac_digits);
+    void set_color(int color);
+    void prepare_time(int hour, int min, int sec, int frac);
+    void flip();
+    void set_time(int hour, int min, int sec, int frac);
+};
+
+
 class ScreenMain : public ScreenBase
 {
 protected:
-    lv_obj_t *label_clock;
+    DigitClock digit_clock;
+    time_t clock_sec;           // 時計に表示中の秒
+    int clock_frac;             // 時計に表示中の秒の小数部
     lv_obj_t *label_date;
     lv_obj_t *label_battery;
     lv_obj_t *led;
@@ -109,6 +225,8 @@ protected:
     BoxLabel boxl_lon;
     BoxLabel boxl_temp;
     BoxLabel boxl_pres;
+    BoxLabel boxl_alt;
+    BoxLabel boxl_vs;
     BoxLabel boxl_sdcard;
     int sync_state; // 0: 未同期, 1: 同期中, 2: 同期完了
     int sync_state_prev;
@@ -123,8 +241,10 @@ public:
     void on_swipe(lv_dir_t dir);
 
     void led_trigger();
+    void prepare_second(time_t next_sec);
+    void flip_second(time_t sec);
     SatelliteDisplay sat_display;
-    void update_satellite(nmea_gsv_data_t *gsv_data);
+    void update_satellite(nmea_gsv_data_t *gsv_data, int constellation);
     void update_satellite_all();
     void set_sync_state(int state); // 0: 未同期, 1: 同期中, 2: 同期完了
     void set_sdcard_status(int status);
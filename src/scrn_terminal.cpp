@@ -512,6 +512,11 @@ void ScreenTerminal::on_swipe(lv_dir_t dir)
         // 左スワイプでMain画面へ
         change_screen(SCREEN_ID_MAIN, SCREEN_ANIM_LEFT);
     }
+    else if (dir == LV_DIR_RIGHT)
+    {
+        // 右スワイプで振動スペクトル画面へ
+        change_screen(SCREEN_ID_VIB, SCREEN_ANIM_RIGHT);
+    }
 }
 
 
@@ -0,0 +1,165 @@
+/**
+ * @file scrn_vib.cpp
+ * @author amagai
+ * @brief 振動スペクトルの画面
+ * @version 0.1
+ * @date 2025-10-18
+ * 
+ * @copyright Copyright (c) 2025
+ * 
+ * VibAnalyzerの最新の平均結果を棒グラフで表示する．
+ * 縦軸はPSD(dB re 1G^2/Hz)，横軸は0からナイキスト周波数まで．
+ */
+#include "scrn_vib.h"
+#include "fast_format.h"
+
+// 縦軸の範囲(dB)
+#define VIB_SCREEN_DB_MIN -100
+#define VIB_SCREEN_DB_MAX 0
+
+
+ScreenVib::ScreenVib()
+{
+    label_title = nullptr;
+    label_info = nullptr;
+    label_fmax = nullptr;
+    chart = nullptr;
+    series = nullptr;
+    analyzer = nullptr;
+    last_seq = 0;
+}
+
+
+/**
+ * @brief セットアップ
+ * 
+ */
+void ScreenVib::setup()
+{
+    ScreenBase::setup();
+
+    lv_obj_set_style_bg_color(lv_screen, lv_color_make(0, 0, 0), 0);
+
+    label_title = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_title, lv_color_make(255, 255, 255), 0);
+    lv_label_set_text(label_title, "Vibration PSD [dB G^2/Hz]");
+    lv_obj_align(label_title, LV_ALIGN_TOP_LEFT, 4, 2);
+
+    label_info = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_info, lv_color_make(255, 200, 0), 0);
+    lv_label_set_text(label_info, "waiting for data");
+    lv_obj_align(label_info, LV_ALIGN_TOP_LEFT, 4, 22);
+
+    chart = lv_chart_create(lv_screen);
+    lv_obj_set_size(chart, 312, 170);
+    lv_obj_align(chart, LV_ALIGN_TOP_LEFT, 4, 44);
+    lv_chart_set_type(chart, LV_CHART_TYPE_BAR);
+    lv_chart_set_point_count(chart, VIB_DISPLAY_BINS);
+    lv_chart_set_range(chart, LV_CHART_AXIS_PRIMARY_Y, VIB_SCREEN_DB_MIN, VIB_SCREEN_DB_MAX);
+    lv_chart_set_div_line_count(chart, 5, 0);
+    lv_obj_set_style_bg_color(chart, lv_color_make(16, 16, 16), 0);
+    lv_obj_set_style_border_width(chart, 0, 0);
+    lv_obj_set_style_pad_all(chart, 2, 0);
+    lv_obj_set_style_pad_column(chart, 1, 0);
+    series = lv_chart_add_series(chart, lv_color_make(0, 200, 255), LV_CHART_AXIS_PRIMARY_Y);
+    lv_chart_set_all_value(chart, series, VIB_SCREEN_DB_MIN);
+
+    lv_obj_t *label_zero = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_zero, lv_color_make(160, 160, 160), 0);
+    lv_label_set_text(label_zero, "0");
+    lv_obj_align(label_zero, LV_ALIGN_BOTTOM_LEFT, 4, -4);
+
+    label_fmax = lv_label_create(lv_screen);
+    lv_obj_set_style_text_color(label_fmax, lv_color_make(160, 160, 160), 0);
+    lv_label_set_text(label_fmax, "- Hz");
+    lv_obj_align(label_fmax, LV_ALIGN_BOTTOM_RIGHT, -4, -4);
+
+    // スワイプジェスチャーの有効化
+    lv_obj_add_event_cb(lv_screen, callback, LV_EVENT_GESTURE, this);
+
+    // 平均は数秒毎にしか更新されないので，1秒毎に確認すれば十分
+    lv_timer_create(callback_timer, 1000, this);
+}
+
+
+void ScreenVib::loop()
+{
+}
+
+
+/**
+ * @brief 新しい結果があれば表示を更新する
+ * 
+ */
+void ScreenVib::update()
+{
+    static vib_result_t r;
+    char buf[96];
+
+    if( analyzer == nullptr || !analyzer->get_result(&r) || r.seq == last_seq )
+    {
+        return;
+    }
+    last_seq = r.seq;
+
+    for( int i = 0; i < VIB_DISPLAY_BINS; i++ )
+    {
+        int v = (int)r.spectrum_db[i];
+        if( v < VIB_SCREEN_DB_MIN )
+        {
+            v = VIB_SCREEN_DB_MIN;
+        }
+        if( v > VIB_SCREEN_DB_MAX )
+        {
+            v = VIB_SCREEN_DB_MAX;
+        }
+        lv_chart_set_value_by_id(chart, series, i, v);
+    }
+    lv_chart_refresh(chart);
+
+    fmt_format(buf, "rms ", fmt_fixed<1>(r.rms_mg), "mg  peak ", fmt_fixed<1>(r.peak_hz[0]), "Hz ",
+            fmt_fixed<1>(r.peak_mg[0]), "mg");
+    lv_label_set_text(label_info, buf);
+    fmt_format(buf, (int)(r.fs / 2), " Hz");
+    lv_label_set_text(label_fmax, buf);
+}
+
+
+void ScreenVib::callback(lv_event_t *e)
+{
+    lv_event_code_t code = lv_event_get_code(e);
+    ScreenVib *scrn = static_cast<ScreenVib *>(lv_event_get_user_data(e));
+    if (code == LV_EVENT_GESTURE)
+    {
+        lv_dir_t dir = lv_indev_get_gesture_dir(lv_indev_get_act());
+        scrn->on_swipe(dir);
+    }
+}
+
+
+void ScreenVib::callback_timer(lv_timer_t *timer)
+{
+    ScreenVib *scrn = static_cast<ScreenVib *>(lv_timer_get_user_data(timer));
+    if( scrn->is_active() )
+        scrn->update();
+}
+
+
+/**
+ * @brief スワイプ操作の処理
+ * 
+ * @param dir スワイプ方向
+ */
+void ScreenVib::on_swipe(lv_dir_t dir)
+{
+    if (dir == LV_DIR_LEFT)
+    {
+        // 左スワイプでターミナル画面へ
+        change_screen(SCREEN_ID_TERMINAL, SCREEN_ANIM_LEFT);
+    }
+    else if (dir == LV_DIR_RIGHT)
+    {
+        // 右スワイプで姿勢の画面へ
+        change_screen(SCREEN_ID_ATTITUDE, SCREEN_ANIM_RIGHT);
+    }
+}
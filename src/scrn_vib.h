@@ -0,0 +1,40 @@
+/**
+ * @file scrn_vib.h
+ * @author amagai
+ * @brief 振動スペクトルの画面
+ * @version 0.1
+ * @date 2025-10-18
+ * 
+ * @copyright Copyright (c) 2025
+ * 
+ */
+#ifndef SCRN_VIB_H
+#define SCRN_VIB_H
+
+#include "screen_base.h"
+#include "screen_id.h"
+#include "vib_analyzer.h"
+
+class ScreenVib : public ScreenBase
+{
+protected:
+    lv_obj_t *label_title;
+    lv_obj_t *label_info;
+    lv_obj_t *label_fmax;
+    lv_obj_t *chart;
+    lv_chart_series_t *series;
+    VibAnalyzer *analyzer;
+    uint32_t last_seq;
+
+public:
+    ScreenVib();
+    void setup();
+    void loop();
+    void update();
+    static void callback(lv_event_t *e);
+    static void callback_timer(lv_timer_t *timer);
+    void on_swipe(lv_dir_t dir);
+    void set_analyzer(VibAnalyzer *a) { analyzer = a; }
+};
+
+#endif // SCRN_VIB_H
@@ -11,13 +11,28 @@
  * 時刻を元に生成される．
  * ファイルは常にcloseされた状態で，バッファからデータを書き込む時にのみ
  * 一時的にopenされ，appendされ，closeされる．
- * NMEAのデータであれば，3秒に1回程度の頻度で書き込まれる．
+ * 
+ * SDカードへのアクセスは全てI/Oスケジューラのタスクが行う．
+ * 各ロガーはバッファブロックにデータを溜め，一杯になったブロックを
+ * スケジューラに渡す．スケジューラは全ロガーのブロックを1回のSPI取得で
+ * まとめて書き込む．一杯にならないブロックも，sd_io_set_commit_interval()で
+ * 設定した時間を超えてバッファに留まることはない(グループコミット)．
+ * 
+ * sd_set_rotation()でファイルローテーションを設定できる．
+ * サイズによるローテーションと，UTCの時刻境界(例えば毎正時)による
+ * ローテーションを併用でき，全てのロガーは同じ境界でファイルを切り替える．
+ * 次のファイルは境界の前に作成しておくので，切り替え時に記録が遅れることはない．
+ * 
+ * set_compression()で圧縮を有効にすると，ブロックはSPIを取得する前に
+ * I/Oスケジューラのタスクで圧縮され，lz_block.hの形式のフレームとして書き込まれる．
  */
 
 #include "sd_logger.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
 
 
 // SDカードのSPIピン設定
@@ -29,9 +44,62 @@
 #define SD_SPI_MISO_PIN 38
 #define SD_SPI_MOSI_PIN 23
 
+// ファイル操作要求の種類
+#define SD_IO_OP_CREATE 1
+#define SD_IO_OP_REMOVE 2
+// 全ロガーが一度に次のファイルの削除と作成を要求しても溢れない長さにする
+#define SD_IO_OP_QUEUE_LEN (2 * SD_IO_MAX_LOGGERS)
+
 static bool sd_initialized = false;
 static volatile bool sd_fault= false;
 
+// ファイルローテーションの設定．全ロガー共通．
+static size_t rotation_max_bytes = 0;   // 0ならサイズによるローテーションなし
+static int rotation_period_sec = 0;     // 0なら時刻によるローテーションなし
+static time_t rotation_request = 0;     // サイズ超過で要求された切り替え時刻(UTC)
+static SimpleMutex rotation_mutex;
+
+// I/Oスケジューラ
+typedef struct {
+    int type;
+    char filename[96];
+} sd_io_op_t;
+
+static TaskHandle_t sd_io_handle = NULL;
+static QueueHandle_t sd_io_op_queue = NULL;
+static SimpleMutex sd_io_registry_mutex;
+static SDLogger *sd_io_loggers[SD_IO_MAX_LOGGERS];
+static volatile uint32_t sd_io_commit_ms = SD_IO_COMMIT_INTERVAL_MS;
+static volatile uint32_t sd_io_cycle_count = 0;
+static sd_io_stats_t sd_io_stats;
+
+// 圧縮用の作業領域．全ロガー共通で，I/Oスケジューラのタスクだけが使う．
+static uint8_t *sd_lz_window = NULL;    // 辞書(直前のブロック)と圧縮対象を連結した領域
+static uint8_t *sd_lz_frame = NULL;     // 圧縮後のフレーム
+static uint16_t *sd_lz_table = NULL;    // ハッシュテーブル
+
+
+/**
+ * @brief I/Oスケジューラ．SDカードへのアクセスはこのクラスのタスクだけが行う．
+ */
+class SDIOScheduler
+{
+public:
+    static void task(void *param);
+    static void cycle();
+    static void do_ops();
+    static int add(SDLogger *logger);
+    static void remove(SDLogger *logger);
+    static int post_op(int type, const char *name);
+    static void notify()
+    {
+        if( sd_io_handle != NULL )
+        {
+            xTaskNotifyGive(sd_io_handle);
+        }
+    }
+};
+
 
 /**
  * @brief SDカードの初期化を行う
@@ -53,6 +121,23 @@ int sd_init()
         sd_fault = true;
         return -1;
     }
+
+    // I/Oスケジューラの起動
+    sd_io_op_queue = xQueueCreate(SD_IO_OP_QUEUE_LEN, sizeof(sd_io_op_t));
+    if( sd_io_op_queue == NULL )
+    {
+        ESP_LOGE("SDLogger", "Failed to create I/O queue");
+        sd_fault = true;
+        return -1;
+    }
+    xTaskCreatePinnedToCore(SDIOScheduler::task, "SDIO", 4096, NULL, 1, &sd_io_handle, 1);
+    if( sd_io_handle == NULL )
+    {
+        ESP_LOGE("SDLogger", "Failed to create SDIO task");
+        sd_fault = true;
+        return -1;
+    }
+
     sd_initialized = true;
     sd_fault = false;
     return 0;
@@ -82,23 +167,393 @@ int sd_get_free_mb()
     {
         return -1;
     }
+    spi_mutex.lock(SPI_CLIENT_SD_INFO);
     uint64_t free_bytes = SD.totalBytes() - SD.usedBytes();
+    spi_mutex.unlock(SPI_CLIENT_SD_INFO);
     return free_bytes / (1024 * 1024);
 }
 
 
-SDLogger::SDLogger()
+/**
+ * @brief ファイルローテーションを設定する
+ * 
+ * @param max_bytes 1ファイルの最大サイズ(バイト)．0ならサイズによるローテーションを行わない
+ * @param period_sec ローテーション周期(秒)．0なら時刻によるローテーションを行わない
+ * 
+ * 周期はUTCの0時を起点とした境界で切り替わる．3600なら毎正時．
+ * 全てのロガーに共通の設定で，ロガーの開始前に呼び出すこと．
+ */
+void sd_set_rotation(size_t max_bytes, int period_sec)
+{
+    rotation_mutex.lock();
+    rotation_max_bytes = max_bytes;
+    rotation_period_sec = (period_sec > 0) ? period_sec : 0;
+    rotation_mutex.unlock();
+}
+
+
+/**
+ * @brief 全てのロガーにファイルの切り替えを要求する
+ * 
+ * 次の秒の境界で，全てのロガーが同時に新しいファイルに切り替わる．
+ * 既に要求済みで切り替え前の場合は何もしない．
+ */
+void sd_request_rotation()
 {
-    log_buffer = new uint8_t[buffer_size];
-    if( log_buffer == NULL ) 
+    time_t now = time(NULL);
+
+    rotation_mutex.lock();
+    if( rotation_request <= now )
     {
-        sd_fault = true;
-        ESP_LOGE("SDLogger", "Failed to allocate log buffer");
+        rotation_request = now + 1;
+    }
+    rotation_mutex.unlock();
+}
+
+
+/**
+ * @brief 次のローテーション時刻を求める
+ * 
+ * @param file_time 現在のファイルの開始時刻(UTC)
+ * @return time_t 次にファイルを切り替える時刻(UTC)．ローテーションしない場合は0
+ */
+static time_t sd_rotation_boundary(time_t file_time)
+{
+    time_t boundary = 0;
+    time_t request;
+
+    rotation_mutex.lock();
+    if( rotation_period_sec > 0 )
+    {
+        boundary = (file_time / rotation_period_sec + 1) * rotation_period_sec;
+    }
+    request = rotation_request;
+    rotation_mutex.unlock();
+
+    if( request > file_time && (boundary == 0 || request < boundary) )
+    {
+        boundary = request;
+    }
+    return boundary;
+}
+
+
+/**
+ * @brief 現在時刻までに過ぎた最後のローテーション時刻を求める
+ * 
+ * @param file_time 現在のファイルの開始時刻(UTC)
+ * @param now 現在時刻(UTC)
+ * @return time_t file_timeより後でnow以前の最後の切り替え時刻(UTC)．無ければ0
+ * 
+ * 書き込みが途絶えていた間に複数の境界を過ぎていても，空のファイルを作らずに今の区間のファイルへ切り替えるために使う．
+ */
+static time_t sd_rotation_last_boundary(time_t file_time, time_t now)
+{
+    time_t boundary = 0;
+    time_t request;
+
+    rotation_mutex.lock();
+    if( rotation_period_sec > 0 )
+    {
+        boundary = now / rotation_period_sec * rotation_period_sec;
+    }
+    request = rotation_request;
+    rotation_mutex.unlock();
+
+    if( request <= now && request > boundary )
+    {
+        boundary = request;
+    }
+    return (boundary > file_time) ? boundary : 0;
+}
+
+
+/**
+ * @brief データがバッファに留まる最大時間を設定する
+ * 
+ * @param ms 最大時間(ms)
+ * 
+ * 電源断などで失われる可能性があるデータの時間幅の上限になる．
+ * 短くするとSDカードへの書き込み回数が増える．
+ */
+void sd_io_set_commit_interval(uint32_t ms)
+{
+    if( ms < 100 )
+    {
+        ms = 100;
+    }
+    sd_io_commit_ms = ms;
+    SDIOScheduler::notify();
+}
+
+
+/**
+ * @brief I/Oスケジューラが書き込み待ちのブロックを書き込むまで待つ
+ * 
+ * 呼び出し時点でスケジューラに渡されているブロックとファイル操作が
+ * 全て処理されてから戻る．
+ */
+void sd_io_sync()
+{
+    uint32_t start;
+
+    if( sd_io_handle == NULL || xTaskGetCurrentTaskHandle() == sd_io_handle )
+    {
+        return;
+    }
+    // 処理中のサイクルは要求より前に始まっている可能性があるので，2サイクル待つ
+    start = sd_io_cycle_count;
+    while( (uint32_t)(sd_io_cycle_count - start) < 2 )
+    {
+        SDIOScheduler::notify();
+        vTaskDelay(1);
+    }
+}
+
+
+/**
+ * @brief I/Oスケジューラの統計を取得する
+ * 
+ * @return sd_io_stats_t 統計情報
+ */
+sd_io_stats_t sd_io_get_stats()
+{
+    return sd_io_stats;
+}
+
+
+/**
+ * @brief ロガーをI/Oスケジューラに登録する
+ * 
+ * @param logger 登録するロガー
+ * @return int 成功すれば0，登録できる数を超えた場合は-1
+ */
+int SDIOScheduler::add(SDLogger *logger)
+{
+    int rtn = -1;
+
+    sd_io_registry_mutex.lock();
+    for( int i = 0; i < SD_IO_MAX_LOGGERS; i++ )
+    {
+        if( sd_io_loggers[i] == logger )
+        {
+            rtn = 0;
+            break;
+        }
+    }
+    if( rtn != 0 )
+    {
+        for( int i = 0; i < SD_IO_MAX_LOGGERS; i++ )
+        {
+            if( sd_io_loggers[i] == NULL )
+            {
+                sd_io_loggers[i] = logger;
+                rtn = 0;
+                break;
+            }
+        }
+    }
+    sd_io_registry_mutex.unlock();
+    return rtn;
+}
+
+
+/**
+ * @brief ロガーの登録を解除する
+ * 
+ * @param logger 登録を解除するロガー
+ */
+void SDIOScheduler::remove(SDLogger *logger)
+{
+    sd_io_registry_mutex.lock();
+    for( int i = 0; i < SD_IO_MAX_LOGGERS; i++ )
+    {
+        if( sd_io_loggers[i] == logger )
+        {
+            sd_io_loggers[i] = NULL;
+        }
+    }
+    sd_io_registry_mutex.unlock();
+}
+
+
+/**
+ * @brief ファイルの作成・削除を要求する
+ * 
+ * @param type SD_IO_OP_CREATE または SD_IO_OP_REMOVE
+ * @param name ファイル名
+ * @return int 成功すれば0，キューが一杯なら-1
+ */
+int SDIOScheduler::post_op(int type, const char *name)
+{
+    sd_io_op_t op;
+
+    if( sd_io_op_queue == NULL )
+    {
+        return -1;
+    }
+    op.type = type;
+    strlcpy(op.filename, name, sizeof(op.filename));
+    if( xQueueSend(sd_io_op_queue, &op, 0) != pdTRUE )
+    {
+        ESP_LOGW("SDLogger", "I/O op queue full");
+        return -1;
+    }
+    notify();
+    return 0;
+}
+
+
+/**
+ * @brief ファイルの作成・削除要求を処理する．要求毎にSPIを取得する．
+ */
+void SDIOScheduler::do_ops()
+{
+    sd_io_op_t op;
+    File file;
+
+    while( xQueueReceive(sd_io_op_queue, &op, 0) == pdTRUE )
+    {
+        if( sd_fault )
+        {
+            continue;
+        }
+        spi_mutex.lock(SPI_CLIENT_SD);
+        if( op.type == SD_IO_OP_CREATE )
+        {
+            file = SD.open(op.filename, FILE_WRITE);
+            if( !file )
+            {
+                sd_fault = true;
+                ESP_LOGE("SDLogger", "Failed to create log file");
+            }
+            else
+            {
+                file.close();
+            }
+        }
+        else if( op.type == SD_IO_OP_REMOVE )
+        {
+            SD.remove(op.filename);
+        }
+        spi_mutex.unlock(SPI_CLIENT_SD);
+    }
+}
+
+
+/**
+ * @brief I/Oスケジューラの1サイクル
+ * 
+ * 各ロガーのローテーションを確認して古くなったブロックを確定させ，
+ * 書き込み待ちのブロックがあれば全ロガーの分をまとめて書き込む．
+ * SPIはファイルの操作とSD_IO_CHUNK_BYTES毎の書き込みの度に取得し直し，間にLCDの転送が入れるようにする．
+ * 圧縮はio_collect()で行うので，SPIの占有時間には含まれない．
+ */
+void SDIOScheduler::cycle()
+{
+    uint32_t now_ms = millis();
+    uint32_t commit_ms = sd_io_commit_ms;
+    int pending = 0;
+    SDLogger *loggers[SD_IO_MAX_LOGGERS];
+    int64_t t0, t1;
+    uint32_t window;
+
+    sd_io_registry_mutex.lock();
+    memcpy(loggers, sd_io_loggers, sizeof(loggers));
+    // 登録解除はレジストリを取得してから行うので，このサイクル中はロガーは削除されない
+    for( int i = 0; i < SD_IO_MAX_LOGGERS; i++ )
+    {
+        if( loggers[i] != NULL )
+        {
+            pending += loggers[i]->io_collect(now_ms, commit_ms);
+        }
+    }
+    pending += uxQueueMessagesWaiting(sd_io_op_queue);
+
+    if( pending > 0 )
+    {
+        t0 = esp_timer_get_time();
+        do_ops();
+        for( int i = 0; i < SD_IO_MAX_LOGGERS; i++ )
+        {
+            if( loggers[i] != NULL )
+            {
+                loggers[i]->io_write(now_ms);
+            }
+        }
+        t1 = esp_timer_get_time();
+
+        window = (uint32_t)(t1 - t0);
+        sd_io_stats.cycles++;
+        sd_io_stats.total_window_us += window;
+        if( window > sd_io_stats.max_window_us )
+        {
+            sd_io_stats.max_window_us = window;
+        }
+    }
+    sd_io_registry_mutex.unlock();
+}
+
+
+/**
+ * @brief I/Oスケジューラのタスク
+ * 
+ * @param param 未使用
+ * 
+ * ブロックが一杯になった時などに通知で起こされる．
+ * 通知が無くても，コミット間隔の1/4毎に起きて古いブロックを書き込む．
+ */
+void SDIOScheduler::task(void *param)
+{
+    uint32_t wait_ms;
+
+    while( true )
+    {
+        wait_ms = sd_io_commit_ms / 4;
+        ulTaskNotifyTake(pdTRUE, wait_ms / portTICK_PERIOD_MS);
+        cycle();
+        sd_io_cycle_count++;
     }
+}
+
+
+SDLogger::SDLogger()
+{
     prefix[0] = '\0';
+    strlcpy(suffix, ".log", sizeof(suffix));
     filename[0] = '\0';
-    buffer_pos = 0;
+    next_filename[0] = '\0';
+    active = NULL;
+    num_pending = 0;
+    compress = false;
+    lz_prev = NULL;
+    lz_prev_len = 0;
+    lz_since_key = 0;
+    lz_file[0] = '\0';
+    file_time = 0;
+    file_bytes = 0;
+    next_time = 0;
+    memset(&stats, 0, sizeof(stats));
+    dropping = false;
     sd_status = SD_STATUS_ERROR;
+
+    for( int i = 0; i < SD_LOGGER_NUM_BLOCKS; i++ )
+    {
+        sd_block_t *blk = &blocks[i];
+        // 圧縮できないブロックはヘッダ分だけ大きくなる
+        blk->data = new uint8_t[buffer_size + sizeof(lzb_frame_header_t)];
+        blk->len = 0;
+        blk->raw_len = 0;
+        blk->first_ms = 0;
+        blk->filename[0] = '\0';
+        if( blk->data == NULL )
+        {
+            sd_fault = true;
+            ESP_LOGE("SDLogger", "Failed to allocate log buffer");
+            continue;
+        }
+        free_queue.push(blk);
+    }
 }
 
 
@@ -108,7 +563,12 @@ SDLogger::~SDLogger()
     {
         close();
     }
-    delete[] log_buffer;
+    SDIOScheduler::remove(this);
+    for( int i = 0; i < SD_LOGGER_NUM_BLOCKS; i++ )
+    {
+        delete[] blocks[i].data;
+    }
+    delete[] lz_prev;
 }
 
 
@@ -125,17 +585,69 @@ int SDLogger::set_prefix(const char* pre)
 }
 
 
+/**
+ * @brief 生成するファイル名の拡張子を設定する
+ * 
+ * @param suf 拡張子．"."を含める．デフォルトは".log"
+ * @return int 0
+ */
+int SDLogger::set_suffix(const char* suf)
+{
+    strlcpy(suffix, suf, sizeof(suffix));
+    return 0;
+}
+
+
+/**
+ * @brief 圧縮の有無を設定する
+ * 
+ * @param enable trueなら圧縮する
+ * @return int 成功すれば0，開始済みかメモリが確保できない場合は-1
+ * 
+ * start()の前に呼び出すこと．拡張子はset_suffix()で別途設定する．
+ * 圧縮したファイルはtools/nmea_unpackで展開できる．
+ */
+int SDLogger::set_compression(bool enable)
+{
+    if( sd_status == SD_STATUS_READY )
+    {
+        return -1;
+    }
+    if( enable )
+    {
+        if( sd_lz_window == NULL )
+        {
+            sd_lz_window = new uint8_t[LZB_MAX_WINDOW];
+            sd_lz_frame = new uint8_t[LZB_MAX_FRAME_SIZE];
+            sd_lz_table = new uint16_t[LZB_TABLE_SIZE / sizeof(uint16_t)];
+        }
+        if( lz_prev == NULL )
+        {
+            lz_prev = new uint8_t[buffer_size];
+        }
+        if( sd_lz_window == NULL || sd_lz_frame == NULL || sd_lz_table == NULL || lz_prev == NULL )
+        {
+            ESP_LOGE("SDLogger", "Failed to allocate compression buffer");
+            return -1;
+        }
+    }
+    compress = enable;
+    return 0;
+}
+
+
 /**
  * @brief SDカードのロガーを開始する．
  * 
  * @return int 成功すれば0，失敗すれば-1
  * 
  * ファイル名は，プリフィクス_YYYYMMDD_HHMMSS.logの形式で生成される．
+ * 拡張子はset_suffix()で変更できる．
+ * ファイルの作成はI/Oスケジューラが行う．
  */
 int SDLogger::start() 
 {
     time_t now = time(NULL);
-    struct tm *t = localtime(&now);
 
     if( (!sd_initialized) || sd_fault ) 
     {
@@ -148,28 +660,139 @@ int SDLogger::start()
         // すでに開始されている場合は何もしない
         return 0;
     }
+
+    mutex.lock();
     // ファイル名を生成
-    strlcpy(filename, prefix, sizeof(filename));
-    int n = strlen(filename);
-    strftime(filename + n, sizeof(filename) - n, "_%Y%m%d_%H%M%S.log", t);
+    make_filename(filename, sizeof(filename), now);
+    file_time = now;
+    file_bytes = 0;
+    next_time = 0;
+    memset(&stats, 0, sizeof(stats));
+    stats.start_ms = millis();
+    dropping = false;
+    lz_prev_len = 0;
+    lz_file[0] = '\0';
+    mutex.unlock();
 
-    spi_mutex.lock();
-    logFile = SD.open(filename, FILE_WRITE);
-    if (!logFile) 
+    if( SDIOScheduler::add(this) != 0 )
     {
-        sd_status = SD_STATUS_ERROR;
-        sd_fault = true;
-        spi_mutex.unlock();
+        ESP_LOGE("SDLogger", "Too many loggers");
+        return -1;
+    }
+    if( SDIOScheduler::post_op(SD_IO_OP_CREATE, filename) != 0 )
+    {
+        SDIOScheduler::remove(this);
         return -1;
     }
     sd_status = SD_STATUS_READY;
-    buffer_pos = 0;
-    logFile.close();
-    spi_mutex.unlock();
     return 0;
 }
 
 
+/**
+ * @brief ファイル名を生成する
+ * 
+ * @param buf ファイル名の格納先
+ * @param size bufのサイズ
+ * @param t ファイルの開始時刻
+ * 
+ * ファイル名は，プリフィクス_YYYYMMDD_HHMMSS.logの形式．拡張子はsuffixで決まる．
+ */
+void SDLogger::make_filename(char *buf, size_t size, time_t t)
+{
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    strlcpy(buf, prefix, size);
+    int n = strlen(buf);
+    strftime(buf + n, size - n, "_%Y%m%d_%H%M%S", &tm);
+    strlcat(buf, suffix, size);
+}
+
+
+/**
+ * @brief 書き込み中のブロックを確定させ，I/Oスケジューラに渡す．mutexを取得してから呼ぶこと．
+ */
+void SDLogger::seal_block()
+{
+    if( active == NULL )
+    {
+        return;
+    }
+    if( active->len == 0 )
+    {
+        return;
+    }
+    strlcpy(active->filename, filename, sizeof(active->filename));
+    active->raw_len = active->len;
+    // ブロックの総数とキューの長さが同じなので，書き込みは失敗しない
+    ready_queue.push(active);
+    active = NULL;
+}
+
+
+/**
+ * @brief ファイルのローテーションを行う．mutexを取得してから呼ぶこと．
+ * 
+ * @param now 現在時刻(UTC)
+ * 
+ * 次の境界が決まったら，その時点で次のファイルの作成を要求しておく．
+ * 要求の待ち行列が一杯で失敗した時は，次の書き込みかI/Oスケジューラの次のサイクルで要求し直す．
+ * 境界を過ぎたら，書き込み中のブロックを古いファイル宛てに確定させてから
+ * 現在時刻の区間のファイルに切り替える．事前に作成できていなくても，書き込み時に追記で作られる．
+ */
+void SDLogger::check_rotation(time_t now)
+{
+    time_t boundary = sd_rotation_boundary(file_time);
+
+    if( boundary == 0 )
+    {
+        return;
+    }
+
+    if( now < boundary )
+    {
+        if( boundary != next_time )
+        {
+            // 境界が変わった(サイズ超過による切り替え要求など)ので，次のファイルを作り直す
+            if( next_time != 0 )
+            {
+                SDIOScheduler::post_op(SD_IO_OP_REMOVE, next_filename);
+                next_time = 0;
+            }
+            make_filename(next_filename, sizeof(next_filename), boundary);
+            if( SDIOScheduler::post_op(SD_IO_OP_CREATE, next_filename) == 0 )
+            {
+                next_time = boundary;
+            }
+        }
+        return;
+    }
+
+    // 境界を過ぎたので，書き込み中のブロックを古いファイル宛てに確定させて切り替える．
+    // 書き込みが途絶えていた間に過ぎた境界の分のファイルは作らない
+    boundary = sd_rotation_last_boundary(file_time, now);
+    if( boundary == 0 )
+    {
+        return;
+    }
+    seal_block();
+    SDIOScheduler::notify();
+    if( boundary != next_time )
+    {
+        if( next_time != 0 )
+        {
+            SDIOScheduler::post_op(SD_IO_OP_REMOVE, next_filename);
+        }
+        make_filename(next_filename, sizeof(next_filename), boundary);
+    }
+    strlcpy(filename, next_filename, sizeof(filename));
+    file_time = boundary;
+    file_bytes = 0;
+    next_time = 0;
+}
+
+
 /**
  * @brief SDカードのロガーを再起動する
  * 
@@ -192,6 +815,8 @@ int SDLogger::restart()
  * @brief SDカードのロガーを閉じる
  * 
  * @return int 成功すれば0，失敗すれば-1
+ * 
+ * バッファに残っているデータが書き込まれるまで待つ．
  */
 int SDLogger::close() 
 {
@@ -200,7 +825,19 @@ int SDLogger::close()
         return -1;
     }
     flush();
+
+    mutex.lock();
+    if( next_time != 0 )
+    {
+        // 事前に作成した次のファイルは不要になった
+        SDIOScheduler::post_op(SD_IO_OP_REMOVE, next_filename);
+        next_time = 0;
+    }
     sd_status = SD_STATUS_ERROR;
+    mutex.unlock();
+
+    sd_io_sync();
+    SDIOScheduler::remove(this);
     return 0;
 }
 
@@ -211,74 +848,76 @@ int SDLogger::close()
  * @param data 書き込むデータ
  * @param length データの長さ
  * @return int 成功すれば0，失敗すれば-1
+ * 
+ * データはバッファブロックにコピーされるだけで，SDカードへの書き込みは
+ * I/Oスケジューラが行う．空きブロックが無い場合はデータを捨てて統計に記録する．
  */
 int SDLogger::write_data(const uint8_t* data, size_t length) 
 {
+    size_t n;
+
     if (sd_status != SD_STATUS_READY) 
     {
         return -1;
     }
-    // バッファに収まる場合は，バッファに追加するだけで終了
-    if (buffer_pos + length < buffer_size) 
-    {
-        memcpy(log_buffer + buffer_pos, data, length);
-        buffer_pos += length;
-        return 0;
-    }
-    // バッファに収まらない場合は，バッファをフラッシュしてから追加
-    spi_mutex.lock();
-    logFile = SD.open(filename, FILE_APPEND);
-    if (!logFile) 
+
+    mutex.lock();
+    // ローテーションの確認．次のファイルの準備に失敗しても今のファイルに書き続ける
+    check_rotation(time(NULL));
+    file_bytes += length;
+    if( rotation_max_bytes > 0 && file_bytes >= rotation_max_bytes )
     {
-        sd_status = SD_STATUS_ERROR;
-        sd_fault = true;
-        spi_mutex.unlock();
-        ESP_LOGE("SDLogger", "Failed to open log file");
-        return -1;
+        sd_request_rotation();
     }
-    if (buffer_pos > 0) 
+
+    while( length > 0 )
     {
-        if( logFile.write(log_buffer, buffer_pos) != buffer_pos )
+        if( active == NULL )
         {
-            sd_fault = true;
-            sd_status = SD_STATUS_ERROR;
-            logFile.close();
-            spi_mutex.unlock();
-            ESP_LOGE("SDLogger", "Failed to write data");
-            return -1;
+            if( !free_queue.pop(active) )
+            {
+                // 空きブロックが無い．SDカードの書き込みが追いついていない．
+                // 捨てた量は統計に数え，高いレートでUARTを溢れさせないよう警告は詰まる度に1回だけ出す
+                active = NULL;
+                stats.dropped_bytes += length;
+                if( !dropping )
+                {
+                    ESP_LOGW("SDLogger", "%s: no free block, dropping data", prefix);
+                    dropping = true;
+                }
+                SDIOScheduler::notify();
+                break;
+            }
+            dropping = false;
+            active->len = 0;
+            active->first_ms = millis();
         }
-        buffer_pos = 0;
-    }
-
-    if (length > buffer_size) 
-    {
-        // データがバッファサイズを超える場合は直接書き込む
-        if( logFile.write(data, length) != length )
+        n = buffer_size - active->len;
+        if( n > length )
         {
-            sd_fault = true;
-            sd_status = SD_STATUS_ERROR;
-            logFile.close();
-            spi_mutex.unlock();
-            ESP_LOGE("SDLogger", "Failed to write data");
-            return -1;
+            n = length;
+        }
+        memcpy(active->data + active->len, data, n);
+        active->len += n;
+        data += n;
+        length -= n;
+        if( active->len >= buffer_size )
+        {
+            seal_block();
+            SDIOScheduler::notify();
         }
-        logFile.flush();
-    } 
-    else 
-    {
-        memcpy(log_buffer, data, length);
-        buffer_pos = length;
     }
-    logFile.close();
-    spi_mutex.unlock();
+    mutex.unlock();
     return 0;
 }
 
 
 /**
- * @brief 現在のバッファ内容をSDカードにフラッシュする
+ * @brief 現在のバッファ内容をSDカードに書き込む
  * 
  * @return int 成功すれば0，失敗すれば-1
+ * 
+ * I/Oスケジューラが書き込みを終えるまで待つ．
  */
 int SDLogger::flush() 
 {
@@ -286,31 +925,241 @@ int SDLogger::flush()
     {
         return -1;
     }
-    spi_mutex.lock();
-    logFile = SD.open(filename, FILE_APPEND);
-    if (!logFile) 
+    mutex.lock();
+    seal_block();
+    mutex.unlock();
+    sd_io_sync();
+    return (sd_status == SD_STATUS_READY) ? 0 : -1;
+}
+
+
+/**
+ * @brief 書き込み統計を取得する
+ * 
+ * @return sd_logger_stats_t 統計情報
+ */
+sd_logger_stats_t SDLogger::get_stats()
+{
+    sd_logger_stats_t s;
+
+    mutex.lock();
+    s = stats;
+    mutex.unlock();
+    return s;
+}
+
+
+/**
+ * @brief 名前と書き込み統計を写す
+ * 
+ * @param snap 格納先
+ * @return int 成功すれば0，記録していなければ-1
+ */
+int SDLogger::get_snapshot(sd_logger_snapshot_t *snap)
+{
+    if( sd_status != SD_STATUS_READY )
     {
-        sd_status = SD_STATUS_ERROR;
-        sd_fault = true;
-        spi_mutex.unlock();
-        ESP_LOGE("SDLogger", "Failed to open log file");
         return -1;
     }
-    if (buffer_pos > 0) 
+    strlcpy(snap->prefix, prefix, sizeof(snap->prefix));
+    snap->stats = get_stats();
+    return 0;
+}
+
+
+/**
+ * @brief 古くなったブロックを確定させ，書き込み待ちのブロックを取り出す．I/Oスケジューラから呼ばれる．
+ * 
+ * @param now_ms 現在時刻(millis)
+ * @param commit_ms データがバッファに留まる最大時間(ms)
+ * @return int 書き込み待ちのブロック数
+ * 
+ * 書き込みが無くても周期の境界で全ロガーが揃って切り替わるよう，ローテーションもここで確認する．
+ * 圧縮が有効なら，取り出したブロックをここで圧縮する．
+ */
+int SDLogger::io_collect(uint32_t now_ms, uint32_t commit_ms)
+{
+    sd_block_t *blk;
+
+    mutex.lock();
+    if( sd_status == SD_STATUS_READY )
+    {
+        check_rotation(time(NULL));
+    }
+    if( active != NULL && active->len > 0 && (uint32_t)(now_ms - active->first_ms) >= commit_ms )
+    {
+        seal_block();
+    }
+    mutex.unlock();
+
+    while( num_pending < SD_LOGGER_NUM_BLOCKS && ready_queue.pop(blk) )
+    {
+        if( compress )
+        {
+            io_encode(blk);
+        }
+        pending[num_pending++] = blk;
+    }
+    return num_pending;
+}
+
+
+/**
+ * @brief ブロックを圧縮してフレームに置き換える．I/Oスケジューラから呼ばれる．
+ * 
+ * @param blk 圧縮するブロック
+ * 
+ * 直前のブロックを辞書として使う．ファイルの先頭と，SD_LZ_KEYFRAME_INTERVAL
+ * ブロック毎には辞書を使わないキーフレームにする．
+ */
+void SDLogger::io_encode(sd_block_t *blk)
+{
+    size_t dict_len = lz_prev_len;
+    size_t n;
+    lzb_frame_header_t header;
+
+    if( strcmp(lz_file, blk->filename) != 0 || lz_since_key >= SD_LZ_KEYFRAME_INTERVAL )
+    {
+        dict_len = 0;
+    }
+    memcpy(sd_lz_window, lz_prev, dict_len);
+    memcpy(sd_lz_window + dict_len, blk->data, blk->len);
+    n = lzb_encode_frame(sd_lz_window, dict_len, blk->len, sd_lz_frame, sd_lz_table);
+    if( n == 0 )
+    {
+        return;     // ブロックサイズはLZB_MAX_RAW_SIZE以下なので起こらない
+    }
+    memcpy(&header, sd_lz_frame, sizeof(header));
+    lz_since_key = (header.flags & LZB_FLAG_KEYFRAME) ? 1 : lz_since_key + 1;
+
+    memcpy(lz_prev, blk->data, blk->len);
+    lz_prev_len = blk->len;
+    strlcpy(lz_file, blk->filename, sizeof(lz_file));
+
+    memcpy(blk->data, sd_lz_frame, n);
+    blk->raw_len = blk->len;
+    blk->len = n;
+}
+
+
+/**
+ * @brief SPIをSD_IO_CHUNK_BYTES毎に取得し直しながら書き込む
+ * 
+ * @param file 書き込むファイル
+ * @param data データ
+ * @param len バイト数
+ * @return size_t 書き込んだバイト数
+ * 
+ * 最初のチャンクはファイル位置がセクタ境界に揃うように短くする．
+ */
+static size_t sd_write_chunked(File &file, const uint8_t *data, size_t len)
+{
+    size_t done = 0;
+    size_t pos = file.position();
+    size_t n, w;
+
+    while( done < len )
+    {
+        n = SD_IO_CHUNK_BYTES - (pos + done) % SD_IO_CHUNK_BYTES;
+        if( n > len - done )
+        {
+            n = len - done;
+        }
+        spi_mutex.lock(SPI_CLIENT_SD);
+        w = file.write(data + done, n);
+        spi_mutex.unlock(SPI_CLIENT_SD);
+        done += w;
+        if( w != n )
+        {
+            break;
+        }
+    }
+    return done;
+}
+
+
+/**
+ * @brief io_collect()で取り出したブロックをSDカードに書き込む．I/Oスケジューラから呼ばれる．
+ * 
+ * @param now_ms サイクル開始時刻(millis)
+ * 
+ * 同じファイル宛ての連続したブロックは，1回のopenでまとめて書き込む．
+ * SPIはopen，close，チャンク毎の書き込みの間だけ取得する．
+ */
+void SDLogger::io_write(uint32_t now_ms)
+{
+    sd_block_t *blk;
+    File file;
+    char open_name[96];
+    int64_t t0;
+    uint32_t dt, risk;
+    bool ok;
+
+    open_name[0] = '\0';
+    for( int i = 0; i < num_pending; i++ )
     {
-        if( logFile.write(log_buffer, buffer_pos) != buffer_pos )
+        blk = pending[i];
+        ok = false;
+        if( !sd_fault )
+        {
+            t0 = esp_timer_get_time();
+            if( !file || strcmp(open_name, blk->filename) != 0 )
+            {
+                strlcpy(open_name, blk->filename, sizeof(open_name));
+                spi_mutex.lock(SPI_CLIENT_SD);
+                if( file )
+                {
+                    file.close();
+                }
+                file = SD.open(open_name, FILE_APPEND);
+                spi_mutex.unlock(SPI_CLIENT_SD);
+            }
+            if( !file )
+            {
+                ESP_LOGE("SDLogger", "Failed to open log file");
+            }
+            else if( sd_write_chunked(file, blk->data, blk->len) != blk->len )
+            {
+                ESP_LOGE("SDLogger", "Failed to write data");
+            }
+            else
+            {
+                ok = true;
+            }
+            dt = (uint32_t)(esp_timer_get_time() - t0);
+            risk = now_ms - blk->first_ms;
+
+            mutex.lock();
+            if( ok )
+            {
+                stats.bytes_written += blk->len;
+                stats.raw_bytes += blk->raw_len;
+                stats.blocks_written++;
+            }
+            stats.write_time_us += dt;
+            if( dt > stats.max_write_us )
+            {
+                stats.max_write_us = dt;
+            }
+            if( risk > stats.max_risk_ms )
+            {
+                stats.max_risk_ms = risk;
+            }
+            mutex.unlock();
+        }
+        if( !ok )
         {
             sd_fault = true;
             sd_status = SD_STATUS_ERROR;
-            logFile.close();
-            spi_mutex.unlock();
-            ESP_LOGE("SDLogger", "Failed to write data");
-            return -1;
         }
-        logFile.flush();
-        buffer_pos = 0;
+        blk->len = 0;
+        free_queue.push(blk);
+    }
+    num_pending = 0;
+    if( file )
+    {
+        spi_mutex.lock(SPI_CLIENT_SD);
+        file.close();
+        spi_mutex.unlock(SPI_CLIENT_SD);
     }
-    logFile.close();
-    spi_mutex.unlock();
-    return 0;
 }
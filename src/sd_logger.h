@@ -7,26 +7,130 @@
 #include <M5Unified.h>
 
 #include <time.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 
 #include "bus_mutex.h"
+#include "lz_block.h"
+#include "spsc_ring.h"
 
 #define SD_STATUS_ERROR 0
 #define SD_STATUS_READY 1
 
-class SDLogger 
+// 1ロガーあたりのバッファブロック数(2のべき乗)
+#define SD_LOGGER_NUM_BLOCKS 4
+// I/Oスケジューラに登録できるロガーの最大数
+#define SD_IO_MAX_LOGGERS 8
+// データがバッファに留まる最大時間(ms)のデフォルト値
+#define SD_IO_COMMIT_INTERVAL_MS 2000
+// SDカードへの書き込みでSPIを保持する単位(バイト)．この単位毎にLCDの転送に譲る
+#define SD_IO_CHUNK_BYTES 512
+// 圧縮時，このブロック数毎に直前のブロックに依存しないキーフレームを入れる
+#define SD_LZ_KEYFRAME_INTERVAL 16
+
+
+/**
+ * @brief ロガー毎の書き込み統計
+ */
+typedef struct {
+    uint32_t start_ms;          // 記録開始時刻(millis)
+    uint32_t bytes_written;     // 書き込んだバイト数
+    uint32_t raw_bytes;         // 書き込んだデータの圧縮前のバイト数
+    uint32_t blocks_written;    // 書き込んだブロック数
+    uint32_t write_time_us;     // 書き込みに要した時間の合計(us)
+    uint32_t max_write_us;      // 1ブロックの書き込みに要した最長時間(us)
+    uint32_t max_risk_ms;       // データが書き込まれるまでバッファに留まった最長時間(ms)
+    uint32_t dropped_bytes;     // バッファ不足で捨てたバイト数
+} sd_logger_stats_t;
+
+
+/**
+ * @brief ロガーの統計の写し．元のロガーを閉じた後も使える
+ */
+typedef struct {
+    char prefix[64];
+    sd_logger_stats_t stats;
+} sd_logger_snapshot_t;
+
+
+/**
+ * @brief I/Oスケジューラ全体の統計
+ */
+typedef struct {
+    uint32_t cycles;            // 書き込みを行った回数
+    uint32_t max_window_us;     // 1回の書き込みに要した最長時間(us)．SPIはチャンク毎に解放する
+    uint32_t total_window_us;   // 書き込みに要した時間の合計(us)
+} sd_io_stats_t;
+
+
+/**
+ * @brief 書き込み待ちのデータブロック
+ */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t raw_len;             // 圧縮前のバイト数
+    uint32_t first_ms;          // 最初のデータが書き込まれた時刻(millis)
+    char filename[96];          // 書き込み先のファイル名
+} sd_block_t;
+
+
+class SDIOScheduler;
+
+class SDLogger
 {
+    friend class SDIOScheduler;
+
 private:
-    int sd_status;
-    File logFile;
+    volatile int sd_status;
     char prefix[64];
+    char suffix[16];
     char filename[96];
-    uint8_t *log_buffer;
-    size_t buffer_pos;
     const size_t buffer_size = 4096; // バッファサイズ
 
+    // バッファブロック．activeに書き込み，一杯になるか古くなったら
+    // ready_queueに移してI/Oスケジューラに書き込んでもらう．
+    SimpleMutex mutex;          // active, ファイル名，ローテーション状態を保護する
+    sd_block_t blocks[SD_LOGGER_NUM_BLOCKS];
+    sd_block_t *active;
+    // 書き込み側はmutexで排他したロガーの利用者，読み出し側はI/Oスケジューラ(ready_queue)．
+    // free_queueはその逆．
+    SpscRing<sd_block_t *, SD_LOGGER_NUM_BLOCKS> free_queue;
+    SpscRing<sd_block_t *, SD_LOGGER_NUM_BLOCKS> ready_queue;
+    sd_logger_stats_t stats;
+    bool dropping;              // 空きブロックが無くて捨てている間true．警告は捨て始めに1回だけ出す
+
+    // I/Oスケジューラが書き込み待ちキューから取り出したブロック
+    sd_block_t *pending[SD_LOGGER_NUM_BLOCKS];
+    int num_pending;
+
+    // 圧縮
+    bool compress;
+    uint8_t *lz_prev;           // 直前のブロック(圧縮前)．次のブロックの辞書になる
+    size_t lz_prev_len;
+    int lz_since_key;           // 直前のキーフレームからのブロック数
+    char lz_file[96];           // 直前のブロックの書き込み先
+
+    // ファイルローテーション
+    time_t file_time;           // 現在のファイルの開始時刻(UTC)
+    size_t file_bytes;          // 現在のファイルに書き込んだバイト数
+    time_t next_time;           // 事前に作成済みの次のファイルの開始時刻．0なら未作成
+    char next_filename[96];     // 事前に作成済みの次のファイル名
+
+    void make_filename(char *buf, size_t size, time_t t);
+    void check_rotation(time_t now);
+    void seal_block();
+    void io_encode(sd_block_t *blk);
+
+    // I/Oスケジューラから呼ばれる
+    int io_collect(uint32_t now_ms, uint32_t commit_ms);
+    void io_write(uint32_t now_ms);
+
 public:
     SDLogger();
     int set_prefix(const char* pre);
+    int set_suffix(const char* suf);
+    int set_compression(bool enable);
     int start();
     int restart();
     int close();
@@ -35,11 +139,18 @@ public:
     int flush();
     ~SDLogger();
     int get_status(){ return sd_status; }
-
+    const char *get_prefix(){ return prefix; }
+    sd_logger_stats_t get_stats();
+    int get_snapshot(sd_logger_snapshot_t *snap);
 };
 
 extern int sd_init();
 extern bool sd_is_fault();
 extern int sd_get_free_mb();
+extern void sd_set_rotation(size_t max_bytes, int period_sec);
+extern void sd_request_rotation();
+extern void sd_io_set_commit_interval(uint32_t ms);
+extern void sd_io_sync();
+extern sd_io_stats_t sd_io_get_stats();
 
 #endif // SD_LOGGER_H
@@ -10,103 +10,431 @@
  */
 
 #include "sensor_logger.h"
+#include "imu_binlog.h"
+#include "fast_format.h"
+#include "spsc_ring.h"
+#include "bmi270_fifo.h"
+#include "imu_clock.h"
+#include "imu_resampler.h"
+#include "imu_filter.h"
+#include "vib_analyzer.h"
+#include "ahrs.h"
+#include "gnss_ins.h"
+#include "bmp280.h"
+#include "alt_filter.h"
+#include "simple_mutex.h"
 #include "M5Module_GNSS.h"
+#include <esp_timer.h>
 
+static volatile bool terminate_sensor_sampling = false;
 static volatile bool terminate_sensor_logging = false;
+// ロギングタスクが記録を受け取れる間だけtrue．falseの間はサンプリングタスクがキューに積まない
+static volatile bool sensor_logging_active = false;
 static TaskHandle_t sensor_sampler_handle;
 static TaskHandle_t sensor_logger_handle;
 
 static volatile bool sensor_sampler_terminated = false;
 static volatile bool sensor_logger_terminated = false;
+static SDLogger * volatile imu_logger = NULL;
+// 記録中のロガーのポインタを外す時と，統計を写す時に取る
+static SimpleMutex sd_logger_mutex;
+static volatile int imu_log_format = IMU_LOG_FORMAT_CSV;
+static volatile int imu_sample_rate = IMU_SAMPLE_RATE_POLL;
+static volatile int imu_output_rate = 0;
+static volatile int imu_decim_method = IMU_DECIM_FIR;
+static volatile float imu_lowpass_hz = 0.0f;
+static VibAnalyzer * volatile vib_analyzer = NULL;
+static volatile bool ahrs_enable = false;
+static volatile int ahrs_log_rate = 0;
 
 #define BIM270_SENSOR_ADDR 0x68
 BMI270::BMI270 bmi270;
+static Bmi270Fifo bmi270_fifo(BIM270_SENSOR_ADDR);
+static bmi270_sample_t fifo_samples[BMI270_FIFO_MAX_FRAMES];
 
-class IMUFifo 
+// センサ時刻をUTCに変換する．サンプリングタスクだけが使う
+static ImuClock imu_clock(BMI270_SENSORTIME_NS / 1000.0);
+static ImuResampler imu_resampler(0);
+static imu_record_t resampled[IMU_RESAMPLE_MAX_OUT];
+// 間引きフィルタの作業領域(チャネル毎)
+static float filter_buf[IMU_FILTER_CHANNELS][BMI270_FIFO_MAX_FRAMES];
+// 姿勢推定．サンプリングタスクだけが更新する
+static Ahrs ahrs(IMU_SAMPLE_RATE_POLL);
+// 最新の姿勢．画面から読む
+static SimpleMutex ahrs_mutex;
+static ahrs_record_t ahrs_latest;
+static bool ahrs_latest_valid = false;
+// サンプリングタスクからロギングタスクへの姿勢の記録
+static SpscRing<ahrs_record_t, AHRS_LOG_QUEUE_SIZE> ahrs_queue;
+static ahrs_record_t ahrs_log_buf[AHRS_LOG_BATCH];
+static SDLogger * volatile ahrs_logger = NULL;
+// GNSS/INSはサンプリングタスクだけが更新する．測位はキューで受け取る
+static GnssIns gnss_ins;
+static volatile bool ins_enable = false;
+static volatile int ins_rate = 100;
+static volatile int ins_log_rate = 0;
+static SpscRing<gnss_fix_t, GNSS_INS_FIX_QUEUE_SIZE> fix_queue;
+static SpscRing<gnss_ins_output_t, GNSS_INS_LOG_QUEUE_SIZE> ins_queue;
+static SimpleMutex ins_mutex;
+static gnss_ins_output_t ins_latest;
+static bool ins_latest_valid = false;
+static SDLogger * volatile ins_logger = NULL;
+// 気圧センサ．I2Cはサンプリングタスクが読み出しの度に排他する
+static Bmp280 * volatile baro = NULL;
+static volatile int baro_rate = 0;
+static SpscRing<baro_record_t, BARO_LOG_QUEUE_SIZE> baro_queue;
+static SimpleMutex baro_mutex;
+static baro_record_t baro_latest;
+static bool baro_latest_valid = false;
+static SDLogger * volatile baro_logger = NULL;
+// 高度の推定．気圧の読み出し毎に更新する
+static AltFilter alt_filter;
+static volatile bool alt_enable = false;
+static volatile bool alt_use_imu = false;
+static float alt_acc_sum = 0.0f;        // 前回の気圧からの鉛直加速度の和(m/s^2)
+static int alt_acc_n = 0;
+static SpscRing<alt_output_t, ALT_LOG_QUEUE_SIZE> alt_queue;
+static SimpleMutex alt_mutex;
+static alt_output_t alt_latest;
+static bool alt_latest_valid = false;
+static SDLogger * volatile alt_logger = NULL;
+// メインループ(書き込み側)からサンプリングタスク(読み出し側)へのPPSエッジ
+static SpscRing<imu_pps_edge_t, IMU_PPS_QUEUE_SIZE> pps_queue;
+
+// サンプリングタスクからロギングタスクへのFIFO
+typedef SpscRing<imu_record_t, IMU_FIFO_SIZE> IMUFifo;
+
+static IMUFifo *imufifo = NULL;
+
+// ロギングタスクの統計．ロギングタスクだけが更新する
+static imu_logger_stats_t imu_log_stats;
+static char csv_buf[IMU_LOG_CSV_BUF_SIZE];
+
+
+/**
+ * @brief FIFOがウォーターマークを超えていればロギングタスクを起こす．サンプリングタスクから呼ぶ．
+ */
+static void notify_logger()
+{
+    TaskHandle_t handle = sensor_logger_handle;
+
+    if( sensor_logging_active && handle != NULL && imufifo->size() >= IMU_LOG_WATERMARK )
+    {
+        xTaskNotifyGive(handle);
+    }
+}
+
+/**
+ * @brief 姿勢の記録を作り，最新の姿勢として公開する．ログのレートに当たるサンプルはロギングタスクへ渡す
+ * 
+ * @param time_us サンプルの時刻(unixtime, us)
+ * @param flags AHRS_FLAG_*
+ * @param log trueならロギングタスクへ渡す
+ */
+static void ahrs_output(int64_t time_us, uint8_t flags, bool log)
+{
+    ahrs_record_t rec;
+
+    ahrs.to_record(time_us, flags, &rec);
+    if( log && sensor_logging_active && !ahrs_queue.push(rec) )
+    {
+        ESP_LOGW("SensorLogger", "AHRS queue overflow");
+    }
+    ahrs_mutex.lock();
+    ahrs_latest = rec;
+    ahrs_latest_valid = true;
+    ahrs_mutex.unlock();
+}
+
+
+/**
+ * @brief 溜まった姿勢の記録をSDカードに書き出す．ロギングタスクから呼ぶ
+ * 
+ * @return int 成功すれば0，書き込みに失敗すれば-1
+ */
+static int ahrs_flush_log(SDLogger *logger)
 {
-private:
-    static const int FIFO_SIZE = 128; // FIFOのサイズ
-    imu_record_t buffer[FIFO_SIZE];
-    int head;
-    int tail;
-    int count;
-    int overflow;
-    SemaphoreHandle_t mutex;
+    size_t n;
 
-public:
-    IMUFifo() : head(0), tail(0), count(0), overflow(0) 
+    while( (n = ahrs_queue.pop_n(ahrs_log_buf, AHRS_LOG_BATCH)) > 0 )
     {
-        mutex = xSemaphoreCreateMutex();
+        if( logger != NULL && logger->write_data((const uint8_t *)ahrs_log_buf, n * sizeof(ahrs_record_t)) != 0 )
+        {
+            return -1;
+        }
     }
-    ~IMUFifo() 
+    return 0;
+}
+
+
+/**
+ * @brief 受け取った測位でGNSS/INSと高度を補正する．サンプリングタスクから呼ぶ
+ */
+static void apply_gnss_fixes()
+{
+    gnss_fix_t fix;
+
+    while( fix_queue.pop(fix) )
     {
-        vSemaphoreDelete(mutex);
+        if( ins_enable )
+        {
+            gnss_ins.update_gnss(fix);
+        }
+        if( alt_enable )
+        {
+            alt_filter.update_gnss(fix.altitude, fix.hdop, fix.fix_type);
+        }
     }
+}
 
-    void lock() 
+
+/**
+ * @brief 高度の推定に使う鉛直加速度を加える．サンプリングタスクから呼ぶ
+ * 
+ * @param ax 加速度(G，センサ座標)
+ */
+static void alt_add_accel(float ax, float ay, float az)
+{
+    if( alt_use_imu )
     {
-        xSemaphoreTake(mutex, portMAX_DELAY);
+        alt_acc_sum += (ahrs.get_vertical(ax, ay, az) - 1.0f) * 9.80665f;
+        alt_acc_n++;
     }
+}
 
-    void unlock() 
+
+/**
+ * @brief GNSS/INSの推定位置を出力する．サンプリングタスクから呼ぶ
+ * 
+ * @param log trueならロギングタスクへ渡す
+ * @param publish trueなら最新の位置として公開する
+ */
+static void ins_output(bool log, bool publish)
+{
+    gnss_ins_output_t out;
+
+    if( !gnss_ins.get_output(&out) )
+    {
+        return;
+    }
+    if( log && sensor_logging_active && !ins_queue.push(out) )
+    {
+        ESP_LOGW("SensorLogger", "INS queue overflow");
+    }
+    if( publish )
     {
-        xSemaphoreGive(mutex);
+        ins_mutex.lock();
+        ins_latest = out;
+        ins_latest_valid = true;
+        ins_mutex.unlock();
     }
+}
 
-    bool push(const imu_record_t& record) 
+
+/**
+ * @brief CSVの1行をバッファに追加する．バッファが一杯なら先に書き出す．ロギングタスクから呼ぶ
+ * 
+ * @param logger 書き出し先．NULLなら捨てる
+ * @param csv_len バッファに溜まっているバイト数
+ * @param line 追加する行
+ * @param len 行の長さ
+ * @return int 成功すれば0，書き込みに失敗すれば-1
+ * 
+ * IMUのCSV用のバッファを使うので，IMUのレコードを書き出した後に使うこと．
+ */
+static int csv_append(SDLogger *logger, size_t *csv_len, const char *line, int len)
+{
+    if( *csv_len + len > sizeof(csv_buf) )
     {
-        bool ret = false;
-        lock();
-        if (count < FIFO_SIZE) 
+        if( logger != NULL && logger->write_data((const uint8_t *)csv_buf, *csv_len) != 0 )
         {
-            buffer[head] = record;
-            head = (head + 1) % FIFO_SIZE;
-            count++;
-            ret = true;
+            return -1;
         }
-        else
+        *csv_len = 0;
+    }
+    memcpy(csv_buf + *csv_len, line, len);
+    *csv_len += len;
+    return 0;
+}
+
+
+/**
+ * @brief csv_append()で溜めた行を書き出す
+ */
+static int csv_flush(SDLogger *logger, size_t csv_len)
+{
+    if( csv_len > 0 && logger != NULL )
+    {
+        return logger->write_data((const uint8_t *)csv_buf, csv_len);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 溜まった推定位置をCSV形式でSDカードに書き出す．ロギングタスクから呼ぶ
+ * 
+ * @return int 成功すれば0，書き込みに失敗すれば-1
+ */
+static int ins_flush_log(SDLogger *logger)
+{
+    gnss_ins_output_t out;
+    size_t csv_len = 0;
+    char line[256];
+    int len;
+
+    while( ins_queue.pop(out) )
+    {
+        len = fmt_format(line,
+                         (int64_t)(out.time_us / 1000000), '.', fmt_zero<6>((uint32_t)(out.time_us % 1000000)), ',',
+                         fmt_fixed<7>(out.latitude), ',', fmt_fixed<7>(out.longitude), ',', fmt_fixed<2>(out.altitude), ',',
+                         fmt_fixed<2>(out.vn), ',', fmt_fixed<2>(out.ve), ',', fmt_fixed<2>(out.vu), ',',
+                         fmt_fixed<2>(out.pos_sigma), ',', (int)out.status, '\n');
+        if( csv_append(logger, &csv_len, line, len) != 0 )
         {
-            // FIFOがいっぱいでデータを追加できない
-            overflow++;
-            ret = false;
+            return -1;
         }
-        unlock();
-        return ret;
     }
+    return csv_flush(logger, csv_len);
+}
+
+
+/**
+ * @brief 読み出した気圧を補正して出力する．サンプリングタスクから呼ぶ
+ * 
+ * @param time_us 読み出した時刻(unixtime, us)
+ * @param raw 生の値
+ * 
+ * センサの出力データレートより速く読むと同じ値が返るので，前回と同じ値は捨てる．
+ */
+static void baro_output(int64_t time_us, const bmp280_raw_t &raw)
+{
+    static bmp280_raw_t last = { 0, 0 };
+    baro_record_t rec;
+    bmp280_data_t data;
+
+    if( raw.adc_p == last.adc_p && raw.adc_t == last.adc_t )
+    {
+        return;
+    }
+    last = raw;
+    baro->compensate(raw, &data);
+    rec.time_us = time_us;
+    rec.pressure_q8 = data.pressure_q8;
+    rec.temp_centi = data.temp_centi;
+    if( baro_rate > 0 && sensor_logging_active && !baro_queue.push(rec) )
+    {
+        ESP_LOGW("SensorLogger", "Baro queue overflow");
+    }
+    baro_mutex.lock();
+    baro_latest = rec;
+    baro_latest_valid = true;
+    baro_mutex.unlock();
 
-    bool pop(imu_record_t& record) 
+    if( alt_enable )
     {
-        bool ret = false;
-        lock();
-        if (count > 0) 
+        alt_output_t out;
+        float acc = 0.0f;
+        if( alt_acc_n > 0 )
+        {
+            acc = alt_acc_sum / alt_acc_n;
+        }
+        alt_filter.update_baro(time_us, data.pressure_q8 / 256.0f, (alt_acc_n > 0) ? &acc : NULL);
+        alt_acc_sum = 0.0f;
+        alt_acc_n = 0;
+        if( alt_filter.get_output(&out) )
         {
-            record = buffer[tail];
-            tail = (tail + 1) % FIFO_SIZE;
-            count--;
-            ret = true;
+            if( sensor_logging_active && !alt_queue.push(out) )
+            {
+                ESP_LOGW("SensorLogger", "Altitude queue overflow");
+            }
+            alt_mutex.lock();
+            alt_latest = out;
+            alt_latest_valid = true;
+            alt_mutex.unlock();
         }
-        unlock();
-        return ret;
     }
+}
+
+
+/**
+ * @brief 溜まった高度の記録をCSV形式でSDカードに書き出す．ロギングタスクから呼ぶ
+ * 
+ * @return int 成功すれば0，書き込みに失敗すれば-1
+ * 
+ * 1行は「時刻,高度(m),昇降速度(m/s),気圧高度のオフセット(m),高度の誤差(m),フラグ」．
+ */
+static int alt_flush_log(SDLogger *logger)
+{
+    alt_output_t out;
+    size_t csv_len = 0;
+    char line[256];
+    int len;
 
-    int size() const 
+    while( alt_queue.pop(out) )
     {
-        return count;
+        len = fmt_format(line,
+                         (int64_t)(out.time_us / 1000000), '.', fmt_zero<6>((uint32_t)(out.time_us % 1000000)), ',',
+                         fmt_fixed<2>(out.altitude), ',', fmt_fixed<2>(out.vspeed), ',',
+                         fmt_fixed<2>(out.baro_offset), ',', fmt_fixed<2>(out.sigma), ',', (int)out.flags, '\n');
+        if( csv_append(logger, &csv_len, line, len) != 0 )
+        {
+            return -1;
+        }
     }
+    return csv_flush(logger, csv_len);
+}
+
+
+/**
+ * @brief 溜まった気圧の記録をCSV形式でSDカードに書き出す．ロギングタスクから呼ぶ
+ * 
+ * @return int 成功すれば0，書き込みに失敗すれば-1
+ * 
+ * 1行は「時刻,圧力(Pa),温度(度)」．圧力は小数点以下2桁まで(切り捨て)．
+ */
+static int baro_flush_log(SDLogger *logger)
+{
+    baro_record_t rec;
+    size_t csv_len = 0;
+    char line[128];
+    int len;
 
-    void clear() 
+    while( baro_queue.pop(rec) )
     {
-        lock();
-        head = 0;
-        tail = 0;
-        count = 0;
-        overflow = 0;
-        unlock();
+        len = fmt_format(line,
+                         (int64_t)(rec.time_us / 1000000), '.', fmt_zero<6>((uint32_t)(rec.time_us % 1000000)), ',',
+                         rec.pressure_q8 >> 8, '.', fmt_zero<2>(((rec.pressure_q8 & 0xff) * 100) >> 8), ',',
+                         fmt_fixed<2>(rec.temp_centi / 100.0f), '\n');
+        if( csv_append(logger, &csv_len, line, len) != 0 )
+        {
+            return -1;
+        }
     }
-};
+    return csv_flush(logger, csv_len);
+}
 
 
-static IMUFifo *imufifo = NULL;
+/**
+ * @brief センサ時刻をunixtime(us)に変換する
+ * 
+ * @param ticks センサ時刻
+ * @param offset_us 校正前に使う，センサ時刻とunixtimeの差(us)
+ * @param calibrated PPSで校正した時刻ならtrueを格納する
+ * @return int64_t 時刻(unixtime, us)
+ */
+static int64_t imu_sample_time_us(int64_t ticks, int64_t offset_us, bool *calibrated)
+{
+    int64_t t_us;
+
+    *calibrated = imu_clock.to_utc_us(ticks, &t_us);
+    if( !*calibrated )
+    {
+        t_us = Bmi270Fifo::ticks_to_us(ticks) + offset_us;
+    }
+    return t_us;
+}
+
 
 /**
  * @brief センサーデータのサンプリングタスク
@@ -123,19 +451,30 @@ static void task_sensor_sampler(void *param)
     float x, y, z;
     float gx, gy, gz;
     int16_t mx, my, mz;
+    Bmp280 *bp = baro;
+    bmp280_raw_t baro_raw;
+    bool baro_ok;
 
     xLastWakeTime = xTaskGetTickCount();
 
     x = y = z = 0.0f;
     gx = gy = gz = 0.0f;
     mx = my = mz = 0;
-    while (terminate_sensor_logging == false) 
+    ahrs.set_rate(1000.0f / sample_period_ms);
+    ahrs.reset();
+    gnss_ins.reset();
+    alt_filter.reset();
+    alt_acc_sum = 0.0f;
+    alt_acc_n = 0;
+    while (terminate_sensor_sampling == false) 
     {
+        int64_t wake_us = esp_timer_get_time();
+
         // 時刻の取得
         gettimeofday(&tv, NULL);
 
         // センサデータの更新
-        i2c_mutex.lock();
+        i2c_mutex.lock(I2C_CLIENT_IMU);
         if (bmi270.accelerationAvailable()) 
         {
             bmi270.readAcceleration(x, y, z);
@@ -148,7 +487,10 @@ static void task_sensor_sampler(void *param)
         {
             bmi270.readMagneticField(mx, my, mz);
         }
-        i2c_mutex.unlock();
+        baro_ok = (bp != NULL && bp->read_raw(&baro_raw) == 0);
+        i2c_mutex.unlock(I2C_CLIENT_IMU);
+        // 次のサンプルの時刻に他のクライアントがバスを使わないようにする
+        i2c_mutex.reserve(I2C_CLIENT_IMU, wake_us + sample_period_ms * 1000);
 
         record.ax = x;
         record.ay = y;
@@ -161,11 +503,35 @@ static void task_sensor_sampler(void *param)
         record.mz = mz;
         record.timestamp = tv;
         record.count = samplecount++;
-        if (!imufifo->push(record)) 
+        if( sensor_logging_active && !imufifo->push(record) )
         {
-            // FIFOがオーバーフローした場合の処理
+            // FIFOがオーバーフローした場合の処理．数はget_fifo_stats()で取得できる
             ESP_LOGW("IMUFifo", "FIFO overflow");
         }
+        apply_gnss_fixes();
+        if( ahrs_enable )
+        {
+            int log_step = (ahrs_log_rate > 0 && ahrs_log_rate < IMU_SAMPLE_RATE_POLL) ? IMU_SAMPLE_RATE_POLL / ahrs_log_rate : 1;
+            ahrs.update(gx, gy, gz, x, y, z, mx, my, mz);
+            ahrs_output((int64_t)tv.tv_sec * 1000000 + tv.tv_usec, (mx != 0 || my != 0 || mz != 0) ? AHRS_FLAG_MAG : 0,
+                        ahrs_log_rate > 0 && record.count % log_step == 0);
+            alt_add_accel(x, y, z);
+            // ポーリングではサンプリングレートのままGNSS/INSを更新する
+            if( ins_enable )
+            {
+                int ins_log_step = (ins_log_rate > 0 && ins_log_rate < IMU_SAMPLE_RATE_POLL) ? IMU_SAMPLE_RATE_POLL / ins_log_rate : 1;
+                float q[4];
+                float acc[3] = { x, y, z };
+                ahrs.get_quaternion(q);
+                gnss_ins.propagate((int64_t)tv.tv_sec * 1000000 + tv.tv_usec, q, acc, sample_period_ms / 1000.0f);
+                ins_output(ins_log_rate > 0 && record.count % ins_log_step == 0, true);
+            }
+        }
+        if( baro_ok )
+        {
+            baro_output((int64_t)tv.tv_sec * 1000000 + tv.tv_usec, baro_raw);
+        }
+        notify_logger();
         vTaskDelayUntil(&xLastWakeTime, sample_period_ms / portTICK_PERIOD_MS);
     }
     sensor_sampler_terminated = true;
@@ -175,150 +541,1373 @@ static void task_sensor_sampler(void *param)
 
 
 /**
- * @brief センサーデータのロギングタスク
+ * @brief 設定に従って間引きフィルタを作る
  * 
- * @param param 
+ * @param rate サンプリングレート(Hz)
+ * @return ImuFilter* フィルタ．間引きもローパスも不要な場合や作れない場合はNULL
+ * 
+ * FIRの場合は，間引き率を4以下の段に分けてタップ数を抑える．
+ * CICの場合は3次のCIC1段で間引く．
  */
-static void task_sensor_logger(void *param)
+static ImuFilter *create_filter(int rate)
 {
-    imu_record_t record;
-    char logline[128];
-    int len;
-    SDLogger *imu_logger;
+    ImuFilter *filter;
+    int out = imu_output_rate;
+    int decim = 1;
+    int rtn = 0;
+    const float lsb[IMU_FILTER_CHANNELS] = {
+        IMU_ACCEL_SCALE, IMU_ACCEL_SCALE, IMU_ACCEL_SCALE,
+        IMU_GYRO_SCALE, IMU_GYRO_SCALE, IMU_GYRO_SCALE,
+    };
 
-    imu_logger = new SDLogger();
-    if (imu_logger == NULL)
+    if( out > 0 && out < rate )
     {
-        ESP_LOGE("SensorLogger", "Failed to create SDLogger");
-        terminate_sensor_logging = true;
-        sensor_logger_terminated = true;
-        vTaskDelete(NULL);
-        return;
+        if( rate % out != 0 )
+        {
+            ESP_LOGE("SensorLogger", "Output rate %d Hz does not divide %d Hz", out, rate);
+            return NULL;
+        }
+        decim = rate / out;
+    }
+    if( decim == 1 && imu_lowpass_hz <= 0.0f )
+    {
+        return NULL;
     }
 
-    imu_logger->set_prefix("/imu");
-    imu_logger->start();
-
-    while (terminate_sensor_logging == false) 
+    filter = new ImuFilter(rate);
+    if( filter == NULL )
     {
-        if (imufifo->pop(record)) 
-        {
-            // ログ行の生成
-            len = snprintf(logline, sizeof(logline), 
-                            "%ld.%06ld,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d,%d\n",
-                           record.timestamp.tv_sec, record.timestamp.tv_usec,
-                           record.count,
-                           record.ax, record.ay, record.az,
-                           record.gx, record.gy, record.gz,
-                           record.mx, record.my, record.mz);
-            if (len > 0 && len < sizeof(logline)) 
-            {
-                if (imu_logger->write_data((const uint8_t *)logline, len) != 0) 
-                {
-                    ESP_LOGE("SensorLogger", "Failed to write data");
-                    terminate_sensor_logging = true;
-                }
-            }
-        } 
-        else 
+        return NULL;
+    }
+    if( imu_lowpass_hz > 0.0f )
+    {
+        rtn = filter->add_lowpass(imu_lowpass_hz, 0.7071f);
+    }
+    if( imu_decim_method == IMU_DECIM_CIC && decim > 1 )
+    {
+        rtn |= filter->add_cic_decimator(decim, 3, lsb);
+    }
+    else
+    {
+        while( decim > 1 && rtn == 0 )
         {
-            // FIFOが空の場合は少し待つ
-            vTaskDelay(100 / portTICK_PERIOD_MS);
+            int d = (decim % 4 == 0) ? 4 : (decim % 2 == 0) ? 2 : decim;
+            rtn = filter->add_fir_decimator(d, 0);
+            decim /= d;
         }
     }
-    imu_logger->close();
-    delete imu_logger;
-
-    sensor_logger_terminated = true;
-
-    vTaskDelete(NULL);
-}
-
-
-SensorLogger::SensorLogger()
-{
-    sensor_sampler_handle = NULL;
-    sensor_logger_handle = NULL;
-    sensor_sampler_terminated = true;
-    sensor_logger_terminated = true;
+    if( rtn != 0 )
+    {
+        ESP_LOGE("SensorLogger", "Failed to configure IMU filter");
+        delete filter;
+        return NULL;
+    }
+    return filter;
 }
 
 
-SensorLogger::~SensorLogger()
+/**
+ * @brief BMI270のFIFOを使うサンプリングタスク
+ * 
+ * @param param 
+ * 
+ * FIFOの半分程度が溜まる間隔で，FIFOをまとめて読み出す．
+ * サンプルの時刻はセンサ時刻から求める．PPSで校正できていればImuClockでUTCに変換し，
+ * 校正前は読み出し時のシステム時刻との差でunixtimeに変換する．
+ * 出力レートが設定されていれば，間引きフィルタを通してから出力する．
+ * 間引いたサンプルの時刻は，フィルタの群遅延を差し引いたものになる．
+ * リサンプルが有効で校正できていれば，UTCに揃った格子点のサンプルを出力する．
+ * 磁気は読み出し毎に1回だけ取得する．
+ */
+static void task_sensor_sampler_fifo(void *param)
 {
-}
-
+    const int rate = imu_sample_rate;
+    int drain_ms;
+    portTickType xLastWakeTime;
+    struct timeval tv;
+    imu_record_t record;
+    int64_t now_us, off_us;
+    int64_t offset_us = 0;
+    bool offset_valid = false;
+    int64_t first_tick = -1;
+    int64_t read_mono_us;
+    int64_t read_ticks;
+    bool read_time_valid;
+    imu_pps_edge_t edge;
+    ImuFilter *filter;
+    float *filter_ch[IMU_FILTER_CHANNELS];
+    int first, step;
+    int64_t delay_ticks;
+    VibAnalyzer *vib = vib_analyzer;
+    int ahrs_log_step;
+    int ins_step, ins_log_step;
+    int64_t ins_last_k = -1;
+    float ins_acc[3] = { 0.0f, 0.0f, 0.0f };
+    int ins_acc_n = 0;
+    int16_t mx, my, mz;
+    Bmp280 *bp = baro;
+    bmp280_raw_t baro_raw;
+    bool baro_ok;
+    int n, m;
+    int rtn;
 
-int SensorLogger::start()
-{
-    if( imufifo != NULL ) 
+    // 加速度+角速度のフレームは13バイト
+    drain_ms = (BMI270_FIFO_SIZE / 2) * 1000 / (13 * rate);
+    if( drain_ms > 100 )
     {
-        // 既に開始されている
-        return -1;
+        drain_ms = 100;
     }
-
-    sensor_sampler_terminated = true;
-    sensor_logger_terminated = true;
-    terminate_sensor_logging = false;
-
-    imufifo = new IMUFifo();
-    if (imufifo == NULL) 
+    // 気圧はFIFOの読み出しと同時に読むので，気圧のレートより間隔を空けない
+    if( bp != NULL && baro_rate > 0 && drain_ms > 1000 / baro_rate )
     {
-        ESP_LOGE("SensorLogger", "Failed to create IMUFifo");
-        goto error_exit;
+        drain_ms = 1000 / baro_rate;
+    }
+    if( drain_ms < 10 )
+    {
+        drain_ms = 10;
     }
 
-    sensor_sampler_terminated = false;
-    xTaskCreatePinnedToCore(task_sensor_sampler, "SensorSampler", 2048, NULL, 0, &sensor_sampler_handle, 0);
-    if (sensor_sampler_handle == NULL) 
+    i2c_mutex.lock(I2C_CLIENT_IMU);
+    rtn = bmi270_fifo.begin(rate);
+    i2c_mutex.unlock(I2C_CLIENT_IMU);
+    if( rtn != 0 )
     {
-        ESP_LOGE("SensorLogger", "Failed to create SensorSampler task");
+        ESP_LOGE("SensorLogger", "Failed to configure BMI270 FIFO");
+        terminate_sensor_sampling = true;
         sensor_sampler_terminated = true;
-        goto error_exit;
+        vTaskDelete(NULL);
+        return;
     }
 
-    sensor_logger_terminated = false;
-    xTaskCreatePinnedToCore(task_sensor_logger, "SensorLogger", 4096, NULL, 0, &sensor_logger_handle, 1);
-    if (sensor_logger_handle == NULL) 
+    filter = create_filter(rate);
+    step = (filter != NULL) ? filter->get_decimation() : 1;
+    delay_ticks = (filter != NULL) ? (int64_t)(filter->get_delay_samples() * bmi270_fifo.get_period_ticks() + 0.5f) : 0;
+    for( int c = 0; c < IMU_FILTER_CHANNELS; c++ )
     {
-        ESP_LOGE("SensorLogger", "Failed to create SensorLogger task");
-        sensor_logger_terminated = true;
-        goto error_exit;
+        filter_ch[c] = filter_buf[c];
     }
 
-    return 0;
-
-error_exit:
-    if (imufifo != NULL) 
+    imu_clock.reset();
+    imu_resampler.reset();
+    ahrs.set_rate(rate);
+    ahrs.reset();
+    ahrs_log_step = (ahrs_log_rate > 0 && ahrs_log_rate < rate) ? rate / ahrs_log_rate : 1;
+    ins_step = (ins_rate > 0 && ins_rate < rate) ? rate / ins_rate : 1;
+    ins_log_step = (ins_log_rate > 0 && ins_log_rate * ins_step < rate) ? rate / (ins_log_rate * ins_step) : 1;
+    gnss_ins.reset();
+    alt_filter.reset();
+    alt_acc_sum = 0.0f;
+    alt_acc_n = 0;
+    mx = my = mz = 0;
+    xLastWakeTime = xTaskGetTickCount();
+    while (terminate_sensor_sampling == false) 
     {
-        delete imufifo;
-        imufifo = NULL;
-    }
-    terminate_sensor_logging = true;
-    return -1;
-}
+        vTaskDelayUntil(&xLastWakeTime, drain_ms / portTICK_PERIOD_MS);
+        int64_t wake_us = esp_timer_get_time();
 
+        i2c_mutex.lock(I2C_CLIENT_IMU);
+        n = bmi270_fifo.read(fifo_samples, BMI270_FIFO_MAX_FRAMES);
+        // センサ時刻フレームはバーストの最後に読まれるので，直後の時刻と組にする
+        read_mono_us = esp_timer_get_time();
+        read_time_valid = bmi270_fifo.get_read_time(&read_ticks);
+        if (bmi270.magneticFieldAvailable()) 
+        {
+            bmi270.readMagneticField(mx, my, mz);
+        }
+        baro_ok = (bp != NULL && bp->read_raw(&baro_raw) == 0);
+        i2c_mutex.unlock(I2C_CLIENT_IMU);
+        // 次の読み出しの時刻に他のクライアントがバスを使わないようにする
+        i2c_mutex.reserve(I2C_CLIENT_IMU, wake_us + drain_ms * 1000);
+        gettimeofday(&tv, NULL);
 
-int SensorLogger::stop()
-{
-    terminate_sensor_logging = true;
+        if( read_time_valid )
+        {
+            imu_clock.add_sync(read_ticks, read_mono_us);
+        }
+        while( pps_queue.pop(edge) )
+        {
+            imu_clock.add_pps(edge);
+        }
+        if( n <= 0 )
+        {
+            continue;
+        }
 
-    // タスクが終了するまで待つ
-    while (!sensor_sampler_terminated || !sensor_logger_terminated) 
-    {
+        // センサ時刻とunixtimeの差．読み出しの遅れは常に正なので，小さくなる方向にはすぐに，
+        // 大きくなる方向(水晶の周波数のずれ)にはゆっくり追従する．時刻合わせで大きく変わった場合は置き直す．
+        now_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+        off_us = now_us - Bmi270Fifo::ticks_to_us(fifo_samples[n - 1].sensortime);
+        if( !offset_valid || off_us < offset_us || off_us - offset_us > 100000 )
+        {
+            offset_us = off_us;
+            offset_valid = true;
+        }
+        else
+        {
+            offset_us += (off_us - offset_us) / 64;
+        }
+        if( first_tick < 0 )
+        {
+            first_tick = fifo_samples[0].sensortime;
+        }
+        for( int i = 0; i < n; i++ )
+        {
+            for( int c = 0; c < 3; c++ )
+            {
+                filter_buf[c][i] = fifo_samples[i].acc[c] * IMU_ACCEL_SCALE;
+                filter_buf[c + 3][i] = fifo_samples[i].gyr[c] * IMU_GYRO_SCALE;
+            }
+        }
+        // 測位は過去の状態と比べるので，このバーストの更新より先に適用する
+        apply_gnss_fixes();
+        // 姿勢推定は間引く前のレートで行う．磁気は読み出し毎に1回なので，同じ値を使う
+        if( ahrs_enable )
+        {
+            uint8_t flags = (mx != 0 || my != 0 || mz != 0) ? AHRS_FLAG_MAG : 0;
+            bool ins_on = ins_enable;
+
+            for( int i = 0; i < n; i++ )
+            {
+                int64_t k = (fifo_samples[i].sensortime - first_tick) / bmi270_fifo.get_period_ticks();
+                bool log = ahrs_log_rate > 0 && k % ahrs_log_step == 0;
+                bool ins_due = false;
+                ahrs.update(filter_buf[3][i], filter_buf[4][i], filter_buf[5][i],
+                            filter_buf[0][i], filter_buf[1][i], filter_buf[2][i], mx, my, mz);
+                alt_add_accel(filter_buf[0][i], filter_buf[1][i], filter_buf[2][i]);
+                // GNSS/INSは加速度をins_step毎に平均して更新する
+                if( ins_on )
+                {
+                    for( int c = 0; c < 3; c++ )
+                    {
+                        ins_acc[c] += filter_buf[c][i];
+                    }
+                    ins_acc_n++;
+                    ins_due = (k % ins_step == 0);
+                }
+                // 最新の姿勢はバーストの最後のサンプルだけ公開する
+                if( log || ins_due || i == n - 1 )
+                {
+                    bool calibrated;
+                    int64_t t_us = imu_sample_time_us(fifo_samples[i].sensortime, offset_us, &calibrated);
+                    if( log || i == n - 1 )
+                    {
+                        ahrs_output(t_us, flags | (calibrated ? AHRS_FLAG_CALIBRATED : 0), log);
+                    }
+                    if( ins_due )
+                    {
+                        float q[4];
+                        for( int c = 0; c < 3; c++ )
+                        {
+                            ins_acc[c] /= ins_acc_n;
+                        }
+                        ahrs.get_quaternion(q);
+                        // 欠けたサンプルがあっても，センサ時刻から経過時間を求める
+                        if( ins_last_k >= 0 )
+                        {
+                            gnss_ins.propagate(t_us, q, ins_acc, (float)(k - ins_last_k) / rate);
+                        }
+                        ins_last_k = k;
+                        ins_acc[0] = ins_acc[1] = ins_acc[2] = 0.0f;
+                        ins_acc_n = 0;
+                        ins_output(ins_log_rate > 0 && (k / ins_step) % ins_log_step == 0, false);
+                    }
+                }
+            }
+            if( ins_on )
+            {
+                ins_output(false, true);
+            }
+        }
+        // 気圧はFIFOの直後に読んだので，読み出し時のセンサ時刻で記録する．
+        // 高度の推定ではこのバーストまでの鉛直加速度を使う
+        if( baro_ok )
+        {
+            bool calibrated;
+            baro_output(read_time_valid ? imu_sample_time_us(read_ticks, offset_us, &calibrated) : now_us, baro_raw);
+        }
+        // 振動解析には間引く前のデータを渡す
+        if( vib != NULL && vib->is_running() )
+        {
+            for( int i = 0; i < n; i++ )
+            {
+                vib->push({filter_buf[0][i], filter_buf[1][i], filter_buf[2][i]});
+            }
+        }
+        if( filter != NULL )
+        {
+            first = filter->get_first_output_index();
+            m = filter->process(filter_ch, n);
+        }
+        else
+        {
+            first = 0;
+            m = n;
+        }
+
+        for( int j = 0; j < m; j++ )
+        {
+            const bmi270_sample_t &smp = fifo_samples[first + j * step];
+            bool calibrated;
+            int64_t t_us = imu_sample_time_us(smp.sensortime - delay_ticks, offset_us, &calibrated);
+
+            record.timestamp.tv_sec = t_us / 1000000;
+            record.timestamp.tv_usec = t_us % 1000000;
+            // サンプル番号はセンサ時刻から求めるので，FIFOのオーバーフローで失われたサンプルは欠番になる
+            record.count = (uint32_t)((smp.sensortime - first_tick) / bmi270_fifo.get_period_ticks() / step);
+            record.ax = filter_buf[0][j];
+            record.ay = filter_buf[1][j];
+            record.az = filter_buf[2][j];
+            record.gx = filter_buf[3][j];
+            record.gy = filter_buf[4][j];
+            record.gz = filter_buf[5][j];
+            record.mx = mx;
+            record.my = my;
+            record.mz = mz;
+            if( imu_resampler.get_period() > 0 )
+            {
+                // 校正前の時刻は格子に揃えられないので出力しない
+                if( !calibrated )
+                {
+                    imu_resampler.reset();
+                    continue;
+                }
+                int n_out = imu_resampler.push(record, t_us, resampled, IMU_RESAMPLE_MAX_OUT);
+                if( sensor_logging_active && imufifo->push_n(resampled, n_out) != (size_t)n_out )
+                {
+                    ESP_LOGW("IMUFifo", "FIFO overflow");
+                }
+            }
+            else if( sensor_logging_active && !imufifo->push(record) )
+            {
+                ESP_LOGW("IMUFifo", "FIFO overflow");
+            }
+        }
+        notify_logger();
+    }
+    delete filter;
+    sensor_sampler_terminated = true;
+
+    vTaskDelete(NULL);
+}
+
+
+/**
+ * @brief float値をスケール係数で生の値に戻す
+ * 
+ * @param v 物理量
+ * @param scale 1LSBあたりの値
+ * @return int16_t 生の値
+ */
+static int16_t imu_to_raw(float v, float scale)
+{
+    float r = roundf(v / scale);
+    if( r > 32767.0f )
+    {
+        return 32767;
+    }
+    if( r < -32768.0f )
+    {
+        return -32768;
+    }
+    return (int16_t)r;
+}
+
+
+/**
+ * @brief IMUレコードをバイナリ形式のブロックに追加する
+ * 
+ * @param encoder エンコーダ
+ * @param logger 出力先のロガー
+ * @param record 追加するレコード
+ * @return int 成功すれば0，書き込みに失敗すれば-1
+ * 
+ * ブロックが一杯になったら書き出してから追加する．
+ */
+static int imu_write_binary(ImuBinEncoder *encoder, SDLogger *logger, const imu_record_t &record)
+{
+    const uint8_t *block;
+    size_t len;
+    int16_t raw[IMU_BINLOG_NUM_AXES];
+    int64_t time_us;
+
+    raw[0] = imu_to_raw(record.ax, IMU_ACCEL_SCALE);
+    raw[1] = imu_to_raw(record.ay, IMU_ACCEL_SCALE);
+    raw[2] = imu_to_raw(record.az, IMU_ACCEL_SCALE);
+    raw[3] = imu_to_raw(record.gx, IMU_GYRO_SCALE);
+    raw[4] = imu_to_raw(record.gy, IMU_GYRO_SCALE);
+    raw[5] = imu_to_raw(record.gz, IMU_GYRO_SCALE);
+    raw[6] = record.mx;
+    raw[7] = record.my;
+    raw[8] = record.mz;
+    time_us = (int64_t)record.timestamp.tv_sec * 1000000 + record.timestamp.tv_usec;
+
+    if( encoder->add(time_us, record.count, raw) )
+    {
+        return 0;
+    }
+    len = encoder->finish(&block);
+    imu_log_stats.writes++;
+    if( logger->write_data(block, len) != 0 )
+    {
+        return -1;
+    }
+    encoder->add(time_us, record.count, raw);
+    return 0;
+}
+
+
+/**
+ * @brief バイナリ形式のブロックを書き出す
+ * 
+ * @param encoder エンコーダ
+ * @param logger 出力先のロガー
+ * @return int 成功すれば0，書き込みに失敗すれば-1
+ */
+static int imu_flush_binary(ImuBinEncoder *encoder, SDLogger *logger)
+{
+    const uint8_t *block;
+    size_t len;
+
+    len = encoder->finish(&block);
+    if( len == 0 )
+    {
+        return 0;
+    }
+    imu_log_stats.writes++;
+    return logger->write_data(block, len);
+}
+
+
+/**
+ * @brief CSV形式のバッファを書き出す
+ * 
+ * @param logger 出力先のロガー
+ * @param len バッファに溜まっているバイト数
+ * @return int 成功すれば0，書き込みに失敗すれば-1
+ */
+static int imu_flush_csv(SDLogger *logger, size_t len)
+{
+    if( len == 0 )
+    {
+        return 0;
+    }
+    imu_log_stats.writes++;
+    return logger->write_data((const uint8_t *)csv_buf, len);
+}
+
+
+/**
+ * @brief 1回の起床で取り出したレコード数を統計に加える
+ * 
+ * @param batch レコード数
+ */
+static void imu_count_batch(uint32_t batch)
+{
+    int bin = 0;
+
+    if( batch == 0 )
+    {
+        return;
+    }
+    imu_log_stats.batches++;
+    imu_log_stats.records += batch;
+    if( batch > imu_log_stats.max_batch )
+    {
+        imu_log_stats.max_batch = batch;
+    }
+    while( bin < IMU_LOG_BATCH_HIST - 1 && (batch >> (bin + 1)) != 0 )
+    {
+        bin++;
+    }
+    imu_log_stats.batch_hist[bin]++;
+}
+
+
+/**
+ * @brief センサーデータのロギングタスク
+ * 
+ * @param param 
+ * 
+ * FIFOがウォーターマークまで溜まるとサンプリングタスクに起こされ，
+ * その時点でFIFOにあるレコードを全て取り出す．
+ * 低いレートでも遅れすぎないよう，IMU_LOG_WAIT_MS毎にも起きる．
+ * CSV形式では取り出したレコードを1つのバッファに書式化して，まとめてSDLoggerに渡す．
+ * バイナリ形式ではブロックが一杯になるか1秒分溜まった時に渡す．
+ * 書き込みに失敗したら記録だけを止める．サンプリングと推定は続け，stop_logging()で終了する．
+ */
+static void task_sensor_logger(void *param)
+{
+    imu_record_t records[IMU_LOG_BATCH];
+    int n;
+    char logline[256];
+    int len;
+    size_t csv_len;
+    uint32_t batch;
+    SDLogger *logger;
+    SDLogger *ahrs_sd = NULL;
+    SDLogger *ins_sd = NULL;
+    SDLogger *baro_sd = NULL;
+    SDLogger *alt_sd = NULL;
+    ImuBinEncoder *encoder = NULL;
+    int format = imu_log_format;
+    int rtn;
+
+    logger = new SDLogger();
+    if (logger == NULL)
+    {
+        ESP_LOGE("SensorLogger", "Failed to create SDLogger");
+        sensor_logger_terminated = true;
+        vTaskDelete(NULL);
+        return;
+    }
+
+    if( format == IMU_LOG_FORMAT_BINARY )
+    {
+        encoder = new ImuBinEncoder(IMU_ACCEL_SCALE, IMU_GYRO_SCALE, IMU_MAG_SCALE);
+        logger->set_suffix(".bin");
+    }
+
+    logger->set_prefix("/imu");
+    logger->start();
+    imu_logger = logger;
+
+    if( ahrs_enable && ahrs_log_rate > 0 )
+    {
+        ahrs_sd = new SDLogger();
+        if( ahrs_sd == NULL )
+        {
+            ESP_LOGE("SensorLogger", "Failed to create AHRS logger");
+        }
+        else
+        {
+            ahrs_sd->set_prefix("/ahrs");
+            ahrs_sd->set_suffix(".bin");
+            ahrs_sd->start();
+            ahrs_logger = ahrs_sd;
+        }
+    }
+
+    if( ins_enable && ins_log_rate > 0 )
+    {
+        ins_sd = new SDLogger();
+        if( ins_sd == NULL )
+        {
+            ESP_LOGE("SensorLogger", "Failed to create INS logger");
+        }
+        else
+        {
+            ins_sd->set_prefix("/fused");
+            ins_sd->start();
+            ins_logger = ins_sd;
+        }
+    }
+
+    if( baro != NULL && baro_rate > 0 )
+    {
+        baro_sd = new SDLogger();
+        if( baro_sd == NULL )
+        {
+            ESP_LOGE("SensorLogger", "Failed to create baro logger");
+        }
+        else
+        {
+            baro_sd->set_prefix("/baro");
+            baro_sd->start();
+            baro_logger = baro_sd;
+        }
+    }
+
+    if( baro != NULL && alt_enable )
+    {
+        alt_sd = new SDLogger();
+        if( alt_sd == NULL )
+        {
+            ESP_LOGE("SensorLogger", "Failed to create altitude logger");
+        }
+        else
+        {
+            alt_sd->set_prefix("/alt");
+            alt_sd->start();
+            alt_logger = alt_sd;
+        }
+    }
+
+    sensor_logging_active = true;
+    rtn = 0;
+    while( terminate_sensor_logging == false && rtn == 0 )
+    {
+        if( imufifo->size() < IMU_LOG_WATERMARK )
+        {
+            imu_log_stats.wakes++;
+            if( ulTaskNotifyTake(pdTRUE, IMU_LOG_WAIT_MS / portTICK_PERIOD_MS) != 0 )
+            {
+                imu_log_stats.notified++;
+            }
+        }
+
+        batch = 0;
+        csv_len = 0;
+        rtn = 0;
+        while( rtn == 0 && !terminate_sensor_logging && (n = imufifo->pop_n(records, IMU_LOG_BATCH)) > 0 )
+        {
+            batch += n;
+            for( int i = 0; i < n && rtn == 0; i++ )
+            {
+                const imu_record_t &record = records[i];
+                if( encoder != NULL )
+                {
+                    rtn = imu_write_binary(encoder, logger, record);
+                    // ブロックが1秒分溜まったら書き出す
+                    if( rtn == 0 && (int64_t)record.timestamp.tv_sec * 1000000 + record.timestamp.tv_usec
+                                    - encoder->get_base_time_us() >= 1000000 )
+                    {
+                        rtn = imu_flush_binary(encoder, logger);
+                    }
+                }
+                else
+                {
+                    // ログ行の生成
+                    len = fmt_format(logline,
+                                   record.timestamp.tv_sec, '.', fmt_zero<6>(record.timestamp.tv_usec), ',',
+                                   record.count, ',',
+                                   fmt_fixed<3>(record.ax), ',', fmt_fixed<3>(record.ay), ',', fmt_fixed<3>(record.az), ',',
+                                   fmt_fixed<3>(record.gx), ',', fmt_fixed<3>(record.gy), ',', fmt_fixed<3>(record.gz), ',',
+                                   record.mx, ',', record.my, ',', record.mz, '\n');
+                    if( csv_len + len > sizeof(csv_buf) )
+                    {
+                        rtn = imu_flush_csv(logger, csv_len);
+                        csv_len = 0;
+                    }
+                    memcpy(csv_buf + csv_len, logline, len);
+                    csv_len += len;
+                }
+            }
+        }
+        if( rtn == 0 )
+        {
+            rtn = imu_flush_csv(logger, csv_len);
+        }
+        if( rtn == 0 )
+        {
+            rtn = ahrs_flush_log(ahrs_sd);
+        }
+        if( rtn == 0 )
+        {
+            rtn = ins_flush_log(ins_sd);
+        }
+        if( rtn == 0 )
+        {
+            rtn = baro_flush_log(baro_sd);
+        }
+        if( rtn == 0 )
+        {
+            rtn = alt_flush_log(alt_sd);
+        }
+        imu_count_batch(batch);
+        if( rtn != 0 )
+        {
+            ESP_LOGE("SensorLogger", "Failed to write data");
+        }
+    }
+    sensor_logging_active = false;
+    // get_log_snapshot()が使い終わってから閉じる
+    sd_logger_mutex.lock();
+    imu_logger = NULL;
+    ahrs_logger = NULL;
+    ins_logger = NULL;
+    baro_logger = NULL;
+    alt_logger = NULL;
+    sd_logger_mutex.unlock();
+    if( encoder != NULL )
+    {
+        imu_flush_binary(encoder, logger);
+        delete encoder;
+    }
+    logger->close();
+    delete logger;
+    if( ahrs_sd != NULL )
+    {
+        ahrs_flush_log(ahrs_sd);
+        ahrs_sd->close();
+        delete ahrs_sd;
+    }
+    if( ins_sd != NULL )
+    {
+        ins_flush_log(ins_sd);
+        ins_sd->close();
+        delete ins_sd;
+    }
+    if( baro_sd != NULL )
+    {
+        baro_flush_log(baro_sd);
+        baro_sd->close();
+        delete baro_sd;
+    }
+    if( alt_sd != NULL )
+    {
+        alt_flush_log(alt_sd);
+        alt_sd->close();
+        delete alt_sd;
+    }
+
+    // サンプリングタスクが通知するハンドルを残すため，stop_logging()まで終了しない
+    while( terminate_sensor_logging == false )
+    {
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+    sensor_logger_terminated = true;
+
+    vTaskDelete(NULL);
+}
+
+
+SensorLogger::SensorLogger()
+{
+    sensor_sampler_handle = NULL;
+    sensor_logger_handle = NULL;
+    sensor_sampler_terminated = true;
+    sensor_logger_terminated = true;
+}
+
+
+SensorLogger::~SensorLogger()
+{
+}
+
+
+/**
+ * @brief サンプリングと推定を開始する．設定関数の後で1回だけ呼ぶ
+ * 
+ * @return int 成功すれば0，失敗すれば-1
+ * 
+ * SDカードへの記録はstart_logging()で別に開始する．
+ */
+int SensorLogger::start()
+{
+    if( imufifo != NULL ) 
+    {
+        // 既に開始されている
+        return -1;
+    }
+
+    sensor_sampler_terminated = true;
+    sensor_logger_terminated = true;
+    terminate_sensor_sampling = false;
+    sensor_logging_active = false;
+    sensor_logger_handle = NULL;
+
+    ahrs_mutex.lock();
+    ahrs_latest_valid = false;
+    ahrs_mutex.unlock();
+    ins_mutex.lock();
+    ins_latest_valid = false;
+    ins_mutex.unlock();
+    baro_mutex.lock();
+    baro_latest_valid = false;
+    baro_mutex.unlock();
+    alt_mutex.lock();
+    alt_latest_valid = false;
+    alt_mutex.unlock();
+    imufifo = new IMUFifo();
+    if (imufifo == NULL) 
+    {
+        ESP_LOGE("SensorLogger", "Failed to create IMUFifo");
+        goto error_exit;
+    }
+
+    sensor_sampler_terminated = false;
+    xTaskCreatePinnedToCore((imu_sample_rate == IMU_SAMPLE_RATE_POLL) ? task_sensor_sampler : task_sensor_sampler_fifo,
+                            "SensorSampler", 4096, NULL, 0, &sensor_sampler_handle, 0);
+    if (sensor_sampler_handle == NULL) 
+    {
+        ESP_LOGE("SensorLogger", "Failed to create SensorSampler task");
+        sensor_sampler_terminated = true;
+        goto error_exit;
+    }
+
+    if( vib_analyzer != NULL && imu_sample_rate != IMU_SAMPLE_RATE_POLL )
+    {
+        // 解析できなくても記録は続ける
+        if( vib_analyzer->start((float)imu_sample_rate) != 0 )
+        {
+            ESP_LOGW("SensorLogger", "Failed to start VibAnalyzer");
+        }
+    }
+
+    return 0;
+
+error_exit:
+    if (imufifo != NULL) 
+    {
+        delete imufifo;
+        imufifo = NULL;
+    }
+    terminate_sensor_sampling = true;
+    return -1;
+}
+
+
+/**
+ * @brief SDカードへの記録を開始する．start()の後に呼ぶ
+ * 
+ * @return int 成功すれば0，失敗すれば-1
+ * 
+ * 記録していない間の記録はサンプリングタスクがキューに積まないので，
+ * 開始前に残っている分だけを捨てる．
+ */
+int SensorLogger::start_logging()
+{
+    imu_record_t record;
+    ahrs_record_t ahrs_rec;
+    gnss_ins_output_t ins_out;
+    baro_record_t baro_rec;
+    alt_output_t alt_out;
+
+    if( imufifo == NULL || !sensor_logger_terminated )
+    {
+        // サンプリングが始まっていないか，既に記録している
+        return -1;
+    }
+
+    // ロギングタスクが居ないので，ここが読み出し側になる
+    while( imufifo->pop(record) ) {}
+    while( ahrs_queue.pop(ahrs_rec) ) {}
+    while( ins_queue.pop(ins_out) ) {}
+    while( baro_queue.pop(baro_rec) ) {}
+    while( alt_queue.pop(alt_out) ) {}
+    memset(&imu_log_stats, 0, sizeof(imu_log_stats));
+
+    terminate_sensor_logging = false;
+    sensor_logger_terminated = false;
+    xTaskCreatePinnedToCore(task_sensor_logger, "SensorLogger", 4096, NULL, 0, &sensor_logger_handle, 1);
+    if (sensor_logger_handle == NULL) 
+    {
+        ESP_LOGE("SensorLogger", "Failed to create SensorLogger task");
+        sensor_logger_terminated = true;
+        return -1;
+    }
+    // 振動解析の結果も同じ時から記録する．開けなくてもIMUの記録は続ける
+    if( vib_analyzer != NULL && vib_analyzer->is_running() )
+    {
+        vib_analyzer->start_logging();
+    }
+    return 0;
+}
+
+
+/**
+ * @brief SDカードへの記録を終了する．サンプリングと推定は続ける
+ */
+int SensorLogger::stop_logging()
+{
+    sensor_logging_active = false;
+    terminate_sensor_logging = true;
+    if( vib_analyzer != NULL )
+    {
+        vib_analyzer->stop_logging();
+    }
+
+    // タスクが終了するまで待つ
+    while (!sensor_logger_terminated) 
+    {
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+
+    sensor_logger_handle = NULL;
+    return 0;
+}
+
+
+int SensorLogger::stop()
+{
+    stop_logging();
+    terminate_sensor_sampling = true;
+
+    // タスクが終了するまで待つ
+    while (!sensor_sampler_terminated) 
+    {
         vTaskDelay(100 / portTICK_PERIOD_MS);
     }
 
-    // FIFOを削除
-    if (imufifo != NULL) 
+    if( vib_analyzer != NULL && vib_analyzer->is_running() )
+    {
+        vib_analyzer->stop();
+    }
+
+    // FIFOを削除
+    if (imufifo != NULL) 
+    {
+        delete imufifo;
+        imufifo = NULL;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 振動解析を設定する．start()の前に呼ぶこと．
+ * 
+ * @param analyzer 加速度を渡す先．NULLなら解析しない
+ * 
+ * FIFOでサンプリングする場合だけ，間引く前の加速度を渡す．
+ * 解析はstart()で開始し，stop()で終了する．結果の記録はstart_logging()，stop_logging()に合わせる．
+ */
+void SensorLogger::set_vib_analyzer(VibAnalyzer *analyzer)
+{
+    vib_analyzer = analyzer;
+}
+
+
+/**
+ * @brief 気圧センサを設定する．start()の前に呼ぶこと．
+ * 
+ * @param sensor 初期化済みの気圧センサ．NULLなら読まない
+ * @param rate_hz 気圧を/baroに記録するレート(Hz)の上限．0なら記録しない
+ * @return int 成功すれば0，不正な値なら-1
+ * 
+ * 気圧はIMUの読み出しと同じI2Cの排他区間で読み，IMUと同じ時刻の基準で記録する．
+ * FIFOを使う場合は読み出しの間隔をこのレートに合わせて短くする．
+ * ポーリングの場合はサンプリングレート(10Hz)で読む．
+ * センサの出力データレート(BMP280_ODR_HZ)を超えるレートは意味が無い．
+ */
+int SensorLogger::set_baro(Bmp280 *sensor, int rate_hz)
+{
+    if( rate_hz < 0 )
+    {
+        return -1;
+    }
+    baro_rate = (rate_hz > BMP280_ODR_HZ) ? BMP280_ODR_HZ : rate_hz;
+    baro = sensor;
+    return 0;
+}
+
+
+/**
+ * @brief 最新の気圧を取得する
+ * 
+ * @param rec 気圧の格納先
+ * @return int 成功すれば0，まだ読んでいない場合は-1
+ */
+int SensorLogger::get_baro(baro_record_t *rec)
+{
+    int rtn = -1;
+
+    baro_mutex.lock();
+    if( baro_latest_valid )
     {
-        delete imufifo;
-        imufifo = NULL;
+        *rec = baro_latest;
+        rtn = 0;
+    }
+    baro_mutex.unlock();
+    return rtn;
+}
+
+
+/**
+ * @brief 高度の推定を設定する．start()の前に呼ぶこと．
+ * 
+ * @param enable trueなら気圧とGNSSの高度から高度と昇降速度を推定し，/altに記録する
+ * @param use_imu trueならIMUの鉛直加速度も使う．姿勢推定(set_ahrs())が有効な場合だけ使える
+ * 
+ * 推定は気圧の読み出し毎に行うので，気圧センサ(set_baro())も設定すること．
+ */
+void SensorLogger::set_altitude(bool enable, bool use_imu)
+{
+    alt_use_imu = enable && use_imu && ahrs_enable;
+    alt_enable = enable;
+}
+
+
+/**
+ * @brief 最新の推定高度を取得する
+ * 
+ * @param out 推定高度の格納先
+ * @return int 成功すれば0，まだ推定していない場合は-1
+ */
+int SensorLogger::get_altitude(alt_output_t *out)
+{
+    int rtn = -1;
+
+    alt_mutex.lock();
+    if( alt_latest_valid )
+    {
+        *out = alt_latest;
+        rtn = 0;
+    }
+    alt_mutex.unlock();
+    return rtn;
+}
+
+
+/**
+ * @brief 高度の推定の統計を取得する
+ * 
+ * @param stats 統計情報の格納先
+ * @return int 成功すれば0，推定していない場合は-1
+ */
+int SensorLogger::get_alt_stats(alt_filter_stats_t *stats)
+{
+    if( imufifo == NULL || !alt_enable || baro == NULL )
+    {
+        return -1;
+    }
+    *stats = alt_filter.get_stats();
+    return 0;
+}
+
+
+/**
+ * @brief 姿勢推定を設定する．start()の前に呼ぶこと．
+ * 
+ * @param enable trueなら姿勢を推定する
+ * @param beta 補正の強さ(Ahrs参照)
+ * @param log_rate_hz 姿勢を/ahrsに記録するレート(Hz)．0なら記録しない
+ * @return int 成功すれば0，不正な値なら-1
+ * 
+ * 姿勢はサンプリングレートのまま，間引く前のデータで更新する．
+ * 記録はahrs_record_tをそのまま並べたバイナリ形式で，ファイルの拡張子は.binになる．
+ * サンプリングレートを割り切らないレートを指定した場合は，それより高いレートになる．
+ */
+int SensorLogger::set_ahrs(bool enable, float beta, int log_rate_hz)
+{
+    if( beta <= 0.0f || log_rate_hz < 0 )
+    {
+        return -1;
+    }
+    ahrs.set_beta(beta);
+    ahrs_log_rate = log_rate_hz;
+    ahrs_enable = enable;
+    return 0;
+}
+
+
+/**
+ * @brief 磁気のオフセット(ハードアイアン)を設定する．start()の前に呼ぶこと．
+ * 
+ * @param x 生の値でのオフセット
+ */
+void SensorLogger::set_mag_offset(float x, float y, float z)
+{
+    ahrs.set_mag_offset(x, y, z);
+}
+
+
+/**
+ * @brief 最新の姿勢を取得する
+ * 
+ * @param rec 姿勢の格納先
+ * @return int 成功すれば0，まだ推定していない場合は-1
+ */
+int SensorLogger::get_attitude(ahrs_record_t *rec)
+{
+    int rtn = -1;
+
+    ahrs_mutex.lock();
+    if( ahrs_latest_valid )
+    {
+        *rec = ahrs_latest;
+        rtn = 0;
+    }
+    ahrs_mutex.unlock();
+    return rtn;
+}
+
+
+/**
+ * @brief GNSS/INSによる位置推定を設定する．start()の前に呼ぶこと．
+ * 
+ * @param enable trueなら位置を推定する．姿勢推定(set_ahrs())も有効にすること
+ * @param rate_hz 加速度で位置を更新するレート(Hz)．サンプリングレートを超える場合はサンプリングレート
+ * @param log_rate_hz 推定位置を/fusedに記録するレート(Hz)．0なら記録しない
+ * @param declination_deg 磁気偏角(度)．磁北が真北より東にある場合を正とする
+ * @return int 成功すれば0，不正な値なら-1
+ * 
+ * 記録はCSV形式で，1行が「時刻,緯度,経度,高度,北向き速度,東向き速度,上向き速度,位置の誤差,状態」．
+ */
+int SensorLogger::set_gnss_ins(bool enable, int rate_hz, int log_rate_hz, float declination_deg)
+{
+    if( rate_hz <= 0 || log_rate_hz < 0 )
+    {
+        return -1;
+    }
+    if( enable && !ahrs_enable )
+    {
+        ESP_LOGW("SensorLogger", "GNSS/INS needs AHRS");
+    }
+    gnss_ins.set_declination(declination_deg);
+    ins_rate = rate_hz;
+    ins_log_rate = log_rate_hz;
+    ins_enable = enable;
+    return 0;
+}
+
+
+/**
+ * @brief GNSSの測位をGNSS/INSと高度の推定に渡す．メインループから呼ぶ
+ * 
+ * @param fix 測位結果
+ */
+void SensorLogger::add_gnss_fix(const gnss_fix_t &fix)
+{
+    if( (!ins_enable && !alt_enable) || imufifo == NULL )
+    {
+        return;
+    }
+    if( !fix_queue.push(fix) )
+    {
+        ESP_LOGW("SensorLogger", "GNSS fix queue overflow");
+    }
+}
+
+
+/**
+ * @brief 最新の推定位置を取得する
+ * 
+ * @param out 推定位置の格納先
+ * @return int 成功すれば0，まだ推定していない場合は-1
+ */
+int SensorLogger::get_fused_position(gnss_ins_output_t *out)
+{
+    int rtn = -1;
+
+    ins_mutex.lock();
+    if( ins_latest_valid )
+    {
+        *out = ins_latest;
+        rtn = 0;
+    }
+    ins_mutex.unlock();
+    return rtn;
+}
+
+
+/**
+ * @brief GNSS/INSの統計を取得する
+ * 
+ * @param stats 統計情報の格納先
+ * @return int 成功すれば0，推定していない場合は-1
+ */
+int SensorLogger::get_gnss_ins_stats(gnss_ins_stats_t *stats)
+{
+    if( imufifo == NULL || !ins_enable )
+    {
+        return -1;
+    }
+    *stats = gnss_ins.get_stats();
+    return 0;
+}
+
+
+/**
+ * @brief 記録形式を設定する．start()の前に呼ぶこと．
+ * 
+ * @param format IMU_LOG_FORMAT_CSV または IMU_LOG_FORMAT_BINARY
+ * @return int 成功すれば0，不正な形式なら-1
+ * 
+ * バイナリ形式のファイルの拡張子は.binになる．形式はimu_binlog.hを参照．
+ */
+int SensorLogger::set_format(int format)
+{
+    if( format != IMU_LOG_FORMAT_CSV && format != IMU_LOG_FORMAT_BINARY )
+    {
+        return -1;
+    }
+    imu_log_format = format;
+    return 0;
+}
+
+
+/**
+ * @brief サンプリングタスクとロギングタスクの間のFIFOの統計を取得する
+ * 
+ * @param stats 統計情報の格納先
+ * @return int 成功すれば0，記録していない場合は-1
+ */
+int SensorLogger::get_fifo_stats(spsc_ring_stats_t *stats)
+{
+    if( imufifo == NULL )
+    {
+        return -1;
+    }
+    *stats = imufifo->get_stats();
+    return 0;
+}
+
+
+/**
+ * @brief サンプリングレートを設定する．start()の前に呼ぶこと．
+ * 
+ * @param hz サンプリングレート(Hz)．IMU_SAMPLE_RATE_POLL(10)なら従来のポーリング，
+ *           100, 200, 400, 800, 1600ならBMI270のFIFOを使う
+ * @return int 成功すれば0，設定できないレートなら-1
+ */
+int SensorLogger::set_sample_rate(int hz)
+{
+    switch( hz )
+    {
+        case IMU_SAMPLE_RATE_POLL:
+        case 100:
+        case 200:
+        case 400:
+        case 800:
+        case 1600:
+            imu_sample_rate = hz;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+
+/**
+ * @brief 記録する出力レートを設定する．start()の前に呼ぶこと．
+ * 
+ * @param hz 出力レート(Hz)．サンプリングレートを割り切る値．0ならサンプリングレートのまま
+ * @param method 間引きの方法．IMU_DECIM_FIR または IMU_DECIM_CIC
+ * @param lowpass_hz 間引きの前に通すローパスのカットオフ周波数(Hz)．0なら通さない
+ * @return int 成功すれば0，不正な値なら-1
+ * 
+ * BMI270のFIFOを使う場合だけ有効．サンプリングレートとの整合はstart()時に確認する．
+ */
+int SensorLogger::set_output_rate(int hz, int method, float lowpass_hz)
+{
+    if( hz < 0 || lowpass_hz < 0.0f || (method != IMU_DECIM_FIR && method != IMU_DECIM_CIC) )
+    {
+        return -1;
+    }
+    imu_output_rate = hz;
+    imu_decim_method = method;
+    imu_lowpass_hz = lowpass_hz;
+    return 0;
+}
+
+
+/**
+ * @brief UTCに揃った格子にリサンプルする間隔を設定する．start()の前に呼ぶこと．
+ * 
+ * @param period_us 格子の間隔(us)．1秒を割り切る値．0ならリサンプルしない
+ * @return int 成功すれば0，設定できない間隔なら-1
+ * 
+ * BMI270のFIFOを使う場合だけ有効．PPSで時刻を校正できるまでは記録しない．
+ * レコードのサンプル番号はUTCの0時からの格子点の番号になる．
+ */
+int SensorLogger::set_resample_period(int period_us)
+{
+    if( period_us < 0 || (period_us > 0 && 1000000 % period_us != 0) )
+    {
+        return -1;
+    }
+    imu_resampler.set_period(period_us);
+    return 0;
+}
+
+
+/**
+ * @brief PPSのエッジを通知する．メインループから呼ぶ．
+ * 
+ * @param mono_us エッジのモノトニック時刻(esp_timer_get_time()の値)
+ * @param utc_sec エッジが示すUTCの秒
+ * 
+ * サンプリングタスクがセンサ時刻とUTCの関係の校正に使う．
+ * 呼び出し側は1つのタスクに限ること．
+ */
+void SensorLogger::add_pps_edge(int64_t mono_us, int64_t utc_sec)
+{
+    imu_pps_edge_t edge;
+
+    if( imufifo == NULL || imu_sample_rate == IMU_SAMPLE_RATE_POLL )
+    {
+        return;
+    }
+    edge.mono_us = mono_us;
+    edge.utc_sec = utc_sec;
+    pps_queue.push(edge);
+}
+
+
+/**
+ * @brief センサ時刻の校正の状態を取得する
+ * 
+ * @param stats 校正の状態の格納先
+ * @return int 成功すれば0，FIFOを使っていない場合は-1
+ */
+int SensorLogger::get_clock_stats(imu_clock_stats_t *stats)
+{
+    if( imufifo == NULL || imu_sample_rate == IMU_SAMPLE_RATE_POLL )
+    {
+        return -1;
+    }
+    *stats = imu_clock.get_stats();
+    return 0;
+}
+
+
+/**
+ * @brief ロギングタスクの統計を取得する
+ * 
+ * @param stats 統計情報の格納先
+ * @return int 成功すれば0，記録していない場合は-1
+ */
+int SensorLogger::get_logger_stats(imu_logger_stats_t *stats)
+{
+    if( imufifo == NULL )
+    {
+        return -1;
+    }
+    *stats = imu_log_stats;
+    return 0;
+}
+
+
+/**
+ * @brief BMI270のFIFOの読み出し統計を取得する
+ * 
+ * @param stats 統計情報の格納先
+ * @return int 成功すれば0，FIFOを使っていない場合は-1
+ */
+int SensorLogger::get_bmi270_stats(bmi270_fifo_stats_t *stats)
+{
+    if( imufifo == NULL || imu_sample_rate == IMU_SAMPLE_RATE_POLL )
+    {
+        return -1;
     }
+    *stats = bmi270_fifo.get_stats();
     return 0;
 }
 
 
+/**
+ * @brief 記録しているファイルの統計を写す
+ * 
+ * @param stream SENSOR_LOG_*
+ * @param snap 格納先
+ * @return int 成功すれば0，記録していなければ-1
+ * 
+ * ロギングタスクは閉じる前にポインタを外すので，同じロックの下で写せば閉じたロガーを触らない．
+ */
+int SensorLogger::get_log_snapshot(int stream, sd_logger_snapshot_t *snap)
+{
+    static SDLogger * volatile * const loggers[SENSOR_LOG_NUM] = {
+        &imu_logger, &ahrs_logger, &ins_logger, &baro_logger, &alt_logger
+    };
+    SDLogger *logger;
+    int rtn = -1;
+
+    if( stream < 0 || stream >= SENSOR_LOG_NUM )
+    {
+        return -1;
+    }
+    sd_logger_mutex.lock();
+    logger = *loggers[stream];
+    if( logger != NULL )
+    {
+        rtn = logger->get_snapshot(snap);
+    }
+    sd_logger_mutex.unlock();
+    return rtn;
+}
+
+
 int SensorLogger::init()
 {
     int rtn;
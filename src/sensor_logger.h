@@ -4,6 +4,63 @@
 
 #include "sd_logger.h"
 #include "bus_mutex.h"
+#include "spsc_ring.h"
+#include "bmi270_fifo.h"
+#include "imu_clock.h"
+#include "imu_filter.h"
+#include "ahrs.h"
+#include "gnss_ins.h"
+#include "bmp280.h"
+#include "alt_filter.h"
+
+// 記録形式
+#define IMU_LOG_FORMAT_CSV 0
+#define IMU_LOG_FORMAT_BINARY 1
+
+// ポーリングでのサンプリングレート(Hz)．これより高いレートではBMI270のFIFOを使う
+#define IMU_SAMPLE_RATE_POLL 10
+
+// BMI270ライブラリの設定(±4G, ±2000deg/s)での1LSBあたりの値
+#define IMU_ACCEL_SCALE (1.0f / 8192.0f)
+#define IMU_GYRO_SCALE (1.0f / 16.384f)
+#define IMU_MAG_SCALE 1.0f
+
+// サンプリングタスクとロギングタスクの間のFIFOのサイズ(2のべき乗)
+#define IMU_FIFO_SIZE 256
+// ロギングタスクが1回に取り出すレコード数
+#define IMU_LOG_BATCH 16
+// FIFOにこの数のレコードが溜まったら，サンプリングタスクがロギングタスクを起こす
+#define IMU_LOG_WATERMARK (IMU_FIFO_SIZE / 4)
+// ロギングタスクが起こされるのを待つ最大時間(ms)．低いレートでもこの間隔で書き出す
+#define IMU_LOG_WAIT_MS 500
+// CSV形式で1回にSDLoggerへ渡すバッファのサイズ
+#define IMU_LOG_CSV_BUF_SIZE 4096
+// バッチサイズの分布のビン数．ビンiは2^i以上2^(i+1)未満(最後のビンはそれ以上全て)
+#define IMU_LOG_BATCH_HIST 8
+// メインループからサンプリングタスクへ渡すPPSエッジのキューのサイズ(2のべき乗)
+#define IMU_PPS_QUEUE_SIZE 4
+// リサンプラが1つの入力から出力する最大サンプル数
+#define IMU_RESAMPLE_MAX_OUT 8
+// サンプリングタスクからロギングタスクへ渡す姿勢の記録のキューのサイズ(2のべき乗)
+#define AHRS_LOG_QUEUE_SIZE 256
+// ロギングタスクが1回に取り出す姿勢の記録の数
+#define AHRS_LOG_BATCH 32
+// メインループからサンプリングタスクへ渡す測位のキューのサイズ(2のべき乗)
+#define GNSS_INS_FIX_QUEUE_SIZE 4
+// サンプリングタスクからロギングタスクへ渡す推定位置のキューのサイズ(2のべき乗)
+#define GNSS_INS_LOG_QUEUE_SIZE 64
+// サンプリングタスクからロギングタスクへ渡す気圧の記録のキューのサイズ(2のべき乗)
+#define BARO_LOG_QUEUE_SIZE 64
+// サンプリングタスクからロギングタスクへ渡す推定高度のキューのサイズ(2のべき乗)
+#define ALT_LOG_QUEUE_SIZE 64
+
+// 記録しているファイル．get_log_snapshot()で指定する
+#define SENSOR_LOG_IMU 0
+#define SENSOR_LOG_AHRS 1
+#define SENSOR_LOG_INS 2
+#define SENSOR_LOG_BARO 3
+#define SENSOR_LOG_ALT 4
+#define SENSOR_LOG_NUM 5
 
 typedef struct {
     struct timeval timestamp; // タイムスタンプ
@@ -13,6 +70,30 @@ typedef struct {
     int16_t mx, my, mz;
 } imu_record_t;
 
+/**
+ * @brief 気圧の記録
+ */
+typedef struct {
+    int64_t time_us;            // 読み出した時刻(unixtime, us)
+    uint32_t pressure_q8;       // 圧力(Pa，下位8bitが小数部)
+    int32_t temp_centi;         // 温度(0.01度)
+} baro_record_t;
+
+/**
+ * @brief ロギングタスクの統計
+ */
+typedef struct {
+    uint32_t wakes;             // 待ちから起きた回数
+    uint32_t notified;          // そのうちサンプリングタスクに起こされた回数
+    uint32_t batches;           // 1回の起床でまとめて取り出した回数(0件は数えない)
+    uint32_t records;           // 取り出したレコードの総数
+    uint32_t max_batch;         // 1回に取り出した最大レコード数
+    uint32_t writes;            // SDLoggerへの書き込み回数
+    uint32_t batch_hist[IMU_LOG_BATCH_HIST];    // 1回に取り出したレコード数の分布
+} imu_logger_stats_t;
+
+class VibAnalyzer;
+
 class SensorLogger 
 {
 protected:
@@ -23,7 +104,32 @@ public:
 
     int start();
     int stop();
+    int start_logging();
+    int stop_logging();
     int init();
+    int set_format(int format);
+    int set_sample_rate(int hz);
+    int set_output_rate(int hz, int method, float lowpass_hz);
+    int set_resample_period(int period_us);
+    void add_pps_edge(int64_t mono_us, int64_t utc_sec);
+    void set_vib_analyzer(VibAnalyzer *analyzer);
+    int set_baro(Bmp280 *sensor, int rate_hz);
+    int get_baro(baro_record_t *rec);
+    void set_altitude(bool enable, bool use_imu);
+    int get_altitude(alt_output_t *out);
+    int get_alt_stats(alt_filter_stats_t *stats);
+    int set_ahrs(bool enable, float beta, int log_rate_hz);
+    void set_mag_offset(float x, float y, float z);
+    int get_attitude(ahrs_record_t *rec);
+    int set_gnss_ins(bool enable, int rate_hz, int log_rate_hz, float declination_deg);
+    void add_gnss_fix(const gnss_fix_t &fix);
+    int get_fused_position(gnss_ins_output_t *out);
+    int get_gnss_ins_stats(gnss_ins_stats_t *stats);
+    int get_log_snapshot(int stream, sd_logger_snapshot_t *snap);
+    int get_fifo_stats(spsc_ring_stats_t *stats);
+    int get_bmi270_stats(bmi270_fifo_stats_t *stats);
+    int get_clock_stats(imu_clock_stats_t *stats);
+    int get_logger_stats(imu_logger_stats_t *stats);
 };
 
 #endif // SENSOR_LOGGER_H
@@ -0,0 +1,204 @@
+/**
+ * @file spsc_ring.h
+ * @author amagai
+ * @brief ロックフリーのリングバッファ(書き込み側1つ，読み出し側1つ)
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 書き込み側と読み出し側がそれぞれ1つのタスク(または割り込み)に限られる場合に，
+ * ミューテックス無しでデータを受け渡す．
+ * 書き込み側が複数ある場合は，書き込み側同士を呼び出し側で排他すること．
+ * 読み出し側も同様．
+ *
+ * インデックスは増加し続ける32bitの値で，Nが2のべき乗なのでマスクで位置を求める．
+ * 書き込み位置はrelease/acquireで公開するので，読み出し側からは
+ * 書き込み済みのデータだけが見える．
+ */
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+
+/**
+ * @brief リングバッファの統計
+ */
+typedef struct {
+    uint32_t capacity;          // 容量
+    uint32_t used;              // 現在のデータ数
+    uint32_t max_used;          // データ数の最大値
+    uint32_t overflow;          // 一杯で書き込めなかったデータ数
+} spsc_ring_stats_t;
+
+
+template<typename T, size_t N>
+class SpscRing
+{
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing: N must be a power of two");
+
+protected:
+    T buffer[N];
+    std::atomic<uint32_t> head;         // 次の書き込み位置．書き込み側だけが更新する
+    std::atomic<uint32_t> tail;         // 次の読み出し位置．読み出し側だけが更新する
+    std::atomic<uint32_t> overflow;     // 書き込み側だけが更新する
+    std::atomic<uint32_t> max_used;     // 書き込み側だけが更新する
+
+    void count_overflow(uint32_t n)
+    {
+        overflow.store(overflow.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void update_max_used(uint32_t used)
+    {
+        if( used > max_used.load(std::memory_order_relaxed) )
+        {
+            max_used.store(used, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    SpscRing() : head(0), tail(0), overflow(0), max_used(0) {}
+
+    /**
+     * @brief データを1つ書き込む．書き込み側から呼ぶ．
+     *
+     * @param item データ
+     * @return true 書き込めた
+     * @return false 一杯で書き込めなかった．overflowに数えられる
+     */
+    bool push(const T &item)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t used = h - tail.load(std::memory_order_acquire);
+
+        if( used >= N )
+        {
+            count_overflow(1);
+            return false;
+        }
+        buffer[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        update_max_used(used + 1);
+        return true;
+    }
+
+    /**
+     * @brief データをまとめて書き込む．書き込み側から呼ぶ．
+     *
+     * @param items データ
+     * @param n データ数
+     * @return size_t 書き込めたデータ数．書き込めなかった分はoverflowに数えられる
+     */
+    size_t push_n(const T *items, size_t n)
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        uint32_t used = h - tail.load(std::memory_order_acquire);
+        size_t m = N - used;
+
+        if( m > n )
+        {
+            m = n;
+        }
+        for( size_t i = 0; i < m; i++ )
+        {
+            buffer[(h + i) & (N - 1)] = items[i];
+        }
+        head.store(h + m, std::memory_order_release);
+        update_max_used(used + m);
+        if( m < n )
+        {
+            count_overflow(n - m);
+        }
+        return m;
+    }
+
+    /**
+     * @brief データを1つ読み出す．読み出し側から呼ぶ．
+     *
+     * @param item データの格納先
+     * @return true 読み出せた
+     * @return false 空だった
+     */
+    bool pop(T &item)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+
+        if( head.load(std::memory_order_acquire) == t )
+        {
+            return false;
+        }
+        item = buffer[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief データをまとめて読み出す．読み出し側から呼ぶ．
+     *
+     * @param items データの格納先
+     * @param max_n 読み出す最大数
+     * @return size_t 読み出したデータ数
+     */
+    size_t pop_n(T *items, size_t max_n)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        size_t n = head.load(std::memory_order_acquire) - t;
+
+        if( n > max_n )
+        {
+            n = max_n;
+        }
+        for( size_t i = 0; i < n; i++ )
+        {
+            items[i] = buffer[(t + i) & (N - 1)];
+        }
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * @brief 現在のデータ数．どちらの側から呼んでもよいが，値はすぐに古くなる．
+     */
+    size_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const
+    {
+        return N;
+    }
+
+    /**
+     * @brief 統計を取得する
+     *
+     * @return spsc_ring_stats_t 統計情報
+     */
+    spsc_ring_stats_t get_stats() const
+    {
+        spsc_ring_stats_t st;
+
+        st.capacity = N;
+        st.used = size();
+        st.max_used = max_used.load(std::memory_order_relaxed);
+        st.overflow = overflow.load(std::memory_order_relaxed);
+        return st;
+    }
+
+    /**
+     * @brief 空にして統計もクリアする．書き込み側と読み出し側が動いていない時に呼ぶこと．
+     */
+    void clear()
+    {
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        overflow.store(0, std::memory_order_relaxed);
+        max_used.store(0, std::memory_order_relaxed);
+    }
+};
+
+#endif // SPSC_RING_H
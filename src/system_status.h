@@ -17,6 +17,9 @@ typedef struct {
     nmea_gga_data_t gga_data;    // NMEA GGA data
     float temp;
     float pressure;
+    float altitude;     // 気圧とGNSSから推定した高度(m)
+    float vspeed;       // 昇降速度(m/s)
+    int alt_valid;      // 1: altitudeとvspeedが有効
 
     int sync_state; // 0: not synchronized, 1: synchronized
     int shutdown_request; // 1: shutdown requested, 0: running
@@ -0,0 +1,569 @@
+/**
+ * @file vib_analyzer.cpp
+ * @author amagai
+ * @brief 加速度の振動スペクトル解析
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ */
+
+#include <Arduino.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "vib_analyzer.h"
+#include "fast_format.h"
+
+#if VIB_USE_DSP
+#include <esp_dsp.h>
+#endif
+
+// 解析タスクがキューを確認する間隔(ms)
+#define VIB_POLL_MS 100
+// FFTの結果を格納する配列の長さ(float)
+#define VIB_FFT_BUF_LEN (VIB_FFT_SIZE * 2)
+#define VIB_PSD_LEN (VIB_FFT_SIZE / 2 + 1)
+
+
+VibAnalyzer::VibAnalyzer()
+{
+    fs = 0.0f;
+    log_period_sec = VIB_LOG_PERIOD_SEC;
+    task_handle = NULL;
+    running = false;
+    terminate = false;
+    terminated = true;
+    frame = NULL;
+    fill = 0;
+    window = NULL;
+    win_power = 0.0f;
+    fft_xy = NULL;
+    fft_z = NULL;
+    psd_sum = NULL;
+    frames = 0;
+    frames_per_log = 0;
+#if !VIB_USE_DSP
+    twiddle = NULL;
+#endif
+    logger = NULL;
+    memset(&result, 0, sizeof(result));
+}
+
+
+VibAnalyzer::~VibAnalyzer()
+{
+    stop();
+}
+
+
+/**
+ * @brief 作業領域を確保し，窓関数などを準備する
+ *
+ * @return int 成功すれば0，失敗すれば-1
+ */
+int VibAnalyzer::alloc_buffers()
+{
+    frame = new float[VIB_FFT_SIZE * 3];
+    window = new float[VIB_FFT_SIZE];
+    fft_xy = new float[VIB_FFT_BUF_LEN];
+    fft_z = new float[VIB_FFT_BUF_LEN];
+    psd_sum = new float[VIB_PSD_LEN];
+    if( frame == NULL || window == NULL || fft_xy == NULL || fft_z == NULL || psd_sum == NULL )
+    {
+        return -1;
+    }
+
+    win_power = 0.0f;
+    for( int i = 0; i < VIB_FFT_SIZE; i++ )
+    {
+        window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / VIB_FFT_SIZE);
+        win_power += window[i] * window[i];
+    }
+
+#if VIB_USE_DSP
+    if( dsps_fft2r_init_fc32(NULL, VIB_FFT_SIZE) != ESP_OK )
+    {
+        return -1;
+    }
+#else
+    twiddle = new float[VIB_FFT_SIZE];
+    if( twiddle == NULL )
+    {
+        return -1;
+    }
+    for( int i = 0; i < VIB_FFT_SIZE / 2; i++ )
+    {
+        twiddle[i * 2] = cosf(2.0f * (float)M_PI * i / VIB_FFT_SIZE);
+        twiddle[i * 2 + 1] = sinf(2.0f * (float)M_PI * i / VIB_FFT_SIZE);
+    }
+#endif
+    return 0;
+}
+
+
+void VibAnalyzer::free_buffers()
+{
+    delete[] frame;
+    delete[] window;
+    delete[] fft_xy;
+    delete[] fft_z;
+    delete[] psd_sum;
+    frame = window = fft_xy = fft_z = psd_sum = NULL;
+#if !VIB_USE_DSP
+    delete[] twiddle;
+    twiddle = NULL;
+#endif
+}
+
+
+/**
+ * @brief 解析を開始する
+ *
+ * @param sample_rate 加速度のサンプリングレート(Hz)
+ * @return int 成功すれば0，失敗すれば-1
+ */
+int VibAnalyzer::start(float sample_rate)
+{
+    if( running )
+    {
+        return -1;
+    }
+    fs = sample_rate;
+    fill = 0;
+    frames = 0;
+    // 1フレームは半分ずつ重ねるので，VIB_FFT_SIZE/2サンプル毎に1フレーム
+    frames_per_log = (uint32_t)(log_period_sec * fs / (VIB_FFT_SIZE / 2));
+    if( frames_per_log < 1 )
+    {
+        frames_per_log = 1;
+    }
+
+    if( alloc_buffers() != 0 )
+    {
+        ESP_LOGE("VibAnalyzer", "Failed to allocate buffers");
+        free_buffers();
+        return -1;
+    }
+    memset(psd_sum, 0, sizeof(float) * VIB_PSD_LEN);
+    queue.clear();
+
+    terminate = false;
+    terminated = false;
+    running = true;
+    xTaskCreatePinnedToCore(task, "VibAnalyzer", 4096, this, 0, &task_handle, 1);
+    if( task_handle == NULL )
+    {
+        ESP_LOGE("VibAnalyzer", "Failed to create task");
+        running = false;
+        terminated = true;
+        free_buffers();
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 解析を停止する．途中の平均は記録しない．記録していればstop_logging()も行う
+ *
+ * @return int 常に0
+ */
+int VibAnalyzer::stop()
+{
+    if( !running )
+    {
+        return 0;
+    }
+    terminate = true;
+    while( !terminated )
+    {
+        vTaskDelay(VIB_POLL_MS / portTICK_PERIOD_MS);
+    }
+    task_handle = NULL;
+    running = false;
+
+    stop_logging();
+    free_buffers();
+    return 0;
+}
+
+
+/**
+ * @brief 結果のSDカードへの記録を開始する．SDカードの初期化後に呼ぶ
+ *
+ * @return int 成功すれば0，既に記録しているか開けなければ-1
+ *
+ * 解析(start())とは独立に開始，終了できる．記録していない間の結果は画面にだけ出る．
+ */
+int VibAnalyzer::start_logging()
+{
+    SDLogger *l;
+
+    if( logger != NULL )
+    {
+        return -1;
+    }
+    l = new SDLogger();
+    if( l == NULL )
+    {
+        ESP_LOGE("VibAnalyzer", "Failed to create logger");
+        return -1;
+    }
+    l->set_prefix("/vib");
+    if( l->start() != 0 )
+    {
+        ESP_LOGE("VibAnalyzer", "Failed to start logger");
+        delete l;
+        return -1;
+    }
+    log_mutex.lock();
+    logger = l;
+    log_mutex.unlock();
+    return 0;
+}
+
+
+/**
+ * @brief 結果のSDカードへの記録を終了する
+ *
+ * @return int 常に0
+ */
+int VibAnalyzer::stop_logging()
+{
+    SDLogger *l;
+
+    // 解析タスクが書き込み中でなくなってから外す
+    log_mutex.lock();
+    l = logger;
+    logger = NULL;
+    log_mutex.unlock();
+    if( l != NULL )
+    {
+        l->close();
+        delete l;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 記録の間隔を設定する．start()の前に呼ぶこと．
+ *
+ * @param sec 間隔(秒)
+ * @return int 成功すれば0，不正な値なら-1
+ */
+int VibAnalyzer::set_log_period(int sec)
+{
+    if( sec < 1 )
+    {
+        return -1;
+    }
+    log_period_sec = sec;
+    return 0;
+}
+
+
+/**
+ * @brief 最新の結果を取得する
+ *
+ * @param r 結果の格納先
+ * @return true 結果がある
+ * @return false まだ1回も平均を終えていない
+ */
+bool VibAnalyzer::get_result(vib_result_t *r)
+{
+    mutex.lock();
+    *r = result;
+    mutex.unlock();
+    return r->seq != 0;
+}
+
+
+/**
+ * @brief 複素FFT(その場で計算，結果は自然な順)
+ *
+ * @param data 実部と虚部を交互に並べたVIB_FFT_SIZE点の複素数
+ */
+void VibAnalyzer::fft(float *data)
+{
+#if VIB_USE_DSP
+    dsps_fft2r_fc32(data, VIB_FFT_SIZE);
+    dsps_bit_rev_fc32(data, VIB_FFT_SIZE);
+#else
+    const int n = VIB_FFT_SIZE;
+
+    // ビット反転の並べ替え
+    for( int i = 1, j = 0; i < n; i++ )
+    {
+        int bit = n >> 1;
+        for( ; j & bit; bit >>= 1 )
+        {
+            j ^= bit;
+        }
+        j ^= bit;
+        if( i < j )
+        {
+            float tr = data[i * 2], ti = data[i * 2 + 1];
+            data[i * 2] = data[j * 2];
+            data[i * 2 + 1] = data[j * 2 + 1];
+            data[j * 2] = tr;
+            data[j * 2 + 1] = ti;
+        }
+    }
+    // 時間間引きのバタフライ
+    for( int len = 2; len <= n; len <<= 1 )
+    {
+        int step = n / len;
+        for( int i = 0; i < n; i += len )
+        {
+            for( int k = 0; k < len / 2; k++ )
+            {
+                float wr = twiddle[k * step * 2];
+                float wi = -twiddle[k * step * 2 + 1];
+                float *a = &data[(i + k) * 2];
+                float *b = &data[(i + k + len / 2) * 2];
+                float br = b[0] * wr - b[1] * wi;
+                float bi = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - br;
+                b[1] = a[1] - bi;
+                a[0] += br;
+                a[1] += bi;
+            }
+        }
+    }
+#endif
+}
+
+
+/**
+ * @brief 1フレーム分のPSDを求めて積算する
+ *
+ * X + jYを1回のFFTで計算する．実信号x, yのスペクトルをX, Yとすると，
+ * F = X + jYについて |X[k]|^2 + |Y[k]|^2 = (|F[k]|^2 + |F[N-k]|^2) / 2 が成り立つので，
+ * 2軸のパワーの和は分離せずに求められる．
+ */
+void VibAnalyzer::process_frame()
+{
+    const float *fx = frame;
+    const float *fy = frame + VIB_FFT_SIZE;
+    const float *fz = frame + VIB_FFT_SIZE * 2;
+    float mx = 0.0f, my = 0.0f, mz = 0.0f;
+
+    for( int i = 0; i < VIB_FFT_SIZE; i++ )
+    {
+        mx += fx[i];
+        my += fy[i];
+        mz += fz[i];
+    }
+    mx /= VIB_FFT_SIZE;
+    my /= VIB_FFT_SIZE;
+    mz /= VIB_FFT_SIZE;
+    for( int i = 0; i < VIB_FFT_SIZE; i++ )
+    {
+        fft_xy[i * 2] = (fx[i] - mx) * window[i];
+        fft_xy[i * 2 + 1] = (fy[i] - my) * window[i];
+        fft_z[i * 2] = (fz[i] - mz) * window[i];
+        fft_z[i * 2 + 1] = 0.0f;
+    }
+    fft(fft_xy);
+    fft(fft_z);
+
+    for( int k = 0; k < VIB_PSD_LEN; k++ )
+    {
+        int nk = (VIB_FFT_SIZE - k) & (VIB_FFT_SIZE - 1);
+        float p_xy = (fft_xy[k * 2] * fft_xy[k * 2] + fft_xy[k * 2 + 1] * fft_xy[k * 2 + 1]
+                    + fft_xy[nk * 2] * fft_xy[nk * 2] + fft_xy[nk * 2 + 1] * fft_xy[nk * 2 + 1]) * 0.5f;
+        float p_z = fft_z[k * 2] * fft_z[k * 2] + fft_z[k * 2 + 1] * fft_z[k * 2 + 1];
+        psd_sum[k] += p_xy + p_z;
+    }
+    frames++;
+}
+
+
+/**
+ * @brief 平均を終えて結果を更新し，記録する
+ */
+void VibAnalyzer::finish_average()
+{
+    vib_result_t r;
+    float df = fs / VIB_FFT_SIZE;
+    // 片側PSD(G^2/Hz)への換算係数．直流とナイキスト周波数以外は2倍する
+    float scale = 2.0f / (fs * win_power * frames);
+    float total = 0.0f;
+    int per_bin = (VIB_PSD_LEN - 1) / VIB_DISPLAY_BINS;
+
+    memset(&r, 0, sizeof(r));
+    r.time = time(NULL);
+    r.fs = fs;
+    r.frames = frames;
+
+    for( int k = 0; k < VIB_PSD_LEN; k++ )
+    {
+        psd_sum[k] *= (k == 0 || k == VIB_PSD_LEN - 1) ? scale / 2 : scale;
+    }
+
+    // 帯域は2ビン目からナイキスト周波数まで，対数で等間隔
+    float f_lo = 2 * df;
+    float f_hi = fs / 2;
+    for( int b = 0; b <= VIB_NUM_BANDS; b++ )
+    {
+        r.band_edge_hz[b] = f_lo * powf(f_hi / f_lo, (float)b / VIB_NUM_BANDS);
+    }
+    for( int k = 1; k < VIB_PSD_LEN; k++ )
+    {
+        float f = k * df;
+        float e = psd_sum[k] * df;
+        total += e;
+        for( int b = 0; b < VIB_NUM_BANDS; b++ )
+        {
+            if( f >= r.band_edge_hz[b] && (f < r.band_edge_hz[b + 1] || b == VIB_NUM_BANDS - 1) )
+            {
+                r.band_mg[b] += e;
+                break;
+            }
+        }
+    }
+    r.rms_mg = sqrtf(total) * 1000.0f;
+    for( int b = 0; b < VIB_NUM_BANDS; b++ )
+    {
+        r.band_mg[b] = sqrtf(r.band_mg[b]) * 1000.0f;
+    }
+
+    // ピーク．極大の大きい順に選び，周波数は放物線補間する
+    float peak_p[VIB_NUM_PEAKS] = { 0.0f };
+    for( int k = 2; k < VIB_PSD_LEN - 1; k++ )
+    {
+        float p = psd_sum[k];
+        if( p <= psd_sum[k - 1] || p < psd_sum[k + 1] || p <= peak_p[VIB_NUM_PEAKS - 1] )
+        {
+            continue;
+        }
+        int i = VIB_NUM_PEAKS - 1;
+        while( i > 0 && peak_p[i - 1] < p )
+        {
+            peak_p[i] = peak_p[i - 1];
+            r.peak_hz[i] = r.peak_hz[i - 1];
+            r.peak_mg[i] = r.peak_mg[i - 1];
+            i--;
+        }
+        float den = psd_sum[k - 1] - 2 * p + psd_sum[k + 1];
+        float delta = (den != 0.0f) ? 0.5f * (psd_sum[k - 1] - psd_sum[k + 1]) / den : 0.0f;
+        peak_p[i] = p;
+        r.peak_hz[i] = (k + delta) * df;
+        // ハン窓の主ローブは前後1ビンに広がる
+        r.peak_mg[i] = sqrtf((psd_sum[k - 1] + p + psd_sum[k + 1]) * df) * 1000.0f;
+    }
+
+    // 表示用のスペクトル
+    for( int i = 0; i < VIB_DISPLAY_BINS; i++ )
+    {
+        float sum = 0.0f;
+        for( int k = 0; k < per_bin; k++ )
+        {
+            sum += psd_sum[1 + i * per_bin + k];
+        }
+        sum /= per_bin;
+        r.spectrum_db[i] = (sum > 1e-12f) ? 10.0f * log10f(sum) : -120.0f;
+    }
+
+    mutex.lock();
+    r.seq = result.seq + 1;
+    result = r;
+    mutex.unlock();
+
+    write_log(r);
+    memset(psd_sum, 0, sizeof(float) * VIB_PSD_LEN);
+    frames = 0;
+}
+
+
+/**
+ * @brief 記録しているファイルの統計を写す
+ *
+ * @param snap 格納先
+ * @return int 成功すれば0，記録していなければ-1
+ */
+int VibAnalyzer::get_log_snapshot(sd_logger_snapshot_t *snap)
+{
+    int rtn = -1;
+
+    log_mutex.lock();
+    if( logger != NULL )
+    {
+        rtn = logger->get_snapshot(snap);
+    }
+    log_mutex.unlock();
+    return rtn;
+}
+
+
+/**
+ * @brief 結果を1行のCSVとして記録する．記録していなければ何もしない
+ */
+void VibAnalyzer::write_log(const vib_result_t &r)
+{
+    // unixtime, フレーム数と(1 + VIB_NUM_BANDS + VIB_NUM_PEAKS * 2)個の値
+    static char line[32 + (1 + VIB_NUM_BANDS + VIB_NUM_PEAKS * 2) * 22 + 1];
+    char *p;
+
+    p = fmt_cat(line, (long long)r.time, ',', r.frames, ',', fmt_fixed<1>(r.rms_mg));
+    for( int b = 0; b < VIB_NUM_BANDS; b++ )
+    {
+        p = fmt_cat(p, ',', fmt_fixed<1>(r.band_mg[b]));
+    }
+    for( int i = 0; i < VIB_NUM_PEAKS; i++ )
+    {
+        p = fmt_cat(p, ',', fmt_fixed<1>(r.peak_hz[i]), ',', fmt_fixed<1>(r.peak_mg[i]));
+    }
+    p = fmt_cat(p, '\n');
+    log_mutex.lock();
+    if( logger != NULL && logger->write_data((const uint8_t *)line, p - line) != 0 )
+    {
+        ESP_LOGW("VibAnalyzer", "Failed to write log");
+    }
+    log_mutex.unlock();
+}
+
+
+/**
+ * @brief 解析タスク
+ *
+ * キューから取り出したサンプルをフレームに溜め，一杯になったらFFTして半分ずらす．
+ */
+void VibAnalyzer::task(void *param)
+{
+    VibAnalyzer *self = static_cast<VibAnalyzer *>(param);
+    vib_sample_t s;
+
+    while( !self->terminate )
+    {
+        vTaskDelay(VIB_POLL_MS / portTICK_PERIOD_MS);
+        while( !self->terminate && self->queue.pop(s) )
+        {
+            self->frame[self->fill] = s.x;
+            self->frame[VIB_FFT_SIZE + self->fill] = s.y;
+            self->frame[VIB_FFT_SIZE * 2 + self->fill] = s.z;
+            self->fill++;
+            if( self->fill < VIB_FFT_SIZE )
+            {
+                continue;
+            }
+            self->process_frame();
+            if( self->frames >= self->frames_per_log )
+            {
+                self->finish_average();
+            }
+            for( int a = 0; a < 3; a++ )
+            {
+                float *f = self->frame + VIB_FFT_SIZE * a;
+                memmove(f, f + VIB_FFT_SIZE / 2, sizeof(float) * (VIB_FFT_SIZE / 2));
+            }
+            self->fill = VIB_FFT_SIZE / 2;
+        }
+    }
+    self->terminated = true;
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,134 @@
+/**
+ * @file vib_analyzer.h
+ * @author amagai
+ * @brief 加速度の振動スペクトル解析
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 加速度のデータ列にハン窓を掛けて半分ずつ重ねながらFFTし，パワースペクトル密度(PSD)を
+ * 一定時間平均する．平均したPSDから，帯域毎の振動の大きさとピークを求めてSDカードに記録し，
+ * 画面表示用のスペクトルを更新する．生データの代わりに特徴量だけを記録するので，
+ * 記録するデータ量は数KB/時間程度になる．
+ *
+ * 3軸のPSDの和を解析する．重力の影響を除くため，FFTの前にフレーム毎の平均を引く．
+ * X軸とY軸は1回の複素FFTにまとめて計算する．
+ * esp-dspが使える場合は，FFTにesp-dspの関数を使う．
+ *
+ * 記録の形式(CSV)は，
+ *   unixtime, 平均したフレーム数, 全体のRMS(mg), 帯域毎のRMS(mg) x VIB_NUM_BANDS,
+ *   ピークの周波数(Hz), ピークのRMS(mg) x VIB_NUM_PEAKS
+ */
+#ifndef VIB_ANALYZER_H
+#define VIB_ANALYZER_H
+
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "spsc_ring.h"
+#include "simple_mutex.h"
+#include "sd_logger.h"
+
+#ifndef VIB_USE_DSP
+#if defined(__has_include)
+#if __has_include(<esp_dsp.h>)
+#define VIB_USE_DSP 1
+#endif
+#endif
+#endif
+#ifndef VIB_USE_DSP
+#define VIB_USE_DSP 0
+#endif
+
+// FFTの点数(2のべき乗)
+#define VIB_FFT_SIZE 512
+// 帯域の数．帯域は対数で等間隔に分ける
+#define VIB_NUM_BANDS 8
+// 記録するピークの数
+#define VIB_NUM_PEAKS 3
+// 画面表示用のスペクトルの点数
+#define VIB_DISPLAY_BINS 64
+// サンプリングタスクから解析タスクへのキューのサイズ(2のべき乗)
+#define VIB_INPUT_QUEUE_SIZE 1024
+// 記録の間隔(秒)の既定値
+#define VIB_LOG_PERIOD_SEC 10
+
+
+typedef struct {
+    float x, y, z;              // 加速度(G)
+} vib_sample_t;
+
+
+/**
+ * @brief 1回の平均の結果
+ */
+typedef struct {
+    uint32_t seq;               // 更新の度に増える
+    time_t time;                // 平均を終えた時刻
+    float fs;                   // サンプリングレート(Hz)
+    uint32_t frames;            // 平均したフレーム数
+    float rms_mg;               // 直流を除く全体のRMS(mg)
+    float band_edge_hz[VIB_NUM_BANDS + 1];
+    float band_mg[VIB_NUM_BANDS];
+    float peak_hz[VIB_NUM_PEAKS];
+    float peak_mg[VIB_NUM_PEAKS];
+    float spectrum_db[VIB_DISPLAY_BINS];    // PSD(dB re 1G^2/Hz)．0からfs/2まで等間隔
+} vib_result_t;
+
+
+class VibAnalyzer
+{
+protected:
+    SpscRing<vib_sample_t, VIB_INPUT_QUEUE_SIZE> queue;
+    float fs;
+    int log_period_sec;
+    TaskHandle_t task_handle;
+    volatile bool running;
+    volatile bool terminate;
+    volatile bool terminated;
+
+    float *frame;               // 直近のVIB_FFT_SIZEサンプル．x, y, zの順にVIB_FFT_SIZEずつ
+    int fill;
+    float *window;
+    float win_power;            // 窓の2乗和
+    float *fft_xy;              // 複素数の配列(実部，虚部の順)
+    float *fft_z;
+    float *psd_sum;             // VIB_FFT_SIZE/2+1点
+    uint32_t frames;
+    uint32_t frames_per_log;
+#if !VIB_USE_DSP
+    float *twiddle;             // cos, sinの順にVIB_FFT_SIZE/2組
+#endif
+
+    SDLogger *logger;           // 記録していなければNULL
+    SimpleMutex log_mutex;      // loggerの差し替えと書き込みを排他する
+    SimpleMutex mutex;
+    vib_result_t result;
+
+    static void task(void *param);
+    int alloc_buffers();
+    void free_buffers();
+    void fft(float *data);
+    void process_frame();
+    void finish_average();
+    void write_log(const vib_result_t &r);
+
+public:
+    VibAnalyzer();
+    ~VibAnalyzer();
+
+    int start(float fs);
+    int stop();
+    int start_logging();
+    int stop_logging();
+    bool is_running() const { return running; }
+    int set_log_period(int sec);
+    void push(const vib_sample_t &s) { queue.push(s); }
+    bool get_result(vib_result_t *r);
+    int get_log_snapshot(sd_logger_snapshot_t *snap);
+    spsc_ring_stats_t get_queue_stats() const { return queue.get_stats(); }
+};
+
+#endif // VIB_ANALYZER_H
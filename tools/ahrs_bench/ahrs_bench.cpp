@@ -0,0 +1,511 @@
+/**
+ * @file ahrs_bench.cpp
+ * @author amagai
+ * @brief 姿勢推定(Ahrs)の精度と速度を評価するPC用ツール
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 記録したIMUデータ(CSV形式．バイナリ形式はtools/imu_decodeで変換しておく)を
+ * 本体と同じAhrsに通して，精度と1回の更新にかかる時間を測る．
+ *
+ * 精度は次のどちらかで評価する．
+ *   - 基準の姿勢のファイルを与えた場合は，それとの差
+ *     (1行に 時刻(unixtime, s), qw, qx, qy, qz．時刻が最も近い行と比べる)
+ *   - 与えない場合は，静止している区間で加速度から求めた傾きとの差
+ * --synthを指定すると，真の姿勢が分かっている合成データで評価する．
+ *
+ * ビルド:
+ *   g++ -O2 -std=c++17 -I../../src -o ahrs_bench ahrs_bench.cpp ../../src/ahrs.cpp
+ * 使い方:
+ *   ahrs_bench [-b beta] [-r rate] imu_20250920_055127.log [reference.csv]
+ *   ahrs_bench [-b beta] --synth
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#else
+#define HAVE_RDTSC 0
+#endif
+
+#include "ahrs.h"
+
+// 精度の評価から除く最初の時間(s)．初期値からの収束を待つ
+#define SETTLE_SEC 5.0
+// 速度の測定で行う更新の回数
+#define BENCH_UPDATES 2000000
+
+typedef struct {
+    double t;                   // unixtime(s)
+    float a[3];                 // 加速度(G)
+    float g[3];                 // 角速度(deg/s)
+    float m[3];                 // 磁気
+} sample_t;
+
+typedef struct {
+    double t;
+    double q[4];
+} ref_t;
+
+typedef struct {
+    double sum_tilt2, max_tilt;
+    double sum_head2, max_head;
+    double sum_full2, max_full;
+    int n;
+} error_stats_t;
+
+
+/**
+ * @brief クォータニオンで表した姿勢でのセンサ座標の上向きと，X軸の方位を求める
+ */
+static void pose_of(const double q[4], double up[3], double *heading)
+{
+    // 回転行列の3行目がセンサ座標での上向き
+    up[0] = 2.0 * (q[1] * q[3] - q[0] * q[2]);
+    up[1] = 2.0 * (q[2] * q[3] + q[0] * q[1]);
+    up[2] = 1.0 - 2.0 * (q[1] * q[1] + q[2] * q[2]);
+    *heading = -atan2(2.0 * (q[1] * q[2] + q[0] * q[3]), 1.0 - 2.0 * (q[2] * q[2] + q[3] * q[3])) * 180.0 / M_PI;
+}
+
+
+static double angle_between(const double a[3], const double b[3])
+{
+    double d = (a[0] * b[0] + a[1] * b[1] + a[2] * b[2])
+               / sqrt((a[0] * a[0] + a[1] * a[1] + a[2] * a[2]) * (b[0] * b[0] + b[1] * b[1] + b[2] * b[2]));
+    return acos(std::max(-1.0, std::min(1.0, d))) * 180.0 / M_PI;
+}
+
+
+static double wrap180(double d)
+{
+    while( d > 180.0 )
+    {
+        d -= 360.0;
+    }
+    while( d < -180.0 )
+    {
+        d += 360.0;
+    }
+    return d;
+}
+
+
+static void add_error(error_stats_t *st, const double est[4], const double ref[4])
+{
+    double up_e[3], up_r[3], h_e, h_r;
+    double dot = fabs(est[0] * ref[0] + est[1] * ref[1] + est[2] * ref[2] + est[3] * ref[3]);
+    double full = 2.0 * acos(std::min(1.0, dot)) * 180.0 / M_PI;
+    double tilt, head;
+
+    pose_of(est, up_e, &h_e);
+    pose_of(ref, up_r, &h_r);
+    tilt = angle_between(up_e, up_r);
+    head = fabs(wrap180(h_e - h_r));
+
+    st->sum_tilt2 += tilt * tilt;
+    st->sum_head2 += head * head;
+    st->sum_full2 += full * full;
+    st->max_tilt = std::max(st->max_tilt, tilt);
+    st->max_head = std::max(st->max_head, head);
+    st->max_full = std::max(st->max_full, full);
+    st->n++;
+}
+
+
+static void print_error(const char *name, const error_stats_t &st)
+{
+    if( st.n == 0 )
+    {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    printf("%s (%d samples): tilt rms %.3f max %.3f deg, heading rms %.3f max %.3f deg, total rms %.3f max %.3f deg\n",
+           name, st.n, sqrt(st.sum_tilt2 / st.n), st.max_tilt, sqrt(st.sum_head2 / st.n), st.max_head,
+           sqrt(st.sum_full2 / st.n), st.max_full);
+}
+
+
+/**
+ * @brief CSV形式のIMUログを読む
+ *
+ * タイムスタンプ, カウント, 加速度X,Y,Z, 角速度X,Y,Z, 磁気X,Y,Z の並び．
+ */
+static int read_imu_csv(const char *path, std::vector<sample_t> &out)
+{
+    FILE *fp = fopen(path, "r");
+    char line[512];
+
+    if( fp == NULL )
+    {
+        perror(path);
+        return -1;
+    }
+    while( fgets(line, sizeof(line), fp) != NULL )
+    {
+        sample_t s;
+        unsigned count;
+        if( sscanf(line, "%lf,%u,%f,%f,%f,%f,%f,%f,%f,%f,%f", &s.t, &count,
+                   &s.a[0], &s.a[1], &s.a[2], &s.g[0], &s.g[1], &s.g[2], &s.m[0], &s.m[1], &s.m[2]) == 11 )
+        {
+            out.push_back(s);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+static int read_reference(const char *path, std::vector<ref_t> &out)
+{
+    FILE *fp = fopen(path, "r");
+    char line[512];
+
+    if( fp == NULL )
+    {
+        perror(path);
+        return -1;
+    }
+    while( fgets(line, sizeof(line), fp) != NULL )
+    {
+        ref_t r;
+        if( sscanf(line, "%lf,%lf,%lf,%lf,%lf", &r.t, &r.q[0], &r.q[1], &r.q[2], &r.q[3]) == 5 )
+        {
+            out.push_back(r);
+        }
+    }
+    fclose(fp);
+    std::sort(out.begin(), out.end(), [](const ref_t &a, const ref_t &b) { return a.t < b.t; });
+    return 0;
+}
+
+
+static void quat_mul(const double a[4], const double b[4], double r[4])
+{
+    double t[4];
+    t[0] = a[0] * b[0] - a[1] * b[1] - a[2] * b[2] - a[3] * b[3];
+    t[1] = a[0] * b[1] + a[1] * b[0] + a[2] * b[3] - a[3] * b[2];
+    t[2] = a[0] * b[2] - a[1] * b[3] + a[2] * b[0] + a[3] * b[1];
+    t[3] = a[0] * b[3] + a[1] * b[2] - a[2] * b[1] + a[3] * b[0];
+    memcpy(r, t, sizeof(t));
+}
+
+
+/**
+ * @brief 地面座標のベクトルをセンサ座標に回転する(q* v q)
+ */
+static void earth_to_sensor(const double q[4], const double v[3], float out[3])
+{
+    double r00 = 1 - 2 * (q[2] * q[2] + q[3] * q[3]), r01 = 2 * (q[1] * q[2] - q[0] * q[3]), r02 = 2 * (q[1] * q[3] + q[0] * q[2]);
+    double r10 = 2 * (q[1] * q[2] + q[0] * q[3]), r11 = 1 - 2 * (q[1] * q[1] + q[3] * q[3]), r12 = 2 * (q[2] * q[3] - q[0] * q[1]);
+    double r20 = 2 * (q[1] * q[3] - q[0] * q[2]), r21 = 2 * (q[2] * q[3] + q[0] * q[1]), r22 = 1 - 2 * (q[1] * q[1] + q[2] * q[2]);
+    out[0] = (float)(r00 * v[0] + r10 * v[1] + r20 * v[2]);
+    out[1] = (float)(r01 * v[0] + r11 * v[1] + r21 * v[2]);
+    out[2] = (float)(r02 * v[0] + r12 * v[1] + r22 * v[2]);
+}
+
+
+/**
+ * @brief 真の姿勢が分かっている合成データを作る
+ *
+ * 400Hzで120秒．3軸の正弦波の角速度に一定の旋回を加える．
+ * 角速度にはバイアスと雑音，加速度と磁気には雑音を加える．伏角は50度．
+ */
+static void make_synthetic(std::vector<sample_t> &out, std::vector<ref_t> &ref)
+{
+    const double rate = 400.0;
+    const int substeps = 10;
+    const double incl = 50.0 * M_PI / 180.0;
+    const double g_earth[3] = { 0.0, 0.0, 1.0 };
+    const double m_earth[3] = { cos(incl), 0.0, -sin(incl) };
+    const float gyro_bias[3] = { 0.3f, -0.2f, 0.1f };
+    std::mt19937 rng(1);
+    std::normal_distribution<float> gyro_noise(0.0f, 0.1f);
+    std::normal_distribution<float> acc_noise(0.0f, 0.003f);
+    std::normal_distribution<float> mag_noise(0.0f, 0.01f);
+    // 方位30度，ロール10度から始める
+    double h0 = -30.0 * M_PI / 180.0, r0 = 10.0 * M_PI / 180.0;
+    double qz[4] = { cos(h0 / 2), 0.0, 0.0, sin(h0 / 2) };
+    double qx[4] = { cos(r0 / 2), sin(r0 / 2), 0.0, 0.0 };
+    double q[4];
+
+    quat_mul(qz, qx, q);
+    for( int i = 0; i < (int)(120.0 * rate); i++ )
+    {
+        double t = i / rate;
+        sample_t s;
+        ref_t r;
+        double w[3];
+
+        w[0] = 40.0 * sin(2 * M_PI * 0.23 * t);
+        w[1] = 30.0 * sin(2 * M_PI * 0.17 * t + 1.0);
+        w[2] = 20.0 * sin(2 * M_PI * 0.11 * t + 2.0) + 5.0;
+
+        s.t = t;
+        for( int c = 0; c < 3; c++ )
+        {
+            s.g[c] = (float)w[c] + gyro_bias[c] + gyro_noise(rng);
+        }
+        earth_to_sensor(q, g_earth, s.a);
+        earth_to_sensor(q, m_earth, s.m);
+        for( int c = 0; c < 3; c++ )
+        {
+            s.a[c] += acc_noise(rng);
+            s.m[c] = (s.m[c] + mag_noise(rng)) * 500.0f;
+        }
+        out.push_back(s);
+
+        r.t = t;
+        memcpy(r.q, q, sizeof(q));
+        ref.push_back(r);
+
+        // 次のサンプルまでの真の姿勢の変化．細かく分けて積分する
+        for( int k = 0; k < substeps; k++ )
+        {
+            double tt = t + (k + 0.5) / (rate * substeps);
+            double ww[3] = {
+                40.0 * sin(2 * M_PI * 0.23 * tt),
+                30.0 * sin(2 * M_PI * 0.17 * tt + 1.0),
+                20.0 * sin(2 * M_PI * 0.11 * tt + 2.0) + 5.0 };
+            double ang = sqrt(ww[0] * ww[0] + ww[1] * ww[1] + ww[2] * ww[2]) * M_PI / 180.0 / (rate * substeps);
+            double dq[4] = { 1.0, 0.0, 0.0, 0.0 };
+            if( ang > 0.0 )
+            {
+                double n = sqrt(ww[0] * ww[0] + ww[1] * ww[1] + ww[2] * ww[2]);
+                dq[0] = cos(ang / 2);
+                dq[1] = sin(ang / 2) * ww[0] / n;
+                dq[2] = sin(ang / 2) * ww[1] / n;
+                dq[3] = sin(ang / 2) * ww[2] / n;
+            }
+            quat_mul(q, dq, q);
+        }
+    }
+}
+
+
+/**
+ * @brief 全サンプルを通して精度を求める
+ */
+static void evaluate(const std::vector<sample_t> &data, const std::vector<ref_t> &ref, float rate, float beta, bool use_mag)
+{
+    Ahrs ahrs(rate, beta);
+    error_stats_t st;
+    size_t ri = 0;
+    float qf[4];
+    double q[4];
+
+    memset(&st, 0, sizeof(st));
+    for( size_t i = 0; i < data.size(); i++ )
+    {
+        const sample_t &s = data[i];
+        if( use_mag )
+        {
+            ahrs.update(s.g[0], s.g[1], s.g[2], s.a[0], s.a[1], s.a[2], s.m[0], s.m[1], s.m[2]);
+        }
+        else
+        {
+            ahrs.update_imu(s.g[0], s.g[1], s.g[2], s.a[0], s.a[1], s.a[2]);
+        }
+        if( s.t - data[0].t < SETTLE_SEC )
+        {
+            continue;
+        }
+        ahrs.get_quaternion(qf);
+        for( int c = 0; c < 4; c++ )
+        {
+            q[c] = qf[c];
+        }
+
+        if( !ref.empty() )
+        {
+            while( ri + 1 < ref.size() && fabs(ref[ri + 1].t - s.t) <= fabs(ref[ri].t - s.t) )
+            {
+                ri++;
+            }
+            if( fabs(ref[ri].t - s.t) < 0.5 / rate )
+            {
+                add_error(&st, q, ref[ri].q);
+            }
+        }
+        else
+        {
+            // 静止している区間だけ，加速度の向きを正解とする
+            double an = sqrt(s.a[0] * s.a[0] + s.a[1] * s.a[1] + s.a[2] * s.a[2]);
+            double gn = sqrt(s.g[0] * s.g[0] + s.g[1] * s.g[1] + s.g[2] * s.g[2]);
+            if( fabs(an - 1.0) < 0.02 && gn < 2.0 )
+            {
+                double up_e[3], h;
+                double up_a[3] = { s.a[0], s.a[1], s.a[2] };
+                pose_of(q, up_e, &h);
+                double tilt = angle_between(up_e, up_a);
+                st.sum_tilt2 += tilt * tilt;
+                st.max_tilt = std::max(st.max_tilt, tilt);
+                st.n++;
+            }
+        }
+    }
+
+    if( !ref.empty() )
+    {
+        print_error(use_mag ? "9-axis" : "6-axis", st);
+    }
+    else if( st.n > 0 )
+    {
+        printf("%s: static tilt vs accel (%d samples): rms %.3f max %.3f deg\n",
+               use_mag ? "9-axis" : "6-axis", st.n, sqrt(st.sum_tilt2 / st.n), st.max_tilt);
+    }
+    else
+    {
+        printf("%s: no static samples\n", use_mag ? "9-axis" : "6-axis");
+    }
+}
+
+
+/**
+ * @brief 1回の更新にかかる時間を測る
+ */
+static void benchmark(const std::vector<sample_t> &data, float rate, float beta, bool use_mag)
+{
+    Ahrs ahrs(rate, beta);
+    size_t n = data.size();
+    float sink = 0.0f;
+    float q[4];
+
+    // 初期化を済ませておく
+    ahrs.update(data[0].g[0], data[0].g[1], data[0].g[2], data[0].a[0], data[0].a[1], data[0].a[2],
+                data[0].m[0], data[0].m[1], data[0].m[2]);
+
+    auto t0 = std::chrono::steady_clock::now();
+#if HAVE_RDTSC
+    uint64_t c0 = __rdtsc();
+#endif
+    for( int i = 0; i < BENCH_UPDATES; i++ )
+    {
+        const sample_t &s = data[i % n];
+        if( use_mag )
+        {
+            ahrs.update(s.g[0], s.g[1], s.g[2], s.a[0], s.a[1], s.a[2], s.m[0], s.m[1], s.m[2]);
+        }
+        else
+        {
+            ahrs.update_imu(s.g[0], s.g[1], s.g[2], s.a[0], s.a[1], s.a[2]);
+        }
+    }
+#if HAVE_RDTSC
+    uint64_t c1 = __rdtsc();
+#endif
+    auto t1 = std::chrono::steady_clock::now();
+    ahrs.get_quaternion(q);
+    sink = q[0];
+
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / BENCH_UPDATES;
+#if HAVE_RDTSC
+    printf("%s: %.1f ns/update, %.0f TSC cycles/update (q0 %.3f)\n", use_mag ? "9-axis" : "6-axis",
+           ns, (double)(c1 - c0) / BENCH_UPDATES, sink);
+#else
+    printf("%s: %.1f ns/update (q0 %.3f)\n", use_mag ? "9-axis" : "6-axis", ns, sink);
+#endif
+}
+
+
+static void usage()
+{
+    fprintf(stderr, "usage: ahrs_bench [-b beta] [-r rate] imu.log [reference.csv]\n");
+    fprintf(stderr, "       ahrs_bench [-b beta] --synth\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    std::vector<sample_t> data;
+    std::vector<ref_t> ref;
+    float beta = AHRS_DEFAULT_BETA;
+    float rate = 0.0f;
+    bool synth = false;
+    const char *files[2] = { NULL, NULL };
+    int nfiles = 0;
+    bool has_mag = false;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( strcmp(argv[i], "-b") == 0 && i + 1 < argc )
+        {
+            beta = (float)atof(argv[++i]);
+        }
+        else if( strcmp(argv[i], "-r") == 0 && i + 1 < argc )
+        {
+            rate = (float)atof(argv[++i]);
+        }
+        else if( strcmp(argv[i], "--synth") == 0 )
+        {
+            synth = true;
+        }
+        else if( argv[i][0] != '-' && nfiles < 2 )
+        {
+            files[nfiles++] = argv[i];
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if( synth )
+    {
+        make_synthetic(data, ref);
+        rate = 400.0f;
+    }
+    else
+    {
+        if( nfiles == 0 )
+        {
+            usage();
+            return 1;
+        }
+        if( read_imu_csv(files[0], data) != 0 || (nfiles > 1 && read_reference(files[1], ref) != 0) )
+        {
+            return 1;
+        }
+    }
+    if( data.size() < 2 )
+    {
+        fprintf(stderr, "not enough samples\n");
+        return 1;
+    }
+    if( rate <= 0.0f )
+    {
+        // 本体と同じく固定の時間刻みで更新するので，平均のレートを使う
+        rate = (float)((data.size() - 1) / (data.back().t - data.front().t));
+    }
+    for( const sample_t &s : data )
+    {
+        if( s.m[0] != 0.0f || s.m[1] != 0.0f || s.m[2] != 0.0f )
+        {
+            has_mag = true;
+            break;
+        }
+    }
+
+    printf("%zu samples, %.1f Hz, beta %.3f%s\n", data.size(), rate, beta, has_mag ? "" : ", no magnetometer");
+    evaluate(data, ref, rate, beta, false);
+    if( has_mag )
+    {
+        evaluate(data, ref, rate, beta, true);
+    }
+    benchmark(data, rate, beta, false);
+    if( has_mag )
+    {
+        benchmark(data, rate, beta, true);
+    }
+    return 0;
+}
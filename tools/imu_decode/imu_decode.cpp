@@ -0,0 +1,148 @@
+/**
+ * @file imu_decode.cpp
+ * @author amagai
+ * @brief バイナリ形式のIMUログをCSVに変換するPC用ツール
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 出力はCSV形式で記録した場合と同じ並び．
+ * タイムスタンプ, カウント, 加速度X, 加速度Y, 加速度Z, 角速度X, 角速度Y, 角速度Z, 磁気X, 磁気Y, 磁気Z
+ *
+ * ビルド:
+ *   g++ -O2 -std=c++17 -I../../src -o imu_decode imu_decode.cpp
+ * 使い方:
+ *   imu_decode imu_20250920_055127.bin > imu_20250920_055127.log
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <vector>
+
+#include "imu_binlog.h"
+
+
+/**
+ * @brief 1ブロック分のレコードをCSVで出力する
+ *
+ * @param header ブロックヘッダ
+ * @param payload レコード列
+ * @param out 出力先
+ * @return int 成功すれば0，レコードが壊れていれば-1
+ */
+static int decode_block(const imu_binlog_header_t &header, const uint8_t *payload, FILE *out)
+{
+    const uint8_t *p = payload;
+    const uint8_t *end = payload + header.payload_size;
+    int64_t time_us = header.base_time_us;
+    uint32_t count = header.base_count;
+    uint64_t v;
+    int n;
+    int16_t raw[IMU_BINLOG_NUM_AXES];
+
+    for( int i = 0; i < header.num_records; i++ )
+    {
+        n = imu_binlog_get_varint(p, end, &v);
+        if( n == 0 )
+        {
+            return -1;
+        }
+        time_us += imu_binlog_unzigzag(v);
+        p += n;
+        n = imu_binlog_get_varint(p, end, &v);
+        if( n == 0 )
+        {
+            return -1;
+        }
+        count += (uint32_t)v;
+        p += n;
+        if( p + IMU_BINLOG_NUM_AXES * 2 > end )
+        {
+            return -1;
+        }
+        for( int k = 0; k < IMU_BINLOG_NUM_AXES; k++ )
+        {
+            raw[k] = (int16_t)(p[0] | (p[1] << 8));
+            p += 2;
+        }
+
+        // 負のタイムスタンプは扱わない
+        int64_t sec = time_us / 1000000;
+        int64_t usec = time_us % 1000000;
+        fprintf(out, "%" PRId64 ".%06" PRId64 ",%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d,%d\n",
+                sec, usec, count,
+                raw[0] * header.accel_scale, raw[1] * header.accel_scale, raw[2] * header.accel_scale,
+                raw[3] * header.gyro_scale, raw[4] * header.gyro_scale, raw[5] * header.gyro_scale,
+                (int)(raw[6] * header.mag_scale), (int)(raw[7] * header.mag_scale), (int)(raw[8] * header.mag_scale));
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    FILE *in;
+    std::vector<uint8_t> data;
+    uint8_t buf[4096];
+    size_t n;
+    size_t pos = 0;
+    int blocks = 0;
+    int bad_blocks = 0;
+    uint32_t magic = IMU_BINLOG_MAGIC;
+
+    if( argc < 2 )
+    {
+        fprintf(stderr, "usage: %s imu_xxx.bin > imu_xxx.log\n", argv[0]);
+        return 1;
+    }
+    in = fopen(argv[1], "rb");
+    if( in == NULL )
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    while( (n = fread(buf, 1, sizeof(buf), in)) > 0 )
+    {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(in);
+
+    while( pos + sizeof(imu_binlog_header_t) <= data.size() )
+    {
+        imu_binlog_header_t header;
+
+        if( memcmp(&data[pos], &magic, sizeof(magic)) != 0 )
+        {
+            // 次のブロックの先頭を探す
+            pos++;
+            continue;
+        }
+        memcpy(&header, &data[pos], sizeof(header));
+        if( header.version != IMU_BINLOG_VERSION || header.header_size != sizeof(imu_binlog_header_t)
+            || header.payload_size > IMU_BINLOG_MAX_PAYLOAD )
+        {
+            pos++;
+            continue;
+        }
+        if( pos + sizeof(header) + header.payload_size > data.size() )
+        {
+            // 途中で切れたブロック
+            fprintf(stderr, "truncated block at offset %zu\n", pos);
+            break;
+        }
+        const uint8_t *payload = &data[pos + sizeof(header)];
+        if( imu_binlog_block_crc(&header, payload) != header.crc || decode_block(header, payload, stdout) != 0 )
+        {
+            fprintf(stderr, "bad block at offset %zu\n", pos);
+            bad_blocks++;
+            pos++;
+            continue;
+        }
+        blocks++;
+        pos += sizeof(header) + header.payload_size;
+    }
+    fprintf(stderr, "%d blocks decoded, %d bad blocks\n", blocks, bad_blocks);
+    return 0;
+}
@@ -0,0 +1,360 @@
+/**
+ * @file ins_replay.cpp
+ * @author amagai
+ * @brief 記録したNMEAとIMUのログでGNSS/INSの位置推定を再生するPC用ツール
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 本体と同じAhrsとGnssInsに記録したデータを通し，推定した軌跡を出力する．
+ * 測位を受信するまでの遅れは-lで与える(NMEAのログには受信時刻が無いため)．
+ *
+ * --outageで指定した区間の測位を使わずに推定させ，その間の測位と比べることで，
+ * 測位が途切れた時の精度を評価できる．区間は最初の測位からの秒数で，複数指定できる．
+ *
+ * IMUのログはCSV形式(バイナリ形式はtools/imu_decodeで変換しておく)，
+ * NMEAのログはテキスト(圧縮したものはtools/nmea_unpackで展開しておく)．
+ *
+ * ビルド:
+ *   gcc -O2 -c -I../../src ../../src/nmea_parser.c
+ *   g++ -O2 -std=c++17 -I../../src -o ins_replay ins_replay.cpp ../../src/gnss_ins.cpp ../../src/ahrs.cpp nmea_parser.o
+ * 使い方:
+ *   ins_replay [-r rate] [-R out_rate] [-l latency_ms] [-d declination] [-b beta]
+ *              [--outage start:len ...] [-o fused.csv] imu.log nmea.log
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cinttypes>
+#include <vector>
+
+#include "ahrs.h"
+#include "gnss_ins.h"
+#include "nmea_parser.h"
+
+#define MAX_OUTAGES 16
+
+typedef struct {
+    int64_t t_us;
+    float a[3];                 // 加速度(G)
+    float g[3];                 // 角速度(deg/s)
+    float m[3];                 // 磁気
+} sample_t;
+
+typedef struct {
+    double start, len;          // 最初の測位からの秒数
+    double sum_err2, max_err, end_err;
+    int n;
+} outage_t;
+
+
+static int read_imu_csv(const char *path, std::vector<sample_t> &out)
+{
+    FILE *fp = fopen(path, "r");
+    char line[512];
+
+    if( fp == NULL )
+    {
+        perror(path);
+        return -1;
+    }
+    while( fgets(line, sizeof(line), fp) != NULL )
+    {
+        sample_t s;
+        long long sec;
+        long usec;
+        unsigned count;
+        if( sscanf(line, "%lld.%ld,%u,%f,%f,%f,%f,%f,%f,%f,%f,%f", &sec, &usec, &count,
+                   &s.a[0], &s.a[1], &s.a[2], &s.g[0], &s.g[1], &s.g[2], &s.m[0], &s.m[1], &s.m[2]) == 12 )
+        {
+            s.t_us = sec * 1000000 + usec;
+            out.push_back(s);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+/**
+ * @brief NMEAのログから測位結果を取り出す．本体と同じくGGAを受信した時点で1つの測位とする
+ */
+static int read_nmea(const char *path, std::vector<gnss_fix_t> &out)
+{
+    FILE *fp = fopen(path, "r");
+    char line[256];
+    nmea_rmc_data_t rmc;
+    nmea_gga_data_t gga;
+    gnss_fix_t fix;
+
+    if( fp == NULL )
+    {
+        perror(path);
+        return -1;
+    }
+    nmea_init_rmc(&rmc);
+    nmea_init_gga(&gga);
+    while( fgets(line, sizeof(line), fp) != NULL )
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if( strlen(line) < 7 || line[0] != '$' )
+        {
+            continue;
+        }
+        if( line[3] == 'R' && line[4] == 'M' && line[5] == 'C' )
+        {
+            nmea_parse_rmc(line, &rmc);
+        }
+        else if( line[3] == 'G' && line[4] == 'G' && line[5] == 'A' )
+        {
+            if( nmea_parse_gga(line, &gga) == 0 && gnss_ins_fix_from_nmea(&rmc, &gga, &fix) == 0 )
+            {
+                out.push_back(fix);
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+/**
+ * @brief 2点間の水平距離(m)．近い点どうしなので平面で近似する
+ */
+static double horizontal_distance(double lat1, double lon1, double lat2, double lon2)
+{
+    double dn = (lat1 - lat2) * 111320.0;
+    double de = (lon1 - lon2) * 111320.0 * cos(lat1 * M_PI / 180.0);
+    return sqrt(dn * dn + de * de);
+}
+
+
+static void usage()
+{
+    fprintf(stderr, "usage: ins_replay [-r rate] [-R out_rate] [-l latency_ms] [-d declination] [-b beta]\n");
+    fprintf(stderr, "                  [--outage start:len ...] [-o fused.csv] imu.log nmea.log\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    std::vector<sample_t> imu;
+    std::vector<gnss_fix_t> fixes;
+    outage_t outages[MAX_OUTAGES];
+    int num_outages = 0;
+    int ins_rate = 100;
+    int out_rate = 10;
+    int latency_ms = 200;
+    float declination = 0.0f;
+    float beta = AHRS_DEFAULT_BETA;
+    const char *out_path = NULL;
+    const char *files[2] = { NULL, NULL };
+    int nfiles = 0;
+    FILE *out = NULL;
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( strcmp(argv[i], "-r") == 0 && i + 1 < argc )
+        {
+            ins_rate = atoi(argv[++i]);
+        }
+        else if( strcmp(argv[i], "-R") == 0 && i + 1 < argc )
+        {
+            out_rate = atoi(argv[++i]);
+        }
+        else if( strcmp(argv[i], "-l") == 0 && i + 1 < argc )
+        {
+            latency_ms = atoi(argv[++i]);
+        }
+        else if( strcmp(argv[i], "-d") == 0 && i + 1 < argc )
+        {
+            declination = (float)atof(argv[++i]);
+        }
+        else if( strcmp(argv[i], "-b") == 0 && i + 1 < argc )
+        {
+            beta = (float)atof(argv[++i]);
+        }
+        else if( strcmp(argv[i], "-o") == 0 && i + 1 < argc )
+        {
+            out_path = argv[++i];
+        }
+        else if( strcmp(argv[i], "--outage") == 0 && i + 1 < argc && num_outages < MAX_OUTAGES )
+        {
+            outage_t &o = outages[num_outages];
+            memset(&o, 0, sizeof(o));
+            if( sscanf(argv[++i], "%lf:%lf", &o.start, &o.len) != 2 )
+            {
+                usage();
+                return 1;
+            }
+            num_outages++;
+        }
+        else if( argv[i][0] != '-' && nfiles < 2 )
+        {
+            files[nfiles++] = argv[i];
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if( nfiles != 2 || ins_rate <= 0 )
+    {
+        usage();
+        return 1;
+    }
+    if( read_imu_csv(files[0], imu) != 0 || read_nmea(files[1], fixes) != 0 )
+    {
+        return 1;
+    }
+    if( imu.size() < 2 || fixes.empty() )
+    {
+        fprintf(stderr, "not enough data (%zu IMU samples, %zu fixes)\n", imu.size(), fixes.size());
+        return 1;
+    }
+    if( out_path != NULL )
+    {
+        out = fopen(out_path, "w");
+        if( out == NULL )
+        {
+            perror(out_path);
+            return 1;
+        }
+    }
+
+    // 本体と同じく，サンプリングレートの固定の時間刻みで更新する
+    double imu_rate = (imu.size() - 1) / ((imu.back().t_us - imu.front().t_us) / 1e6);
+    int step = (int)lround(imu_rate / ins_rate);
+    if( step < 1 )
+    {
+        step = 1;
+    }
+    int out_step = (out_rate > 0 && out_rate < ins_rate) ? ins_rate / out_rate : 1;
+    float dt = (float)(step / imu_rate);
+    Ahrs ahrs((float)imu_rate, beta);
+    GnssIns ins;
+    ins.set_declination(declination);
+
+    int64_t t_first_fix = fixes[0].time_us;
+    size_t apply_idx = 0;       // 次に受信する測位
+    size_t eval_idx = 0;        // 次に推定値と比べる測位
+    double sum_resid2 = 0.0;
+    int n_resid = 0;
+    float acc[3] = { 0.0f, 0.0f, 0.0f };
+    int acc_n = 0;
+    uint32_t steps = 0;
+
+    printf("%zu IMU samples (%.1f Hz), %zu fixes, INS %d Hz, latency %d ms\n",
+           imu.size(), imu_rate, fixes.size(), ins_rate, latency_ms);
+
+    for( size_t i = 0; i < imu.size(); i++ )
+    {
+        const sample_t &s = imu[i];
+
+        // 受信した測位を渡す．停電区間の測位は捨てる
+        while( apply_idx < fixes.size() && fixes[apply_idx].time_us + latency_ms * 1000LL <= s.t_us )
+        {
+            const gnss_fix_t &f = fixes[apply_idx++];
+            double rel = (f.time_us - t_first_fix) / 1e6;
+            bool dropped = false;
+            for( int k = 0; k < num_outages; k++ )
+            {
+                if( rel >= outages[k].start && rel < outages[k].start + outages[k].len )
+                {
+                    dropped = true;
+                }
+            }
+            if( !dropped )
+            {
+                ins.update_gnss(f);
+            }
+        }
+
+        ahrs.update(s.g[0], s.g[1], s.g[2], s.a[0], s.a[1], s.a[2], s.m[0], s.m[1], s.m[2]);
+        for( int c = 0; c < 3; c++ )
+        {
+            acc[c] += s.a[c];
+        }
+        if( ++acc_n < step )
+        {
+            continue;
+        }
+        float q[4];
+        for( int c = 0; c < 3; c++ )
+        {
+            acc[c] /= acc_n;
+        }
+        ahrs.get_quaternion(q);
+        ins.propagate(s.t_us, q, acc, dt);
+        acc[0] = acc[1] = acc[2] = 0.0f;
+        acc_n = 0;
+        steps++;
+
+        gnss_ins_output_t o;
+        if( !ins.get_output(&o) )
+        {
+            continue;
+        }
+
+        // 測位時刻を過ぎたら，その時点の推定値を測位と比べる
+        while( eval_idx < fixes.size() && fixes[eval_idx].time_us <= s.t_us )
+        {
+            const gnss_fix_t &f = fixes[eval_idx++];
+            double rel = (f.time_us - t_first_fix) / 1e6;
+            double err = horizontal_distance(o.latitude, o.longitude, f.latitude, f.longitude);
+            bool in_outage = false;
+            for( int k = 0; k < num_outages; k++ )
+            {
+                outage_t &ot = outages[k];
+                if( rel >= ot.start && rel < ot.start + ot.len )
+                {
+                    ot.sum_err2 += err * err;
+                    ot.n++;
+                    ot.max_err = (err > ot.max_err) ? err : ot.max_err;
+                    ot.end_err = err;
+                    in_outage = true;
+                }
+            }
+            if( !in_outage && rel > 1.0 )
+            {
+                sum_resid2 += err * err;
+                n_resid++;
+            }
+        }
+
+        if( out != NULL && steps % out_step == 0 )
+        {
+            fprintf(out, "%" PRId64 ".%06d,%.8f,%.8f,%.2f,%.2f,%.2f,%.2f,%.2f,%d\n",
+                    o.time_us / 1000000, (int)(o.time_us % 1000000), o.latitude, o.longitude, o.altitude,
+                    o.vn, o.ve, o.vu, o.pos_sigma, o.status);
+        }
+    }
+    if( out != NULL )
+    {
+        fclose(out);
+    }
+
+    gnss_ins_stats_t st = ins.get_stats();
+    printf("fixes used %u, rejected %u, resets %u, longest gap %.1f s\n",
+           st.fixes, st.rejected, st.resets, st.max_coast_sec);
+    if( n_resid > 0 )
+    {
+        printf("prediction vs fix (%d fixes): rms %.2f m\n", n_resid, sqrt(sum_resid2 / n_resid));
+    }
+    for( int k = 0; k < num_outages; k++ )
+    {
+        const outage_t &ot = outages[k];
+        if( ot.n == 0 )
+        {
+            printf("outage %.0f+%.0fs: no fixes to compare\n", ot.start, ot.len);
+            continue;
+        }
+        printf("outage %.0f+%.0fs (%d fixes): rms %.2f m, max %.2f m, at end %.2f m\n",
+               ot.start, ot.len, ot.n, sqrt(ot.sum_err2 / ot.n), ot.max_err, ot.end_err);
+    }
+    return 0;
+}
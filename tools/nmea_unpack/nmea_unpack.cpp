@@ -0,0 +1,128 @@
+/**
+ * @file nmea_unpack.cpp
+ * @author amagai
+ * @brief 圧縮したNMEAログを展開するPC用ツール
+ * @version 0.1
+ * @date 2025-10-18
+ *
+ * @copyright Copyright (c) 2025
+ *
+ * 形式はsrc/lz_block.hを参照．
+ * 壊れたフレームがあった場合は，次のキーフレームから展開を再開する．
+ *
+ * ビルド:
+ *   g++ -O2 -std=c++17 -I../../src -o nmea_unpack nmea_unpack.cpp ../../src/lz_block.cpp
+ * 使い方:
+ *   nmea_unpack nmea_20250920_055127.nlz > nmea_20250920_055127.log
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "lz_block.h"
+
+
+int main(int argc, char *argv[])
+{
+    FILE *in;
+    std::vector<uint8_t> data;
+    uint8_t buf[4096];
+    // 直前のフレームの展開結果(辞書)と，展開先
+    uint8_t window[LZB_MAX_WINDOW];
+    size_t dict_len = 0;
+    bool dict_valid = false;
+    size_t n;
+    size_t pos = 0;
+    int frames = 0;
+    int bad_frames = 0;
+    int skipped_frames = 0;
+    uint32_t magic = LZB_MAGIC;
+
+    if( argc < 2 )
+    {
+        fprintf(stderr, "usage: %s nmea_xxx.nlz > nmea_xxx.log\n", argv[0]);
+        return 1;
+    }
+    in = fopen(argv[1], "rb");
+    if( in == NULL )
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    while( (n = fread(buf, 1, sizeof(buf), in)) > 0 )
+    {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(in);
+
+    while( pos + sizeof(lzb_frame_header_t) <= data.size() )
+    {
+        lzb_frame_header_t header;
+
+        if( memcmp(&data[pos], &magic, sizeof(magic)) != 0 )
+        {
+            // 次のフレームの先頭を探す
+            pos++;
+            continue;
+        }
+        memcpy(&header, &data[pos], sizeof(header));
+        if( header.version != LZB_VERSION || header.raw_size > LZB_MAX_RAW_SIZE
+            || header.payload_size > LZB_MAX_RAW_SIZE )
+        {
+            pos++;
+            continue;
+        }
+        if( pos + sizeof(header) + header.payload_size > data.size() )
+        {
+            // 途中で切れたフレーム
+            fprintf(stderr, "truncated frame at offset %zu\n", pos);
+            break;
+        }
+        const uint8_t *payload = &data[pos + sizeof(header)];
+
+        if( (header.flags & LZB_FLAG_KEYFRAME) != 0 )
+        {
+            dict_len = 0;
+        }
+        else if( !dict_valid )
+        {
+            // 辞書になる直前のフレームが壊れているので，次のキーフレームまで展開できない
+            skipped_frames++;
+            pos += sizeof(header) + header.payload_size;
+            continue;
+        }
+
+        int rtn;
+        if( (header.flags & LZB_FLAG_STORED) != 0 )
+        {
+            rtn = (header.payload_size == header.raw_size) ? 0 : -1;
+            if( rtn == 0 )
+            {
+                memcpy(window, payload, header.raw_size);
+            }
+        }
+        else
+        {
+            rtn = lzb_decompress(payload, header.payload_size, window, dict_len, header.raw_size);
+        }
+        uint8_t *raw = window + ((header.flags & LZB_FLAG_STORED) ? 0 : dict_len);
+        if( rtn != 0 || crc32_update(0, raw, header.raw_size) != header.crc )
+        {
+            fprintf(stderr, "bad frame at offset %zu\n", pos);
+            bad_frames++;
+            dict_valid = false;
+            pos++;
+            continue;
+        }
+        fwrite(raw, 1, header.raw_size, stdout);
+        // 展開結果を次のフレームの辞書にする
+        memmove(window, raw, header.raw_size);
+        dict_len = header.raw_size;
+        dict_valid = true;
+        frames++;
+        pos += sizeof(header) + header.payload_size;
+    }
+    fprintf(stderr, "%d frames decoded, %d bad frames, %d frames skipped\n", frames, bad_frames, skipped_frames);
+    return 0;
+}